@@ -765,6 +765,111 @@ intptr_t CL_CgameSystemCalls( intptr_t *args )
 }
 
 
+/*
+====================
+CL_Prefetch
+
+Starts reading what the cgame is about to load, while it loads the map
+and everything before it.  Only the names the gamestate and the bsp
+already give away are worth guessing; anything not used by the end
+of CG_INIT is dropped again
+====================
+*/
+static void CL_Prefetch( void ) {
+	static const char	*keep[] = { "md3", "mdr", "iqm", "tga", "jpg", "png" };
+	static const char	*stream[] = { "wav", "ogg", "opus" };
+	// the order R_LoadImage tries the extensions in
+	static const char	*gl1Images[] = { "tga", "jpg", "png" };
+	static const char	*gl2Images[] = { "png", "tga", "jpg" };
+	const char			**images;
+	bool				keepImages;
+	dheader_t			header;
+	fileHandle_t		f;
+	int					i, j;
+
+	// the bsp itself is the first thing loaded
+	FS_Prefetch( cl.mapname, true );
+
+	// models and sounds named in the configstrings
+	for ( i = 0; i < MAX_CONFIGSTRINGS; i++ ) {
+		const char *s = cl.gameState.stringData + cl.gameState.stringOffsets[ i ];
+		const char *ext;
+
+		if ( !cl.gameState.stringOffsets[ i ] ) {
+			continue;
+		}
+		if ( s[0] == '*' ) {
+			s++;
+		}
+		if ( !strchr( s, '/' ) ) {
+			continue;
+		}
+
+		ext = COM_GetExtension( s );
+		for ( j = 0; j < (int)ARRAY_LEN( keep ); j++ ) {
+			if ( !Q_stricmp( ext, keep[ j ] ) ) {
+				FS_Prefetch( s, true );
+			}
+		}
+		// the codecs stream these through a file handle
+		for ( j = 0; j < (int)ARRAY_LEN( stream ); j++ ) {
+			if ( !Q_stricmp( ext, stream[ j ] ) ) {
+				FS_Prefetch( s, false );
+			}
+		}
+	}
+
+	// the images behind the map's surface shaders, from the header and
+	// shader lump alone.  Only the one the renderer will pick is worth
+	// keeping; when that can't be told, just warm the OS cache for all
+	images = gl1Images;
+	keepImages = false;
+#ifdef USE_RENDERER_DLOPEN
+	if ( cl_renderer && !Q_stricmp( cl_renderer->string, "opengl1" ) ) {
+		keepImages = true;
+	} else if ( cl_renderer && !Q_stricmp( cl_renderer->string, "opengl2" ) ) {
+		images = gl2Images;
+		keepImages = true;
+	}
+#endif
+
+	if ( FS_FOpenFileRead( cl.mapname, &f, true ) < 0 || !f ) {
+		return;
+	}
+
+	if ( FS_Read( &header, sizeof( header ), f ) == (int)sizeof( header ) &&
+		LittleLong( header.ident ) == BSP_IDENT ) {
+		int ofs = LittleLong( header.lumps[ LUMP_SHADERS ].fileofs );
+		int count = LittleLong( header.lumps[ LUMP_SHADERS ].filelen ) / sizeof( dshader_t );
+		dshader_t *shaders;
+
+		if ( ofs >= (int)sizeof( header ) && count > 0 && count <= MAX_MAP_SHADERS ) {
+			FS_Seek( f, ofs, FS_SEEK_SET );
+			shaders = (dshader_t *)Z_Malloc( count * sizeof( dshader_t ) );
+			count = FS_Read( shaders, count * sizeof( dshader_t ), f ) / sizeof( dshader_t );
+
+			for ( i = 0; i < count; i++ ) {
+				char name[ MAX_QPATH ];
+				char base[ MAX_QPATH ];
+
+				Q_strncpyz( base, shaders[ i ].shader, sizeof( base ) );
+				COM_StripExtension( base, base, sizeof( base ) );
+
+				for ( j = 0; j < (int)ARRAY_LEN( gl1Images ); j++ ) {
+					Com_sprintf( name, sizeof( name ), "%s.%s", base, images[ j ] );
+					if ( FS_Prefetch( name, keepImages ) >= 0 && keepImages ) {
+						break;
+					}
+				}
+			}
+
+			Z_Free( shaders );
+		}
+	}
+
+	FS_FCloseFile( f );
+}
+
 /*
 ====================
 CL_InitCGame
@@ -780,12 +885,15 @@ void CL_InitCGame( void ) {
 	vmInterpret_t		interpret;
 
 	t1 = Sys_Milliseconds();
+	cl.mapLoadTime = t1;
 
 	// find the current mapname
 	info = cl.gameState.stringData + cl.gameState.stringOffsets[ CS_SERVERINFO ];
 	mapname = Info_ValueForKey( info, "mapname" );
 	Com_sprintf( cl.mapname, sizeof( cl.mapname ), "maps/%s.bsp", mapname );
 
+	CL_Prefetch();
+
 	// load the dll or bytecode
 	interpret = (vmInterpret_t)Cvar_VariableValue("vm_cgame");
 	if(cl_connectedToPureServer)
@@ -838,6 +946,9 @@ void CL_InitCGame( void ) {
 
 	Com_Printf( "CL_InitCGame: %5.2f seconds\n", (t2-t1)/1000.0 );
 
+	// whatever the cgame did not ask for is not going to be asked for
+	FS_PrefetchCancel();
+
 	// have the renderer touch all its images, so they are present
 	// on the card even if the driver does deferred loading
 	re.EndRegistration();
@@ -978,6 +1089,11 @@ void CL_FirstSnapshot( void ) {
 	}
 	clc.state = CA_ACTIVE;
 
+	if ( cl.mapLoadTime ) {
+		Com_Printf( "Map load to first snapshot: %5.2f seconds\n", ( Sys_Milliseconds() - cl.mapLoadTime ) / 1000.0 );
+		cl.mapLoadTime = 0;
+	}
+
 	// set the timedelta so we are exactly on this first frame
 	cl.serverTimeDelta = cl.snap.serverTime - cls.realtime;
 	cl.oldServerTime = cl.snap.serverTime;
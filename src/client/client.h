@@ -179,6 +179,7 @@ struct clientActive_t {
 
     gameState_t gameState;  // configstrings
     char mapname[MAX_QPATH];  // extracted from CS_SERVERINFO
+    int mapLoadTime;  // Sys_Milliseconds when CL_InitCGame started on it
 
     int parseEntitiesNum;  // index (not anded off) into cl_parse_entities[]
 
@@ -490,6 +491,7 @@ extern cvar_t *j_forward_axis;
 extern cvar_t *j_side_axis;
 extern cvar_t *j_up_axis;
 
+extern cvar_t *cl_renderer;
 extern cvar_t *cl_timedemo;
 extern cvar_t *cl_aviFrameRate;
 extern cvar_t *cl_aviMotionJpeg;
@@ -32,6 +32,20 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define  FREEMEMCOOKIE  ((int)0xDEADBE3F)  // Any unlikely to be used value
 #define  ROUNDBITS    31          // Round to 32 bytes
+#define  PREVFREE     1           // In an allocated block's size: the block before it is free
+
+// Freed blocks are kept on one list per size up to SMALLSIZE, and on a
+// list per power of two above that.  Memory that has never been handed
+// out is a bump region at the top of the pool.  Allocating takes the
+// smallest listed size that fits and only searches within a list above
+// SMALLSIZE, so it does not slow down as the server stays up.  Freeing
+// merges a block with free neighbours straight away: a free block ends
+// in a copy of its size, which the next block's PREVFREE bit says is
+// there to find.
+#define  SMALLSIZE    2048
+#define  NUMSMALL     ( SMALLSIZE / ( ROUNDBITS + 1 ) )
+#define  LARGESHIFT   11          // log2( SMALLSIZE )
+#define  NUMLARGE     10          // up to a 1MB pool
 
 typedef struct freeMemNode_s
 {
@@ -41,72 +55,144 @@ typedef struct freeMemNode_s
 } freeMemNode_t;
 
 static char           memoryPool[POOLSIZE];
-static freeMemNode_t  *freeHead;
+static freeMemNode_t  *smallFree[ NUMSMALL ];
+static freeMemNode_t  *largeFree[ NUMLARGE ];
+static char           *bumpPtr;   // start of the never used region
 static int            freeMem;
 
-void *BG_Alloc( int size )
+static freeMemNode_t **BG_FreeList( int size )
 {
-  // Find a free block and allocate.
-  // Does two passes, attempts to fill same-sized free slot first.
+  int bin;
 
-  freeMemNode_t *fmn, *prev, *next, *smallest;
-  int allocsize, smallestsize;
-  char *endptr;
-  int *ptr;
+  if( size <= SMALLSIZE )
+    return &smallFree[ ( size >> 5 ) - 1 ];
 
-  allocsize = ( size + (int)sizeof(int) + ROUNDBITS ) & ~ROUNDBITS;    // Round to 32-byte boundary
-  ptr = NULL;
+  bin = Q_log2( size ) - LARGESHIFT;
+  if( bin >= NUMLARGE )
+    bin = NUMLARGE - 1;
+  return &largeFree[ bin ];
+}
+
+static void BG_LinkFree( freeMemNode_t *fmn, int size )
+{
+  freeMemNode_t **list = BG_FreeList( size );
+  char *end = (char *)fmn + size;
+
+  fmn->cookie = FREEMEMCOOKIE;
+  fmn->size = size;
+  ( (int *)end )[ -1 ] = size;
+  if( end < bumpPtr )
+    *(int *)end |= PREVFREE;
+
+  fmn->prev = NULL;
+  fmn->next = *list;
+  if( fmn->next )
+    fmn->next->prev = fmn;
+  *list = fmn;
+}
+
+static void BG_UnlinkFree( freeMemNode_t *fmn )
+{
+  if( fmn->prev )
+    fmn->prev->next = fmn->next;
+  else
+    *BG_FreeList( fmn->size ) = fmn->next;
+  if( fmn->next )
+    fmn->next->prev = fmn->prev;
+}
+
+static freeMemNode_t *BG_FindFree( int allocsize )
+{
+  freeMemNode_t *fmn;
+  int i;
+
+  if( allocsize <= SMALLSIZE )
+  {
+    // Anything on a small list this size or bigger fits
+    for( i = ( allocsize >> 5 ) - 1; i < NUMSMALL; i++ )
+    {
+      if( smallFree[ i ] )
+        return smallFree[ i ];
+    }
+    i = 0;
+  }
+  else
+  {
+    // Sizes on one large list differ, so it has to be checked
+    i = BG_FreeList( allocsize ) - largeFree;
+    for( fmn = largeFree[ i ]; fmn; fmn = fmn->next )
+    {
+      if( fmn->cookie != FREEMEMCOOKIE )
+        Com_Error( ERR_DROP, "BG_Alloc: Memory corruption detected!" );
+      if( fmn->size >= allocsize )
+        return fmn;
+    }
+    i++;
+  }
+
+  for( ; i < NUMLARGE; i++ )
+  {
+    if( largeFree[ i ] )
+      return largeFree[ i ];
+  }
+  return NULL;
+}
+
+static int *BG_TakeBlock( int allocsize, int *prevFree )
+{
+  freeMemNode_t *fmn;
+  char *end;
 
-  smallest = NULL;
-  smallestsize = POOLSIZE + 1;    // Guaranteed not to miss any slots :)
-  for( fmn = freeHead; fmn; fmn = fmn->next )
+  fmn = BG_FindFree( allocsize );
+  if( fmn )
   {
     if( fmn->cookie != FREEMEMCOOKIE )
       Com_Error( ERR_DROP, "BG_Alloc: Memory corruption detected!" );
 
-    if( fmn->size >= allocsize )
+    BG_UnlinkFree( fmn );
+    end = (char *)fmn + fmn->size;
+    if( end < bumpPtr )
+      *(int *)end &= ~PREVFREE;
+
+    if( fmn->size == allocsize )
     {
-      // We've got a block
-      if( fmn->size == allocsize )
-      {
-        // Same size, just remove
-
-        prev = fmn->prev;
-        next = fmn->next;
-        if( prev )
-          prev->next = next;      // Point previous node to next
-        if( next )
-          next->prev = prev;      // Point next node to previous
-        if( fmn == freeHead )
-          freeHead = next;      // Set head pointer to next
-        ptr = (int *) fmn;
-        break;              // Stop the loop, this is fine
-      }
-      else
-      {
-        // Keep track of the smallest free slot
-        if( fmn->size < smallestsize )
-        {
-          smallest = fmn;
-          smallestsize = fmn->size;
-        }
-      }
+      *prevFree = 0;
+      return (int *)fmn;
     }
+
+    // Cut it from the end, the rest stays where it is
+    BG_LinkFree( fmn, fmn->size - allocsize );
+    *prevFree = PREVFREE;
+    return (int *)( end - allocsize );
   }
 
-  if( !ptr && smallest )
+  // Never used memory.  Nothing free touches it, it would have been
+  // given back
+  if( memoryPool + POOLSIZE - bumpPtr >= allocsize )
   {
-    // We found a slot big enough
-    smallest->size -= allocsize;
-    endptr = (char *) smallest + smallest->size;
-    ptr = (int *) endptr;
+    end = bumpPtr;
+    bumpPtr += allocsize;
+    *prevFree = 0;
+    return (int *)end;
   }
 
+  return NULL;
+}
+
+void *BG_Alloc( int size )
+{
+  int allocsize, prevFree;
+  int *ptr;
+
+  allocsize = ( size + (int)sizeof(int) + ROUNDBITS ) & ~ROUNDBITS;    // Round to 32-byte boundary
+
+  ptr = ( size >= 0 && allocsize <= POOLSIZE ) ? BG_TakeBlock( allocsize, &prevFree ) : NULL;
+
   if( ptr )
   {
     freeMem -= allocsize;
     memset( ptr, 0, allocsize );
-    *ptr++ = allocsize;        // Store a copy of size for deallocation
+    *ptr++ = allocsize | prevFree;        // Store a copy of size for deallocation
     return( (void *) ptr );
   }
 
@@ -116,90 +202,115 @@ void *BG_Alloc( int size )
 
 void BG_Free( void *ptr )
 {
-  // Release allocated memory, add it to the free list.
+  // Release allocated memory, merge it with free neighbours and add it
+  // to a free list.
 
-  freeMemNode_t *fmn;
-  char *freeend;
+  freeMemNode_t *fmn, *other;
   int *freeptr;
+  int size;
 
   freeptr = ptr;
   freeptr--;
+  size = *freeptr & ~PREVFREE;
 
-  freeMem += *freeptr;
+  if( size <= 0 || ( size & ROUNDBITS ) ||
+      (char *)freeptr < memoryPool || (char *)freeptr + size > bumpPtr )
+    Com_Error( ERR_DROP, "BG_Free: Memory corruption detected!" );
 
-  for( fmn = freeHead; fmn; fmn = fmn->next )
+  freeMem += size;
+  fmn = (freeMemNode_t *)freeptr;
+
+  if( *freeptr & PREVFREE )
   {
-    freeend = ((char *) fmn) + fmn->size;
-    if( freeend == (char *) freeptr )
-    {
-      // Released block can be merged to an existing node
+    other = (freeMemNode_t *)( (char *)fmn - freeptr[ -1 ] );
+    if( (char *)other < memoryPool || other->cookie != FREEMEMCOOKIE ||
+        other->size != freeptr[ -1 ] )
+      Com_Error( ERR_DROP, "BG_Free: Memory corruption detected!" );
+
+    BG_UnlinkFree( other );
+    size += other->size;
+    fmn = other;
+
+    // The block is now inside its neighbour; a zero size makes freeing
+    // it again fail the checks above instead of corrupting the lists
+    *freeptr = 0;
+  }
 
-      fmn->size += *freeptr;    // Add size of node.
-      return;
-    }
+  other = (freeMemNode_t *)( (char *)fmn + size );
+  if( (char *)other < bumpPtr && other->cookie == FREEMEMCOOKIE )
+  {
+    BG_UnlinkFree( other );
+    size += other->size;
+    other->cookie = 0;
   }
-  // No merging, add to head of list
 
-  fmn = (freeMemNode_t *) freeptr;
-  fmn->size = *freeptr;        // Set this first to avoid corrupting *freeptr
-  fmn->cookie = FREEMEMCOOKIE;
-  fmn->prev = NULL;
-  fmn->next = freeHead;
-  freeHead->prev = fmn;
-  freeHead = fmn;
+  if( (char *)fmn + size == bumpPtr )
+  {
+    // Give it back to the never used region
+    bumpPtr = (char *)fmn;
+    return;
+  }
+
+  BG_LinkFree( fmn, size );
 }
 
 void BG_InitMemory( void )
 {
-  // Set up the initial node
+  // Everything is the never used region
 
-  freeHead = (freeMemNode_t *)memoryPool;
-  freeHead->cookie = FREEMEMCOOKIE;
-  freeHead->size = POOLSIZE;
-  freeHead->next = NULL;
-  freeHead->prev = NULL;
+  memset( smallFree, 0, sizeof( smallFree ) );
+  memset( largeFree, 0, sizeof( largeFree ) );
+  bumpPtr = memoryPool;
   freeMem = sizeof( memoryPool );
 }
 
 void BG_DefragmentMemory( void )
 {
-  // If there's a frenzy of deallocation and we want to
-  // allocate something big, this is useful. Otherwise...
-  // not much use.
+  // BG_Free already merges what it can, so this walks the pool checking
+  // every block, merges anything that is somehow still apart, and files
+  // the free blocks again.
 
-  freeMemNode_t *startfmn, *endfmn, *fmn;
+  freeMemNode_t *fmn, *next, *merged;
+  char *end = bumpPtr;
+  int size, prevFree = 0;
 
-  for( startfmn = freeHead; startfmn; )
+  memset( smallFree, 0, sizeof( smallFree ) );
+  memset( largeFree, 0, sizeof( largeFree ) );
+
+  for( fmn = (freeMemNode_t *)memoryPool; (char *)fmn < end; )
   {
-    endfmn = (freeMemNode_t *)(((char *) startfmn) + startfmn->size);
-    for( fmn = freeHead; fmn; )
+    size = fmn->cookie == FREEMEMCOOKIE ? fmn->size : *(int *)fmn & ~PREVFREE;
+    if( size <= 0 || ( size & ROUNDBITS ) || (char *)fmn + size > end )
+      Com_Error( ERR_DROP, "BG_DefragmentMemory: Memory corruption detected!" );
+
+    if( fmn->cookie != FREEMEMCOOKIE )
     {
-      if( fmn->cookie != FREEMEMCOOKIE )
+      *(int *)fmn = size | prevFree;
+      prevFree = 0;
+      fmn = (freeMemNode_t *)( (char *)fmn + size );
+      continue;
+    }
+
+    next = (freeMemNode_t *)( (char *)fmn + size );
+    while( (char *)next < end && next->cookie == FREEMEMCOOKIE )
+    {
+      if( next->size <= 0 || ( next->size & ROUNDBITS ) )
         Com_Error( ERR_DROP, "BG_DefragmentMemory: Memory corruption detected!" );
+      size += next->size;
+      merged = next;
+      next = (freeMemNode_t *)( (char *)next + next->size );
+      merged->cookie = 0;
+    }
 
-      if( fmn == endfmn )
-      {
-        // We can add fmn onto startfmn.
-
-        if( fmn->prev )
-          fmn->prev->next = fmn->next;
-        if( fmn->next )
-        {
-          if( !(fmn->next->prev = fmn->prev) )
-            freeHead = fmn->next;  // We're removing the head node
-        }
-        startfmn->size += fmn->size;
-        memset( fmn, 0, sizeof(freeMemNode_t) );  // A redundant call, really.
-
-        startfmn = freeHead;
-        endfmn = fmn = NULL;        // Break out of current loop
-      }
-      else
-        fmn = fmn->next;
+    if( (char *)next >= end )
+    {
+      bumpPtr = (char *)fmn;
+      break;
     }
 
-    if( endfmn )
-      startfmn = startfmn->next;    // endfmn acts as a 'restart' flag here
+    BG_LinkFree( fmn, size );
+    prevFree = PREVFREE;
+    fmn = next;
   }
 }
 
@@ -209,11 +320,11 @@ void BG_MemoryInfo( void )
 
   freeMemNode_t *fmn = (freeMemNode_t *)memoryPool;
   int size, chunks;
-  freeMemNode_t *end = (freeMemNode_t *)( memoryPool + POOLSIZE );
+  freeMemNode_t *end = (freeMemNode_t *)bumpPtr;
   void *p;
 
   Com_Printf( "%p-%p: %d out of %d bytes allocated\n",
-    fmn, end, POOLSIZE - freeMem, POOLSIZE );
+    fmn, memoryPool + POOLSIZE, POOLSIZE - freeMem, POOLSIZE );
 
   while( fmn < end )
   {
@@ -231,11 +342,14 @@ void BG_MemoryInfo( void )
     p = fmn;
     while( fmn < end && fmn->cookie != FREEMEMCOOKIE )
     {
-      size += *(int *)fmn;
+      size += *(int *)fmn & ~PREVFREE;
       chunks++;
-      fmn = (freeMemNode_t *)( (size_t)fmn + *(int *)fmn );
+      fmn = (freeMemNode_t *)( (size_t)fmn + ( *(int *)fmn & ~PREVFREE ) );
     }
     if( size )
       Com_Printf( "  %p: %d bytes allocated (%d chunks)\n", p, size, chunks );
   }
+
+  Com_Printf( "  %p: %d bytes never used\n",
+    bumpPtr, (int)( memoryPool + POOLSIZE - bumpPtr ) );
 }
@@ -1233,6 +1233,131 @@ qboolean CanDamage( gentity_t *targ, vec3_t origin )
   return qfalse;
 }
 
+/*
+============
+G_CanDamageList
+
+CanDamage for a whole list of entities.  Every entity's center trace goes
+to the engine in one batch, then the corner traces for the ones that were
+blocked.  Entities that can't be damaged from origin are dropped from the
+list, the rest keep their order.  Returns the new length of the list.
+============
+*/
+#define CORNER_BATCH  ( MAX_GENTITIES / 4 )
+
+static qboolean       canDamage[ MAX_GENTITIES ];
+static int            blockedTargets[ MAX_GENTITIES ];
+static traceRequest_t damageRequests[ MAX_GENTITIES ];
+static trace_t        damageResults[ MAX_GENTITIES ];
+
+static void G_DamageTraceRequest( traceRequest_t *req, const vec3_t origin, const vec3_t dest )
+{
+  VectorCopy( origin, req->start );
+  VectorCopy( dest, req->end );
+  VectorClear( req->mins );
+  VectorClear( req->maxs );
+  req->passEntityNum = ENTITYNUM_NONE;
+  req->contentmask = MASK_SOLID;
+  req->type = TT_AABB;
+}
+
+static int G_CanDamageList( int *entityList, int num, vec3_t origin )
+{
+  // this should probably check in the plane of projection,
+  // rather than in world coordinate, and also include Z
+  static const float corners[ 4 ][ 2 ] =
+    { { 15.0f, 15.0f }, { 15.0f, -15.0f }, { -15.0f, 15.0f }, { -15.0f, -15.0f } };
+  gentity_t *targ;
+  vec3_t    midpoint, dest;
+  int       numBlocked, first, count;
+  int       i, j;
+
+  if( num <= 0 )
+    return 0;
+
+  // use the midpoint of the bounds instead of the origin, because
+  // bmodels may have their origin is 0,0,0
+  for( i = 0; i < num; i++ )
+  {
+    targ = &g_entities[ entityList[ i ] ];
+    VectorAdd( targ->r.absmin, targ->r.absmax, midpoint );
+    VectorScale( midpoint, 0.5, midpoint );
+    G_DamageTraceRequest( &damageRequests[ i ], origin, midpoint );
+  }
+
+  trap_TraceBatch( damageResults, damageRequests, num );
+
+  numBlocked = 0;
+  for( i = 0; i < num; i++ )
+  {
+    canDamage[ i ] = damageResults[ i ].fraction == 1.0 ||
+                     damageResults[ i ].entityNum == entityList[ i ];
+    if( !canDamage[ i ] )
+      blockedTargets[ numBlocked++ ] = i;
+  }
+
+  for( first = 0; first < numBlocked; first += CORNER_BATCH )
+  {
+    count = MIN( numBlocked - first, CORNER_BATCH );
+
+    for( i = 0; i < count; i++ )
+    {
+      targ = &g_entities[ entityList[ blockedTargets[ first + i ] ] ];
+      VectorAdd( targ->r.absmin, targ->r.absmax, midpoint );
+      VectorScale( midpoint, 0.5, midpoint );
+
+      for( j = 0; j < 4; j++ )
+      {
+        VectorCopy( midpoint, dest );
+        dest[ 0 ] += corners[ j ][ 0 ];
+        dest[ 1 ] += corners[ j ][ 1 ];
+        G_DamageTraceRequest( &damageRequests[ i * 4 + j ], origin, dest );
+      }
+    }
+
+    trap_TraceBatch( damageResults, damageRequests, count * 4 );
+
+    for( i = 0; i < count * 4; i++ )
+    {
+      if( damageResults[ i ].fraction == 1.0 )
+        canDamage[ blockedTargets[ first + i / 4 ] ] = qtrue;
+    }
+  }
+
+  for( i = j = 0; i < num; i++ )
+  {
+    if( canDamage[ i ] )
+      entityList[ j++ ] = entityList[ i ];
+  }
+
+  return j;
+}
+
+/*
+============
+G_RadiusDamageDistance
+
+Distance from origin to the edge of ent's bounding box
+============
+*/
+static float G_RadiusDamageDistance( vec3_t origin, gentity_t *ent )
+{
+  vec3_t v;
+  int    i;
+
+  for( i = 0 ; i < 3 ; i++ )
+  {
+    if( origin[ i ] < ent->r.absmin[ i ] )
+      v[ i ] = ent->r.absmin[ i ] - origin[ i ];
+    else if( origin[ i ] > ent->r.absmax[ i ] )
+      v[ i ] = origin[ i ] - ent->r.absmax[ i ];
+    else
+      v[ i ] = 0;
+  }
+
+  return VectorLength( v );
+}
+
 /*
 ============
 G_SelectiveRadiusDamage
@@ -1244,9 +1369,8 @@ qboolean G_SelectiveRadiusDamage( vec3_t origin, gentity_t *attacker, float dama
   float     points, dist;
   gentity_t *ent;
   int       entityList[ MAX_GENTITIES ];
-  int       numListedEntities;
+  int       numListedEntities, numTargets;
   vec3_t    mins, maxs;
-  vec3_t    v;
   vec3_t    dir;
   int       i, e;
   qboolean  hitClient = qfalse;
@@ -1262,6 +1386,7 @@ qboolean G_SelectiveRadiusDamage( vec3_t origin, gentity_t *attacker, float dama
 
   numListedEntities = trap_EntitiesInBox( mins, maxs, entityList, MAX_GENTITIES );
 
+  numTargets = 0;
   for( e = 0; e < numListedEntities; e++ )
   {
     ent = &g_entities[ entityList[ e ] ];
@@ -1275,34 +1400,35 @@ qboolean G_SelectiveRadiusDamage( vec3_t origin, gentity_t *attacker, float dama
     if( ent->flags & FL_NOTARGET )
       continue;
 
-    // find the distance from the edge of the bounding box
-    for( i = 0 ; i < 3 ; i++ )
-    {
-      if( origin[ i ] < ent->r.absmin[ i ] )
-        v[ i ] = ent->r.absmin[ i ] - origin[ i ];
-      else if( origin[ i ] > ent->r.absmax[ i ] )
-        v[ i ] = origin[ i ] - ent->r.absmax[ i ];
-      else
-        v[ i ] = 0;
-    }
+    if( !ent->client || ent->client->ps.stats[ STAT_TEAM ] == team )
+      continue;
 
-    dist = VectorLength( v );
-    if( dist >= radius )
+    if( G_RadiusDamageDistance( origin, ent ) >= radius )
       continue;
 
+    entityList[ numTargets++ ] = entityList[ e ];
+  }
+
+  numTargets = G_CanDamageList( entityList, numTargets, origin );
+
+  for( e = 0; e < numTargets; e++ )
+  {
+    ent = &g_entities[ entityList[ e ] ];
+
+    // an earlier target may have taken this one with it
+    if( !ent->takedamage )
+      continue;
+
+    dist = G_RadiusDamageDistance( origin, ent );
     points = damage * ( 1.0 - dist / radius );
 
-    if( CanDamage( ent, origin ) && ent->client &&
-        ent->client->ps.stats[ STAT_TEAM ] != team )
-    {
-      VectorSubtract( ent->r.currentOrigin, origin, dir );
-      // push the center of mass higher than the origin so players
-      // get knocked into the air more
-      dir[ 2 ] += 24;
-      hitClient = qtrue;
-      G_Damage( ent, NULL, attacker, dir, origin,
-          (int)points, DAMAGE_RADIUS|DAMAGE_NO_LOCDAMAGE, mod );
-    }
+    VectorSubtract( ent->r.currentOrigin, origin, dir );
+    // push the center of mass higher than the origin so players
+    // get knocked into the air more
+    dir[ 2 ] += 24;
+    hitClient = qtrue;
+    G_Damage( ent, NULL, attacker, dir, origin,
+        (int)points, DAMAGE_RADIUS|DAMAGE_NO_LOCDAMAGE, mod );
   }
 
   return hitClient;
@@ -1320,9 +1446,8 @@ qboolean G_RadiusDamage( vec3_t origin, gentity_t *attacker, float damage,
   float     points, dist;
   gentity_t *ent;
   int       entityList[ MAX_GENTITIES ];
-  int       numListedEntities;
+  int       numListedEntities, numTargets;
   vec3_t    mins, maxs;
-  vec3_t    v;
   vec3_t    dir;
   int       i, e;
   qboolean  hitClient = qfalse;
@@ -1338,6 +1463,7 @@ qboolean G_RadiusDamage( vec3_t origin, gentity_t *attacker, float damage,
 
   numListedEntities = trap_EntitiesInBox( mins, maxs, entityList, MAX_GENTITIES );
 
+  numTargets = 0;
   for( e = 0; e < numListedEntities; e++ )
   {
     ent = &g_entities[ entityList[ e ] ];
@@ -1348,33 +1474,32 @@ qboolean G_RadiusDamage( vec3_t origin, gentity_t *attacker, float damage,
     if( !ent->takedamage )
       continue;
 
-    // find the distance from the edge of the bounding box
-    for( i = 0; i < 3; i++ )
-    {
-      if( origin[ i ] < ent->r.absmin[ i ] )
-        v[ i ] = ent->r.absmin[ i ] - origin[ i ];
-      else if( origin[ i ] > ent->r.absmax[ i ] )
-        v[ i ] = origin[ i ] - ent->r.absmax[ i ];
-      else
-        v[ i ] = 0;
-    }
+    if( G_RadiusDamageDistance( origin, ent ) >= radius )
+      continue;
+
+    entityList[ numTargets++ ] = entityList[ e ];
+  }
+
+  numTargets = G_CanDamageList( entityList, numTargets, origin );
+
+  for( e = 0; e < numTargets; e++ )
+  {
+    ent = &g_entities[ entityList[ e ] ];
 
-    dist = VectorLength( v );
-    if( dist >= radius )
+    // an earlier target may have taken this one with it
+    if( !ent->takedamage )
       continue;
 
+    dist = G_RadiusDamageDistance( origin, ent );
     points = damage * ( 1.0 - dist / radius );
 
-    if( CanDamage( ent, origin ) )
-    {
-      VectorSubtract( ent->r.currentOrigin, origin, dir );
-      // push the center of mass higher than the origin so players
-      // get knocked into the air more
-      dir[ 2 ] += 24;
-      hitClient = qtrue;
-      G_Damage( ent, NULL, attacker, dir, origin,
-          (int)points, DAMAGE_RADIUS|DAMAGE_NO_LOCDAMAGE, mod );
-    }
+    VectorSubtract( ent->r.currentOrigin, origin, dir );
+    // push the center of mass higher than the origin so players
+    // get knocked into the air more
+    dir[ 2 ] += 24;
+    hitClient = qtrue;
+    G_Damage( ent, NULL, attacker, dir, origin,
+        (int)points, DAMAGE_RADIUS|DAMAGE_NO_LOCDAMAGE, mod );
   }
 
   return hitClient;
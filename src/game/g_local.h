@@ -1253,3 +1253,14 @@ void      trap_SnapVector( float *v );
 void      trap_AddCommand( const char *cmdName );
 void      trap_RemoveCommand( const char *cmdName );
 int       trap_FS_GetFilteredFiles( const char *path, const char *extension, const char *filter, char *listbuf, int bufsize );
+
+int       trap_ProfileRegister( const char *name );
+void      trap_ProfileBegin( int scope );
+void      trap_ProfileEnd( int scope );
+
+void      trap_TraceBatch( trace_t *results, const traceRequest_t *requests, int count );
+qboolean  trap_EntitiesInPVS( int ent1, int ent2, qboolean ignorePortals );
+
+#ifndef Q3_VM
+void      G_SyscallBench_f( void );
+#endif
@@ -288,6 +288,11 @@ static cvarTable_t   gameCvarTable[ ] =
 
 static size_t gameCvarTableSize = ARRAY_LEN( gameCvarTable );
 
+// G_RunFrame timers, dumped by the server's sv_profile command
+static int profEntities;
+static int profEndFrame;
+static int profRules;
+
 
 void G_InitGame( int levelTime, int randomSeed, int restart );
 void G_RunFrame( int levelTime );
@@ -546,6 +551,10 @@ void G_InitGame( int levelTime, int randomSeed, int restart )
 
   G_RegisterCvars( );
 
+  profEntities = trap_ProfileRegister( "game_entities" );
+  profEndFrame = trap_ProfileRegister( "game_endframe" );
+  profRules = trap_ProfileRegister( "game_rules" );
+
   G_Printf( "------- Game Initialization -------\n" );
   G_Printf( "gamename: %s\n", GAME_VERSION );
 
@@ -2340,6 +2349,7 @@ void G_RunFrame( int levelTime )
   //
   // go through all allocated objects
   //
+  trap_ProfileBegin( profEntities );
   ent = &g_entities[ 0 ];
 
   for( i = 0; i < level.num_entities; i++, ent++ )
@@ -2424,8 +2434,10 @@ void G_RunFrame( int levelTime )
 
     G_RunThink( ent );
   }
+  trap_ProfileEnd( profEntities );
 
   // perform final fixups on the players
+  trap_ProfileBegin( profEndFrame );
   ent = &g_entities[ 0 ];
 
   for( i = 0; i < level.maxclients; i++, ent++ )
@@ -2436,7 +2448,9 @@ void G_RunFrame( int levelTime )
 
   // save position information for all active clients
   G_UnlaggedStore( );
+  trap_ProfileEnd( profEndFrame );
 
+  trap_ProfileBegin( profRules );
   G_CountSpawns( );
   if( !g_doWarmup.integer || level.warmupTime <= level.time )
   {
@@ -2458,6 +2472,7 @@ void G_RunFrame( int levelTime )
   // cancel vote if timed out
   for( i = 0; i < NUM_TEAMS; i++ )
     G_CheckVote( i );
+  trap_ProfileEnd( profRules );
 
   level.frameMsec = trap_Milliseconds();
 }
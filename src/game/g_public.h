@@ -90,6 +90,16 @@ typedef struct {
   entityShared_t  r;        // shared by both the server system and game
 } sharedEntity_t;
 
+// one trace of a G_TRACE_BATCH call, with the same meaning as the
+// arguments of G_TRACE
+typedef struct {
+  vec3_t      start, end;
+  vec3_t      mins, maxs;
+  int         passEntityNum;
+  int         contentmask;
+  traceType_t type;       // TT_AABB or TT_CAPSULE
+} traceRequest_t;
+
 
 
 //===============================================================
@@ -228,9 +238,50 @@ typedef enum {
 
   G_ADDCOMMAND,
   G_REMOVECOMMAND,
-  G_FS_GETFILTEREDFILES
+  G_FS_GETFILTEREDFILES,
+
+  G_PROFILE_REGISTER, // int ( const char *name );
+  // returns a handle for a named timer shown by sv_profile, -1 if the
+  // engine has run out of them
+
+  G_PROFILE_BEGIN,  // ( int scope );
+  G_PROFILE_END, // ( int scope );
+
+  G_TRACE_BATCH, // ( trace_t *results, const traceRequest_t *requests, int count );
+  // runs count traces in one call.  They all see the world as it is
+  // when the call is made, so results[ i ] is what G_TRACE (or
+  // G_TRACECAPSULE) would have returned for requests[ i ]
+
+  G_ENTITIES_IN_PVS // ( int ent1, int ent2, qboolean ignorePortals );
+  // G_IN_PVS (or G_IN_PVS_IGNORE_PORTALS) for the two entities'
+  // r.currentOrigin as of their last G_LINKENTITY, which is much cheaper
+  // than passing the points
 } gameImport_t;
 
+//
+// direct entry points for the hottest traps, native game modules only
+//
+// After dllEntry the server hands this table to the module's optional
+// dllDirectCalls export.  Each call behaves exactly like the matching
+// trap, but skips the varargs system call and its switch.  A qvm never
+// sees the table, and everything not in it still goes through G_*
+//
+#define GAME_DIRECT_VERSION 1
+
+typedef struct {
+  int   version;  // GAME_DIRECT_VERSION
+  int   size;     // sizeof( gameDirectCalls_t ), calls are only ever appended
+
+  void  ( *Trace )( trace_t *results, const vec3_t start, const vec3_t mins,
+                    const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask );
+  void  ( *TraceCapsule )( trace_t *results, const vec3_t start, const vec3_t mins,
+                           const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask );
+  int   ( *PointContents )( const vec3_t point, int passEntityNum );
+  void  ( *LinkEntity )( sharedEntity_t *ent );
+  void  ( *UnlinkEntity )( sharedEntity_t *ent );
+  int   ( *EntitiesInBox )( const vec3_t mins, const vec3_t maxs, int *list, int maxcount );
+} gameDirectCalls_t;
+
 
 //
 // functions exported by the game subsystem
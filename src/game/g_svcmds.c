@@ -585,7 +585,10 @@ struct svcmd
   { "say_team", qtrue, Svcmd_TeamMessage_f },
   { "status", qfalse, Svcmd_Status_f },
   { "stopMapRotation", qfalse, G_StopMapRotation },
-  { "suddendeath", qfalse, Svcmd_SuddenDeath_f }
+  { "suddendeath", qfalse, Svcmd_SuddenDeath_f },
+#ifndef Q3_VM
+  { "syscallbench", qfalse, G_SyscallBench_f }
+#endif
 };
 
 /*
@@ -55,6 +55,11 @@ equ trap_SendGameStat                 -49
 equ trap_AddCommand                   -50
 equ trap_RemoveCommand                -51
 equ trap_FS_GetFilteredFiles           -52
+equ trap_ProfileRegister              -53
+equ trap_ProfileBegin                 -54
+equ trap_ProfileEnd                   -55
+equ trap_TraceBatch                   -56
+equ trap_EntitiesInPVS                -57
 
 equ memset                            -101
 equ memcpy                            -102
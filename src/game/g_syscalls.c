@@ -34,6 +34,17 @@ Q_EXPORT void dllEntry( intptr_t (QDECL *syscallptr)( intptr_t arg,... ) )
   syscall = syscallptr;
 }
 
+// set by the server when it supports the direct call table, see g_public.h
+static const gameDirectCalls_t *direct;
+
+Q_EXPORT void dllDirectCalls( const gameDirectCalls_t *calls )
+{
+  if( calls->version == GAME_DIRECT_VERSION && calls->size >= sizeof( *calls ) )
+    direct = calls;
+  else
+    direct = NULL;
+}
+
 int PASSFLOAT( float x )
 {
   floatint_t fi;
@@ -177,16 +188,25 @@ void trap_SetBrushModel( gentity_t *ent, const char *name )
 void trap_Trace( trace_t *results, const vec3_t start, const vec3_t mins,
                  const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask )
 {
-  syscall( G_TRACE, results, start, mins, maxs, end, passEntityNum, contentmask );
+  if( direct )
+    direct->Trace( results, start, mins, maxs, end, passEntityNum, contentmask );
+  else
+    syscall( G_TRACE, results, start, mins, maxs, end, passEntityNum, contentmask );
 }
 
 void trap_TraceCapsule( trace_t *results, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask )
 {
-  syscall( G_TRACECAPSULE, results, start, mins, maxs, end, passEntityNum, contentmask );
+  if( direct )
+    direct->TraceCapsule( results, start, mins, maxs, end, passEntityNum, contentmask );
+  else
+    syscall( G_TRACECAPSULE, results, start, mins, maxs, end, passEntityNum, contentmask );
 }
 
 int trap_PointContents( const vec3_t point, int passEntityNum )
 {
+  if( direct )
+    return direct->PointContents( point, passEntityNum );
+
   return syscall( G_POINT_CONTENTS, point, passEntityNum );
 }
 
@@ -213,17 +233,26 @@ qboolean trap_AreasConnected( int area1, int area2 )
 
 void trap_LinkEntity( gentity_t *ent )
 {
-  syscall( G_LINKENTITY, ent );
+  if( direct )
+    direct->LinkEntity( (sharedEntity_t *)ent );
+  else
+    syscall( G_LINKENTITY, ent );
 }
 
 void trap_UnlinkEntity( gentity_t *ent )
 {
-  syscall( G_UNLINKENTITY, ent );
+  if( direct )
+    direct->UnlinkEntity( (sharedEntity_t *)ent );
+  else
+    syscall( G_UNLINKENTITY, ent );
 }
 
 
 int trap_EntitiesInBox( const vec3_t mins, const vec3_t maxs, int *list, int maxcount )
 {
+  if( direct )
+    return direct->EntitiesInBox( mins, maxs, list, maxcount );
+
   return syscall( G_ENTITIES_IN_BOX, mins, maxs, list, maxcount );
 }
 
@@ -297,3 +326,89 @@ int trap_FS_GetFilteredFiles( const char *path, const char *extension, const cha
   return syscall( G_FS_GETFILTEREDFILES, path, extension, filter, listbuf, bufsize );
 }
 
+int trap_ProfileRegister( const char *name )
+{
+  return syscall( G_PROFILE_REGISTER, name );
+}
+
+void trap_ProfileBegin( int scope )
+{
+  syscall( G_PROFILE_BEGIN, scope );
+}
+
+void trap_ProfileEnd( int scope )
+{
+  syscall( G_PROFILE_END, scope );
+}
+
+void trap_TraceBatch( trace_t *results, const traceRequest_t *requests, int count )
+{
+  syscall( G_TRACE_BATCH, results, requests, count );
+}
+
+qboolean trap_EntitiesInPVS( int ent1, int ent2, qboolean ignorePortals )
+{
+  return syscall( G_ENTITIES_IN_PVS, ent1, ent2, ignorePortals );
+}
+
+
+/*
+=================
+G_SyscallBench_f
+
+Times the hot traps through the system call and through the direct
+table, so the cost of a round trip can be compared on the current map
+=================
+*/
+void G_SyscallBench_f( void )
+{
+  const gameDirectCalls_t *saved = direct;
+  char    arg[ 16 ];
+  int     count = 1000000;
+  int     pass, i, start;
+  int     msec[ 2 ][ 2 ];
+  vec3_t  origin, end, mins = { -15, -15, -24 }, maxs = { 15, 15, 32 };
+  trace_t tr;
+
+  if( trap_Argc( ) > 1 )
+  {
+    trap_Argv( 1, arg, sizeof( arg ) );
+    count = MAX( atoi( arg ), 1 );
+  }
+
+  if( !saved )
+    G_Printf( "the server did not provide direct calls, only timing the system call\n" );
+
+  VectorCopy( level.intermission_origin, origin );
+  VectorCopy( origin, end );
+  end[ 2 ] -= 256.0f;
+
+  for( pass = 0; pass < 2; pass++ )
+  {
+    direct = pass ? saved : NULL;
+    if( pass && !direct )
+    {
+      msec[ pass ][ 0 ] = msec[ pass ][ 1 ] = 0;
+      continue;
+    }
+
+    start = trap_Milliseconds( );
+    for( i = 0; i < count; i++ )
+      trap_PointContents( origin, ENTITYNUM_NONE );
+    msec[ pass ][ 0 ] = trap_Milliseconds( ) - start;
+
+    start = trap_Milliseconds( );
+    for( i = 0; i < count; i++ )
+      trap_Trace( &tr, origin, mins, maxs, end, ENTITYNUM_NONE, MASK_PLAYERSOLID );
+    msec[ pass ][ 1 ] = trap_Milliseconds( ) - start;
+  }
+
+  direct = saved;
+
+  G_Printf( "%d calls each, nsec per call:\n", count );
+  G_Printf( "               syscall  direct\n" );
+  G_Printf( "PointContents  %7.1f %7.1f\n",
+    msec[ 0 ][ 0 ] * 1.0e6f / count, msec[ 1 ][ 0 ] * 1.0e6f / count );
+  G_Printf( "Trace          %7.1f %7.1f\n",
+    msec[ 0 ][ 1 ] * 1.0e6f / count, msec[ 1 ][ 1 ] * 1.0e6f / count );
+}
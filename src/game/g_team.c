@@ -266,7 +266,7 @@ gentity_t *Team_GetLocation( gentity_t *ent )
     if( len > bestlen )
       continue;
 
-    if( !trap_InPVS( ent->r.currentOrigin, eloc->r.currentOrigin ) )
+    if( !trap_EntitiesInPVS( ent->s.number, eloc->s.number, qfalse ) )
       continue;
 
     bestlen = len;
@@ -1020,22 +1020,23 @@ G_FindZapChainTargets
 */
 static void G_FindZapChainTargets( zap_t *zap )
 {
+  static traceRequest_t requests[ MAX_GENTITIES ];
+  static trace_t        results[ MAX_GENTITIES ];
   gentity_t *ent = zap->targets[ 0 ]; // the source
   int       entityList[ MAX_GENTITIES ];
   vec3_t    range = { LEVEL2_AREAZAP_CHAIN_RANGE,
                       LEVEL2_AREAZAP_CHAIN_RANGE,
                       LEVEL2_AREAZAP_CHAIN_RANGE };
   vec3_t    mins, maxs;
-  int       i, num;
+  int       i, num, numCandidates;
   gentity_t *enemy;
-  trace_t   tr;
-  float     distance;
 
   VectorAdd( ent->r.currentOrigin, range, maxs );
   VectorSubtract( ent->r.currentOrigin, range, mins );
 
   num = trap_EntitiesInBox( mins, maxs, entityList, MAX_GENTITIES );
 
+  numCandidates = 0;
   for( i = 0; i < num; i++ )
   {
     enemy = &g_entities[ entityList[ i ] ];
@@ -1043,28 +1044,42 @@ static void G_FindZapChainTargets( zap_t *zap )
     if( enemy == ent || ( enemy->client && enemy->client->noclip ) )
       continue;
 
-    distance = Distance( ent->r.currentOrigin, enemy->r.currentOrigin );
-
     if( ( ( enemy->client &&
             enemy->client->ps.stats[ STAT_TEAM ] == TEAM_HUMANS ) ||
           ( enemy->s.eType == ET_BUILDABLE &&
             BG_Buildable( enemy->s.modelindex )->team == TEAM_HUMANS ) ) &&
         enemy->health > 0 && // only chain to living targets
-        distance <= LEVEL2_AREAZAP_CHAIN_RANGE )
+        Distance( ent->r.currentOrigin, enemy->r.currentOrigin ) <= LEVEL2_AREAZAP_CHAIN_RANGE )
     {
       // world-LOS check: trace against the world, ignoring other BODY entities
-      trap_Trace( &tr, ent->r.currentOrigin, NULL, NULL,
-         enemy->r.currentOrigin, ent->s.number, CONTENTS_SOLID );
-
-      if( tr.entityNum == ENTITYNUM_NONE )
-      {
-        zap->targets[ zap->numTargets ] = enemy;
-        zap->distances[ zap->numTargets ] = distance;
-        if( ++zap->numTargets >= LEVEL2_AREAZAP_MAX_TARGETS )
-          return;
-      }
+      entityList[ numCandidates ] = entityList[ i ];
+      VectorCopy( ent->r.currentOrigin, requests[ numCandidates ].start );
+      VectorCopy( enemy->r.currentOrigin, requests[ numCandidates ].end );
+      VectorClear( requests[ numCandidates ].mins );
+      VectorClear( requests[ numCandidates ].maxs );
+      requests[ numCandidates ].passEntityNum = ent->s.number;
+      requests[ numCandidates ].contentmask = CONTENTS_SOLID;
+      requests[ numCandidates ].type = TT_AABB;
+      numCandidates++;
     }
   }
+
+  if( !numCandidates )
+    return;
+
+  trap_TraceBatch( results, requests, numCandidates );
+
+  for( i = 0; i < numCandidates; i++ )
+  {
+    if( results[ i ].entityNum != ENTITYNUM_NONE )
+      continue;
+
+    enemy = &g_entities[ entityList[ i ] ];
+    zap->targets[ zap->numTargets ] = enemy;
+    zap->distances[ zap->numTargets ] = Distance( ent->r.currentOrigin, enemy->r.currentOrigin );
+    if( ++zap->numTargets >= LEVEL2_AREAZAP_MAX_TARGETS )
+      return;
+  }
 }
 
 /*
@@ -22,9 +22,14 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 // cmodel.c -- model loading
 
+#include <cstddef>
+#include <vector>
+
 #include "cm_local.h"
+#include "cm_patch.h"
 #include "files.h"
 #include "md4.h"
+#include "sys/sys_shared.h"
 
 #ifdef BSPC
 
@@ -55,8 +60,8 @@ void SetPlaneSignbits (cplane_t *out) {
 
 
 clipMap_t	cm;
-int			c_pointcontents;
-int			c_traces, c_brush_traces, c_patch_traces;
+thread_local int	c_pointcontents;
+thread_local int	c_traces, c_brush_traces, c_patch_traces;
 
 
 byte		*cmod_base;
@@ -65,13 +70,13 @@ byte		*cmod_base;
 cvar_t		*cm_noAreas;
 cvar_t		*cm_noCurves;
 cvar_t		*cm_playerCurveClip;
+cvar_t		*cm_debugSurfaceUpdate;
+cvar_t		*cm_simd;
+cvar_t		*cm_traceCache;
+cvar_t		*cm_traceCacheSize;
+cvar_t		*cm_cache;
 #endif
 
-cmodel_t	box_model;
-cplane_t	*box_planes;
-cbrush_t	*box_brush;
-
-
 
 void	CM_InitBoxHull (void);
 
@@ -227,6 +232,44 @@ void CM_BoundBrush( cbrush_t *b ) {
 }
 
 
+/*
+=================
+CMod_PackBrushSides
+
+Copies each brush's side planes into groups of four normal x's, y's, z's
+and dists, so the trace code can test four sides at a time
+=================
+*/
+static void CMod_PackBrushSides( void ) {
+	cbrush_t	*b;
+	cplane_t	*plane;
+	float		*out, *group;
+	int			i, j, total;
+
+	total = 0;
+	for ( i = 0, b = cm.brushes ; i < cm.numBrushes ; i++, b++ ) {
+		total += ( b->numsides + 3 ) >> 2;
+	}
+
+	out = (float *)Hunk_Alloc( total * 16 * sizeof( float ), h_high );
+
+	for ( i = 0, b = cm.brushes ; i < cm.numBrushes ; i++, b++ ) {
+		b->sidePlanes = out;
+
+		for ( j = 0 ; j < b->numsides ; j++ ) {
+			plane = b->sides[j].plane;
+			group = out + ( j >> 2 ) * 16 + ( j & 3 );
+
+			group[0] = plane->normal[0];
+			group[4] = plane->normal[1];
+			group[8] = plane->normal[2];
+			group[12] = plane->dist;
+		}
+
+		out += ( ( b->numsides + 3 ) >> 2 ) * 16;
+	}
+}
+
 /*
 =================
 CMod_LoadBrushes
@@ -262,6 +305,7 @@ void CMod_LoadBrushes( lump_t *l ) {
 		CM_BoundBrush( out );
 	}
 
+	CMod_PackBrushSides();
 }
 
 /*
@@ -706,6 +750,340 @@ unsigned CM_Checksum(dheader_t *header) {
 	return LittleLong(Com_BlockChecksum(checksums, 11 * 4));
 }
 
+#ifndef BSPC
+/*
+===============================================================================
+
+COLLISION CACHE
+
+Building the clip map from the BSP lumps, in particular the brush edges and
+the patch collision facets, is most of the time a map load spends in here.
+Once built, the whole clipMap_t is written to cmcache/<checksum>.cmcache in
+the homepath as one flat block where every pointer is replaced by an offset
+from the start of the file.  Loading the same BSP again maps the file
+copy-on-write and turns the offsets back into pointers in place.
+
+===============================================================================
+*/
+
+#define	CM_CACHE_IDENT		(('C'<<24)+('M'<<16)+('C'<<8)+'T')
+#define	CM_CACHE_VERSION	1		// bump whenever the built data changes
+
+typedef struct {
+	int			ident;
+	int			version;
+	unsigned	checksum;		// of everything after this field
+
+	unsigned	bspChecksum;	// of the BSP the cache was built from
+	unsigned	layout;			// CMod_CacheLayout of the build that wrote it
+	int			length;			// of the whole file
+	clipMap_t	cm;				// pointers are offsets from the start of the file
+} cmCacheHeader_t;
+
+#define	CM_CACHE_CHECKED	( offsetof( cmCacheHeader_t, checksum ) + sizeof( unsigned ) )
+
+static void		*cm_cacheBase;
+static size_t	cm_cacheLength;
+
+/*
+=================
+CMod_CacheLayout
+
+Differs between builds whose structures wouldn't line up with each other
+=================
+*/
+static unsigned CMod_CacheLayout( void ) {
+	int		sizes[] = {
+		(int)sizeof( void * ), (int)sizeof( clipMap_t ), (int)sizeof( cNode_t ),
+		(int)sizeof( cLeaf_t ), (int)sizeof( cmodel_t ), (int)sizeof( cbrushside_t ),
+		(int)sizeof( cbrush_t ), (int)sizeof( cbrushedge_t ), (int)sizeof( cplane_t ),
+		(int)sizeof( cPatch_t ), (int)sizeof( patchCollide_t ), (int)sizeof( patchPlane_t ),
+		(int)sizeof( facet_t ), BOX_BRUSHES, BOX_SIDES, BOX_LEAFS, BOX_PLANES
+	};
+
+	return Com_BlockChecksum( sizes, sizeof( sizes ) );
+}
+
+/*
+=================
+CMod_CacheAppend
+
+Adds length bytes to the end of the cache on a 16 byte boundary and
+returns their offset
+=================
+*/
+static size_t CMod_CacheAppend( std::vector<byte> &buf, const void *data, size_t length ) {
+	size_t	ofs;
+
+	ofs = ( buf.size() + 15 ) & ~(size_t)15;
+	buf.resize( ofs + length );
+	if ( data && length ) {
+		::memcpy( buf.data() + ofs, data, length );
+	}
+
+	return ofs;
+}
+
+template<typename T>
+static ID_INLINE T *CMod_CacheOffset( size_t ofs ) {
+	return (T *)(intptr_t)ofs;
+}
+
+template<typename T>
+static ID_INLINE void CMod_CacheRelocate( byte *base, T *&ptr ) {
+	if ( ptr ) {
+		ptr = (T *)( base + (intptr_t)ptr );
+	}
+}
+
+/*
+=================
+CMod_FreeCache
+=================
+*/
+static void CMod_FreeCache( void ) {
+	Sys_UnmapFile( cm_cacheBase, cm_cacheLength );
+	cm_cacheBase = NULL;
+	cm_cacheLength = 0;
+}
+
+/*
+=================
+CMod_WriteCache
+
+Flattens the clip map that was just built into qpath
+=================
+*/
+static void CMod_WriteCache( const char *qpath, unsigned bspChecksum ) {
+	std::vector<byte>	buf;
+	std::vector<int>	leafbrushes, leafsurfaces;
+	std::vector<size_t>	edgeOfs, patchOfs;
+	cmCacheHeader_t		*header;
+	clipMap_t			*out;
+	size_t		shadersOfs, sidesOfs, planesOfs, nodesOfs, leafsOfs;
+	size_t		leafbrushesOfs, leafsurfacesOfs, cmodelsOfs, brushesOfs;
+	size_t		sidePlanesOfs, entityOfs, visOfs, areasOfs, portalsOfs, surfacesOfs;
+	size_t		visLength, pcOfs, ofs;
+	cmodel_t	*model;
+	cbrush_t	*brush;
+	cPatch_t	*patch;
+	patchCollide_t	*pc;
+	char		tmpPath[MAX_QPATH + 4];
+	int			i, numSidePlanes;
+
+	CMod_CacheAppend( buf, NULL, sizeof( cmCacheHeader_t ) );
+
+	shadersOfs = CMod_CacheAppend( buf, cm.shaders, cm.numShaders * sizeof( *cm.shaders ) );
+	sidesOfs = CMod_CacheAppend( buf, cm.brushsides, ( cm.numBrushSides + BOX_SIDES ) * sizeof( *cm.brushsides ) );
+	planesOfs = CMod_CacheAppend( buf, cm.planes, ( cm.numPlanes + BOX_PLANES ) * sizeof( *cm.planes ) );
+	nodesOfs = CMod_CacheAppend( buf, cm.nodes, cm.numNodes * sizeof( *cm.nodes ) );
+	leafsOfs = CMod_CacheAppend( buf, cm.leafs, ( cm.numLeafs + BOX_LEAFS ) * sizeof( *cm.leafs ) );
+	cmodelsOfs = CMod_CacheAppend( buf, cm.cmodels, cm.numSubModels * sizeof( *cm.cmodels ) );
+
+	// the submodels' brush and surface lists were allocated after the world's,
+	// so they go on the end of the world's lists
+	leafbrushes.assign( cm.leafbrushes, cm.leafbrushes + cm.numLeafBrushes + BOX_BRUSHES );
+	leafsurfaces.assign( cm.leafsurfaces, cm.leafsurfaces + cm.numLeafSurfaces );
+	for ( i = 1 ; i < cm.numSubModels ; i++ ) {
+		model = (cmodel_t *)( buf.data() + cmodelsOfs ) + i;
+
+		leafbrushes.insert( leafbrushes.end(), cm.leafbrushes + model->leaf.firstLeafBrush,
+			cm.leafbrushes + model->leaf.firstLeafBrush + model->leaf.numLeafBrushes );
+		model->leaf.firstLeafBrush = leafbrushes.size() - model->leaf.numLeafBrushes;
+
+		leafsurfaces.insert( leafsurfaces.end(), cm.leafsurfaces + model->leaf.firstLeafSurface,
+			cm.leafsurfaces + model->leaf.firstLeafSurface + model->leaf.numLeafSurfaces );
+		model->leaf.firstLeafSurface = leafsurfaces.size() - model->leaf.numLeafSurfaces;
+	}
+	leafbrushesOfs = CMod_CacheAppend( buf, leafbrushes.data(), leafbrushes.size() * sizeof( int ) );
+	leafsurfacesOfs = CMod_CacheAppend( buf, leafsurfaces.data(), leafsurfaces.size() * sizeof( int ) );
+
+	brushesOfs = CMod_CacheAppend( buf, cm.brushes, ( cm.numBrushes + BOX_BRUSHES ) * sizeof( *cm.brushes ) );
+
+	// CMod_PackBrushSides put every brush's planes in one block
+	numSidePlanes = 0;
+	for ( i = 0 ; i < cm.numBrushes ; i++ ) {
+		numSidePlanes += ( ( cm.brushes[i].numsides + 3 ) >> 2 ) * 16;
+	}
+	sidePlanesOfs = CMod_CacheAppend( buf, cm.numBrushes ? cm.brushes[0].sidePlanes : NULL,
+		numSidePlanes * sizeof( float ) );
+
+	edgeOfs.resize( cm.numBrushes );
+	for ( i = 0 ; i < cm.numBrushes ; i++ ) {
+		edgeOfs[i] = CMod_CacheAppend( buf, cm.brushes[i].edges, cm.brushes[i].numEdges * sizeof( cbrushedge_t ) );
+	}
+
+	visLength = cm.vised ? cm.numClusters * cm.clusterBytes : cm.clusterBytes;
+	entityOfs = CMod_CacheAppend( buf, cm.entityString, cm.numEntityChars );
+	visOfs = CMod_CacheAppend( buf, cm.visibility, visLength );
+	areasOfs = CMod_CacheAppend( buf, cm.areas, cm.numAreas * sizeof( *cm.areas ) );
+	portalsOfs = CMod_CacheAppend( buf, cm.areaPortals, cm.numAreas * cm.numAreas * sizeof( *cm.areaPortals ) );
+
+	// each patch is followed by its collide, planes and facets
+	surfacesOfs = CMod_CacheAppend( buf, NULL, cm.numSurfaces * sizeof( *cm.surfaces ) );
+	patchOfs.assign( cm.numSurfaces, 0 );
+	for ( i = 0 ; i < cm.numSurfaces ; i++ ) {
+		patch = cm.surfaces[i];
+		if ( !patch ) {
+			continue;
+		}
+		pc = patch->pc;
+
+		patchOfs[i] = CMod_CacheAppend( buf, patch, sizeof( *patch ) );
+		pcOfs = CMod_CacheAppend( buf, pc, sizeof( *pc ) );
+		( (cPatch_t *)( buf.data() + patchOfs[i] ) )->pc = CMod_CacheOffset<patchCollide_t>( pcOfs );
+
+		ofs = CMod_CacheAppend( buf, pc->planes, pc->numPlanes * sizeof( *pc->planes ) );
+		( (patchCollide_t *)( buf.data() + pcOfs ) )->planes = CMod_CacheOffset<patchPlane_t>( ofs );
+		ofs = CMod_CacheAppend( buf, pc->facets, pc->numFacets * sizeof( *pc->facets ) );
+		( (patchCollide_t *)( buf.data() + pcOfs ) )->facets = CMod_CacheOffset<facet_t>( ofs );
+	}
+
+	// everything is in place, swap the pointers for offsets
+	for ( i = 0 ; i < cm.numSurfaces ; i++ ) {
+		( (cPatch_t **)( buf.data() + surfacesOfs ) )[i] = CMod_CacheOffset<cPatch_t>( patchOfs[i] );
+	}
+
+	for ( i = 0 ; i < cm.numBrushSides + BOX_SIDES ; i++ ) {
+		cbrushside_t	*side = (cbrushside_t *)( buf.data() + sidesOfs ) + i;
+
+		side->plane = side->plane ? CMod_CacheOffset<cplane_t>( planesOfs + side->planeNum * sizeof( cplane_t ) ) : NULL;
+		side->winding = NULL;
+	}
+
+	for ( i = 0 ; i < cm.numNodes ; i++ ) {
+		cNode_t		*node = (cNode_t *)( buf.data() + nodesOfs ) + i;
+
+		node->plane = CMod_CacheOffset<cplane_t>( planesOfs + ( cm.nodes[i].plane - cm.planes ) * sizeof( cplane_t ) );
+	}
+
+	for ( i = 0 ; i < cm.numBrushes ; i++ ) {
+		brush = (cbrush_t *)( buf.data() + brushesOfs ) + i;
+
+		brush->sides = CMod_CacheOffset<cbrushside_t>( sidesOfs + ( cm.brushes[i].sides - cm.brushsides ) * sizeof( cbrushside_t ) );
+		brush->sidePlanes = CMod_CacheOffset<float>( sidePlanesOfs + ( cm.brushes[i].sidePlanes - cm.brushes[0].sidePlanes ) * sizeof( float ) );
+		brush->edges = CMod_CacheOffset<cbrushedge_t>( edgeOfs[i] );
+	}
+
+	header = (cmCacheHeader_t *)buf.data();
+	header->ident = CM_CACHE_IDENT;
+	header->version = CM_CACHE_VERSION;
+	header->bspChecksum = bspChecksum;
+	header->layout = CMod_CacheLayout();
+	header->length = buf.size();
+
+	out = &header->cm;
+	*out = cm;
+	::memset( out->name, 0, sizeof( out->name ) );
+	out->shaders = CMod_CacheOffset<dshader_t>( shadersOfs );
+	out->brushsides = CMod_CacheOffset<cbrushside_t>( sidesOfs );
+	out->planes = CMod_CacheOffset<cplane_t>( planesOfs );
+	out->nodes = CMod_CacheOffset<cNode_t>( nodesOfs );
+	out->leafs = CMod_CacheOffset<cLeaf_t>( leafsOfs );
+	out->leafbrushes = CMod_CacheOffset<int>( leafbrushesOfs );
+	out->leafsurfaces = CMod_CacheOffset<int>( leafsurfacesOfs );
+	out->cmodels = CMod_CacheOffset<cmodel_t>( cmodelsOfs );
+	out->brushes = CMod_CacheOffset<cbrush_t>( brushesOfs );
+	out->visibility = CMod_CacheOffset<byte>( visOfs );
+	out->entityString = CMod_CacheOffset<char>( entityOfs );
+	out->areas = CMod_CacheOffset<cArea_t>( areasOfs );
+	out->areaPortals = CMod_CacheOffset<int>( portalsOfs );
+	out->surfaces = CMod_CacheOffset<cPatch_t *>( surfacesOfs );
+
+	header->checksum = Com_BlockChecksum( buf.data() + CM_CACHE_CHECKED, buf.size() - CM_CACHE_CHECKED );
+
+	// another process may have the old cache mapped, so never truncate it;
+	// a new file renamed over it leaves their mapping on the old contents
+	Com_sprintf( tmpPath, sizeof( tmpPath ), "%s.tmp", qpath );
+	FS_WriteFile( tmpPath, buf.data(), buf.size() );
+#ifdef _WIN32
+	// rename won't replace an existing file here; while it's mapped
+	// neither call succeeds and the old cache stays
+	FS_HomeRemove( qpath );
+#endif
+	FS_Rename( tmpPath, qpath );
+
+	// only still there if the rename failed
+	if ( FS_FileExists( tmpPath ) ) {
+		FS_HomeRemove( tmpPath );
+	}
+}
+
+/*
+=================
+CMod_LoadCache
+
+Maps a cache written by CMod_WriteCache for the same BSP, returns false
+if there isn't a usable one
+=================
+*/
+static bool CMod_LoadCache( const char *qpath, unsigned bspChecksum ) {
+	cmCacheHeader_t	*header;
+	byte		*base;
+	size_t		length;
+	cPatch_t	*patch;
+	int			i;
+
+	base = (byte *)Sys_MapFile( FS_BuildOSPath( Cvar_VariableString( "fs_homepath" ),
+		FS_GetCurrentGameDir(), qpath ), &length );
+	if ( !base ) {
+		return false;
+	}
+
+	header = (cmCacheHeader_t *)base;
+	if ( length < sizeof( *header ) || header->ident != CM_CACHE_IDENT || header->version != CM_CACHE_VERSION
+		|| header->bspChecksum != bspChecksum || header->layout != CMod_CacheLayout()
+		|| (size_t)header->length != length
+		|| Com_BlockChecksum( base + CM_CACHE_CHECKED, length - CM_CACHE_CHECKED ) != header->checksum ) {
+		Com_DPrintf( "Ignoring stale collision cache %s\n", qpath );
+		Sys_UnmapFile( base, length );
+		return false;
+	}
+
+	cm = header->cm;
+	CMod_CacheRelocate( base, cm.shaders );
+	CMod_CacheRelocate( base, cm.brushsides );
+	CMod_CacheRelocate( base, cm.planes );
+	CMod_CacheRelocate( base, cm.nodes );
+	CMod_CacheRelocate( base, cm.leafs );
+	CMod_CacheRelocate( base, cm.leafbrushes );
+	CMod_CacheRelocate( base, cm.leafsurfaces );
+	CMod_CacheRelocate( base, cm.cmodels );
+	CMod_CacheRelocate( base, cm.brushes );
+	CMod_CacheRelocate( base, cm.visibility );
+	CMod_CacheRelocate( base, cm.entityString );
+	CMod_CacheRelocate( base, cm.areas );
+	CMod_CacheRelocate( base, cm.areaPortals );
+	CMod_CacheRelocate( base, cm.surfaces );
+
+	// the mapping is private, so these writes only touch our copy
+	for ( i = 0 ; i < cm.numBrushSides + BOX_SIDES ; i++ ) {
+		CMod_CacheRelocate( base, cm.brushsides[i].plane );
+	}
+	for ( i = 0 ; i < cm.numNodes ; i++ ) {
+		CMod_CacheRelocate( base, cm.nodes[i].plane );
+	}
+	for ( i = 0 ; i < cm.numBrushes ; i++ ) {
+		CMod_CacheRelocate( base, cm.brushes[i].sides );
+		CMod_CacheRelocate( base, cm.brushes[i].sidePlanes );
+		CMod_CacheRelocate( base, cm.brushes[i].edges );
+	}
+	for ( i = 0 ; i < cm.numSurfaces ; i++ ) {
+		CMod_CacheRelocate( base, cm.surfaces[i] );
+		patch = cm.surfaces[i];
+		if ( patch ) {
+			CMod_CacheRelocate( base, patch->pc );
+			CMod_CacheRelocate( base, patch->pc->planes );
+			CMod_CacheRelocate( base, patch->pc->facets );
+		}
+	}
+
+	cm_cacheBase = base;
+	cm_cacheLength = length;
+	return true;
+}
+#endif
+
 /*
 ==================
 CM_LoadMap
@@ -715,12 +1093,17 @@ Loads in the map and all submodels
 */
 void CM_LoadMap( const char *name, bool clientload, int *checksum ) {
 	union {
-		int				*i;
-		void			*v;
+		const int		*i;
+		const void		*v;
 	} buf;
 	dheader_t		header;
 	int				length;
 	static unsigned	last_checksum;
+	int				start;
+	bool			cached = false;
+#ifndef BSPC
+	char			cachePath[MAX_QPATH];
+#endif
 
 	if ( !name || !name[0] ) {
 		Com_Error( ERR_DROP, "CM_LoadMap: NULL name" );
@@ -730,6 +1113,12 @@ void CM_LoadMap( const char *name, bool clientload, int *checksum ) {
 	cm_noAreas = Cvar_Get ("cm_noAreas", "0", CVAR_CHEAT);
 	cm_noCurves = Cvar_Get ("cm_noCurves", "0", CVAR_CHEAT);
 	cm_playerCurveClip = Cvar_Get ("cm_playerCurveClip", "1", CVAR_ARCHIVE|CVAR_CHEAT );
+	cm_debugSurfaceUpdate = Cvar_Get ("r_debugSurfaceUpdate", "1", 0 );
+	cm_simd = Cvar_Get ("cm_simd", "1", 0 );
+	cm_traceCache = Cvar_Get ("cm_traceCache", "0", 0 );
+	cm_traceCacheSize = Cvar_Get ("cm_traceCacheSize", "256", 0 );
+	Cvar_SetDescription( cm_traceCacheSize, "KB of world trace cache for each thread that traces" );
+	cm_cache = Cvar_Get ("cm_cache", "1", 0 );
 #endif
 	Com_DPrintf( "CM_LoadMap( %s, %i )\n", name, clientload );
 
@@ -741,6 +1130,10 @@ void CM_LoadMap( const char *name, bool clientload, int *checksum ) {
 	// free old stuff
 	::memset( &cm, 0, sizeof( cm ) );
 	CM_ClearLevelPatches();
+	CM_InvalidateTraceCache();
+#ifndef BSPC
+	CMod_FreeCache();
+#endif
 
 	if ( !name[0] ) {
 		cm.numLeafs = 1;
@@ -751,13 +1144,16 @@ void CM_LoadMap( const char *name, bool clientload, int *checksum ) {
 		return;
 	}
 
+	start = Sys_Milliseconds();
+
 	//
 	// load the file
 	//
 #ifndef BSPC
-	length = FS_ReadFile( name, &buf.v );
+	// only read from, so a stored bsp is used straight from the pk3
+	length = FS_ReadFileView( name, &buf.v );
 #else
-	length = LoadQuakeFile((quakefile_t *) name, &buf.v);
+	length = LoadQuakeFile((quakefile_t *) name, (void **)&buf.v);
 #endif
 
 	if ( !buf.i ) {
@@ -779,29 +1175,51 @@ void CM_LoadMap( const char *name, bool clientload, int *checksum ) {
 
 	cmod_base = (byte *)buf.i;
 
-	// load into heap
-	CMod_LoadShaders( &header.lumps[LUMP_SHADERS] );
-	CMod_LoadLeafs (&header.lumps[LUMP_LEAFS]);
-	CMod_LoadLeafBrushes (&header.lumps[LUMP_LEAFBRUSHES]);
-	CMod_LoadLeafSurfaces (&header.lumps[LUMP_LEAFSURFACES]);
-	CMod_LoadPlanes (&header.lumps[LUMP_PLANES]);
-	CMod_LoadBrushSides (&header.lumps[LUMP_BRUSHSIDES]);
-	CMod_LoadBrushes (&header.lumps[LUMP_BRUSHES]);
-	CMod_LoadSubmodels (&header.lumps[LUMP_MODELS]);
-	CMod_LoadNodes (&header.lumps[LUMP_NODES]);
-	CMod_LoadEntityString (&header.lumps[LUMP_ENTITIES]);
-	CMod_LoadVisibility( &header.lumps[LUMP_VISIBILITY] );
-	CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS] );
-
-	CMod_CreateBrushSideWindings( );
+#ifndef BSPC
+	Com_sprintf( cachePath, sizeof( cachePath ), "cmcache/%08x.cmcache", last_checksum );
+	if ( cm_cache->integer ) {
+		cached = CMod_LoadCache( cachePath, last_checksum );
+	}
+#endif
+
+	if ( !cached ) {
+		// load into heap
+		CMod_LoadShaders( &header.lumps[LUMP_SHADERS] );
+		CMod_LoadLeafs (&header.lumps[LUMP_LEAFS]);
+		CMod_LoadLeafBrushes (&header.lumps[LUMP_LEAFBRUSHES]);
+		CMod_LoadLeafSurfaces (&header.lumps[LUMP_LEAFSURFACES]);
+		CMod_LoadPlanes (&header.lumps[LUMP_PLANES]);
+		CMod_LoadBrushSides (&header.lumps[LUMP_BRUSHSIDES]);
+		CMod_LoadBrushes (&header.lumps[LUMP_BRUSHES]);
+		CMod_LoadSubmodels (&header.lumps[LUMP_MODELS]);
+		CMod_LoadNodes (&header.lumps[LUMP_NODES]);
+		CMod_LoadEntityString (&header.lumps[LUMP_ENTITIES]);
+		CMod_LoadVisibility( &header.lumps[LUMP_VISIBILITY] );
+		CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS] );
+
+		CMod_CreateBrushSideWindings( );
+	}
 
 	// we are NOT freeing the file, because it is cached for the ref
-	FS_FreeFile (buf.v);
+#ifndef BSPC
+	FS_FreeFileView (buf.v);
+#else
+	FS_FreeFile ((void *)buf.v);
+#endif
 
 	CM_InitBoxHull ();
 
 	CM_FloodAreaConnections ();
 
+	Com_Printf( "Collision map %s loaded in %i msec%s\n", name, Sys_Milliseconds() - start,
+		cached ? " from cache" : "" );
+
+#ifndef BSPC
+	if ( cm_cache->integer && !cached ) {
+		CMod_WriteCache( cachePath, last_checksum );
+	}
+#endif
+
 	// allow this to be cached if it is loaded by the server
 	if ( !clientload ) {
 		Q_strncpyz( cm.name, name, sizeof( cm.name ) );
@@ -816,14 +1234,18 @@ CM_ClearMap
 void CM_ClearMap( void ) {
 	::memset( &cm, 0, sizeof( cm ) );
 	CM_ClearLevelPatches();
+	CM_InvalidateTraceCache();
+#ifndef BSPC
+	CMod_FreeCache();
+#endif
 }
 
 /*
 ==================
-CM_ClipHandleToModel
+CM_ContextClipHandleToModel
 ==================
 */
-cmodel_t	*CM_ClipHandleToModel( clipHandle_t handle ) {
+cmodel_t	*CM_ContextClipHandleToModel( cmTraceContext_t *ctx, clipHandle_t handle ) {
 	if ( handle < 0 ) {
 		Com_Error( ERR_DROP, "CM_ClipHandleToModel: bad handle %i", handle );
 	}
@@ -831,7 +1253,7 @@ cmodel_t	*CM_ClipHandleToModel( clipHandle_t handle ) {
 		return &cm.cmodels[handle];
 	}
 	if ( handle == BOX_MODEL_HANDLE ) {
-		return &box_model;
+		return &ctx->boxModel;
 	}
 	if ( handle < MAX_SUBMODELS ) {
 		Com_Error( ERR_DROP, "CM_ClipHandleToModel: bad handle %i < %i < %i", 
@@ -843,6 +1265,15 @@ cmodel_t	*CM_ClipHandleToModel( clipHandle_t handle ) {
 
 }
 
+/*
+==================
+CM_ClipHandleToModel
+==================
+*/
+cmodel_t	*CM_ClipHandleToModel( clipHandle_t handle ) {
+	return CM_ContextClipHandleToModel( CM_ThreadTraceContext(), handle );
+}
+
 /*
 ==================
 CM_InlineModel
@@ -888,76 +1319,160 @@ int		CM_LeafArea( int leafnum ) {
 ===================
 CM_InitBoxHull
 
-Set up the planes and nodes so that the six floats of a bounding box
-can just be stored out and get a proper clipping hull structure.
+The temp box model's leaf lists brush number cm.numBrushes, which every
+trace context resolves to a box brush of its own
 ===================
 */
 void CM_InitBoxHull (void)
 {
+	cm.leafbrushes[cm.numLeafBrushes] = cm.numBrushes;
+}
+
+/*
+===================
+CM_CreateTraceContext
+
+Set up the planes and brush so that the six floats of a bounding box
+can just be stored out and get a proper clipping hull structure.
+===================
+*/
+cmTraceContext_t *CM_CreateTraceContext( void ) {
+	cmTraceContext_t	*ctx;
 	int			i;
 	int			side;
 	cplane_t	*p;
 	cbrushside_t	*s;
 
-	box_planes = &cm.planes[cm.numPlanes];
+	// not Z_Malloc, contexts can be made on any thread
+	ctx = new cmTraceContext_t();
 
-	box_brush = &cm.brushes[cm.numBrushes];
-	box_brush->numsides = 6;
-	box_brush->sides = cm.brushsides + cm.numBrushSides;
-	box_brush->contents = CONTENTS_BODY;
-	box_brush->edges = (cbrushedge_t *)Hunk_Alloc(
-			sizeof( cbrushedge_t ) * 12, h_low );
-	box_brush->numEdges = 12;
+	ctx->boxBrush.numsides = 6;
+	ctx->boxBrush.sides = ctx->boxSides;
+	ctx->boxBrush.contents = CONTENTS_BODY;
+	ctx->boxBrush.edges = ctx->boxEdges;
+	ctx->boxBrush.numEdges = 12;
 
-	box_model.leaf.numLeafBrushes = 1;
-//	box_model.leaf.firstLeafBrush = cm.numBrushes;
-	box_model.leaf.firstLeafBrush = cm.numLeafBrushes;
-	cm.leafbrushes[cm.numLeafBrushes] = cm.numBrushes;
+	ctx->boxModel.leaf.numLeafBrushes = 1;
 
 	for (i=0 ; i<6 ; i++)
 	{
 		side = i&1;
 
 		// brush sides
-		s = &cm.brushsides[cm.numBrushSides+i];
-		s->plane = 	cm.planes + (cm.numPlanes+i*2+side);
+		s = &ctx->boxSides[i];
+		s->plane = 	ctx->boxPlanes + (i*2+side);
 		s->surfaceFlags = 0;
 
 		// planes
-		p = &box_planes[i*2];
+		p = &ctx->boxPlanes[i*2];
 		p->type = i>>1;
 		p->signbits = 0;
 		VectorClear (p->normal);
 		p->normal[i>>1] = 1;
 
-		p = &box_planes[i*2+1];
+		p = &ctx->boxPlanes[i*2+1];
 		p->type = 3 + (i>>1);
 		p->signbits = 0;
 		VectorClear (p->normal);
 		p->normal[i>>1] = -1;
 
 		SetPlaneSignbits( p );
-	}	
+	}
+
+	return ctx;
 }
 
 /*
 ===================
-CM_TempBoxModel
+CM_FreeTraceContext
+===================
+*/
+void CM_FreeTraceContext( cmTraceContext_t *ctx ) {
+	if ( !ctx ) {
+		return;
+	}
+
+	delete[] ctx->brushChecks;
+	delete[] ctx->brushCollided;
+	delete[] ctx->patchChecks;
+	CM_FreeTraceCache( ctx );
+	delete ctx;
+}
+
+/*
+===================
+CM_ThreadTraceContext
+
+The context behind the calls that don't take one
+===================
+*/
+struct cmThreadContext_t {
+	cmTraceContext_t	*ctx;
+
+	~cmThreadContext_t() {
+		CM_FreeTraceContext( ctx );
+	}
+};
+
+static thread_local cmThreadContext_t cm_threadContext;
+
+cmTraceContext_t *CM_ThreadTraceContext( void ) {
+	if ( !cm_threadContext.ctx ) {
+		cm_threadContext.ctx = CM_CreateTraceContext();
+	}
+
+	return cm_threadContext.ctx;
+}
+
+/*
+===================
+CM_BeginQuery
+
+Makes room for the current map and starts a new set of visited marks.
+Marks left over from an older map are all below the new checkcount, so
+they never need clearing.
+===================
+*/
+void CM_BeginQuery( cmTraceContext_t *ctx ) {
+	if ( ctx->numBrushes < cm.numBrushes + 1 ) {
+		delete[] ctx->brushChecks;
+		delete[] ctx->brushCollided;
+		ctx->numBrushes = cm.numBrushes + 1;
+		ctx->brushChecks = new int[ctx->numBrushes]();
+		ctx->brushCollided = new int[ctx->numBrushes]();
+	}
+
+	if ( ctx->numSurfaces < cm.numSurfaces ) {
+		delete[] ctx->patchChecks;
+		ctx->numSurfaces = cm.numSurfaces;
+		ctx->patchChecks = new int[ctx->numSurfaces]();
+	}
+
+	ctx->checkcount++;
+}
+
+/*
+===================
+CM_ContextTempBoxModel
 
 To keep everything totally uniform, bounding boxes are turned into small
 BSP trees instead of being compared directly.
 Capsules are handled differently though.
 ===================
 */
-clipHandle_t CM_TempBoxModel( const vec3_t mins, const vec3_t maxs, int capsule ) {
+clipHandle_t CM_ContextTempBoxModel( cmTraceContext_t *ctx, const vec3_t mins, const vec3_t maxs, int capsule ) {
+	cplane_t		*box_planes = ctx->boxPlanes;
+	cbrush_t		*box_brush = &ctx->boxBrush;
 
-	VectorCopy( mins, box_model.mins );
-	VectorCopy( maxs, box_model.maxs );
+	VectorCopy( mins, ctx->boxModel.mins );
+	VectorCopy( maxs, ctx->boxModel.maxs );
 
 	if ( capsule ) {
 		return CAPSULE_MODEL_HANDLE;
 	}
 
+	ctx->boxModel.leaf.firstLeafBrush = cm.numLeafBrushes;
+
 	box_planes[0].dist = maxs[0];
 	box_planes[1].dist = -maxs[0];
 	box_planes[2].dist = mins[0];
@@ -1007,17 +1522,30 @@ clipHandle_t CM_TempBoxModel( const vec3_t mins, const vec3_t maxs, int capsule
 	return BOX_MODEL_HANDLE;
 }
 
+/*
+===================
+CM_TempBoxModel
+===================
+*/
+clipHandle_t CM_TempBoxModel( const vec3_t mins, const vec3_t maxs, int capsule ) {
+	return CM_ContextTempBoxModel( CM_ThreadTraceContext(), mins, maxs, capsule );
+}
+
 /*
 ===================
 CM_ModelBounds
 ===================
 */
-void CM_ModelBounds( clipHandle_t model, vec3_t mins, vec3_t maxs ) {
+void CM_ContextModelBounds( cmTraceContext_t *ctx, clipHandle_t model, vec3_t mins, vec3_t maxs ) {
 	cmodel_t	*cmod;
 
-	cmod = CM_ClipHandleToModel( model );
+	cmod = CM_ContextClipHandleToModel( ctx, model );
 	VectorCopy( cmod->mins, mins );
 	VectorCopy( cmod->maxs, maxs );
 }
 
+void CM_ModelBounds( clipHandle_t model, vec3_t mins, vec3_t maxs ) {
+	CM_ContextModelBounds( CM_ThreadTraceContext(), model, mins, maxs );
+}
+
 
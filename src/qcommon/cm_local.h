@@ -29,6 +29,13 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "qcommon.h"
 #include "cm_polylib.h"
 
+// SSE side tests for brushes with packed side planes
+#if defined __SSE__ || defined _M_X64 || ( defined _M_IX86_FP && _M_IX86_FP >= 1 )
+#define CM_SIMD 1
+#else
+#define CM_SIMD 0
+#endif
+
 #define	MAX_SUBMODELS			256
 #define	BOX_MODEL_HANDLE		255
 #define CAPSULE_MODEL_HANDLE	254
@@ -74,15 +81,13 @@ typedef struct {
 	vec3_t		bounds[2];
 	int			numsides;
 	cbrushside_t	*sides;
-	int			checkcount;		// to avoid repeated testings
-	bool	    collided; // marker for optimisation
+	float		*sidePlanes;	// side planes in groups of four as {x[4], y[4], z[4], dist[4]}, NULL if not packed
 	cbrushedge_t	*edges;
 	int						numEdges;
 } cbrush_t;
 
 
 typedef struct {
-	int			checkcount;				// to avoid repeated testings
 	int			surfaceFlags;
 	int			contents;
 	struct patchCollide_s	*pc;
@@ -140,20 +145,62 @@ typedef struct {
 	cPatch_t	**surfaces;			// non-patches will be NULL
 
 	int			floodvalid;
-	int			checkcount;					// incremented on each trace
 } clipMap_t;
 
+// one remembered trace against the world, see CM_CachedTrace
+typedef struct {
+	vec3_t		start, end;
+	vec3_t		mins, maxs;
+	int			brushmask;
+	traceType_t	type;
+	int			stamp;		// valid while it equals the context's traceCacheStamp
+	trace_t		trace;
+} cmTraceCacheEntry_t;
+
+/*
+Everything a query writes goes into a trace context, so queries through
+different contexts can run at the same time as long as the map isn't
+being loaded.  The old entry points go through a context of their own
+for each thread.
+*/
+struct cmTraceContext_s {
+	int			checkcount;			// incremented on each query
+	int			numBrushes;			// size of the arrays below
+	int			*brushChecks;		// checkcount of the last query to visit each brush
+	int			*brushCollided;		// checkcount of the last trace that crossed its planes
+	int			numSurfaces;
+	int			*patchChecks;
+
+	// filled in by CM_TempBoxModel, brush number cm.numBrushes
+	cmodel_t	boxModel;
+	cplane_t	boxPlanes[12];
+	cbrushside_t	boxSides[6];
+	cbrushedge_t	boxEdges[12];
+	cbrush_t	boxBrush;
+
+	// world traces remembered by CM_CachedTrace
+	cmTraceCacheEntry_t	*traceCache;
+	int			traceCacheMask;		// number of entries - 1
+	int			traceCacheKB;		// cm_traceCacheSize the table was made for
+	int			traceCacheStamp;
+	int			traceCacheGeneration;	// cm_traceCacheGeneration the entries belong to
+};
+
 
 // keep 1/8 unit away to keep the position valid before network snapping
 // and to avoid various numeric issues
 #define	SURFACE_CLIP_EPSILON	(0.125)
 
 extern	clipMap_t	cm;
-extern	int			c_pointcontents;
-extern	int			c_traces, c_brush_traces, c_patch_traces;
+extern	thread_local int	c_pointcontents;		// counted per thread
+extern	thread_local int	c_traces, c_brush_traces, c_patch_traces;
 extern	cvar_t		*cm_noAreas;
 extern	cvar_t		*cm_noCurves;
 extern	cvar_t		*cm_playerCurveClip;
+extern	cvar_t		*cm_debugSurfaceUpdate;
+extern	cvar_t		*cm_simd;
+extern	cvar_t		*cm_traceCache;
+extern	cvar_t		*cm_traceCacheSize;
 
 // cm_test.c
 
@@ -187,6 +234,8 @@ typedef struct {
 	sphere_t		sphere;		// sphere for oriendted capsule collision
 	biSphere_t	biSphere;
 	bool		testLateralCollision; // whether or not to test for lateral collision
+	bool		brushCollided;	// set by CM_TraceThroughBrush once a plane is crossed
+	cmTraceContext_t	*ctx;
 } traceWork_t;
 
 typedef struct leafList_s {
@@ -197,6 +246,7 @@ typedef struct leafList_s {
 	vec3_t	bounds[2];
 	int		lastLeaf;		// for overflows where each leaf can't be stored individually
 	void	(*storeLeafs)( struct leafList_s *ll, int nodenum );
+	cmTraceContext_t	*ctx;	// for CM_StoreBrushes
 } leafList_t;
 
 
@@ -208,6 +258,25 @@ void CM_StoreBrushes( leafList_t *ll, int nodenum );
 void CM_BoxLeafnums_r( leafList_t *ll, int nodenum );
 
 cmodel_t	*CM_ClipHandleToModel( clipHandle_t handle );
+cmodel_t	*CM_ContextClipHandleToModel( cmTraceContext_t *ctx, clipHandle_t handle );
+void		CM_ContextModelBounds( cmTraceContext_t *ctx, clipHandle_t model, vec3_t mins, vec3_t maxs );
+cmTraceContext_t	*CM_ThreadTraceContext( void );
+void		CM_BeginQuery( cmTraceContext_t *ctx );
+void		CM_InvalidateTraceCache( void );
+void		CM_FreeTraceCache( cmTraceContext_t *ctx );
+
+/*
+==================
+CM_ContextBrush
+
+The temp box model's leaf refers to brush number cm.numBrushes, which is
+each context's own box brush
+==================
+*/
+static ID_INLINE cbrush_t *CM_ContextBrush( cmTraceContext_t *ctx, int brushnum ) {
+	return brushnum == cm.numBrushes ? &ctx->boxBrush : &cm.brushes[brushnum];
+}
+
 bool CM_BoundsIntersect( const vec3_t mins, const vec3_t maxs, const vec3_t mins2, const vec3_t maxs2 );
 bool CM_BoundsIntersectPoint( const vec3_t mins, const vec3_t maxs, const vec3_t point );
 
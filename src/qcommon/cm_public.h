@@ -55,6 +55,33 @@ void		CM_TransformedBiSphereTrace( trace_t *results, const vec3_t start,
 							clipHandle_t model, int mask,
 							const vec3_t origin );
 
+// Queries through different contexts may run on different threads at the
+// same time.  The calls above use a context of the calling thread's own, so
+// a temp box model is only valid on the thread that made it.
+typedef struct cmTraceContext_s cmTraceContext_t;
+
+cmTraceContext_t *CM_CreateTraceContext( void );
+void		CM_FreeTraceContext( cmTraceContext_t *ctx );
+
+clipHandle_t CM_ContextTempBoxModel( cmTraceContext_t *ctx, const vec3_t mins, const vec3_t maxs, int capsule );
+int			CM_ContextPointContents( cmTraceContext_t *ctx, const vec3_t p, clipHandle_t model );
+int			CM_ContextTransformedPointContents( cmTraceContext_t *ctx, const vec3_t p, clipHandle_t model,
+						  const vec3_t origin, const vec3_t angles );
+void		CM_ContextBoxTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start, const vec3_t end,
+						  vec3_t mins, vec3_t maxs,
+						  clipHandle_t model, int brushmask, traceType_t type );
+void		CM_ContextTransformedBoxTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start,
+						  const vec3_t end, vec3_t mins, vec3_t maxs,
+						  clipHandle_t model, int brushmask,
+						  const vec3_t origin, const vec3_t angles, traceType_t type );
+void		CM_ContextBiSphereTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start,
+							const vec3_t end, float startRad, float endRad,
+							clipHandle_t model, int mask );
+void		CM_ContextTransformedBiSphereTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start,
+							const vec3_t end, float startRad, float endRad,
+							clipHandle_t model, int mask,
+							const vec3_t origin );
+
 byte		*CM_ClusterPVS (int cluster);
 
 int			CM_PointLeafnum( const vec3_t p );
@@ -72,6 +99,17 @@ bool	CM_AreasConnected( int area1, int area2 );
 
 int			CM_WriteAreaBits( byte *buffer, int area );
 
+// world trace cache counters, summed over every thread; entries and
+// bytes are the calling thread's table, tables and totalBytes cover
+// every thread that has one
+typedef struct {
+	int			hits, misses, evictions;
+	int			entries, bytes;
+	int			tables, totalBytes;
+} cmTraceCacheStats_t;
+
+void		CM_TraceCacheStats( cmTraceCacheStats_t *stats, bool reset );
+
 // cm_patch.c
 void CM_DrawDebugSurface( void (*drawPoly)(int color, int numPoints, float *points) );
 
@@ -94,6 +94,7 @@ void CM_StoreBrushes( leafList_t *ll, int nodenum ) {
 	int			brushnum;
 	cLeaf_t		*leaf;
 	cbrush_t	*b;
+	cmTraceContext_t	*ctx = ll->ctx;
 
 	leafnum = -1 - nodenum;
 
@@ -101,11 +102,11 @@ void CM_StoreBrushes( leafList_t *ll, int nodenum ) {
 
 	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
-		b = &cm.brushes[brushnum];
-		if ( b->checkcount == cm.checkcount ) {
+		if ( ctx->brushChecks[brushnum] == ctx->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		ctx->brushChecks[brushnum] = ctx->checkcount;
+		b = &cm.brushes[brushnum];
 		for ( i = 0 ; i < 3 ; i++ ) {
 			if ( b->bounds[0][i] >= ll->bounds[1][i] || b->bounds[1][i] <= ll->bounds[0][i] ) {
 				break;
@@ -173,8 +174,6 @@ CM_BoxLeafnums
 int	CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsize, int *lastLeaf) {
 	leafList_t	ll;
 
-	cm.checkcount++;
-
 	VectorCopy( mins, ll.bounds[0] );
 	VectorCopy( maxs, ll.bounds[1] );
 	ll.count = 0;
@@ -183,6 +182,7 @@ int	CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsiz
 	ll.storeLeafs = CM_StoreLeafs;
 	ll.lastLeaf = 0;
 	ll.overflowed = false;
+	ll.ctx = NULL;
 
 	CM_BoxLeafnums_r( &ll, 0 );
 
@@ -198,7 +198,8 @@ CM_BoxBrushes
 int CM_BoxBrushes( const vec3_t mins, const vec3_t maxs, cbrush_t **list, int listsize ) {
 	leafList_t	ll;
 
-	cm.checkcount++;
+	ll.ctx = CM_ThreadTraceContext();
+	CM_BeginQuery( ll.ctx );
 
 	VectorCopy( mins, ll.bounds[0] );
 	VectorCopy( maxs, ll.bounds[1] );
@@ -220,11 +221,11 @@ int CM_BoxBrushes( const vec3_t mins, const vec3_t maxs, cbrush_t **list, int li
 
 /*
 ==================
-CM_PointContents
+CM_ContextPointContents
 
 ==================
 */
-int CM_PointContents( const vec3_t p, clipHandle_t model ) {
+int CM_ContextPointContents( cmTraceContext_t *ctx, const vec3_t p, clipHandle_t model ) {
 	int			leafnum;
 	int			i, k;
 	int			brushnum;
@@ -239,7 +240,7 @@ int CM_PointContents( const vec3_t p, clipHandle_t model ) {
 	}
 
 	if ( model ) {
-		clipm = CM_ClipHandleToModel( model );
+		clipm = CM_ContextClipHandleToModel( ctx, model );
 		leaf = &clipm->leaf;
 	} else {
 		leafnum = CM_PointLeafnum_r (p, 0);
@@ -252,7 +253,7 @@ int CM_PointContents( const vec3_t p, clipHandle_t model ) {
 	contents = 0;
 	for (k=0 ; k<leaf->numLeafBrushes ; k++) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
-		b = &cm.brushes[brushnum];
+		b = CM_ContextBrush( ctx, brushnum );
 
 		if ( !CM_BoundsIntersectPoint( b->bounds[0], b->bounds[1], p ) ) {
 			continue;
@@ -278,13 +279,22 @@ int CM_PointContents( const vec3_t p, clipHandle_t model ) {
 
 /*
 ==================
-CM_TransformedPointContents
+CM_PointContents
+==================
+*/
+int CM_PointContents( const vec3_t p, clipHandle_t model ) {
+	return CM_ContextPointContents( CM_ThreadTraceContext(), p, model );
+}
+
+/*
+==================
+CM_ContextTransformedPointContents
 
 Handles offseting and rotation of the end points for moving and
 rotating entities
 ==================
 */
-int	CM_TransformedPointContents( const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles) {
+int	CM_ContextTransformedPointContents( cmTraceContext_t *ctx, const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles) {
 	vec3_t		p_l;
 	vec3_t		temp;
 	vec3_t		forward, right, up;
@@ -304,7 +314,16 @@ int	CM_TransformedPointContents( const vec3_t p, clipHandle_t model, const vec3_
 		p_l[2] = DotProduct (temp, up);
 	}
 
-	return CM_PointContents( p_l, model );
+	return CM_ContextPointContents( ctx, p_l, model );
+}
+
+/*
+==================
+CM_TransformedPointContents
+==================
+*/
+int	CM_TransformedPointContents( const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles) {
+	return CM_ContextTransformedPointContents( CM_ThreadTraceContext(), p, model, origin, angles );
 }
 
 
@@ -411,6 +430,7 @@ void	CM_AdjustAreaPortalState( int area1, int area2, bool open ) {
 	}
 
 	CM_FloodAreaConnections ();
+	CM_InvalidateTraceCache();
 }
 
 /*
@@ -20,8 +20,14 @@ along with Tremulous; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 ===========================================================================
 */
+#include <atomic>
+
 #include "cm_local.h"
 
+#if CM_SIMD
+#include <xmmintrin.h>
+#endif
+
 // always use bbox vs. bbox collision and never capsule vs. bbox or vice versa
 //#define ALWAYS_BBOX_VS_BBOX
 // always use capsule vs. capsule collision and never capsule vs. bbox or vice versa
@@ -154,6 +160,128 @@ POSITION TESTING
 ===============================================================================
 */
 
+#if CM_SIMD
+/*
+===============================================================================
+
+SSE SIDE TESTS
+
+Each function takes one group of four packed side planes (see
+CMod_PackBrushSides) and computes the distances the scalar loops compute
+for those sides, with the same operations in the same order, so both give
+the same answers.
+
+===============================================================================
+*/
+
+typedef struct {
+	__m128	x, y, z, dist;
+} sideGroup_t;
+
+static ID_INLINE void CM_LoadSideGroup( const float *group, sideGroup_t *g ) {
+	g->x = _mm_loadu_ps( group );
+	g->y = _mm_loadu_ps( group + 4 );
+	g->z = _mm_loadu_ps( group + 8 );
+	g->dist = _mm_loadu_ps( group + 12 );
+}
+
+static ID_INLINE __m128 CM_DotGroup( const sideGroup_t *g, __m128 x, __m128 y, __m128 z ) {
+	return _mm_add_ps( _mm_add_ps( _mm_mul_ps( x, g->x ), _mm_mul_ps( y, g->y ) ), _mm_mul_ps( z, g->z ) );
+}
+
+static ID_INLINE __m128 CM_SelectGroup( __m128 mask, __m128 a, __m128 b ) {
+	return _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) );
+}
+
+/*
+================
+CM_BoxSideDists
+
+d1 and d2 for a box: each plane is pushed out to the box corner
+tw->offsets[ plane->signbits ] would pick
+================
+*/
+static ID_INLINE void CM_BoxSideDists( const traceWork_t *tw, const float *group, float *d1, float *d2 ) {
+	sideGroup_t	g;
+	__m128		zero, neg, dist;
+
+	CM_LoadSideGroup( group, &g );
+	zero = _mm_setzero_ps();
+
+	// signbits has bit j set when normal[j] < 0, picking size[1][j]
+	neg = _mm_cmplt_ps( g.x, zero );
+	dist = _mm_mul_ps( CM_SelectGroup( neg, _mm_set1_ps( tw->size[1][0] ), _mm_set1_ps( tw->size[0][0] ) ), g.x );
+	neg = _mm_cmplt_ps( g.y, zero );
+	dist = _mm_add_ps( dist, _mm_mul_ps( CM_SelectGroup( neg, _mm_set1_ps( tw->size[1][1] ), _mm_set1_ps( tw->size[0][1] ) ), g.y ) );
+	neg = _mm_cmplt_ps( g.z, zero );
+	dist = _mm_add_ps( dist, _mm_mul_ps( CM_SelectGroup( neg, _mm_set1_ps( tw->size[1][2] ), _mm_set1_ps( tw->size[0][2] ) ), g.z ) );
+	dist = _mm_sub_ps( g.dist, dist );
+
+	_mm_storeu_ps( d1, _mm_sub_ps( CM_DotGroup( &g, _mm_set1_ps( tw->start[0] ),
+		_mm_set1_ps( tw->start[1] ), _mm_set1_ps( tw->start[2] ) ), dist ) );
+	if ( d2 ) {
+		_mm_storeu_ps( d2, _mm_sub_ps( CM_DotGroup( &g, _mm_set1_ps( tw->end[0] ),
+			_mm_set1_ps( tw->end[1] ), _mm_set1_ps( tw->end[2] ) ), dist ) );
+	}
+}
+
+/*
+================
+CM_CapsuleSideDists
+
+d1 and d2 for a capsule: each plane is pushed out by the radius and
+measured from whichever sphere center is closest to it
+================
+*/
+static ID_INLINE void CM_CapsuleSideDists( const traceWork_t *tw, const float *group, float *d1, float *d2 ) {
+	sideGroup_t	g;
+	__m128		up, dist;
+	vec3_t		below, above;
+
+	CM_LoadSideGroup( group, &g );
+
+	up = _mm_cmpgt_ps( CM_DotGroup( &g, _mm_set1_ps( tw->sphere.offset[0] ),
+		_mm_set1_ps( tw->sphere.offset[1] ), _mm_set1_ps( tw->sphere.offset[2] ) ), _mm_setzero_ps() );
+	dist = _mm_add_ps( g.dist, _mm_set1_ps( tw->sphere.radius ) );
+
+	VectorSubtract( tw->start, tw->sphere.offset, below );
+	VectorAdd( tw->start, tw->sphere.offset, above );
+	_mm_storeu_ps( d1, _mm_sub_ps( CM_DotGroup( &g,
+		CM_SelectGroup( up, _mm_set1_ps( below[0] ), _mm_set1_ps( above[0] ) ),
+		CM_SelectGroup( up, _mm_set1_ps( below[1] ), _mm_set1_ps( above[1] ) ),
+		CM_SelectGroup( up, _mm_set1_ps( below[2] ), _mm_set1_ps( above[2] ) ) ), dist ) );
+
+	if ( d2 ) {
+		VectorSubtract( tw->end, tw->sphere.offset, below );
+		VectorAdd( tw->end, tw->sphere.offset, above );
+		_mm_storeu_ps( d2, _mm_sub_ps( CM_DotGroup( &g,
+			CM_SelectGroup( up, _mm_set1_ps( below[0] ), _mm_set1_ps( above[0] ) ),
+			CM_SelectGroup( up, _mm_set1_ps( below[1] ), _mm_set1_ps( above[1] ) ),
+			CM_SelectGroup( up, _mm_set1_ps( below[2] ), _mm_set1_ps( above[2] ) ) ), dist ) );
+	}
+}
+#endif
+
+/*
+================
+CM_PackedSides
+
+Whether brush can go through the SSE side tests for this trace
+================
+*/
+static ID_INLINE bool CM_PackedSides( const traceWork_t *tw, const cbrush_t *brush ) {
+#if CM_SIMD
+#ifndef BSPC
+	if ( !cm_simd->integer ) {
+		return false;
+	}
+#endif
+	return brush->sidePlanes && ( tw->type == TT_AABB || tw->type == TT_CAPSULE );
+#else
+	return false;
+#endif
+}
+
 /*
 ================
 CM_TestBoxInBrush
@@ -183,6 +311,29 @@ void CM_TestBoxInBrush( traceWork_t *tw, cbrush_t *brush ) {
 		return;
 	}
 
+#if CM_SIMD
+	if ( CM_PackedSides( tw, brush ) ) {
+		float	dists[4];
+		int		j;
+
+		// the first six planes are the axial planes, so we only
+		// need to test the remainder, starting in the second group
+		for ( i = 4 ; i < brush->numsides ; i += 4 ) {
+			if ( tw->type == TT_CAPSULE ) {
+				CM_CapsuleSideDists( tw, brush->sidePlanes + i * 4, dists, NULL );
+			} else {
+				CM_BoxSideDists( tw, brush->sidePlanes + i * 4, dists, NULL );
+			}
+
+			for ( j = ( i == 4 ? 2 : 0 ) ; j < 4 && i + j < brush->numsides ; j++ ) {
+				// if completely in front of face, no intersection
+				if ( dists[j] > 0 ) {
+					return;
+				}
+			}
+		}
+	} else
+#endif
    if ( tw->type == TT_CAPSULE ) {
 		// the first six planes are the axial planes, so we only
 		// need to test the remainder
@@ -243,17 +394,20 @@ CM_TestInLeaf
 void CM_TestInLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
 	int			k;
 	int			brushnum;
+	int			surfnum;
 	cbrush_t	*b;
 	cPatch_t	*patch;
 
+	cmTraceContext_t	*ctx = tw->ctx;
+
 	// test box position against all brushes in the leaf
 	for (k=0 ; k<leaf->numLeafBrushes ; k++) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
-		b = &cm.brushes[brushnum];
-		if (b->checkcount == cm.checkcount) {
+		if (ctx->brushChecks[brushnum] == ctx->checkcount) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		ctx->brushChecks[brushnum] = ctx->checkcount;
+		b = CM_ContextBrush( ctx, brushnum );
 
 		if ( !(b->contents & tw->contents)) {
 			continue;
@@ -272,14 +426,15 @@ void CM_TestInLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
 	if ( !cm_noCurves->integer ) {
 #endif //BSPC
 		for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
-			patch = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+			surfnum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+			patch = cm.surfaces[ surfnum ];
 			if ( !patch ) {
 				continue;
 			}
-			if ( patch->checkcount == cm.checkcount ) {
+			if ( ctx->patchChecks[ surfnum ] == ctx->checkcount ) {
 				continue;	// already checked this brush in another leaf
 			}
-			patch->checkcount = cm.checkcount;
+			ctx->patchChecks[ surfnum ] = ctx->checkcount;
 
 			if ( !(patch->contents & tw->contents)) {
 				continue;
@@ -310,7 +465,7 @@ void CM_TestCapsuleInCapsule( traceWork_t *tw, clipHandle_t model ) {
 	vec3_t offset, symetricSize[2];
 	float radius, halfwidth, halfheight, offs, r;
 
-	CM_ModelBounds(model, mins, maxs);
+	CM_ContextModelBounds(tw->ctx, model, mins, maxs);
 
 	VectorAdd(tw->start, tw->sphere.offset, top);
 	VectorSubtract(tw->start, tw->sphere.offset, bottom);
@@ -378,7 +533,7 @@ void CM_TestBoundingBoxInCapsule( traceWork_t *tw, clipHandle_t model ) {
 	int i;
 
 	// mins maxs of the capsule
-	CM_ModelBounds(model, mins, maxs);
+	CM_ContextModelBounds(tw->ctx, model, mins, maxs);
 
 	// offset for capsule center
 	for ( i = 0 ; i < 3 ; i++ ) {
@@ -396,9 +551,9 @@ void CM_TestBoundingBoxInCapsule( traceWork_t *tw, clipHandle_t model ) {
 	VectorSet( tw->sphere.offset, 0, 0, size[1][2] - tw->sphere.radius );
 
 	// replace the capsule with the bounding box
-	h = CM_TempBoxModel(tw->size[0], tw->size[1], false);
+	h = CM_ContextTempBoxModel(tw->ctx, tw->size[0], tw->size[1], false);
 	// calculate collision
-	cmod = CM_ClipHandleToModel( h );
+	cmod = CM_ContextClipHandleToModel( tw->ctx, h );
 	CM_TestInLeaf( tw, &cmod->leaf );
 }
 
@@ -428,14 +583,10 @@ void CM_PositionTest( traceWork_t *tw ) {
 	ll.storeLeafs = CM_StoreLeafs;
 	ll.lastLeaf = 0;
 	ll.overflowed = false;
-
-	cm.checkcount++;
+	ll.ctx = tw->ctx;
 
 	CM_BoxLeafnums_r( &ll, 0 );
 
-
-	cm.checkcount++;
-
 	// test the contents of the leafs
 	for (i=0 ; i < ll.count ; i++) {
 		CM_TestInLeaf( tw, &cm.leafs[leafs[i]] );
@@ -474,6 +625,67 @@ void CM_TraceThroughPatch( traceWork_t *tw, cPatch_t *patch ) {
 	}
 }
 
+typedef struct {
+	float			enterFrac, leaveFrac;
+	bool			getout, startout;
+	cplane_t		*clipplane;
+	cbrushside_t	*leadside;
+} brushClip_t;
+
+/*
+================
+CM_ClipToSide
+
+Folds one side's start and end distances into the brush clip,
+returns false if the trace is completely in front of the side
+================
+*/
+static ID_INLINE bool CM_ClipToSide( traceWork_t *tw, brushClip_t *bc, cbrushside_t *side, float d1, float d2 ) {
+	float		f;
+
+	if (d2 > 0) {
+		bc->getout = true;	// endpoint is not in solid
+	}
+	if (d1 > 0) {
+		bc->startout = true;
+	}
+
+	// if completely in front of face, no intersection with the entire brush
+	if (d1 > 0 && ( d2 >= SURFACE_CLIP_EPSILON || d2 >= d1 )  ) {
+		return false;
+	}
+
+	// if it doesn't cross the plane, the plane isn't relevent
+	if (d1 <= 0 && d2 <= 0 ) {
+		return true;
+	}
+
+	tw->brushCollided = true;
+
+	// crosses face
+	if (d1 > d2) {	// enter
+		f = (d1-SURFACE_CLIP_EPSILON) / (d1-d2);
+		if ( f < 0 ) {
+			f = 0;
+		}
+		if (f > bc->enterFrac) {
+			bc->enterFrac = f;
+			bc->clipplane = side->plane;
+			bc->leadside = side;
+		}
+	} else {	// leave
+		f = (d1+SURFACE_CLIP_EPSILON) / (d1-d2);
+		if ( f > 1 ) {
+			f = 1;
+		}
+		if (f < bc->leaveFrac) {
+			bc->leaveFrac = f;
+		}
+	}
+
+	return true;
+}
+
 /*
 ================
 CM_TraceThroughBrush
@@ -481,39 +693,56 @@ CM_TraceThroughBrush
 */
 void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 	int			i;
-	cplane_t	*plane, *clipplane;
+	cplane_t	*plane;
 	float		dist;
-	float		enterFrac, leaveFrac;
 	float		d1, d2;
-	bool	getout, startout;
-	float		f;
-	cbrushside_t	*side, *leadside;
+	brushClip_t	bc;
+	cbrushside_t	*side;
 	float		t;
 	vec3_t		startp;
 	vec3_t		endp;
 
-	enterFrac = -1.0;
-	leaveFrac = 1.0;
-	clipplane = NULL;
-
 	if ( !brush->numsides ) {
 		return;
 	}
 
 	c_brush_traces++;
 
-	getout = false;
-	startout = false;
+	bc.enterFrac = -1.0;
+	bc.leaveFrac = 1.0;
+	bc.getout = false;
+	bc.startout = false;
+	bc.clipplane = NULL;
+	bc.leadside = NULL;
 
-	leadside = NULL;
+	//
+	// compare the trace against all planes of the brush
+	// find the latest time the trace crosses a plane towards the interior
+	// and the earliest time the trace crosses a plane towards the exterior
+	//
+#if CM_SIMD
+	if ( CM_PackedSides( tw, brush ) ) {
+		float	dists1[4], dists2[4];
+		int		j;
+
+		for ( i = 0 ; i < brush->numsides ; i += 4 ) {
+			if ( tw->type == TT_CAPSULE ) {
+				CM_CapsuleSideDists( tw, brush->sidePlanes + i * 4, dists1, dists2 );
+			} else {
+				CM_BoxSideDists( tw, brush->sidePlanes + i * 4, dists1, dists2 );
+			}
 
+			// walk the lanes in side order so ties resolve as they do below
+			for ( j = 0 ; j < 4 && i + j < brush->numsides ; j++ ) {
+				if ( !CM_ClipToSide( tw, &bc, brush->sides + i + j, dists1[j], dists2[j] ) ) {
+					return;
+				}
+			}
+		}
+	} else
+#endif
 	if( tw->type == TT_BISPHERE )
 	{
-		//
-		// compare the trace against all planes of the brush
-		// find the latest time the trace crosses a plane towards the interior
-		// and the earliest time the trace crosses a plane towards the exterior
-		//
 		for( i = 0; i < brush->numsides; i++ )
 		{
 			side = brush->sides + i;
@@ -525,57 +754,12 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 			d2 = DotProduct( tw->end, plane->normal ) -
 				( plane->dist + tw->biSphere.endRadius );
 
-			if( d2 > 0 )
-				getout = true;	// endpoint is not in solid
-			
-			if( d1 > 0 )
-				startout = true;
-
-			// if completely in front of face, no intersection with the entire brush
-			if( d1 > 0 && ( d2 >= SURFACE_CLIP_EPSILON || d2 >= d1 ) )
+			if ( !CM_ClipToSide( tw, &bc, side, d1, d2 ) ) {
 				return;
-
-			// if it doesn't cross the plane, the plane isn't relevent
-			if( d1 <= 0 && d2 <= 0 )
-				continue;
-
-			brush->collided = true;
-
-			// crosses face
-			if( d1 > d2 )
-			{
-				// enter
-				f = ( d1 - SURFACE_CLIP_EPSILON ) / ( d1 - d2 );
-
-				if( f < 0 )
-					f = 0;
-
-				if( f > enterFrac )
-				{
-					enterFrac = f;
-					clipplane = plane;
-					leadside = side;
-				}
-			}
-			else
-			{
-				// leave
-				f = ( d1 + SURFACE_CLIP_EPSILON ) / ( d1 - d2 );
-
-				if( f > 1 )
-					f = 1;
-
-				if( f < leaveFrac )
-					leaveFrac = f;
 			}
 		}
 	}
 	else if ( tw->type == TT_CAPSULE ) {
-		//
-		// compare the trace against all planes of the brush
-		// find the latest time the trace crosses a plane towards the interior
-		// and the earliest time the trace crosses a plane towards the exterior
-		//
 		for (i = 0; i < brush->numsides; i++) {
 			side = brush->sides + i;
 			plane = side->plane;
@@ -599,52 +783,11 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 			d1 = DotProduct( startp, plane->normal ) - dist;
 			d2 = DotProduct( endp, plane->normal ) - dist;
 
-			if (d2 > 0) {
-				getout = true;	// endpoint is not in solid
-			}
-			if (d1 > 0) {
-				startout = true;
-			}
-
-			// if completely in front of face, no intersection with the entire brush
-			if (d1 > 0 && ( d2 >= SURFACE_CLIP_EPSILON || d2 >= d1 )  ) {
+			if ( !CM_ClipToSide( tw, &bc, side, d1, d2 ) ) {
 				return;
 			}
-
-			// if it doesn't cross the plane, the plane isn't relevent
-			if (d1 <= 0 && d2 <= 0 ) {
-				continue;
-			}
-
-			brush->collided = true;
-
-			// crosses face
-			if (d1 > d2) {	// enter
-				f = (d1-SURFACE_CLIP_EPSILON) / (d1-d2);
-				if ( f < 0 ) {
-					f = 0;
-				}
-				if (f > enterFrac) {
-					enterFrac = f;
-					clipplane = plane;
-					leadside = side;
-				}
-			} else {	// leave
-				f = (d1+SURFACE_CLIP_EPSILON) / (d1-d2);
-				if ( f > 1 ) {
-					f = 1;
-				}
-				if (f < leaveFrac) {
-					leaveFrac = f;
-				}
-			}
 		}
 	} else {
-		//
-		// compare the trace against all planes of the brush
-		// find the latest time the trace crosses a plane towards the interior
-		// and the earliest time the trace crosses a plane towards the exterior
-		//
 		for (i = 0; i < brush->numsides; i++) {
 			side = brush->sides + i;
 			plane = side->plane;
@@ -655,45 +798,9 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 			d1 = DotProduct( tw->start, plane->normal ) - dist;
 			d2 = DotProduct( tw->end, plane->normal ) - dist;
 
-			if (d2 > 0) {
-				getout = true;	// endpoint is not in solid
-			}
-			if (d1 > 0) {
-				startout = true;
-			}
-
-			// if completely in front of face, no intersection with the entire brush
-			if (d1 > 0 && ( d2 >= SURFACE_CLIP_EPSILON || d2 >= d1 )  ) {
+			if ( !CM_ClipToSide( tw, &bc, side, d1, d2 ) ) {
 				return;
 			}
-
-			// if it doesn't cross the plane, the plane isn't relevent
-			if (d1 <= 0 && d2 <= 0 ) {
-				continue;
-			}
-
-			brush->collided = true;
-
-			// crosses face
-			if (d1 > d2) {	// enter
-				f = (d1-SURFACE_CLIP_EPSILON) / (d1-d2);
-				if ( f < 0 ) {
-					f = 0;
-				}
-				if (f > enterFrac) {
-					enterFrac = f;
-					clipplane = plane;
-					leadside = side;
-				}
-			} else {	// leave
-				f = (d1+SURFACE_CLIP_EPSILON) / (d1-d2);
-				if ( f > 1 ) {
-					f = 1;
-				}
-				if (f < leaveFrac) {
-					leaveFrac = f;
-				}
-			}
 		}
 	}
 
@@ -701,9 +808,9 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 	// all planes have been checked, and the trace was not
 	// completely outside the brush
 	//
-	if (!startout) {	// original point was inside brush
+	if (!bc.startout) {	// original point was inside brush
 		tw->trace.startsolid = qtrue;
-		if (!getout) {
+		if (!bc.getout) {
 			tw->trace.allsolid = qtrue;
 			tw->trace.fraction = 0;
 			tw->trace.contents = brush->contents;
@@ -711,17 +818,17 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 		return;
 	}
 	
-	if (enterFrac < leaveFrac) {
-		if (enterFrac > -1 && enterFrac < tw->trace.fraction) {
-			if (enterFrac < 0) {
-				enterFrac = 0;
+	if (bc.enterFrac < bc.leaveFrac) {
+		if (bc.enterFrac > -1 && bc.enterFrac < tw->trace.fraction) {
+			if (bc.enterFrac < 0) {
+				bc.enterFrac = 0;
 			}
-			tw->trace.fraction = enterFrac;
-			if (clipplane != NULL) {
-				tw->trace.plane = *clipplane;
+			tw->trace.fraction = bc.enterFrac;
+			if (bc.clipplane != NULL) {
+				tw->trace.plane = *bc.clipplane;
 			}
-			if (leadside != NULL) {
-				tw->trace.surfaceFlags = leadside->surfaceFlags;
+			if (bc.leadside != NULL) {
+				tw->trace.surfaceFlags = bc.leadside->surfaceFlags;
 			}
 			tw->trace.contents = brush->contents;
 		}
@@ -829,31 +936,36 @@ CM_TraceThroughLeaf
 void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
 	int			k;
 	int			brushnum;
+	int			surfnum;
 	cbrush_t	*b;
 	cPatch_t	*patch;
 
+	cmTraceContext_t	*ctx = tw->ctx;
+
 	// trace line against all brushes in the leaf
 	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
 
-		b = &cm.brushes[brushnum];
-		if ( b->checkcount == cm.checkcount ) {
+		if ( ctx->brushChecks[brushnum] == ctx->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		ctx->brushChecks[brushnum] = ctx->checkcount;
+		b = CM_ContextBrush( ctx, brushnum );
 
 		if ( !(b->contents & tw->contents) ) {
 			continue;
 		}
 
-		b->collided = false;
-
 		if ( !CM_BoundsIntersect( tw->bounds[0], tw->bounds[1],
 					b->bounds[0], b->bounds[1] ) ) {
 			continue;
 		}
 
+		tw->brushCollided = false;
 		CM_TraceThroughBrush( tw, b );
+		if ( tw->brushCollided ) {
+			ctx->brushCollided[brushnum] = ctx->checkcount;
+		}
 		if ( !tw->trace.fraction ) {
 			tw->trace.lateralFraction = 0.0f;
 			return;
@@ -867,14 +979,15 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
 	if ( !cm_noCurves->integer ) {
 #endif
 		for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
-			patch = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+			surfnum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+			patch = cm.surfaces[ surfnum ];
 			if ( !patch ) {
 				continue;
 			}
-			if ( patch->checkcount == cm.checkcount ) {
+			if ( ctx->patchChecks[ surfnum ] == ctx->checkcount ) {
 				continue;	// already checked this patch in another leaf
 			}
-			patch->checkcount = cm.checkcount;
+			ctx->patchChecks[ surfnum ] = ctx->checkcount;
 
 			if ( !(patch->contents & tw->contents) ) {
 				continue;
@@ -895,12 +1008,12 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
 		{
 			brushnum = cm.leafbrushes[ leaf->firstLeafBrush + k ];
 
-			b = &cm.brushes[ brushnum ];
-
 			// This brush never collided, so don't bother
-			if( !b->collided )
+			if( ctx->brushCollided[ brushnum ] != ctx->checkcount )
 				continue;
 
+			b = CM_ContextBrush( ctx, brushnum );
+
 			if( !( b->contents & tw->contents ) )
 				continue;
 
@@ -1136,7 +1249,7 @@ void CM_TraceCapsuleThroughCapsule( traceWork_t *tw, clipHandle_t model ) {
 	vec3_t offset, symetricSize[2];
 	float radius, halfwidth, halfheight, offs, h;
 
-	CM_ModelBounds(model, mins, maxs);
+	CM_ContextModelBounds(tw->ctx, model, mins, maxs);
 	// test trace bounds vs. capsule bounds
 	if ( tw->bounds[0][0] > maxs[0] + RADIUS_EPSILON
 		|| tw->bounds[0][1] > maxs[1] + RADIUS_EPSILON
@@ -1198,7 +1311,7 @@ void CM_TraceBoundingBoxThroughCapsule( traceWork_t *tw, clipHandle_t model ) {
 	int i;
 
 	// mins maxs of the capsule
-	CM_ModelBounds(model, mins, maxs);
+	CM_ContextModelBounds(tw->ctx, model, mins, maxs);
 
 	// offset for capsule center
 	for ( i = 0 ; i < 3 ; i++ ) {
@@ -1216,9 +1329,9 @@ void CM_TraceBoundingBoxThroughCapsule( traceWork_t *tw, clipHandle_t model ) {
 	VectorSet( tw->sphere.offset, 0, 0, size[1][2] - tw->sphere.radius );
 
 	// replace the capsule with the bounding box
-	h = CM_TempBoxModel(tw->size[0], tw->size[1], false);
+	h = CM_ContextTempBoxModel(tw->ctx, tw->size[0], tw->size[1], false);
 	// calculate collision
-	cmod = CM_ClipHandleToModel( h );
+	cmod = CM_ContextClipHandleToModel( tw->ctx, h );
 	CM_TraceThroughLeaf( tw, &cmod->leaf );
 }
 
@@ -1346,7 +1459,7 @@ void CM_TraceThroughTree( traceWork_t *tw, int num, float p1f, float p2f, vec3_t
 CM_Trace
 ==================
 */
-void CM_Trace( trace_t *results, const vec3_t start,
+static void CM_Trace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start,
 		const vec3_t end, vec3_t mins, vec3_t maxs,
 		clipHandle_t model, const vec3_t origin, int brushmask,
 		traceType_t type, sphere_t *sphere ) {
@@ -1355,14 +1468,15 @@ void CM_Trace( trace_t *results, const vec3_t start,
 	vec3_t		offset;
 	cmodel_t	*cmod;
 
-	cmod = CM_ClipHandleToModel( model );
+	cmod = CM_ContextClipHandleToModel( ctx, model );
 
-	cm.checkcount++;		// for multi-check avoidance
+	CM_BeginQuery( ctx );	// for multi-check avoidance
 
 	c_traces++;				// for statistics, may be zeroed
 
 	// fill in a default trace
 	::memset( &tw, 0, sizeof(tw) );
+	tw.ctx = ctx;
 	tw.trace.fraction = 1;	// assume it goes the entire distance until shown otherwise
 	VectorCopy(origin, tw.modelOrigin);
 	tw.type = type;
@@ -1561,6 +1675,217 @@ void CM_Trace( trace_t *results, const vec3_t start,
 	*results = tw.trace;
 }
 
+/*
+===============================================================================
+
+TRACE CACHE
+
+Line of sight checks from buildables and the like repeat the exact same
+trace against the world many times a second.  With cm_traceCache set, each
+context remembers its recent world traces, keyed on the exact start, end,
+bounds, mask and type, so a repeat costs a hash lookup instead of a walk
+through the tree.  The world can't change during a map, so entries only go
+stale when the map changes or an area portal moves.
+
+===============================================================================
+*/
+
+static std::atomic<int>	cm_traceCacheGeneration;
+static std::atomic<int>	cm_traceCacheHits, cm_traceCacheMisses, cm_traceCacheEvictions;
+static std::atomic<int>	cm_traceCacheTables, cm_traceCacheBytes;	// over every context
+
+/*
+==================
+CM_InvalidateTraceCache
+
+Drops every context's cached traces the next time it looks one up
+==================
+*/
+void CM_InvalidateTraceCache( void ) {
+	cm_traceCacheGeneration++;
+}
+
+/*
+==================
+CM_FreeTraceCache
+==================
+*/
+void CM_FreeTraceCache( cmTraceContext_t *ctx ) {
+	if ( !ctx->traceCache ) {
+		return;
+	}
+
+	cm_traceCacheTables--;
+	cm_traceCacheBytes -= ( ctx->traceCacheMask + 1 ) * (int)sizeof( cmTraceCacheEntry_t );
+	delete[] ctx->traceCache;
+	ctx->traceCache = NULL;
+}
+
+#ifndef BSPC
+static ID_INLINE unsigned CM_HashVector( unsigned hash, const vec3_t v ) {
+	unsigned	bits[3];
+	int			i;
+
+	::memcpy( bits, v, sizeof( bits ) );
+	for ( i = 0 ; i < 3 ; i++ ) {
+		hash = ( hash ^ bits[i] ) * 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+==================
+CM_TraceCacheEntry
+
+Returns the entry for this trace, with *hit set if it already holds the
+result, or NULL if the cache is turned off
+==================
+*/
+static cmTraceCacheEntry_t *CM_TraceCacheEntry( cmTraceContext_t *ctx, const vec3_t start, const vec3_t end,
+		const vec3_t mins, const vec3_t maxs, int brushmask, traceType_t type, bool *hit ) {
+	cmTraceCacheEntry_t	*entry;
+	unsigned	hash;
+	size_t		bytes, count;
+	int			generation;
+
+	// size the table to the largest power of two that fits cm_traceCacheSize
+	if ( ctx->traceCacheKB != cm_traceCacheSize->integer ) {
+		CM_FreeTraceCache( ctx );
+		ctx->traceCacheKB = cm_traceCacheSize->integer;
+
+		bytes = ctx->traceCacheKB > 0 ? (size_t)ctx->traceCacheKB * 1024 : 0;
+		for ( count = 1 ; count * 2 * sizeof( cmTraceCacheEntry_t ) <= bytes ; count *= 2 )
+			;
+		if ( count * sizeof( cmTraceCacheEntry_t ) <= bytes ) {
+			ctx->traceCache = new cmTraceCacheEntry_t[count]();
+			ctx->traceCacheMask = count - 1;
+			ctx->traceCacheStamp++;
+			cm_traceCacheTables++;
+			cm_traceCacheBytes += (int)( count * sizeof( cmTraceCacheEntry_t ) );
+		}
+	}
+
+	if ( !ctx->traceCache ) {
+		return NULL;
+	}
+
+	// the curve cvars change what a trace hits, so they count as a new map
+	generation = cm_traceCacheGeneration + cm_noCurves->modificationCount
+		+ cm_playerCurveClip->modificationCount;
+	if ( ctx->traceCacheGeneration != generation ) {
+		ctx->traceCacheGeneration = generation;
+		ctx->traceCacheStamp++;
+	}
+
+	hash = 2166136261u;
+	hash = CM_HashVector( hash, start );
+	hash = CM_HashVector( hash, end );
+	hash = CM_HashVector( hash, mins );
+	hash = CM_HashVector( hash, maxs );
+	hash = ( hash ^ brushmask ) * 16777619u;
+	hash = ( hash ^ type ) * 16777619u;
+
+	entry = &ctx->traceCache[ hash & ctx->traceCacheMask ];
+
+	// compare bits rather than values so -0 and 0 can't share a result
+	if ( entry->stamp == ctx->traceCacheStamp && entry->brushmask == brushmask && entry->type == type
+		&& !::memcmp( entry->start, start, sizeof( vec3_t ) ) && !::memcmp( entry->end, end, sizeof( vec3_t ) )
+		&& !::memcmp( entry->mins, mins, sizeof( vec3_t ) ) && !::memcmp( entry->maxs, maxs, sizeof( vec3_t ) ) ) {
+		cm_traceCacheHits++;
+		*hit = true;
+		return entry;
+	}
+
+	if ( entry->stamp == ctx->traceCacheStamp ) {
+		cm_traceCacheEvictions++;
+	}
+	cm_traceCacheMisses++;
+	*hit = false;
+	return entry;
+}
+#endif
+
+/*
+==================
+CM_CachedTrace
+
+CM_Trace for traces that don't need transforming, going through the trace
+cache when it's on and the trace is against the world
+==================
+*/
+static void CM_CachedTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start, const vec3_t end,
+						  vec3_t mins, vec3_t maxs,
+						  clipHandle_t model, int brushmask, traceType_t type ) {
+#ifndef BSPC
+	cmTraceCacheEntry_t	*entry;
+	bool		hit;
+
+	if ( model == 0 && cm_traceCache->integer ) {
+		if ( !mins ) {
+			mins = vec3_origin;
+		}
+		if ( !maxs ) {
+			maxs = vec3_origin;
+		}
+
+		entry = CM_TraceCacheEntry( ctx, start, end, mins, maxs, brushmask, type, &hit );
+		if ( entry ) {
+			if ( hit ) {
+				c_traces++;		// CM_Trace counts the misses
+			} else {
+				CM_Trace( ctx, &entry->trace, start, end, mins, maxs, model, vec3_origin, brushmask, type, NULL );
+				VectorCopy( start, entry->start );
+				VectorCopy( end, entry->end );
+				VectorCopy( mins, entry->mins );
+				VectorCopy( maxs, entry->maxs );
+				entry->brushmask = brushmask;
+				entry->type = type;
+				entry->stamp = ctx->traceCacheStamp;
+			}
+			*results = entry->trace;
+			return;
+		}
+	}
+#endif
+
+	CM_Trace( ctx, results, start, end, mins, maxs, model, vec3_origin, brushmask, type, NULL );
+}
+
+/*
+==================
+CM_TraceCacheStats
+==================
+*/
+void CM_TraceCacheStats( cmTraceCacheStats_t *stats, bool reset ) {
+	cmTraceContext_t	*ctx = CM_ThreadTraceContext();
+
+	stats->hits = cm_traceCacheHits;
+	stats->misses = cm_traceCacheMisses;
+	stats->evictions = cm_traceCacheEvictions;
+	stats->entries = ctx->traceCache ? ctx->traceCacheMask + 1 : 0;
+	stats->bytes = stats->entries * (int)sizeof( cmTraceCacheEntry_t );
+	stats->tables = cm_traceCacheTables;
+	stats->totalBytes = cm_traceCacheBytes;
+
+	if ( reset ) {
+		cm_traceCacheHits = 0;
+		cm_traceCacheMisses = 0;
+		cm_traceCacheEvictions = 0;
+	}
+}
+
+/*
+==================
+CM_ContextBoxTrace
+==================
+*/
+void CM_ContextBoxTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start, const vec3_t end,
+						  vec3_t mins, vec3_t maxs,
+						  clipHandle_t model, int brushmask, traceType_t type ) {
+	CM_CachedTrace( ctx, results, start, end, mins, maxs, model, brushmask, type );
+}
+
 /*
 ==================
 CM_BoxTrace
@@ -1569,18 +1894,18 @@ CM_BoxTrace
 void CM_BoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
 						  vec3_t mins, vec3_t maxs,
 						  clipHandle_t model, int brushmask, traceType_t type ) {
-	CM_Trace( results, start, end, mins, maxs, model, vec3_origin, brushmask, type, NULL );
+	CM_CachedTrace( CM_ThreadTraceContext(), results, start, end, mins, maxs, model, brushmask, type );
 }
 
 /*
 ==================
-CM_TransformedBoxTrace
+CM_ContextTransformedBoxTrace
 
 Handles offseting and rotation of the end points for moving and
 rotating entities
 ==================
 */
-void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
+void CM_ContextTransformedBoxTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start, const vec3_t end,
 						  vec3_t mins, vec3_t maxs,
 						  clipHandle_t model, int brushmask,
 						  const vec3_t origin, const vec3_t angles, traceType_t type ) {
@@ -1653,7 +1978,7 @@ void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t
 	}
 
 	// sweep the box through the model
-	CM_Trace( &trace, start_l, end_l, symetricSize[0], symetricSize[1],
+	CM_Trace( ctx, &trace, start_l, end_l, symetricSize[0], symetricSize[1],
 			model, origin, brushmask, type, &sphere );
 
 	// if the bmodel was rotated and there was a collision
@@ -1674,10 +1999,23 @@ void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t
 
 /*
 ==================
-CM_BiSphereTrace
+CM_TransformedBoxTrace
 ==================
 */
-void CM_BiSphereTrace( trace_t *results, const vec3_t start,
+void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
+						  vec3_t mins, vec3_t maxs,
+						  clipHandle_t model, int brushmask,
+						  const vec3_t origin, const vec3_t angles, traceType_t type ) {
+	CM_ContextTransformedBoxTrace( CM_ThreadTraceContext(), results, start, end, mins, maxs,
+			model, brushmask, origin, angles, type );
+}
+
+/*
+==================
+CM_ContextBiSphereTrace
+==================
+*/
+void CM_ContextBiSphereTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start,
 		const vec3_t end, float startRad, float endRad,
 		clipHandle_t model, int mask )
 {
@@ -1686,14 +2024,15 @@ void CM_BiSphereTrace( trace_t *results, const vec3_t start,
 	float				largestRadius = startRad > endRad ? startRad : endRad;
 	cmodel_t		*cmod;
 
-	cmod = CM_ClipHandleToModel( model );
+	cmod = CM_ContextClipHandleToModel( ctx, model );
 
-	cm.checkcount++;		// for multi-check avoidance
+	CM_BeginQuery( ctx );	// for multi-check avoidance
 
 	c_traces++;				// for statistics, may be zeroed
 
 	// fill in a default trace
 	::memset( &tw, 0, sizeof( tw ) );
+	tw.ctx = ctx;
 	tw.trace.fraction = 1.0f; // assume it goes the entire distance until shown otherwise
 	VectorCopy( vec3_origin, tw.modelOrigin );
 	tw.type = TT_BISPHERE;
@@ -1769,13 +2108,25 @@ void CM_BiSphereTrace( trace_t *results, const vec3_t start,
 
 /*
 ==================
-CM_TransformedBiSphereTrace
+CM_BiSphereTrace
+==================
+*/
+void CM_BiSphereTrace( trace_t *results, const vec3_t start,
+		const vec3_t end, float startRad, float endRad,
+		clipHandle_t model, int mask )
+{
+	CM_ContextBiSphereTrace( CM_ThreadTraceContext(), results, start, end, startRad, endRad, model, mask );
+}
+
+/*
+==================
+CM_ContextTransformedBiSphereTrace
 
 Handles offseting and rotation of the end points for moving and
 rotating entities
 ==================
 */
-void CM_TransformedBiSphereTrace( trace_t *results, const vec3_t start,
+void CM_ContextTransformedBiSphereTrace( cmTraceContext_t *ctx, trace_t *results, const vec3_t start,
 		const vec3_t end, float startRad, float endRad,
 		clipHandle_t model, int mask,
 		const vec3_t origin )
@@ -1787,7 +2138,7 @@ void CM_TransformedBiSphereTrace( trace_t *results, const vec3_t start,
 	VectorSubtract( start, origin, start_l );
 	VectorSubtract( end, origin, end_l );
 
-	CM_BiSphereTrace( &trace, start_l, end_l, startRad, endRad, model, mask );
+	CM_ContextBiSphereTrace( ctx, &trace, start_l, end_l, startRad, endRad, model, mask );
 
 	// re-calculate the end position of the trace because the trace.endpos
 	// calculated by CM_BiSphereTrace could be rotated and have an offset
@@ -1797,3 +2148,17 @@ void CM_TransformedBiSphereTrace( trace_t *results, const vec3_t start,
 
 	*results = trace;
 }
+
+/*
+==================
+CM_TransformedBiSphereTrace
+==================
+*/
+void CM_TransformedBiSphereTrace( trace_t *results, const vec3_t start,
+		const vec3_t end, float startRad, float endRad,
+		clipHandle_t model, int mask,
+		const vec3_t origin )
+{
+	CM_ContextTransformedBiSphereTrace( CM_ThreadTraceContext(), results, start, end,
+			startRad, endRad, model, mask, origin );
+}
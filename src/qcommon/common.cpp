@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "qcommon.h"
 #include "crypto.h"
 #include "msg.h"
+#include "profile.h"
 #include "sys/sys_shared.h"
 #include "vm.h"
 
@@ -36,6 +37,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "json.h"
 
 #include <setjmp.h>
+#include <unordered_map>
 
 #ifndef _WIN32
 #include <netinet/in.h>
@@ -755,10 +757,17 @@ int Com_RealTime(qtime_t *qtime)
 
 ZONE MEMORY ALLOCATION
 
-There is never any space between memblocks, and there will never be two
-contiguous free memblocks.
+Each zone is one block of memory cut into memblocks that always touch: a
+block's size leads to the next one and its prevSize back to the previous
+one.  There will never be two contiguous free memblocks.
 
-The rover can be left pointing at a non-empty block
+Free blocks are kept on segregated lists, one per size class: exact 8
+byte steps below 128 bytes, then 16 classes for every power of two.
+Allocating rounds the size up to the next class, so the first block of
+the first non-empty class at or above it always fits, and a bitmap of
+the non-empty classes finds that in constant time.  Neither allocating
+nor freeing ever walks the zone.  Blocks in use are linked into a list
+for their tag instead, which is all Z_FreeTags has to walk.
 
 The zone calls are pretty much only used for small strings and structures,
 all big things are allocated on the hunk.
@@ -768,6 +777,13 @@ all big things are allocated on the hunk.
 #define ZONEID 0x1d4a11
 #define MINFRAGMENT 64
 
+#define ZONE_ALIGN_SHIFT 3  // blocks are a multiple of 8 bytes
+#define ZONE_SL_SHIFT 4     // 16 classes per power of two
+#define ZONE_SL_COUNT ( 1 << ZONE_SL_SHIFT )
+#define ZONE_FL_SHIFT ( ZONE_SL_SHIFT + ZONE_ALIGN_SHIFT )
+#define ZONE_FL_COUNT ( 32 - ZONE_FL_SHIFT )
+#define ZONE_TAGS TAG_STATIC  // static blocks are never allocated
+
 typedef struct zonedebug_s {
     const char *label;
     const char *file;
@@ -778,8 +794,9 @@ typedef struct zonedebug_s {
 typedef struct memblock_s {
     int size;           // including the header and possibly tiny fragments
     int tag;            // a tag of 0 is a free block
-    struct memblock_s       *next, *prev;
+    struct memblock_s       *next, *prev;   // the free list of its class, or the blocks of its tag
     int id;          // should be ZONEID
+    int prevSize;    // size of the block before it, 0 for the first one
 #ifdef ZONE_DEBUG
     zonedebug_t d;
 #endif
@@ -788,8 +805,12 @@ typedef struct memblock_s {
 typedef struct {
     int size;   // total bytes malloced, including header
     int used;   // total bytes used
-    memblock_t blocklist; // start / end cap for linked list
-    memblock_t *rover;
+    memblock_t *first;
+    memblock_t *cap;   // never free, ends the zone
+    unsigned int flMap;   // bit per first level with a non-empty class
+    unsigned int slMap[ZONE_FL_COUNT];   // bit per non-empty class
+    memblock_t *freeLists[ZONE_FL_COUNT][ZONE_SL_COUNT];
+    memblock_t tags[ZONE_TAGS];   // start / end caps for the list of each tag
 } memzone_t;
 
 // main zone for all "dynamic" memory allocation
@@ -799,6 +820,134 @@ memzone_t *mainzone;
 memzone_t *smallzone;
 
 void Z_CheckHeap( void );
+static void Z_TraceOp( memblock_t *block, int size );
+
+static inline memblock_t *Z_NextBlock( memblock_t *block )
+{
+    return (memblock_t *)( (byte *)block + block->size );
+}
+
+static inline memblock_t *Z_PrevBlock( memblock_t *block )
+{
+    return block->prevSize ? (memblock_t *)( (byte *)block - block->prevSize ) : NULL;
+}
+
+/*
+========================
+Z_SizeClass
+
+First and second level index of the class a block of size belongs to
+========================
+*/
+static inline void Z_SizeClass( int size, int *fl, int *sl )
+{
+    if ( size < ( 1 << ZONE_FL_SHIFT ) ) {
+        *fl = 0;
+        *sl = size >> ZONE_ALIGN_SHIFT;
+    } else {
+        int top = 31 - Q_clz( size );
+        *fl = top - ZONE_FL_SHIFT + 1;
+        *sl = ( size >> ( top - ZONE_SL_SHIFT ) ) - ZONE_SL_COUNT;
+    }
+}
+
+/*
+========================
+Z_InsertFree
+========================
+*/
+static void Z_InsertFree( memzone_t *zone, memblock_t *block )
+{
+    int fl, sl;
+
+    Z_SizeClass( block->size, &fl, &sl );
+
+    block->tag = 0; // free block
+    block->prev = NULL;
+    block->next = zone->freeLists[fl][sl];
+    if ( block->next ) {
+        block->next->prev = block;
+    }
+    zone->freeLists[fl][sl] = block;
+
+    zone->flMap |= 1u << fl;
+    zone->slMap[fl] |= 1u << sl;
+}
+
+/*
+========================
+Z_RemoveFree
+========================
+*/
+static void Z_RemoveFree( memzone_t *zone, memblock_t *block )
+{
+    int fl, sl;
+
+    if ( block->next ) {
+        block->next->prev = block->prev;
+    }
+    if ( block->prev ) {
+        block->prev->next = block->next;
+        return;
+    }
+
+    Z_SizeClass( block->size, &fl, &sl );
+    zone->freeLists[fl][sl] = block->next;
+    if ( !block->next ) {
+        zone->slMap[fl] &= ~( 1u << sl );
+        if ( !zone->slMap[fl] ) {
+            zone->flMap &= ~( 1u << fl );
+        }
+    }
+}
+
+/*
+========================
+Z_FindFree
+
+Returns a free block of at least size bytes, or NULL if the zone has none
+========================
+*/
+static memblock_t *Z_FindFree( memzone_t *zone, int size )
+{
+    memblock_t *block;
+    unsigned int map;
+    int fl, sl, rounded;
+
+    // round up to the next class boundary, so anything in the class fits
+    rounded = size;
+    if ( size >= ( 1 << ZONE_FL_SHIFT ) ) {
+        rounded += ( 1 << ( 31 - Q_clz( size ) - ZONE_SL_SHIFT ) ) - 1;
+    }
+    Z_SizeClass( rounded, &fl, &sl );
+    if ( fl < ZONE_FL_COUNT ) {
+        map = zone->slMap[fl] & ( ~0u << sl );
+        if ( !map ) {
+            map = zone->flMap & ( ~0u << ( fl + 1 ) );
+            if ( map ) {
+                fl = Q_ctz( map );
+                map = zone->slMap[fl];
+            }
+        }
+        if ( map ) {
+            return zone->freeLists[fl][Q_ctz( map )];
+        }
+    }
+
+    // nothing bigger is free, but a block in the size's own class
+    // still may be big enough
+    Z_SizeClass( size, &fl, &sl );
+    if ( fl >= ZONE_FL_COUNT ) {
+        return NULL;
+    }
+    for ( block = zone->freeLists[fl][sl]; block; block = block->next ) {
+        if ( block->size >= size ) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
 
 /*
 ========================
@@ -808,22 +957,31 @@ Z_ClearZone
 void Z_ClearZone( memzone_t *zone, int size )
 {
     memblock_t *block;
+    int i;
 
-    // set the entire zone to one free block
-
-    zone->blocklist.next = zone->blocklist.prev = block =
-        (memblock_t *)( (byte *)zone + sizeof(memzone_t) );
-    zone->blocklist.tag = 1; // in use block
-    zone->blocklist.id = 0;
-    zone->blocklist.size = 0;
-    zone->rover = block;
+    ::memset( zone, 0, sizeof( *zone ) );
     zone->size = size;
     zone->used = 0;
 
-    block->prev = block->next = &zone->blocklist;
-    block->tag = 0; // free block
+    for ( i = 0; i < ZONE_TAGS; i++ ) {
+        zone->tags[i].next = zone->tags[i].prev = &zone->tags[i];
+        zone->tags[i].tag = i;
+    }
+
+    // set the entire zone to one free block, followed by a cap that
+    // keeps it from merging past the end
+    zone->first = block = (memblock_t *)( (byte *)zone + PAD( sizeof( memzone_t ), 1 << ZONE_ALIGN_SHIFT ) );
+    zone->cap = (memblock_t *)( (byte *)zone + ( ( size - sizeof( memblock_t ) ) & ~( ( 1 << ZONE_ALIGN_SHIFT ) - 1 ) ) );
+
+    zone->cap->size = sizeof( memblock_t );
+    zone->cap->tag = TAG_STATIC;
+    zone->cap->id = ZONEID;
+    zone->cap->prevSize = (byte *)zone->cap - (byte *)block;
+
+    block->size = zone->cap->prevSize;
     block->id = ZONEID;
-    block->size = size - sizeof(memzone_t);
+    block->prevSize = 0;
+    Z_InsertFree( zone, block );
 }
 
 /*
@@ -846,6 +1004,93 @@ int Z_AvailableMemory( void )
     return Z_AvailableZoneMemory( mainzone );
 }
 
+/*
+========================
+Z_ZoneAlloc
+
+Takes size bytes, including the header and trash tester, from zone.
+Returns NULL if it does not have them
+========================
+*/
+static memblock_t *Z_ZoneAlloc( memzone_t *zone, int size, int tag )
+{
+    memblock_t *block, *fragment;
+    int extra;
+
+    block = Z_FindFree( zone, size );
+    if ( !block ) {
+        return NULL;
+    }
+    Z_RemoveFree( zone, block );
+
+    extra = block->size - size;
+    if ( extra > MINFRAGMENT ) {
+        // there will be a free fragment after the allocated block, and
+        // the block after that is in use, or this one would have been
+        // merged with it
+        fragment = (memblock_t *)( (byte *)block + size );
+        fragment->size = extra;
+        fragment->id = ZONEID;
+        fragment->prevSize = size;
+        Z_NextBlock( fragment )->prevSize = extra;
+        block->size = size;
+        Z_InsertFree( zone, fragment );
+    }
+
+    block->tag = tag;
+    block->id = ZONEID;
+    block->prev = &zone->tags[tag];
+    block->next = zone->tags[tag].next;
+    block->next->prev = block;
+    zone->tags[tag].next = block;
+
+    zone->used += block->size;
+
+    // marker for memory trash testing
+    *(int *)( (byte *)block + block->size - 4 ) = ZONEID;
+
+    return block;
+}
+
+/*
+========================
+Z_ZoneFree
+========================
+*/
+static void Z_ZoneFree( memzone_t *zone, memblock_t *block )
+{
+    memblock_t *other;
+
+    zone->used -= block->size;
+
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+
+    // set the block to something that should cause problems
+    // if it is referenced...
+    ::memset( block + 1, 0xaa, block->size - sizeof( *block ) );
+
+    block->tag = 0; // mark as free
+
+    other = Z_PrevBlock( block );
+    if ( other && !other->tag ) {
+        // merge with previous free block
+        Z_RemoveFree( zone, other );
+        other->size += block->size;
+        block = other;
+    }
+
+    other = Z_NextBlock( block );
+    if ( !other->tag ) {
+        // merge the next free block onto the end
+        Z_RemoveFree( zone, other );
+        block->size += other->size;
+    }
+
+    Z_NextBlock( block )->prevSize = block->size;
+    Z_InsertFree( zone, block );
+}
+
 /*
 ========================
 Z_Free
@@ -853,8 +1098,7 @@ Z_Free
 */
 void Z_Free( void *ptr )
 {
-    memblock_t *block, *other;
-    memzone_t *zone;
+    memblock_t *block;
 
     if (!ptr) {
         Com_Printf(S_COLOR_YELLOW "Z_Free: NULL pointer" );
@@ -878,41 +1122,8 @@ void Z_Free( void *ptr )
         Com_Error( ERR_FATAL, "Z_Free: memory block wrote past end" );
     }
 
-    if (block->tag == TAG_SMALL) {
-        zone = smallzone;
-    }
-    else {
-        zone = mainzone;
-    }
-
-    zone->used -= block->size;
-    // set the block to something that should cause problems
-    // if it is referenced...
-    ::memset( ptr, 0xaa, block->size - sizeof( *block ) );
-
-    block->tag = 0; // mark as free
-
-    other = block->prev;
-    if (!other->tag) {
-        // merge with previous free block
-        other->size += block->size;
-        other->next = block->next;
-        other->next->prev = other;
-        if (block == zone->rover) {
-            zone->rover = other;
-        }
-        block = other;
-    }
-
-    zone->rover = block;
-
-    other = block->next;
-    if ( !other->tag ) {
-        // merge the next free block onto the end
-        block->size += other->size;
-        block->next = other->next;
-        block->next->prev = block;
-    }
+    Z_TraceOp( block, -1 );
+    Z_ZoneFree( block->tag == TAG_SMALL ? smallzone : mainzone, block );
 }
 
 
@@ -924,6 +1135,11 @@ Z_FreeTags
 void Z_FreeTags( int tag )
 {
     memzone_t *zone;
+    memblock_t *head;
+
+    if ( tag <= 0 || tag >= ZONE_TAGS ) {
+        return;
+    }
 
     if ( tag == TAG_SMALL )
     {
@@ -933,16 +1149,11 @@ void Z_FreeTags( int tag )
     {
         zone = mainzone;
     }
-    // use the rover as our pointer, because
-    // Z_Free automatically adjusts it
-    zone->rover = zone->blocklist.next;
-    do {
-        if ( zone->rover->tag == tag ) {
-            Z_Free( (void *)(zone->rover + 1) );
-            continue;
-        }
-        zone->rover = zone->rover->next;
-    } while ( zone->rover != &zone->blocklist );
+
+    head = &zone->tags[tag];
+    while ( head->next != head ) {
+        Z_Free( (void *)( head->next + 1 ) );
+    }
 }
 
 
@@ -957,89 +1168,49 @@ void *Z_TagMallocDebug( int size, int tag, const char *label, const char *file,
 void *Z_TagMalloc( int size, int tag )
 #endif
 {
-    int extra;
-    memblock_t *start, *rover, *_new, *base;
+    memblock_t *block;
     memzone_t *zone;
+    int blockSize;
 
     if (!tag)
         Com_Error( ERR_FATAL, "Z_TagMalloc: tried to use a 0 tag" );
+    if ( tag < 0 || tag >= ZONE_TAGS )
+        Com_Error( ERR_FATAL, "Z_TagMalloc: tried to use tag %i", tag );
 
     if ( tag == TAG_SMALL )
         zone = smallzone;
     else
         zone = mainzone;
 
-#ifdef ZONE_DEBUG
-    int allocSize = size;
-#endif
-    //
-    // scan through the block list looking for the first free block
-    // of sufficient size
-    //
-    size += sizeof(memblock_t); // account for size of block header
-    size += 4;     // space for memory trash tester
-    size = PAD(size, sizeof(intptr_t)); // align to 32/64 bit boundary
-
-    base = rover = zone->rover;
-    start = base->prev;
+    blockSize = size + sizeof(memblock_t); // account for size of block header
+    blockSize += 4;     // space for memory trash tester
+    blockSize = PAD(blockSize, 1 << ZONE_ALIGN_SHIFT);
 
-    do {
-        if (rover == start)
-        {
-            // scaned all the way around the list
+    block = size >= 0 && blockSize > 0 ? Z_ZoneAlloc( zone, blockSize, tag ) : NULL;
+    if ( !block )
+    {
 #ifdef ZONE_DEBUG
-            Z_LogHeap();
+        Z_LogHeap();
 
-            Com_Error(ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes from the %s zone: %s, line: %d (%s)",
-                    size, zone == smallzone ? "small" : "main", file, line, label);
+        Com_Error(ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes from the %s zone: %s, line: %d (%s)",
+                blockSize, zone == smallzone ? "small" : "main", file, line, label);
 #else
-            Com_Error(ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes from the %s zone",
-                    size, zone == smallzone ? "small" : "main");
+        Com_Error(ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes from the %s zone",
+                blockSize, zone == smallzone ? "small" : "main");
 #endif
-            return NULL;
-        }
-        if (rover->tag) {
-            base = rover = rover->next;
-        } else {
-            rover = rover->next;
-        }
-    } while (base->tag || base->size < size);
-
-    //
-    // found a block big enough
-    //
-    extra = base->size - size;
-    if (extra > MINFRAGMENT) {
-        // there will be a free fragment after the allocated block
-        _new = (memblock_t *) ((byte *)base + size );
-        _new->size = extra;
-        _new->tag = 0;   // free block
-        _new->prev = base;
-        _new->id = ZONEID;
-        _new->next = base->next;
-        _new->next->prev = _new;
-        base->next = _new;
-        base->size = size;
+        return NULL;
     }
 
-    base->tag = tag; // n_o longer a free block
-
-    zone->rover = base->next; // next allocation will start looking here
-    zone->used += base->size;
-
-    base->id = ZONEID;
-
 #ifdef ZONE_DEBUG
-    base->d.label = label;
-    base->d.file = file;
-    base->d.line = line;
-    base->d.allocSize = allocSize;
+    block->d.label = label;
+    block->d.file = file;
+    block->d.line = line;
+    block->d.allocSize = size;
 #endif
 
-    // marker for memory trash testing
-    *(int *)((byte *)base + base->size - 4) = ZONEID;
+    Z_TraceOp( block, size );
 
-    return (void *) ((byte *)base + sizeof(memblock_t));
+    return (void *) ((byte *)block + sizeof(memblock_t));
 }
 
 /*
@@ -1081,29 +1252,42 @@ void *S_Malloc( int size )
 
 /*
 ========================
-Z_CheckHeap
+Z_CheckZone
 ========================
 */
-void Z_CheckHeap( void )
+static void Z_CheckZone( memzone_t *zone )
 {
-    memblock_t *block;
+    memblock_t *block, *next;
 
-    for (block = mainzone->blocklist.next ; ; block = block->next)
+    for ( block = zone->first; block != zone->cap; block = next )
     {
-        if (block->next == &mainzone->blocklist)
-            break; // all blocks have been hit
+        next = Z_NextBlock( block );
 
-        if ( (byte *)block + block->size != (byte *)block->next)
-            Com_Error( ERR_FATAL, "Z_CheckHeap: block size does not touch the next block" );
+        if ( block->id != ZONEID )
+            Com_Error( ERR_FATAL, "Z_CheckHeap: block without ZONEID" );
 
-        if ( block->next->prev != block)
+        if ( block->size <= 0 || (byte *)next > (byte *)zone->cap )
+            Com_Error( ERR_FATAL, "Z_CheckHeap: block size runs past the end of the zone" );
+
+        if ( next->prevSize != block->size )
             Com_Error( ERR_FATAL, "Z_CheckHeap: next block doesn't have proper back link" );
 
-        if ( !block->tag && !block->next->tag )
+        if ( !block->tag && !next->tag )
             Com_Error( ERR_FATAL, "Z_CheckHeap: two consecutive free blocks" );
     }
 }
 
+/*
+========================
+Z_CheckHeap
+========================
+*/
+void Z_CheckHeap( void )
+{
+    Z_CheckZone( mainzone );
+    Z_CheckZone( smallzone );
+}
+
 /*
 ========================
 Z_LogZoneHeap
@@ -1129,7 +1313,7 @@ void Z_LogZoneHeap( memzone_t *zone, const char *name )
     Com_sprintf(buf, sizeof(buf), "\r\n================\r\n%s log\r\n================\r\n", name);
     FS_Write(buf, strlen(buf), logfile);
 
-    for (block = zone->blocklist.next ; block->next != &zone->blocklist; block = block->next)
+    for (block = zone->first ; block != zone->cap; block = Z_NextBlock(block))
     {
         if (block->tag)
         {
@@ -1312,7 +1496,7 @@ void Com_Meminfo_f( void )
     botlibBytes = 0;
     rendererBytes = 0;
     zoneBlocks = 0;
-    for (block = mainzone->blocklist.next ; ; block = block->next) {
+    for (block = mainzone->first ; block != mainzone->cap ; block = Z_NextBlock(block)) {
         if ( Cmd_Argc() != 1 ) {
             Com_Printf ("block:%p    size:%7i    tag:%3i\n",
                     (void *)block, block->size, block->tag);
@@ -1327,29 +1511,19 @@ void Com_Meminfo_f( void )
             }
         }
 
-        if (block->next == &mainzone->blocklist) {
-            break; // all blocks have been hit
-        }
-        if ( (byte *)block + block->size != (byte *)block->next) {
-            Com_Printf ("ERROR: block size does not touch the next block\n");
+        if ( block->size <= 0 || (byte *)Z_NextBlock(block) > (byte *)mainzone->cap ) {
+            Com_Printf ("ERROR: block size runs past the end of the zone\n");
+            break;
         }
-        if ( block->next->prev != block) {
+        if ( Z_NextBlock(block)->prevSize != block->size ) {
             Com_Printf ("ERROR: next block doesn't have proper back link\n");
         }
-        if ( !block->tag && !block->next->tag ) {
+        if ( !block->tag && !Z_NextBlock(block)->tag ) {
             Com_Printf ("ERROR: two consecutive free blocks\n");
         }
     }
 
-    smallZoneBytes = 0;
-    for (block = smallzone->blocklist.next ; ; block = block->next)
-    {
-        if ( block->tag )
-            smallZoneBytes += block->size;
-
-        if (block->next == &smallzone->blocklist)
-            break; // all blocks have been hit
-    }
+    smallZoneBytes = smallzone->used;
 
     Com_Printf( "%8i bytes total hunk\n", s_hunkTotal );
     Com_Printf( "%8i bytes total zone\n", s_zoneTotal );
@@ -1416,16 +1590,13 @@ void Com_TouchMemory( void )
         sum += ((int *)s_hunkData)[i];
     }
 
-    for (block = mainzone->blocklist.next ; ; block = block->next) {
+    for (block = mainzone->first ; block != mainzone->cap ; block = Z_NextBlock(block)) {
         if ( block->tag ) {
             j = block->size >> 2;
             for ( i = 0 ; i < j ; i+=64 ) { // only need to touch each page
                 sum += ((int *)block)[i];
             }
         }
-        if ( block->next == &mainzone->blocklist ) {
-            break; // all blocks have been hit
-        }
     }
 
     end = Sys_Milliseconds();
@@ -1474,6 +1645,360 @@ void Com_InitZoneMemory( void )
     Z_ClearZone( mainzone, s_zoneTotal );
 }
 
+/*
+==============================================================================
+
+ZONE TRACES
+
+"zonetrace <file>" records every zone allocation and free to a file in the
+home path until "zonetrace" is run again without one, so a long server
+session can be captured as it happens.  "zonebench [file]" replays such a
+trace, or a synthetic one modelled on cvar and command string churn,
+against scratch zones of the same size and against malloc.
+
+==============================================================================
+*/
+
+#define ZONE_TRACE_ID ( ( 'R' << 24 ) + ( 'T' << 16 ) + ( 'Z' << 8 ) + 'Z' )
+#define ZONE_TRACE_BATCH 4096
+
+typedef struct {
+    int size;   // bytes asked for, -1 for a free
+    int tag;
+    unsigned int offset;    // of the block from the start of its zone
+} zoneTraceOp_t;
+
+static FILE *z_traceFile;
+static zoneTraceOp_t z_traceOps[ZONE_TRACE_BATCH];
+static int z_traceCount;
+static unsigned long z_traceTotal;
+
+/*
+========================
+Z_TraceOp
+========================
+*/
+static void Z_TraceOp( memblock_t *block, int size )
+{
+    zoneTraceOp_t *op;
+
+    if ( !z_traceFile ) {
+        return;
+    }
+
+    op = &z_traceOps[z_traceCount++];
+    op->size = size;
+    op->tag = block->tag;
+    op->offset = (byte *)block - (byte *)( block->tag == TAG_SMALL ? smallzone : mainzone );
+    z_traceTotal++;
+
+    if ( z_traceCount == ZONE_TRACE_BATCH ) {
+        fwrite( z_traceOps, sizeof( zoneTraceOp_t ), z_traceCount, z_traceFile );
+        z_traceCount = 0;
+    }
+}
+
+/*
+========================
+Z_TraceOSPath
+
+Traces live in the home path, and only there
+========================
+*/
+static const char *Z_TraceOSPath( const char *name )
+{
+    if ( strstr( name, ".." ) || strstr( name, "::" ) ) {
+        Com_Printf( "zone traces can't be outside the home path\n" );
+        return NULL;
+    }
+
+    return FS_BuildOSPath( Cvar_VariableString( "fs_homepath" ), FS_GetCurrentGameDir(), name );
+}
+
+/*
+========================
+Z_Trace_f
+========================
+*/
+static void Z_Trace_f( void )
+{
+    const char *ospath;
+    int id = ZONE_TRACE_ID;
+
+    if ( z_traceFile ) {
+        fwrite( z_traceOps, sizeof( zoneTraceOp_t ), z_traceCount, z_traceFile );
+        fclose( z_traceFile );
+        z_traceFile = NULL;
+        z_traceCount = 0;
+        Com_Printf( "zone trace stopped after %lu operations\n", z_traceTotal );
+    } else if ( Cmd_Argc() < 2 ) {
+        Com_Printf( "usage: zonetrace <file> to record zone allocations, zonetrace to stop\n" );
+    }
+
+    if ( Cmd_Argc() < 2 || !( ospath = Z_TraceOSPath( Cmd_Argv( 1 ) ) ) ) {
+        return;
+    }
+
+    z_traceFile = Sys_FOpen( ospath, "wb" );
+    if ( !z_traceFile ) {
+        Com_Printf( "couldn't open %s\n", ospath );
+        return;
+    }
+    fwrite( &id, sizeof( id ), 1, z_traceFile );
+    z_traceTotal = 0;
+
+    Com_Printf( "recording zone trace to %s\n", ospath );
+}
+
+typedef struct {
+    int size;   // -1 for a free
+    int tag;
+    int slot;   // of the allocation, or -1 for a free of one that isn't in the trace
+} zoneBenchOp_t;
+
+static unsigned int z_benchSeed;
+
+static int Z_BenchRand( int range )
+{
+    z_benchSeed = z_benchSeed * 1664525 + 1013904223;
+    return ( z_benchSeed >> 8 ) % range;
+}
+
+/*
+========================
+Z_BenchLoad
+
+Turns a recorded trace into allocation slots, so replaying it is nothing
+but allocations and frees
+========================
+*/
+static zoneBenchOp_t *Z_BenchLoad( const char *name, int *numOps, int *numSlots )
+{
+    std::unordered_map<uint64_t, int> live;
+    zoneTraceOp_t batch[ZONE_TRACE_BATCH];
+    zoneBenchOp_t *ops = NULL;
+    const char *ospath;
+    FILE *f;
+    long len;
+    int count, id = 0;
+
+    if ( !( ospath = Z_TraceOSPath( name ) ) ) {
+        return NULL;
+    }
+    f = Sys_FOpen( ospath, "rb" );
+    if ( !f ) {
+        Com_Printf( "couldn't open %s\n", ospath );
+        return NULL;
+    }
+
+    fseek( f, 0, SEEK_END );
+    len = ftell( f );
+    fseek( f, 0, SEEK_SET );
+
+    if ( fread( &id, sizeof( id ), 1, f ) != 1 || id != ZONE_TRACE_ID ) {
+        Com_Printf( "%s is not a zone trace\n", name );
+        fclose( f );
+        return NULL;
+    }
+
+    ops = (zoneBenchOp_t *)malloc( ( len / sizeof( zoneTraceOp_t ) + 1 ) * sizeof( *ops ) );
+    *numOps = *numSlots = 0;
+
+    while ( ( count = fread( batch, sizeof( zoneTraceOp_t ), ZONE_TRACE_BATCH, f ) ) > 0 ) {
+        for ( int i = 0; i < count; i++ ) {
+            zoneBenchOp_t *op = &ops[*numOps];
+            uint64_t key = ( (uint64_t)( batch[i].tag == TAG_SMALL ) << 32 ) | batch[i].offset;
+
+            if ( batch[i].tag <= 0 || batch[i].tag >= ZONE_TAGS ) {
+                continue;
+            }
+
+            op->size = batch[i].size;
+            op->tag = batch[i].tag;
+            if ( op->size >= 0 ) {
+                op->slot = live[key] = ( *numSlots )++;
+            } else {
+                auto it = live.find( key );
+                if ( it == live.end() ) {
+                    // allocated before the trace started
+                    continue;
+                }
+                op->slot = it->second;
+                live.erase( it );
+            }
+            ( *numOps )++;
+        }
+    }
+
+    fclose( f );
+    return ops;
+}
+
+/*
+========================
+Z_BenchSynthetic
+
+A steady churn of short strings in the small zone, like cvars and
+commands being set, next to general blocks from a few bytes to tens
+of kilobytes
+========================
+*/
+static zoneBenchOp_t *Z_BenchSynthetic( int count, int *numOps, int *numSlots )
+{
+    const int maxLive[2] = { 3000, 2000 };
+    zoneBenchOp_t *ops = (zoneBenchOp_t *)malloc( count * sizeof( *ops ) );
+    int *live[2], numLive[2] = { 0, 0 };
+
+    live[0] = (int *)malloc( maxLive[0] * sizeof( int ) );
+    live[1] = (int *)malloc( maxLive[1] * sizeof( int ) );
+    z_benchSeed = 0x1d4a11;
+    *numSlots = 0;
+
+    for ( int i = 0; i < count; i++ ) {
+        zoneBenchOp_t *op = &ops[i];
+        int general = Z_BenchRand( 5 ) == 0;
+        int n = numLive[general];
+        bool alloc;
+
+        if ( n < maxLive[general] / 2 ) {
+            alloc = Z_BenchRand( 4 ) != 0;
+        } else if ( n == maxLive[general] ) {
+            alloc = false;
+        } else {
+            alloc = Z_BenchRand( 2 ) != 0;
+        }
+
+        op->tag = general ? TAG_GENERAL : TAG_SMALL;
+        if ( alloc ) {
+            if ( !general ) {
+                op->size = 2 + Z_BenchRand( Z_BenchRand( 8 ) ? 24 : 96 );
+            } else {
+                int r = Z_BenchRand( 20 );
+                op->size = r < 14 ? 16 + Z_BenchRand( 240 ) : r < 19 ? 256 + Z_BenchRand( 3840 ) : 4096 + Z_BenchRand( 61440 );
+            }
+            op->slot = live[general][numLive[general]++] = ( *numSlots )++;
+        } else {
+            int j = Z_BenchRand( n );
+            op->size = -1;
+            op->slot = live[general][j];
+            live[general][j] = live[general][--numLive[general]];
+        }
+    }
+
+    free( live[0] );
+    free( live[1] );
+    *numOps = count;
+    return ops;
+}
+
+/*
+========================
+Z_Bench_f
+========================
+*/
+static void Z_Bench_f( void )
+{
+    const int runs = 5;
+    zoneBenchOp_t *ops;
+    memzone_t *zones[2];
+    void **slots;
+    int64_t best[2] = { 0, 0 };
+    int numOps, numSlots;
+    int failed = 0, peak = 0;
+
+    if ( Cmd_Argc() > 1 ) {
+        ops = Z_BenchLoad( Cmd_Argv( 1 ), &numOps, &numSlots );
+    } else {
+        ops = Z_BenchSynthetic( 1000000, &numOps, &numSlots );
+    }
+    if ( !ops ) {
+        return;
+    }
+    if ( !numOps ) {
+        Com_Printf( "zonebench: the trace is empty\n" );
+        free( ops );
+        return;
+    }
+
+    zones[0] = (memzone_t *)malloc( s_smallZoneTotal );
+    zones[1] = (memzone_t *)malloc( s_zoneTotal );
+    slots = (void **)calloc( numSlots + 1, sizeof( *slots ) );
+    if ( !zones[0] || !zones[1] || !slots ) {
+        Com_Printf( "zonebench: out of memory\n" );
+        free( zones[0] );
+        free( zones[1] );
+        free( slots );
+        free( ops );
+        return;
+    }
+
+    for ( int run = 0; run < runs; run++ ) {
+        int64_t start;
+
+        Z_ClearZone( zones[0], s_smallZoneTotal );
+        Z_ClearZone( zones[1], s_zoneTotal );
+        failed = 0;
+
+        start = Sys_Microseconds();
+        for ( int i = 0; i < numOps; i++ ) {
+            const zoneBenchOp_t *op = &ops[i];
+            memzone_t *zone = zones[op->tag != TAG_SMALL];
+
+            if ( op->size >= 0 ) {
+                int size = PAD( op->size + sizeof( memblock_t ) + 4, 1 << ZONE_ALIGN_SHIFT );
+                slots[op->slot] = Z_ZoneAlloc( zone, size, op->tag );
+                if ( !slots[op->slot] ) {
+                    failed++;
+                }
+                if ( zones[0]->used + zones[1]->used > peak ) {
+                    peak = zones[0]->used + zones[1]->used;
+                }
+            } else if ( slots[op->slot] ) {
+                Z_ZoneFree( zone, (memblock_t *)slots[op->slot] );
+            }
+        }
+        start = Sys_Microseconds() - start;
+        if ( !run || start < best[0] ) {
+            best[0] = start;
+        }
+
+        // the same thing through malloc
+        ::memset( slots, 0, numSlots * sizeof( *slots ) );
+        start = Sys_Microseconds();
+        for ( int i = 0; i < numOps; i++ ) {
+            const zoneBenchOp_t *op = &ops[i];
+
+            if ( op->size >= 0 ) {
+                slots[op->slot] = malloc( op->size );
+            } else {
+                free( slots[op->slot] );
+                slots[op->slot] = NULL;
+            }
+        }
+        start = Sys_Microseconds() - start;
+        if ( !run || start < best[1] ) {
+            best[1] = start;
+        }
+
+        for ( int i = 0; i < numSlots; i++ ) {
+            free( slots[i] );
+        }
+        ::memset( slots, 0, numSlots * sizeof( *slots ) );
+    }
+
+    Com_Printf( "%d operations on %d blocks%s, best of %d runs\n", numOps, numSlots,
+            Cmd_Argc() > 1 ? "" : " (synthetic)", runs );
+    Com_Printf( "zone:   %8.2f msec, %6.1f nsec per operation, %d KB at most in use, %d failed\n",
+            best[0] / 1000.0, best[0] * 1000.0 / MAX( numOps, 1 ), peak / 1024, failed );
+    Com_Printf( "malloc: %8.2f msec, %6.1f nsec per operation\n",
+            best[1] / 1000.0, best[1] * 1000.0 / MAX( numOps, 1 ) );
+
+    free( zones[0] );
+    free( zones[1] );
+    free( slots );
+    free( ops );
+}
+
 /*
 =================
 Hunk_Log
@@ -1616,6 +2141,8 @@ void Com_InitHunkMemory( void )
     Hunk_Clear();
 
     Cmd_AddCommand( "meminfo", Com_Meminfo_f );
+    Cmd_AddCommand( "zonetrace", Z_Trace_f );
+    Cmd_AddCommand( "zonebench", Z_Bench_f );
 #ifdef ZONE_DEBUG
     Cmd_AddCommand( "zonelog", Z_LogHeap );
 #endif
@@ -2036,6 +2563,31 @@ void Com_QueueEvent( int time, sysEventType_t type, int value, int value2, int p
     ev->evPtr = ptr;
 }
 
+/*
+================
+Com_QueueConsoleInput
+
+Queues a line of console input if there is one, also called by NET_PollSleep
+when the console shares its wait
+================
+*/
+bool Com_QueueConsoleInput( void )
+{
+    char  *s;
+    char  *b;
+    int   len;
+
+    s = Sys_ConsoleInput();
+    if ( !s )
+        return false;
+
+    len = strlen( s ) + 1;
+    b = (char*)Z_Malloc( len );
+    strcpy( b, s );
+    Com_QueueEvent( 0, SE_CONSOLE, 0, 0, len, b );
+    return true;
+}
+
 /*
 ================
 Com_GetSystemEvent
@@ -2045,7 +2597,6 @@ Com_GetSystemEvent
 sysEvent_t Com_GetSystemEvent( void )
 {
     sysEvent_t  ev;
-    char        *s;
 
     // return if we have data
     if ( eventHead > eventTail )
@@ -2055,17 +2606,7 @@ sysEvent_t Com_GetSystemEvent( void )
     }
 
     // check for console commands
-    s = Sys_ConsoleInput();
-    if ( s )
-    {
-        char  *b;
-        int   len;
-
-        len = strlen( s ) + 1;
-        b = (char*)Z_Malloc( len );
-        strcpy( b, s );
-        Com_QueueEvent( 0, SE_CONSOLE, 0, 0, len, b );
-    }
+    Com_QueueConsoleInput();
 
     // return if we have data
     if ( eventHead > eventTail )
@@ -2201,6 +2742,7 @@ Com_RunAndTimeServerPacket
 */
 void Com_RunAndTimeServerPacket( netadr_t *evFrom, msg_t *buf )
 {
+    PROF_SCOPE( prof, "packet" );
     int t1 = 0;
     if ( com_speeds->integer )
         t1 = Sys_Milliseconds();
@@ -2521,6 +3063,86 @@ static void Com_DetectSSE(void)
 
 #endif
 
+/*
+=================
+Frame start timing
+
+How late each frame started after the time it was waiting for, which is
+what decides how evenly sv_fps frames and snapshots go out
+=================
+*/
+
+#define FRAME_TIMING_BUCKETS 10
+
+static const int frameTimingLimits[ FRAME_TIMING_BUCKETS - 1 ] = {
+    25, 50, 100, 250, 500, 1000, 2000, 5000, 10000
+};
+
+static struct {
+    int     counts[ FRAME_TIMING_BUCKETS ];
+    int     frames;
+    int     max;
+    int64_t total;
+} frameTiming;
+
+static void Com_RecordFrameStart( int usec )
+{
+    int i;
+
+    if ( usec < 0 )
+        usec = 0;
+
+    for ( i = 0; i < FRAME_TIMING_BUCKETS - 1; i++ )
+    {
+        if ( usec < frameTimingLimits[ i ] )
+            break;
+    }
+
+    frameTiming.counts[ i ]++;
+    frameTiming.frames++;
+    frameTiming.total += usec;
+    if ( usec > frameTiming.max )
+        frameTiming.max = usec;
+}
+
+/*
+=================
+Com_FrameTiming_f
+
+usage: frametiming [reset]
+=================
+*/
+static void Com_FrameTiming_f( void )
+{
+    int i;
+
+    if ( Cmd_Argc() > 1 && !Q_stricmp( Cmd_Argv( 1 ), "reset" ) )
+    {
+        ::memset( &frameTiming, 0, sizeof( frameTiming ) );
+        return;
+    }
+
+    if ( !frameTiming.frames )
+    {
+        Com_Printf( "No frames timed yet\n" );
+        return;
+    }
+
+    Com_Printf( "frame start error over %i frames: mean %i usec, max %i usec\n",
+            frameTiming.frames, (int)( frameTiming.total / frameTiming.frames ), frameTiming.max );
+
+    for ( i = 0; i < FRAME_TIMING_BUCKETS; i++ )
+    {
+        if ( i < FRAME_TIMING_BUCKETS - 1 )
+            Com_Printf( "  <  %5i usec: ", frameTimingLimits[ i ] );
+        else
+            Com_Printf( "  >= %5i usec: ", frameTimingLimits[ i - 1 ] );
+
+        Com_Printf( "%8i %5.1f%%\n", frameTiming.counts[ i ],
+                frameTiming.counts[ i ] * 100.0f / frameTiming.frames );
+    }
+}
+
 /*
 =================
 Com_InitRand
@@ -2598,6 +3220,8 @@ void Com_Init( char *commandLine )
     }
     Cmd_AddCommand ("quit", Com_Quit_f);
     Cmd_AddCommand ("changeVectors", MSG_ReportChangeVectors_f );
+    Cmd_AddCommand ("huffbench", MSG_HuffmanBench_f );
+    Cmd_AddCommand ("frametiming", Com_FrameTiming_f );
     Cmd_AddCommand ("writeconfig", Com_WriteConfig_f );
     Cmd_SetCommandCompletionFunc( "writeconfig", Cmd_CompleteCfgName );
     Cmd_AddCommand("game_restart", Com_GameRestart_f);
@@ -2915,6 +3539,8 @@ void Com_Frame( void )
 
     int msec, minMsec;
     int timeVal, timeValSV;
+    int64_t frameDeadline, waitUsec;
+    bool consoleWoke;
     static int lastTime = 0, bias = 0;
 
     int timeBeforeFirstEvents;
@@ -2975,25 +3601,33 @@ void Com_Frame( void )
         minMsec = 1;
     }
 
+    // Com_TimeVal reaches 0 on the first microsecond of this millisecond
+    frameDeadline = (int64_t)( com_frameTime + minMsec ) * 1000;
+    consoleWoke = false;
+
     do {
+        waitUsec = frameDeadline - Sys_Microseconds();
+
         if ( com_sv_running->integer )
         {
             timeValSV = SV_SendQueuedPackets();
-            timeVal = Com_TimeVal(minMsec);
 
-            if ( timeValSV < timeVal )
-                timeVal = timeValSV;
-        }
-        else
-        {
-            timeVal = Com_TimeVal(minMsec);
+            if ( (int64_t)timeValSV * 1000 < waitUsec )
+                waitUsec = (int64_t)timeValSV * 1000;
         }
 
-        if ( com_busyWait->integer || timeVal < 1 )
+        if ( com_busyWait->integer || waitUsec < 1 )
             NET_Sleep(0);
-        else
-            NET_Sleep(timeVal - 1);
-    } while( Com_TimeVal(minMsec) );
+        else if ( NET_SleepUsec(waitUsec) )
+            consoleWoke = true;  // run the command now rather than at the next frame
+    } while( !consoleWoke && Com_TimeVal(minMsec) );
+
+    // the last frame's paced snapshots are all due by now
+    if ( com_sv_running->integer )
+        SV_FlushSnapshots();
+
+    if ( !consoleWoke )
+        Com_RecordFrameStart( Sys_Microseconds() - frameDeadline );
 
     IN_Frame();
 
@@ -3020,6 +3654,7 @@ void Com_Frame( void )
         timeBeforeServer = Sys_Milliseconds();
 
     SV_Frame(msec);
+    Prof_EndFrame();
 
     // if "dedicated" has been modified, start up
     // or shut down the client system.
@@ -3095,8 +3730,8 @@ void Com_Frame( void )
     //
     if ( com_showtrace->integer )
     {
-        extern int c_traces, c_brush_traces, c_patch_traces;
-        extern int c_pointcontents;
+        extern thread_local int c_traces, c_brush_traces, c_patch_traces;
+        extern thread_local int c_pointcontents;
 
         Com_Printf("%4i traces  (%ib %ip) %4i points\n",
                 c_traces, c_brush_traces, c_patch_traces, c_pointcontents);
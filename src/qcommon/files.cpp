@@ -29,7 +29,14 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "cmd.h"
 #include "cvar.h"
@@ -45,11 +52,20 @@
 #include "client/cl_rest.h"
 #endif
 
+#include <sys/stat.h>
+
 #ifdef WIN32
 #include <windows.h>
 #include <io.h>	// for _read
 #endif
 
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define FS_INDEX_WATCH
+#endif
+
 using namespace std;
 
 #define MAX_ZPATH 256
@@ -58,6 +74,7 @@ using namespace std;
 
 static bool FS_IsDemoExt(const char *filename);
 static bool FS_IsExt(const char *filename, const char *ext, int namelen);
+static long FS_PrefetchTake(const char *qpath, void **buffer);
 
 struct fileInPack_t {
     char* name;
@@ -83,6 +100,10 @@ struct pack_t {
     bool onlyPrimary;
     bool onlyAlternate;
     pack_t *primaryVersion;
+    // the whole pk3 mapped read-only, once FS_ReadFileView wants it
+    byte *mapBase;
+    size_t mapLength;
+    bool mapFailed;
 
     // member functions
     inline fileInPack_t* find(string filename);
@@ -99,10 +120,14 @@ struct searchpath_t {
     pack_t *pack;  // only one of pack / dir will be non nullptr
     directory_t *dir;
     searchpath_t *next;
+
+    int indexOrder;  // position in fs_searchpaths when the lookup index was built
+    bool indexed;  // false for a directory the index can't see into
 };
 
 static char fs_gamedir[MAX_OSPATH];  // this will be a single file name with no separators
 static cvar_t *fs_debug;
+static cvar_t *fs_mapPaks;
 static cvar_t *fs_homepath;
 
 static cvar_t *fs_basepath;
@@ -118,8 +143,28 @@ static int fs_loadCount;  // total files read
 static int fs_loadStack;  // total files in memory
 static int fs_packFiles = 0;  // total number of files in packs
 
+// FS_ReadFileView, for fs_stats
+static struct {
+    unsigned long mapped;  // stored entries returned without a copy
+    unsigned long inflated;  // deflated entries inflated from the mapping
+    unsigned long read;  // everything else
+    unsigned long long bytesMapped;
+} fs_viewStats;
+
+// FS_Prefetch, for fs_stats
+static struct {
+    unsigned long queued;
+    unsigned long kept;
+    unsigned long used;
+    unsigned long missed;  // queued but found in no source
+    unsigned long refused;  // over fs_prefetchMegs
+    unsigned long long bytes;
+} fs_prefetchStats;
+
 static int fs_checksumFeed;
 
+static bool fs_indexPoll;  // we created or renamed a file, see FS_IndexPoll
+
 union qfile_gut {
     FILE *o;
     unzFile z;
@@ -137,6 +182,7 @@ struct fileHandleData_t {
     int zipFilePos;
     int zipFileLen;
     bool zipFile;
+    pack_t *pack;  // when zipFile
     char name[MAX_ZPATH];
 
     void close();
@@ -579,6 +625,7 @@ fileHandle_t FS_SV_FOpenFileWrite(const char *filename)
 
     Com_DPrintf("writing to: %s\n", ospath);
     fsh[f].handleFiles.file.o = Sys_FOpen(ospath, "wb");
+    fs_indexPoll = true;
 
     Q_strncpyz(fsh[f].name, filename, sizeof(fsh[f].name));
 
@@ -683,6 +730,7 @@ void FS_SV_Rename(const char *from, const char *to, bool safe)
     }
 
     rename(from_ospath, to_ospath);
+    fs_indexPoll = true;
 }
 
 /*
@@ -709,6 +757,7 @@ void FS_Rename(const char *from, const char *to)
     FS_CheckFilenameIsMutable(to_ospath, __FUNCTION__);
 
     rename(from_ospath, to_ospath);
+    fs_indexPoll = true;
 }
 
 /*
@@ -781,6 +830,7 @@ fileHandle_t FS_FOpenFileWrite(const char *filename)
     // when running with +set logfile 1 +set developer 1
     // Com_DPrintf( "writing to: %s\n", ospath );
     fsh[f].handleFiles.file.o = Sys_FOpen(ospath, "wb");
+    fs_indexPoll = true;
 
     Q_strncpyz(fsh[f].name, filename, sizeof(fsh[f].name));
 
@@ -828,6 +878,7 @@ fileHandle_t FS_FOpenFileAppend(const char *filename)
     }
 
     fsh[f].handleFiles.file.o = Sys_FOpen(ospath, "ab");
+    fs_indexPoll = true;
     fsh[f].handleSync = false;
     if (!fsh[f].handleFiles.file.o)
     {
@@ -864,6 +915,7 @@ fileHandle_t FS_FCreateOpenPipeFile(const char *filename)
     FS_CheckFilenameIsMutable(ospath, __FUNCTION__);
 
     FILE *fifo = Sys_Mkfifo(ospath);
+    fs_indexPoll = true;
     if (fifo)
     {
         fsh[f].handleFiles.file.o = fifo;
@@ -965,6 +1017,59 @@ static bool FS_IsDemoExt(const char *filename)
     return false;
 }
 
+/*
+===========
+FS_ReferencePakFile
+
+Marks pak as used for filename, which decides what pure clients
+are told to download
+===========
+*/
+static void FS_ReferencePakFile(pack_t *pak, const char *filename)
+{
+    int len = strlen(filename);
+
+    if (!(pak->referenced & FS_GENERAL_REF))
+    {
+        if ( !FS_IsExt(filename, ".shader", len)
+                && !FS_IsExt(filename, ".mtr", len)
+                && !FS_IsExt(filename, ".txt", len)
+                && !FS_IsExt(filename, ".cfg", len)
+                && !FS_IsExt(filename, ".config", len)
+                && !FS_IsExt(filename, ".arena", len)
+                && !FS_IsExt(filename, ".menu", len)
+                && !strstr(filename, "levelshots") )
+        {
+            pak->referenced |= FS_GENERAL_REF;
+        }
+    }
+
+    if (strstr(filename, "cgame.qvm"))
+        pak->referenced |= FS_CGAME_REF;
+
+    if (strstr(filename, "ui.qvm"))
+        pak->referenced |= FS_UI_REF;
+}
+
+/*
+===========
+FS_PureAllowsDir
+
+On a pure server only a few kinds of file may come from outside a pk3
+===========
+*/
+static bool FS_PureAllowsDir(const char *filename, int len)
+{
+    if (!fs_numServerPaks) return true;
+
+    return FS_IsExt(filename, ".cfg", len) ||  // for config files
+           FS_IsExt(filename, ".lua", len) ||  // lua
+           FS_IsExt(filename, ".menu", len) ||  // menu files
+           FS_IsExt(filename, ".game", len) ||  // menu files
+           FS_IsExt(filename, ".dat", len) ||  // for journal files
+           FS_IsDemoExt(filename);  // demos
+}
+
 /*
 ===========
 FS_FOpenFileReadDir
@@ -1072,28 +1177,7 @@ long FS_FOpenFileReadDir(
                 return -1;
             }
 
-            len = strlen(filename);
-
-            if (!(pak->referenced & FS_GENERAL_REF))
-            {
-                if ( !FS_IsExt(filename, ".shader", len)
-                        && !FS_IsExt(filename, ".mtr", len)
-                        && !FS_IsExt(filename, ".txt", len)
-                        && !FS_IsExt(filename, ".cfg", len)
-                        && !FS_IsExt(filename, ".config", len)
-                        && !FS_IsExt(filename, ".arena", len)
-                        && !FS_IsExt(filename, ".menu", len)
-                        && !strstr(filename, "levelshots") )
-                {
-                    pak->referenced |= FS_GENERAL_REF;
-                }
-            }
-
-            if (strstr(filename, "cgame.qvm"))
-                pak->referenced |= FS_CGAME_REF;
-
-            if (strstr(filename, "ui.qvm"))
-                pak->referenced |= FS_UI_REF;
+            FS_ReferencePakFile(pak, filename);
 
             if (uniqueFILE)
             {
@@ -1108,6 +1192,7 @@ long FS_FOpenFileReadDir(
 
             Q_strncpyz(fsh[*file].name, filename, sizeof(fsh[*file].name));
             fsh[*file].zipFile = true;
+            fsh[*file].pack = pak;
 
             // set the file position in the zip file (also sets the current file info)
             unzSetOffset(fsh[*file].handleFiles.file.z, pakfile->pos);
@@ -1138,18 +1223,10 @@ long FS_FOpenFileReadDir(
         //   this test can make the search fail although the file is in the directory
         // I had the problem on https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=8
         // turned out I used FS_FileExists instead
-        if (!unpure && fs_numServerPaks)
-        {
-            if (!FS_IsExt(filename, ".cfg", len) &&  // for config files
-                !FS_IsExt(filename, ".lua", len) &&  // lua 
-                !FS_IsExt(filename, ".menu", len) &&  // menu files
-                !FS_IsExt(filename, ".game", len) &&  // menu files
-                !FS_IsExt(filename, ".dat", len) &&  // for journal files
-                !FS_IsDemoExt(filename))  // demos
-            {
-                *file = 0;
-                return -1;
-            }
+        if (!unpure && !FS_PureAllowsDir(filename, len))
+        {
+            *file = 0;
+            return -1;
         }
 
         dir = search->dir;
@@ -1180,6 +1257,425 @@ long FS_FOpenFileReadDir(
     return -1;
 }
 
+/*
+======================================================================================
+
+LOOKUP INDEX
+
+One hash map from normalized qpath to every search path that may hold
+it, in search order, so FS_FOpenFileRead only tries those instead of
+probing every pk3 and opening the file in every directory.  A candidate
+still goes through FS_FOpenFileReadDir, which applies purity, reference
+flags and the pure server directory rules as before, so the index may
+list too much but never too little.
+
+Directories are scanned and then watched for new files where inotify
+is available; anywhere else, or if the watch fails, they are tried on
+every lookup just like before.
+
+======================================================================================
+*/
+
+struct fsIndexWatch_t {
+    searchpath_t *search;
+    string prefix;  // relative to the search path, empty or ending in a slash
+};
+
+static cvar_t *fs_index;
+static bool fs_indexValid;
+static unordered_map<string, vector<searchpath_t *>> fs_indexMap;
+static vector<searchpath_t *> fs_indexAlways;  // unindexed directories
+static vector<int> fs_indexPacksBefore;  // by indexOrder, for the stats
+static vector<int> fs_indexDirsBefore;
+static string fs_indexKey;
+static vector<searchpath_t *> fs_indexCandidates;
+
+static struct {
+    unsigned long lookups;
+    unsigned long misses;  // answered by the index alone
+    unsigned long packProbes;  // pk3 hash lookups made
+    unsigned long packProbesSaved;  // ... and the ones a full walk would have added
+    unsigned long dirOpens;
+    unsigned long dirOpensSaved;
+    unsigned long events;
+    int builds;
+    int buildMsec;
+} fs_indexStats;
+
+#ifdef FS_INDEX_WATCH
+#define FS_INDEX_MAX_DEPTH 16
+#define FS_INDEX_POLL_MSEC 100
+
+static int fs_indexNotify = -1;
+static unordered_map<int, vector<fsIndexWatch_t>> fs_indexWatches;
+static int fs_indexLastPoll;
+#endif
+
+/*
+================
+FS_IndexKey
+
+Folds a qpath the way FS_FilenameCompare compares it
+================
+*/
+static void FS_IndexKey(const char *filename, string &key)
+{
+    if (filename[0] == '/' || filename[0] == '\\') filename++;
+
+    key.clear();
+    for (const char *c = filename; *c; c++)
+    {
+        if (*c >= 'A' && *c <= 'Z')
+            key += *c + ('a' - 'A');
+        else if (*c == '\\' || *c == ':')
+            key += '/';
+        else
+            key += *c;
+    }
+}
+
+/*
+================
+FS_IndexAdd
+================
+*/
+static void FS_IndexAdd(const char *filename, searchpath_t *search)
+{
+    FS_IndexKey(filename, fs_indexKey);
+    auto &paths = fs_indexMap[fs_indexKey];
+
+    // keep search order, directories can be reported more than once
+    auto it = paths.begin();
+    for (; it != paths.end() && (*it)->indexOrder <= search->indexOrder; ++it)
+    {
+        if (*it == search) return;
+    }
+    paths.insert(it, search);
+}
+
+#ifdef FS_INDEX_WATCH
+/*
+================
+FS_IndexScanDir
+
+Watches one directory of a search path and indexes everything below
+it.  The watch goes first so a file created during the scan is not
+lost between the two
+================
+*/
+static bool FS_IndexScanDir(searchpath_t *search, const string &prefix, int depth)
+{
+    if (depth > FS_INDEX_MAX_DEPTH) return true;
+
+    string ospath = string(search->dir->fullpath) + PATH_SEP + prefix;
+
+    int wd = inotify_add_watch(fs_indexNotify, ospath.c_str(),
+        IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) return false;
+
+    fs_indexWatches[wd].push_back({search, prefix});
+
+    DIR *d = opendir(ospath.c_str());
+    if (!d) return true;  // gone already, the watch will say so
+
+    bool ok = true;
+    while (struct dirent *de = readdir(d))
+    {
+        if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
+            continue;
+
+        string name = prefix + de->d_name;
+        bool isDir = de->d_type == DT_DIR;
+
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+        {
+            struct stat st;
+            isDir = !stat((ospath + de->d_name).c_str(), &st) && S_ISDIR(st.st_mode);
+        }
+
+        if (isDir)
+            ok = FS_IndexScanDir(search, name + '/', depth + 1) && ok;
+        else
+            FS_IndexAdd(name.c_str(), search);
+    }
+    closedir(d);
+
+    return ok;
+}
+#endif
+
+/*
+================
+FS_IndexClear
+================
+*/
+static void FS_IndexClear(void)
+{
+    fs_indexMap.clear();
+    fs_indexAlways.clear();
+    fs_indexValid = false;
+
+#ifdef FS_INDEX_WATCH
+    fs_indexWatches.clear();
+    if (fs_indexNotify >= 0)
+    {
+        close(fs_indexNotify);
+        fs_indexNotify = -1;
+    }
+#endif
+}
+
+/*
+================
+FS_IndexBuild
+================
+*/
+static void FS_IndexBuild(void)
+{
+    int start = Sys_Milliseconds();
+    int order = 0;
+    int packs = 0;
+    int dirs = 0;
+
+    FS_IndexClear();
+    fs_indexMap.reserve(fs_packFiles);
+    fs_indexPacksBefore.clear();
+    fs_indexDirsBefore.clear();
+
+#ifdef FS_INDEX_WATCH
+    fs_indexNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    fs_indexLastPoll = start;
+#endif
+
+    for (auto search = fs_searchpaths; search; search = search->next)
+    {
+        search->indexOrder = order++;
+        search->indexed = false;
+        fs_indexPacksBefore.push_back(packs);
+        fs_indexDirsBefore.push_back(dirs);
+
+        if (search->pack)
+        {
+            pack_t *pak = search->pack;
+
+            for (int i = 0; i < pak->numfiles && pak->buildBuffer[i].name; i++)
+                FS_IndexAdd(pak->buildBuffer[i].name, search);
+
+            search->indexed = true;
+            packs++;
+        }
+        else if (search->dir)
+        {
+#ifdef FS_INDEX_WATCH
+            if (fs_indexNotify >= 0)
+                search->indexed = FS_IndexScanDir(search, "", 0);
+#endif
+            if (!search->indexed)
+                fs_indexAlways.push_back(search);
+            dirs++;
+        }
+    }
+    fs_indexPacksBefore.push_back(packs);
+    fs_indexDirsBefore.push_back(dirs);
+
+    fs_indexValid = true;
+    fs_indexPoll = false;
+    fs_indexStats.builds++;
+    fs_indexStats.buildMsec = Sys_Milliseconds() - start;
+}
+
+/*
+================
+FS_IndexPoll
+
+Picks up files created in watched directories since the last call.
+Files we create ourselves set fs_indexPoll so they can be read back
+at once; anything else is seen within FS_INDEX_POLL_MSEC.  Removed
+files are left in, they only cost the open a full walk would make
+================
+*/
+static void FS_IndexPoll(void)
+{
+#ifdef FS_INDEX_WATCH
+    int now = Sys_Milliseconds();
+
+    if (fs_indexNotify < 0) return;
+    if (!fs_indexPoll && now - fs_indexLastPoll < FS_INDEX_POLL_MSEC) return;
+
+    fs_indexPoll = false;
+    fs_indexLastPoll = now;
+
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+
+    while ((len = read(fs_indexNotify, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + len;)
+        {
+            auto ev = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(*ev) + ev->len;
+
+            fs_indexStats.events++;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                // lost track, start over on the next lookup
+                fs_indexValid = false;
+                return;
+            }
+
+            auto it = fs_indexWatches.find(ev->wd);
+            if (it == fs_indexWatches.end() || !ev->len) continue;
+
+            // copy, a new directory adds to the table
+            auto watches = it->second;
+            for (auto &w : watches)
+            {
+                string name = w.prefix + ev->name;
+
+                if (ev->mask & IN_ISDIR)
+                {
+                    if (!FS_IndexScanDir(w.search, name + '/', 0) && w.search->indexed)
+                    {
+                        w.search->indexed = false;
+                        fs_indexValid = false;
+                    }
+                }
+                else
+                {
+                    FS_IndexAdd(name.c_str(), w.search);
+                }
+            }
+        }
+    }
+#endif
+}
+
+/*
+================
+FS_IndexFind
+
+Collects the search paths that may hold filename, in search order, into
+fs_indexCandidates.  Returns false if the index is off and every search
+path has to be walked
+================
+*/
+static bool FS_IndexFind(const char *filename)
+{
+    if (fs_index->modified)
+    {
+        fs_index->modified = false;
+        FS_IndexClear();
+    }
+
+    if (!fs_index->integer) return false;
+
+    FS_IndexPoll();
+    if (!fs_indexValid) FS_IndexBuild();
+
+    fs_indexCandidates.clear();
+    fs_indexStats.lookups++;
+
+    FS_IndexKey(filename, fs_indexKey);
+    auto it = fs_indexMap.find(fs_indexKey);
+
+    if (it == fs_indexMap.end())
+    {
+        fs_indexCandidates = fs_indexAlways;
+        return true;
+    }
+
+    // merge in the directories that are always tried
+    auto &paths = it->second;
+    auto a = fs_indexAlways.begin();
+    for (auto p : paths)
+    {
+        while (a != fs_indexAlways.end() && (*a)->indexOrder < p->indexOrder)
+            fs_indexCandidates.push_back(*a++);
+        fs_indexCandidates.push_back(p);
+    }
+    fs_indexCandidates.insert(fs_indexCandidates.end(), a, fs_indexAlways.end());
+
+    return true;
+}
+
+/*
+================
+FS_IndexCount
+
+Books one lookup against what walking every search path up to found,
+or all of them, would have cost
+================
+*/
+static void FS_IndexCount(searchpath_t *found, int packs, int dirs, bool skipPacks)
+{
+    int end = found ? found->indexOrder + 1 : fs_indexPacksBefore.size() - 1;
+
+    if (!found && !packs && !dirs) fs_indexStats.misses++;
+
+    if (!skipPacks)
+    {
+        fs_indexStats.packProbes += packs;
+        fs_indexStats.packProbesSaved += fs_indexPacksBefore[end] - packs;
+    }
+    fs_indexStats.dirOpens += dirs;
+    fs_indexStats.dirOpensSaved += fs_indexDirsBefore[end] - dirs;
+}
+
+/*
+================
+FS_Stats_f
+================
+*/
+static void FS_Stats_f(void)
+{
+    Com_Printf("file views: %lu mapped (%llu bytes not copied), %lu inflated from the mapping, %lu read\n",
+        fs_viewStats.mapped, fs_viewStats.bytesMapped, fs_viewStats.inflated, fs_viewStats.read);
+    Com_Printf("prefetch: %lu queued (%lu kept), %lu used (%llu bytes), %lu missed, %lu refused\n",
+        fs_prefetchStats.queued, fs_prefetchStats.kept, fs_prefetchStats.used, fs_prefetchStats.bytes,
+        fs_prefetchStats.missed, fs_prefetchStats.refused);
+
+    if (!fs_index->integer)
+    {
+        Com_Printf("fs_index is off, every lookup walks all search paths\n");
+        return;
+    }
+
+    if (!fs_indexValid) FS_IndexBuild();
+
+    int indexedDirs = 0;
+    int dirs = 0;
+    for (auto search = fs_searchpaths; search; search = search->next)
+    {
+        if (!search->dir) continue;
+        dirs++;
+        if (search->indexed) indexedDirs++;
+    }
+
+    Com_Printf("%zu names, %d/%d directories indexed, built %d times (last %d msec)\n",
+        fs_indexMap.size(), indexedDirs, dirs, fs_indexStats.builds, fs_indexStats.buildMsec);
+#ifdef FS_INDEX_WATCH
+    Com_Printf("%zu directories watched, %lu change events\n",
+        fs_indexWatches.size(), fs_indexStats.events);
+#endif
+    Com_Printf("%lu lookups, %lu answered without touching a search path\n",
+        fs_indexStats.lookups, fs_indexStats.misses);
+    Com_Printf("pk3 probes:      %lu made, %lu saved\n",
+        fs_indexStats.packProbes, fs_indexStats.packProbesSaved);
+    Com_Printf("directory opens: %lu made, %lu saved\n",
+        fs_indexStats.dirOpens, fs_indexStats.dirOpensSaved);
+
+    if (!strcmp(Cmd_Argv(1), "reset"))
+    {
+        int builds = fs_indexStats.builds;
+        int buildMsec = fs_indexStats.buildMsec;
+
+        Com_Memset(&fs_indexStats, 0, sizeof(fs_indexStats));
+        fs_indexStats.builds = builds;
+        fs_indexStats.buildMsec = buildMsec;
+    }
+}
+
 /*
 ===========
 FS_FOpenFileRead
@@ -1198,20 +1694,46 @@ long FS_FOpenFileRead(const char *filename, fileHandle_t *file, bool uniqueFILE)
     if (!fs_searchpaths) Com_Error(ERR_FATAL, "Filesystem call made without initialization");
 
     bool isLocalConfig = !strcmp(filename, "autoexec.cfg") || !strcmp(filename, Q3CONFIG_CFG);
-    for (search = fs_searchpaths; search; search = search->next)
+    auto found = [&](searchpath_t *search)
     {
-        // autoexec.cfg and q3config.cfg can only be loaded outside of pk3 files.
-        if (isLocalConfig && search->pack) continue;
-
         len = FS_FOpenFileReadDir(filename, search, file, uniqueFILE, false);
 
         if (file == nullptr)
+            return len > 0;
+
+        return len >= 0 && *file;
+    };
+
+    if (FS_IndexFind(filename))
+    {
+        int packs = 0;
+        int dirs = 0;
+        for (auto candidate : fs_indexCandidates)
         {
-            if (len > 0) return len;
+            // autoexec.cfg and q3config.cfg can only be loaded outside of pk3 files.
+            if (isLocalConfig && candidate->pack) continue;
+
+            if (candidate->pack)
+                packs++;
+            else
+                dirs++;
+
+            if (found(candidate))
+            {
+                FS_IndexCount(candidate, packs, dirs, isLocalConfig);
+                return len;
+            }
         }
-        else
+        FS_IndexCount(nullptr, packs, dirs, isLocalConfig);
+    }
+    else
+    {
+        for (search = fs_searchpaths; search; search = search->next)
         {
-            if (len >= 0 && *file) return len;
+            // autoexec.cfg and q3config.cfg can only be loaded outside of pk3 files.
+            if (isLocalConfig && search->pack) continue;
+
+            if (found(search)) return len;
         }
     }
 
@@ -1591,33 +2113,43 @@ int FS_FileIsInPAK_A(bool alternate, const char *filename, int *pChecksum)
     if (strstr(filename, "..") || strstr(filename, "::"))
         return -1;
 
-    //
-    // search through the path, one element at a time
-    //
-    for (auto search = fs_searchpaths; search; search = search->next)
+    auto found = [&](searchpath_t *search)
     {
         if (!search->pack)
-            continue;
+            return false;
 
         // disregard if it doesn't match one of the allowed pure pak files
         if (!search->pack->is_pure())
-            continue;
+            return false;
 
         if ((alternate && search->pack->onlyPrimary) ||
             (!alternate && search->pack->onlyAlternate))
-            continue;
+            return false;
 
-        auto found = search->pack->find(filename);
-        if (found)
-        {
-            if (pChecksum)
-                *pChecksum = search->pack->pure_checksum;
+        if (!search->pack->find(filename))
+            return false;
 
-            return 1;
-        }
-    }
-    return -1;
-}
+        if (pChecksum)
+            *pChecksum = search->pack->pure_checksum;
+
+        return true;
+    };
+
+    //
+    // search through the path, one element at a time
+    //
+    if (FS_IndexFind(filename))
+    {
+        for (auto search : fs_indexCandidates)
+            if (found(search)) return 1;
+    }
+    else
+    {
+        for (auto search = fs_searchpaths; search; search = search->next)
+            if (found(search)) return 1;
+    }
+    return -1;
+}
 
 int FS_FileIsInPAK(const char *filename, int *pChecksum)
 {
@@ -1707,6 +2239,13 @@ long FS_ReadFileDir(const char *qpath, void *searchPath, bool unpure, void **buf
     }
 
     searchpath_t *search = static_cast<searchpath_t *>(searchPath);
+    if (search == nullptr && buffer)
+    {
+        // already read by FS_Prefetch
+        len = FS_PrefetchTake(qpath, buffer);
+        if (len >= 0) return len;
+    }
+
     if (search == nullptr)
     {
         // look for it in the filesystem or pack files
@@ -1808,6 +2347,625 @@ void FS_FreeFile(void *buffer)
     }
 }
 
+/*
+======================================================================================
+
+MAPPED PK3 READS
+
+FS_ReadFileView maps a pk3 the first time one of its files is asked
+for.  A stored entry is then handed out as a pointer into the mapping
+and a deflated one is inflated straight from it into the destination,
+so neither goes through minizip's FILE* buffering.  Anything else, or a
+pk3 that can't be mapped, is read like FS_ReadFile does.
+
+======================================================================================
+*/
+
+#define ZIP_CENTRAL_SIG 0x02014b50
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_LOCAL_SIG 0x04034b50
+#define ZIP_LOCAL_SIZE 30
+
+static unsigned FS_ZipShort(const byte *p) { return p[0] | (p[1] << 8); }
+static unsigned FS_ZipLong(const byte *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24); }
+
+/*
+=================
+FS_PakEntryData
+
+Finds the data of the entry whose central directory record is at pos.
+Returns nullptr for anything unusual (zip64, encryption, a prefixed
+archive) so the caller falls back to minizip
+=================
+*/
+static const byte *FS_PakEntryData(pack_t *pak, unsigned long pos, unsigned long len,
+    int *method, unsigned long *compressedLen)
+{
+    if (!pak->mapBase && !pak->mapFailed)
+    {
+        pak->mapBase = static_cast<byte *>(Sys_MapFile(pak->pakFilename, &pak->mapLength));
+        pak->mapFailed = !pak->mapBase;
+    }
+    if (!pak->mapBase) return nullptr;
+
+    const byte *base = pak->mapBase;
+    size_t length = pak->mapLength;
+
+    if (pos > length || length - pos < ZIP_CENTRAL_SIZE) return nullptr;
+
+    const byte *central = base + pos;
+    if (FS_ZipLong(central) != ZIP_CENTRAL_SIG) return nullptr;
+    if (FS_ZipShort(central + 8) & 1) return nullptr;  // encrypted
+    if (FS_ZipLong(central + 24) != len) return nullptr;
+
+    *method = FS_ZipShort(central + 10);
+    *compressedLen = FS_ZipLong(central + 20);
+    size_t local = FS_ZipLong(central + 42);
+
+    if (local > length || length - local < ZIP_LOCAL_SIZE) return nullptr;
+    if (FS_ZipLong(base + local) != ZIP_LOCAL_SIG) return nullptr;
+
+    size_t data = local + ZIP_LOCAL_SIZE + FS_ZipShort(base + local + 26) + FS_ZipShort(base + local + 28);
+    if (data > length || length - data < *compressedLen) return nullptr;
+
+    return base + data;
+}
+
+/*
+=================
+FS_InflateView
+=================
+*/
+static bool FS_InflateView(const byte *data, unsigned long compressedLen, byte *dest, unsigned long len)
+{
+    z_stream zs;
+
+    Com_Memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return false;
+
+    zs.next_in = const_cast<Bytef *>(data);
+    zs.avail_in = compressedLen;
+    zs.next_out = dest;
+    zs.avail_out = len;
+
+    int err = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    return err == Z_STREAM_END && zs.total_out == len;
+}
+
+/*
+=================
+FS_ReadFileView
+=================
+*/
+long FS_ReadFileView(const char *qpath, const void **buffer)
+{
+    fileHandle_t h;
+
+    if (!fs_searchpaths) Com_Error(ERR_FATAL, "Filesystem call made without initialization");
+
+    if (!qpath || !qpath[0]) Com_Error(ERR_FATAL, "FS_ReadFileView with empty name");
+
+    // configs may have to go through the journal
+    if (!fs_mapPaks->integer || strstr(qpath, ".cfg"))
+    {
+        void *buf;
+        long len = FS_ReadFile(qpath, &buf);
+
+        *buffer = buf;
+        return len;
+    }
+
+    void *kept;
+    long len = FS_PrefetchTake(qpath, &kept);
+    if (len >= 0)
+    {
+        *buffer = kept;
+        return len;
+    }
+
+    len = FS_FOpenFileRead(qpath, &h, false);
+    if (!h)
+    {
+        *buffer = nullptr;
+        return -1;
+    }
+
+    int method = -1;
+    unsigned long compressedLen = 0;
+    const byte *data = nullptr;
+
+    if (fsh[h].zipFile)
+        data = FS_PakEntryData(fsh[h].pack, fsh[h].zipFilePos, len, &method, &compressedLen);
+
+    fs_loadCount++;
+    fs_loadStack++;
+
+#if !id386 && !idx64
+    // the rest of the engine casts file buffers to int *
+    if (method == 0 && ((uintptr_t)data & 3)) method = -1;
+#endif
+
+    if (data && method == 0 && compressedLen == (unsigned long)len)
+    {
+        FS_FCloseFile(h);
+
+        fs_viewStats.mapped++;
+        fs_viewStats.bytesMapped += len;
+        *buffer = data;
+        return len;
+    }
+
+    byte *buf = static_cast<byte *>(Hunk_AllocateTempMemory(len + 1));
+
+    if (data && method == Z_DEFLATED && FS_InflateView(data, compressedLen, buf, len))
+        fs_viewStats.inflated++;
+    else
+    {
+        FS_Read(buf, len, h);
+        fs_viewStats.read++;
+    }
+
+    // guarantee that it will have a trailing 0 for string operations
+    buf[len] = 0;
+    FS_FCloseFile(h);
+
+    *buffer = buf;
+    return len;
+}
+
+/*
+=================
+FS_FreeFileView
+=================
+*/
+void FS_FreeFileView(const void *buffer)
+{
+    if (!fs_searchpaths) Com_Error(ERR_FATAL, "Filesystem call made without initialization");
+
+    if (!buffer) Com_Error(ERR_FATAL, "FS_FreeFileView( nullptr )");
+
+    auto p = static_cast<const byte *>(buffer);
+    for (auto search = fs_searchpaths; search; search = search->next)
+    {
+        pack_t *pak = search->pack;
+
+        if (pak && pak->mapBase && p >= pak->mapBase && p < pak->mapBase + pak->mapLength)
+        {
+            // the mapping stays until the pk3 is closed
+            if (--fs_loadStack == 0) Hunk_ClearTempMemory();
+            return;
+        }
+    }
+
+    FS_FreeFile(const_cast<void *>(buffer));
+}
+
+/*
+======================================================================================
+
+PREFETCH
+
+A loader that knows what it is about to read hands the names to
+FS_Prefetch and a few worker threads read (and inflate) them in the
+background.  The lookup happens right away on the calling thread, so
+purity and search order are exactly those of FS_FOpenFileRead.  The
+workers only ever see OS paths and pk3 mappings.  A kept file is
+picked up by the next FS_ReadFile or FS_ReadFileView of it.  Anything
+else only warms the OS cache for loaders that stream from a handle.
+
+======================================================================================
+*/
+
+#define MAX_PREFETCH_THREADS 8
+#define PREFETCH_CHUNK 65536
+
+struct fsPrefetch_t {
+    string name;
+    int handle;
+    bool keep;
+
+    // sources in search order: directories that may have it, then
+    // at most one pk3 entry that does
+    vector<string> osPaths;
+    pack_t *pack;
+    const byte *data;
+    int method;
+    unsigned long compressedLen;
+    unsigned long len;
+    size_t reserved;  // of fs_prefetchMegs, until it is taken
+
+    // filled in by a worker
+    std::atomic<bool> done;
+    byte *buffer;
+    long length;  // -1 if no source had it
+    pack_t *source;  // the pk3 it came from, to reference it when used
+
+    bool used;
+};
+
+static cvar_t *fs_prefetch;
+static cvar_t *fs_prefetchThreads;
+static cvar_t *fs_prefetchMegs;
+
+static std::thread *fs_prefetchWorkers[MAX_PREFETCH_THREADS];
+static int fs_prefetchNumWorkers;
+static std::mutex fs_prefetchLock;
+static std::condition_variable fs_prefetchWake;  // workers wait for the queue
+static std::condition_variable fs_prefetchDone;  // FS_PrefetchWait waits for a file
+static std::deque<fsPrefetch_t *> fs_prefetchQueue;
+static int fs_prefetchBusy;  // entries taken off the queue but not done
+static bool fs_prefetchQuit;
+
+// owned by the main thread
+static vector<fsPrefetch_t *> fs_prefetchList;  // index is the handle
+static unordered_map<string, fsPrefetch_t *> fs_prefetchNames;
+static size_t fs_prefetchBytes;  // reserved by kept files
+
+/*
+=================
+FS_PrefetchRead
+
+Runs on a worker
+=================
+*/
+static void FS_PrefetchRead(fsPrefetch_t *p)
+{
+    p->length = -1;
+
+    for (auto &path : p->osPaths)
+    {
+        FILE *f = Sys_FOpen(path.c_str(), "rb");
+        if (!f) continue;
+
+        long len = FS_fplength(f);
+        if (p->keep)
+        {
+            p->buffer = static_cast<byte *>(malloc(len + 1));
+            if (p->buffer && (long)fread(p->buffer, 1, len, f) == len)
+                p->length = len;
+        }
+        else
+        {
+            byte chunk[PREFETCH_CHUNK];
+            while (fread(chunk, 1, sizeof(chunk), f) == sizeof(chunk))
+                ;
+            p->length = len;
+        }
+        fclose(f);
+
+        if (p->length < 0)
+        {
+            free(p->buffer);
+            p->buffer = nullptr;
+        }
+        return;
+    }
+
+    if (!p->pack) return;
+
+    p->source = p->pack;
+    p->length = p->len;
+
+    if (p->keep && p->method == Z_DEFLATED)
+    {
+        p->buffer = static_cast<byte *>(malloc(p->len + 1));
+        if (p->buffer && FS_InflateView(p->data, p->compressedLen, p->buffer, p->len)) return;
+
+        // left to the normal path
+        free(p->buffer);
+        p->buffer = nullptr;
+        p->length = -1;
+        return;
+    }
+
+    // a stored entry is read straight from the mapping anyway, so just
+    // fault it in
+    volatile byte sum = 0;
+    for (unsigned long i = 0; i < p->compressedLen; i += 4096)
+        sum += p->data[i];
+}
+
+/*
+=================
+FS_PrefetchWorker
+=================
+*/
+static void FS_PrefetchWorker(void)
+{
+    for ( ;; )
+    {
+        fsPrefetch_t *p;
+
+        {
+            std::unique_lock<std::mutex> lock(fs_prefetchLock);
+            fs_prefetchWake.wait(lock, [] { return fs_prefetchQuit || !fs_prefetchQueue.empty(); });
+            if (fs_prefetchQuit) return;
+
+            p = fs_prefetchQueue.front();
+            fs_prefetchQueue.pop_front();
+            fs_prefetchBusy++;
+        }
+
+        FS_PrefetchRead(p);
+
+        {
+            std::lock_guard<std::mutex> lock(fs_prefetchLock);
+            p->done = true;
+            fs_prefetchBusy--;
+        }
+        fs_prefetchDone.notify_all();
+    }
+}
+
+/*
+=================
+FS_PrefetchStop
+
+Waits for the workers to finish what they are reading, then stops them
+=================
+*/
+static void FS_PrefetchStop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(fs_prefetchLock);
+        fs_prefetchQuit = true;
+    }
+    fs_prefetchWake.notify_all();
+
+    for (int i = 0; i < fs_prefetchNumWorkers; i++)
+    {
+        fs_prefetchWorkers[i]->join();
+        delete fs_prefetchWorkers[i];
+        fs_prefetchWorkers[i] = nullptr;
+    }
+    fs_prefetchNumWorkers = 0;
+    fs_prefetchQuit = false;
+}
+
+/*
+=================
+FS_PrefetchCancel
+=================
+*/
+void FS_PrefetchCancel(void)
+{
+    if (fs_prefetchList.empty()) return;
+
+    {
+        std::unique_lock<std::mutex> lock(fs_prefetchLock);
+        fs_prefetchQueue.clear();
+        fs_prefetchDone.wait(lock, [] { return !fs_prefetchBusy; });
+    }
+
+    for (auto p : fs_prefetchList)
+    {
+        free(p->buffer);
+        delete p;
+    }
+    fs_prefetchList.clear();
+    fs_prefetchNames.clear();
+    fs_prefetchBytes = 0;
+}
+
+/*
+=================
+FS_PrefetchPlan
+
+Does what FS_FOpenFileRead would, without opening anything.  Returns
+false if there is nothing to read or the file has to take the normal
+path
+=================
+*/
+static bool FS_PrefetchPlan(fsPrefetch_t *p)
+{
+    const char *filename = p->name.c_str();
+    int len = p->name.size();
+
+    if (strstr(filename, "..") || strstr(filename, "::")) return false;
+
+    // configs may have to come from the journal
+    if (FS_IsExt(filename, ".cfg", len)) return false;
+
+    vector<searchpath_t *> all;
+    vector<searchpath_t *> *candidates = &all;
+
+    if (FS_IndexFind(filename))
+        candidates = &fs_indexCandidates;
+    else
+    {
+        for (auto search = fs_searchpaths; search; search = search->next)
+            all.push_back(search);
+    }
+
+    for (auto search : *candidates)
+    {
+        if (search->dir)
+        {
+            if (FS_PureAllowsDir(filename, len))
+                p->osPaths.push_back(FS_BuildOSPath(search->dir->path, search->dir->gamedir, filename));
+            continue;
+        }
+
+        auto pakfile = search->pack->find(filename);
+        if (!pakfile || !search->pack->is_pure()) continue;
+
+        p->data = FS_PakEntryData(search->pack, pakfile->pos, pakfile->len, &p->method, &p->compressedLen);
+        if (!p->data || (p->method != 0 && p->method != Z_DEFLATED)) return false;
+
+        p->pack = search->pack;
+        p->len = pakfile->len;
+        break;
+    }
+
+    return p->pack || !p->osPaths.empty();
+}
+
+/*
+=================
+FS_PrefetchSize
+
+What a kept file will take up, from the source a worker will read
+=================
+*/
+static size_t FS_PrefetchSize(fsPrefetch_t *p)
+{
+    for (auto &path : p->osPaths)
+    {
+        struct stat st;
+        if (!stat(path.c_str(), &st)) return st.st_size;
+    }
+
+    return p->pack ? p->len : 0;
+}
+
+/*
+=================
+FS_Prefetch
+=================
+*/
+int FS_Prefetch(const char *qpath, bool keep)
+{
+    if (!fs_searchpaths) Com_Error(ERR_FATAL, "Filesystem call made without initialization");
+
+    if (!fs_prefetch->integer || !qpath || !qpath[0]) return -1;
+
+    if (qpath[0] == '/' || qpath[0] == '\\') qpath++;
+
+    string key;
+    FS_IndexKey(qpath, key);
+    auto it = fs_prefetchNames.find(key);
+    if (it != fs_prefetchNames.end())
+    {
+        // asking to keep it after all is too late, the read may have started
+        return it->second->handle;
+    }
+
+    auto p = new fsPrefetch_t();
+    p->name = qpath;
+    p->keep = keep;
+    if (!FS_PrefetchPlan(p))
+    {
+        delete p;
+        return -1;
+    }
+
+    // reserve the memory now, reads still in the queue count as well
+    if (keep)
+    {
+        p->reserved = FS_PrefetchSize(p);
+        if (fs_prefetchBytes + p->reserved > (size_t)fs_prefetchMegs->integer << 20)
+        {
+            fs_prefetchStats.refused++;
+            delete p;
+            return -1;
+        }
+        fs_prefetchBytes += p->reserved;
+    }
+
+    if (!fs_prefetchNumWorkers)
+    {
+        int count = Com_Clamp(1, MAX_PREFETCH_THREADS, fs_prefetchThreads->integer);
+
+        for (int i = 0; i < count; i++)
+            fs_prefetchWorkers[i] = new std::thread(FS_PrefetchWorker);
+        fs_prefetchNumWorkers = count;
+    }
+
+    p->handle = fs_prefetchList.size();
+    fs_prefetchNames[key] = p;
+    fs_prefetchList.push_back(p);
+    fs_prefetchStats.queued++;
+    if (keep) fs_prefetchStats.kept++;
+
+    {
+        std::lock_guard<std::mutex> lock(fs_prefetchLock);
+        fs_prefetchQueue.push_back(p);
+    }
+    fs_prefetchWake.notify_one();
+
+    return p->handle;
+}
+
+/*
+=================
+FS_PrefetchDone
+=================
+*/
+bool FS_PrefetchDone(int handle)
+{
+    if (handle < 0 || handle >= (int)fs_prefetchList.size()) return true;
+
+    return fs_prefetchList[handle]->done;
+}
+
+/*
+=================
+FS_PrefetchWait
+=================
+*/
+void FS_PrefetchWait(int handle)
+{
+    if (FS_PrefetchDone(handle)) return;
+
+    fsPrefetch_t *p = fs_prefetchList[handle];
+    std::unique_lock<std::mutex> lock(fs_prefetchLock);
+    fs_prefetchDone.wait(lock, [p] { return p->done.load(); });
+}
+
+/*
+=================
+FS_PrefetchTake
+
+Hands a kept file to FS_ReadFile or FS_ReadFileView.  Returns -1 if
+it has to be read the normal way
+=================
+*/
+static long FS_PrefetchTake(const char *qpath, void **buffer)
+{
+    if (fs_prefetchNames.empty()) return -1;
+
+    if (qpath[0] == '/' || qpath[0] == '\\') qpath++;
+
+    FS_IndexKey(qpath, fs_indexKey);
+    auto it = fs_prefetchNames.find(fs_indexKey);
+    if (it == fs_prefetchNames.end()) return -1;
+
+    fsPrefetch_t *p = it->second;
+    if (!p->keep || p->used) return -1;
+
+    FS_PrefetchWait(p->handle);
+
+    p->used = true;
+    fs_prefetchBytes -= p->reserved;
+    p->reserved = 0;
+
+    if (!p->buffer)
+    {
+        if (p->length < 0) fs_prefetchStats.missed++;
+        return -1;
+    }
+
+    if (p->source) FS_ReferencePakFile(p->source, p->name.c_str());
+
+    fs_loadCount++;
+    fs_loadStack++;
+
+    byte *buf = static_cast<byte *>(Hunk_AllocateTempMemory(p->length + 1));
+    ::memcpy(buf, p->buffer, p->length);
+    buf[p->length] = 0;
+
+    free(p->buffer);
+    p->buffer = nullptr;
+
+    fs_prefetchStats.used++;
+    fs_prefetchStats.bytes += p->length;
+
+    *buffer = buf;
+    return p->length;
+}
+
 /*
 ============
 FS_WriteFile
@@ -1974,6 +3132,7 @@ Frees a pak structure and releases all associated resources
 
 static void FS_FreePak(pack_t *thepak)
 {
+    Sys_UnmapFile(thepak->mapBase, thepak->mapLength);
     unzClose(thepak->handle);
     Z_Free(thepak->buildBuffer);
     Z_Free(thepak);
@@ -3179,6 +4338,10 @@ Frees all resources.
 
 void FS_Shutdown(bool closemfp)
 {
+    // the workers may still be reading from the paks
+    FS_PrefetchCancel();
+    FS_PrefetchStop();
+
     for (int i = 0; i < MAX_FILE_HANDLES; i++)
     {
         if (fsh[i].fileSize) FS_FCloseFile(i);
@@ -3196,12 +4359,14 @@ void FS_Shutdown(bool closemfp)
 
     // Any FS_ calls will now be an error until reinitialized
     fs_searchpaths = nullptr;
+    FS_IndexClear();
 
     Cmd_RemoveCommand("path");
     Cmd_RemoveCommand("dir");
     Cmd_RemoveCommand("fdir");
     Cmd_RemoveCommand("touchFile");
     Cmd_RemoveCommand("which");
+    Cmd_RemoveCommand("fs_stats");
 
 #ifdef FS_MISSING
     if (closemfp)
@@ -3239,6 +4404,8 @@ static void FS_ReorderPurePaks(void)
             if (s->pack && fs_serverPaks[i] == s->pack->checksum)
             {
                 fs_reordered = true;
+                fs_indexValid = false;
+                FS_PrefetchCancel();
 
                 // move this element to the insert list
                 *p_previous = s->next;
@@ -3267,6 +4434,11 @@ static void FS_Startup(const char *gameName)
     fs_packFiles = 0;
 
     fs_debug = Cvar_Get("fs_debug", "0", 0);
+    fs_index = Cvar_Get("fs_index", "1", 0);
+    fs_mapPaks = Cvar_Get("fs_mapPaks", "1", 0);
+    fs_prefetch = Cvar_Get("fs_prefetch", "1", 0);
+    fs_prefetchThreads = Cvar_Get("fs_prefetchThreads", "4", 0);
+    fs_prefetchMegs = Cvar_Get("fs_prefetchMegs", "256", 0);
     fs_basepath = Cvar_Get("fs_basepath", Sys_DefaultInstallPath(), CVAR_INIT | CVAR_PROTECTED);
     fs_basegame = Cvar_Get("fs_basegame", BASEGAME, CVAR_INIT);
 
@@ -3380,6 +4552,7 @@ static void FS_Startup(const char *gameName)
     Cmd_AddCommand("fdir", FS_NewDir_f);
     Cmd_AddCommand("touchFile", FS_TouchFile_f);
     Cmd_AddCommand("which", FS_Which_f);
+    Cmd_AddCommand("fs_stats", FS_Stats_f);
 
     // reorder the pure pk3 files according to server order
     FS_ReorderPurePaks();
@@ -3637,6 +4810,7 @@ void FS_PureServerSetLoadedPaks(const char *pakSums, const char *pakNames)
     if (c > MAX_SEARCH_PATHS) c = MAX_SEARCH_PATHS;
 
     fs_numServerPaks = c;
+    FS_PrefetchCancel();
 
     for (int i = 0; i < c; i++) fs_serverPaks[i] = atoi(Cmd_Argv(i));
 
@@ -229,6 +229,22 @@ void         FS_FreeFile (void* buffer);
 long         FS_ReadFile (const char* qpath, void** buffer);
 void         FS_Flush (fileHandle_t f);
 long         FS_ReadFileDir (const char* qpath, void* searchPath, bool unpure, void** buffer);
+long         FS_ReadFileView (const char* qpath, const void** buffer);
+// like FS_ReadFile, but the buffer is read-only and only NUL terminated if it
+// had to be copied; a stored pk3 entry points straight into the mapped pk3.
+// Release it with FS_FreeFileView before the filesystem restarts
+void         FS_FreeFileView (const void* buffer);
+int          FS_Prefetch (const char* qpath, bool keep);
+// starts reading qpath on a background thread and returns a handle, or -1 if
+// it is disabled, already read or over fs_prefetchMegs. With keep the data is
+// handed to the next FS_ReadFile or FS_ReadFileView of qpath, without it the
+// file is only pulled into the OS cache for code that streams it
+bool         FS_PrefetchDone (int handle);
+void         FS_PrefetchWait (int handle);
+// whether the read behind a handle has finished, or block until it has.
+// Handles only mean something until the next FS_PrefetchCancel
+void         FS_PrefetchCancel (void);
+// drops everything prefetched and not yet used
 int          FS_FileIsInPAK_A(bool alternate, const char *filename, int *pChecksum);
 int          FS_FileIsInPAK (const char* filename, int* pChecksum);
 int          FS_FTell (fileHandle_t f);
@@ -33,8 +33,11 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "qcommon.h"
 #include "alternatePlayerstate.h"
 #include "huffman.h"
+#include "profile.h"
 
-static int bloc = 0;
+// bit cursor shared by the helpers below; per thread so that
+// messages can be encoded on more than one thread at a time
+static thread_local int bloc = 0;
 
 void Huff_putBit(int bit, uint8_t *fout, int *offset)
 {
@@ -433,6 +436,182 @@ void Huff_offsetTransmit(huff_t *huff, int ch, uint8_t *fout, int *offset, int m
     *offset = bloc;
 }
 
+/* Write the low count bits of bits at *offset.  Matches a run of
+ * Huff_putBit calls: the partial first byte is OR'd into, any further
+ * bytes are overwritten, and nothing past the last bit is touched */
+static inline void Huff_storeBits(uint64_t bits, int count, uint8_t *fout, int *offset)
+{
+    int pos = *offset;
+    int shift = pos & 7;
+    uint8_t *p = fout + (pos >> 3);
+    uint64_t acc;
+    int n;
+
+    acc = (bits & ((UINT64_C(1) << count) - 1)) << shift;
+    if (shift)
+    {
+        acc |= *p;
+    }
+
+    for (n = (shift + count + 7) >> 3; n > 0; n--)
+    {
+        *p++ = (uint8_t)acc;
+        acc >>= 8;
+    }
+
+    *offset = pos + count;
+}
+
+/* Read up to 16 bits at pos without looking at any byte at or past
+ * maxoffset, missing bits read as zero */
+static inline uint32_t Huff_peekBits(const uint8_t *fin, int pos, int maxoffset)
+{
+    int first = pos >> 3;
+    int last = (maxoffset - 1) >> 3;
+    uint32_t acc = 0;
+    int i;
+
+    for (i = 0; i < 3 && first + i <= last; i++)
+    {
+        acc |= (uint32_t)fin[first + i] << (i * 8);
+    }
+
+    return acc >> (pos & 7);
+}
+
+void Huff_putBits(int value, int bits, uint8_t *fout, int *offset)
+{
+    Huff_storeBits((uint32_t)value & ((1u << bits) - 1), bits, fout, offset);
+}
+
+int Huff_getBits(uint8_t *fin, int *offset, int bits)
+{
+    int pos = *offset;
+    uint32_t acc;
+
+    acc = fin[pos >> 3];
+    if ((pos & 7) + bits > 8)
+    {
+        acc |= (uint32_t)fin[(pos >> 3) + 1] << 8;
+    }
+
+    *offset = pos + bits;
+    return (acc >> (pos & 7)) & ((1u << bits) - 1);
+}
+
+void Huff_BuildTable(huffTable_t *table, const huff_t *compressor, const huff_t *decompressor)
+{
+    node_t *node;
+    uint32_t code;
+    int ch, i, len;
+
+    memset(table, 0, sizeof(*table));
+    table->compressor = compressor;
+    table->tree = decompressor->tree;
+
+    /* the code is the path from the root, which send() finds by
+     * climbing from the leaf, so the last step found is the first bit */
+    for (ch = 0; ch <= HMAX; ch++)
+    {
+        if (!compressor->loc[ch])
+        {
+            continue;
+        }
+
+        code = 0;
+        len = 0;
+        for (node = compressor->loc[ch]; node->parent; node = node->parent)
+        {
+            if (len == 32)
+            {
+                break;
+            }
+            code = (code << 1) | (node->parent->right == node);
+            len++;
+        }
+
+        if (!node->parent)
+        {
+            table->code[ch] = code;
+            table->length[ch] = len;
+        }
+    }
+
+    /* every HUFF_LOOKUP_BITS bit pattern that starts with a whole code */
+    for (i = 0; i < (1 << HUFF_LOOKUP_BITS); i++)
+    {
+        node = decompressor->tree;
+        for (len = 0; node && node->symbol == INTERNAL_NODE && len < HUFF_LOOKUP_BITS; len++)
+        {
+            node = ((i >> len) & 1) ? node->right : node->left;
+        }
+
+        if (node && node->symbol != INTERNAL_NODE && len > 0)
+        {
+            table->lookup[i] = node->symbol | (len << 9);
+        }
+    }
+}
+
+void Huff_tableTransmit(const huffTable_t *table, int ch, uint8_t *fout, int *offset, int maxoffset)
+{
+    int len = table->length[ch];
+
+    if (!len)
+    {
+        Huff_offsetTransmit((huff_t *)table->compressor, ch, fout, offset, maxoffset);
+        return;
+    }
+
+    /* send() writes what fits before maxoffset, then leaves the offset
+     * one past it for the caller to notice */
+    if (*offset + len > maxoffset)
+    {
+        if (*offset < maxoffset)
+        {
+            Huff_storeBits(table->code[ch], maxoffset - *offset, fout, offset);
+        }
+        *offset = maxoffset + 1;
+        return;
+    }
+
+    Huff_storeBits(table->code[ch], len, fout, offset);
+}
+
+void Huff_tableReceive(const huffTable_t *table, int *ch, uint8_t *fin, int *offset, int maxoffset)
+{
+    int pos = *offset;
+    int entry, len;
+
+    if (pos >= maxoffset)
+    {
+        *ch = 0;
+        *offset = maxoffset + 1;
+        return;
+    }
+
+    entry = table->lookup[Huff_peekBits(fin, pos, maxoffset) & ((1 << HUFF_LOOKUP_BITS) - 1)];
+    len = entry >> 9;
+
+    if (!len)
+    {
+        Huff_offsetReceive(table->tree, ch, fin, offset, maxoffset);
+        return;
+    }
+
+    /* a prefix code can only decode from the zeroes past the end if the
+     * real bits ran out first, which is where the tree walk gives up */
+    if (len > maxoffset - pos)
+    {
+        *ch = 0;
+        *offset = maxoffset + 1;
+        return;
+    }
+
+    *ch = entry & 0x1ff;
+    *offset = pos + len;
+}
+
 void Huff_Decompress(struct msg_t *mbuf, int offset)
 {
     int ch, cch, i, j, size;
@@ -440,6 +619,8 @@ void Huff_Decompress(struct msg_t *mbuf, int offset)
     uint8_t *buffer;
     huff_t huff;
 
+    PROF_SCOPE(prof, "huffman");
+
     size = mbuf->cursize - offset;
     buffer = mbuf->data + offset;
 
@@ -492,8 +673,6 @@ void Huff_Decompress(struct msg_t *mbuf, int offset)
     memcpy(mbuf->data + offset, seq, cch);
 }
 
-extern int oldsize;
-
 void Huff_Compress(struct msg_t *mbuf, int offset)
 {
     int i, ch, size;
@@ -501,6 +680,8 @@ void Huff_Compress(struct msg_t *mbuf, int offset)
     uint8_t *buffer;
     huff_t huff;
 
+    PROF_SCOPE(prof, "huffman");
+
     size = mbuf->cursize - offset;
     buffer = mbuf->data + +offset;
 
@@ -39,6 +39,26 @@ typedef struct {
     huff_t decompressor;
 } huffman_t;
 
+/* Flattened code tables for a tree that is no longer being updated, so
+ * symbols can be sent and received without walking the tree a bit at a
+ * time.  The output is bit for bit what the tree functions produce. */
+
+#define HUFF_LOOKUP_BITS 11
+
+typedef struct {
+    uint32_t code[HMAX + 1]; /* first bit sent is the lowest */
+    uint8_t length[HMAX + 1]; /* 0 if the code is too long for code[] */
+    uint16_t lookup[1 << HUFF_LOOKUP_BITS]; /* symbol | length << 9, 0 if longer */
+    const huff_t *compressor; /* fallbacks for codes that don't fit */
+    node_t *tree;
+} huffTable_t;
+
+void Huff_BuildTable(huffTable_t *table, const huff_t *compressor, const huff_t *decompressor);
+void Huff_tableTransmit(const huffTable_t *table, int ch, uint8_t *fout, int *offset, int maxoffset);
+void Huff_tableReceive(const huffTable_t *table, int *ch, uint8_t *fin, int *offset, int maxoffset);
+void Huff_putBits(int value, int bits, uint8_t *fout, int *offset);
+int Huff_getBits(uint8_t *fin, int *offset, int bits);
+
 void Huff_Compress(struct msg_t *buf, int offset);
 void Huff_Decompress(struct msg_t *buf, int offset);
 void Huff_Init(huffman_t *huff);
@@ -0,0 +1,218 @@
+/*
+===========================================================================
+Copyright (C) 2000-2013 Darklegion Development
+
+This file is part of Tremulous.
+
+Tremulous is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Tremulous is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Tremulous; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// jobs.cpp -- worker thread pool
+
+#include "jobs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define MAX_JOB_THREADS 32
+
+struct jobBatch_t {
+    jobFunc_t func;
+    void *data;
+    int count;
+    std::atomic<int> next;  // next index to hand out
+    std::atomic<int> done;  // indices finished
+    int workers;  // workers still holding the batch, guarded by jobLock
+};
+
+// never destroyed, exit() must not run ~thread on a joinable worker
+static std::thread *jobThreads[MAX_JOB_THREADS];
+static int jobNumThreads;
+static std::mutex jobLock;
+static std::condition_variable jobWake;  // workers wait here for a batch
+static std::condition_variable jobIdle;  // Job_Run waits here for the last index
+static jobBatch_t *jobCurrent;
+static int jobGeneration;
+static bool jobQuit;
+
+/*
+=================
+Job_Drain
+
+Runs indices from the batch until there are none left to hand out
+=================
+*/
+static void Job_Drain(jobBatch_t *batch)
+{
+    int i;
+
+    while ((i = batch->next.fetch_add(1)) < batch->count)
+    {
+        batch->func(batch->data, i);
+
+        if (batch->done.fetch_add(1) + 1 == batch->count)
+        {
+            std::lock_guard<std::mutex> lock(jobLock);
+            jobIdle.notify_all();
+        }
+    }
+}
+
+/*
+=================
+Job_Worker
+=================
+*/
+static void Job_Worker(void)
+{
+    int generation = 0;
+
+    for ( ;; )
+    {
+        jobBatch_t *batch;
+
+        {
+            std::unique_lock<std::mutex> lock(jobLock);
+            jobWake.wait(lock, [&] { return jobQuit || jobGeneration != generation; });
+            if (jobQuit)
+            {
+                return;
+            }
+            generation = jobGeneration;
+            batch = jobCurrent;
+            if (!batch)
+            {
+                continue;
+            }
+            batch->workers++;
+        }
+
+        Job_Drain(batch);
+
+        {
+            std::lock_guard<std::mutex> lock(jobLock);
+            batch->workers--;
+        }
+        jobIdle.notify_all();
+    }
+}
+
+/*
+=================
+Job_Shutdown
+=================
+*/
+void Job_Shutdown(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobLock);
+        jobQuit = true;
+    }
+    jobWake.notify_all();
+
+    for (int i = 0; i < jobNumThreads; i++)
+    {
+        jobThreads[i]->join();
+        delete jobThreads[i];
+        jobThreads[i] = NULL;
+    }
+    jobNumThreads = 0;
+    jobQuit = false;
+}
+
+/*
+=================
+Job_SetThreads
+=================
+*/
+void Job_SetThreads(int count)
+{
+    if (count < 0)
+    {
+        count = 0;
+    }
+    if (count > MAX_JOB_THREADS)
+    {
+        count = MAX_JOB_THREADS;
+    }
+    if (count == jobNumThreads)
+    {
+        return;
+    }
+
+    Job_Shutdown();
+
+    for (int i = 0; i < count; i++)
+    {
+        jobThreads[i] = new std::thread(Job_Worker);
+    }
+    jobNumThreads = count;
+}
+
+/*
+=================
+Job_NumThreads
+=================
+*/
+int Job_NumThreads(void) { return jobNumThreads; }
+
+/*
+=================
+Job_Run
+=================
+*/
+void Job_Run(jobFunc_t func, void *data, int count)
+{
+    jobBatch_t batch;
+
+    if (count <= 0)
+    {
+        return;
+    }
+
+    // not worth waking anybody up for
+    if (!jobNumThreads || count == 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            func(data, i);
+        }
+        return;
+    }
+
+    batch.func = func;
+    batch.data = data;
+    batch.count = count;
+    batch.next = 0;
+    batch.done = 0;
+    batch.workers = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(jobLock);
+        jobCurrent = &batch;
+        jobGeneration++;
+    }
+    jobWake.notify_all();
+
+    Job_Drain(&batch);
+
+    // workers that picked up the batch may still be about to look for
+    // another index, so wait for them to let go before it goes out of scope
+    std::unique_lock<std::mutex> lock(jobLock);
+    jobIdle.wait(lock, [&] { return batch.done.load() == batch.count && !batch.workers; });
+    jobCurrent = NULL;
+}
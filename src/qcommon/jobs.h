@@ -0,0 +1,53 @@
+/*
+===========================================================================
+Copyright (C) 2000-2013 Darklegion Development
+
+This file is part of Tremulous.
+
+Tremulous is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Tremulous is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Tremulous; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+#ifndef JOBS_H
+#define JOBS_H 1
+
+/*
+==============================================================
+
+JOBS
+
+A small pool of worker threads for splitting one loop across
+cores.  Job functions must not touch the console, the zone,
+the hunk, cvars or anything else that is not documented as
+safe to use from more than one thread.
+
+==============================================================
+*/
+
+typedef void (*jobFunc_t)(void *data, int index);
+
+void Job_SetThreads(int count);
+// (re)starts the pool with count workers.  0 runs every job on the
+// calling thread.  Must not be called from inside Job_Run
+
+int Job_NumThreads(void);
+
+void Job_Run(jobFunc_t func, void *data, int count);
+// calls func(data, i) for every i in [0, count) and returns once
+// all of them have finished.  The caller runs jobs as well
+
+void Job_Shutdown(void);
+
+#endif
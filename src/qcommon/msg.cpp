@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #include "msg.h"
+#include "cmd.h"
 #include "huffman.h"
 
 #include "cvar.h"
@@ -29,8 +30,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "qcommon.h"
 
 #include "alternatePlayerstate.h"
+#include "sys/sys_shared.h"
 
 static huffman_t msgHuff;
+static huffTable_t msgHuffTable;
 
 static bool msgInit = false;
 
@@ -45,7 +48,7 @@ Handles uint8_t ordering and avoids alignment errors
 ==============================================================================
 */
 
-int oldsize = 0;
+thread_local int oldsize = 0;
 
 void MSG_initHuffman(void);
 
@@ -113,7 +116,7 @@ bit functions
 =============================================================================
 */
 
-int overflows;
+thread_local int overflows;
 
 // negative bit values include signs
 void MSG_WriteBits(msg_t *msg, int value, int bits)
@@ -203,18 +206,15 @@ void MSG_WriteBits(msg_t *msg, int value, int bits)
                 return;
             }
 
-            for (i = 0; i < nbits; i++)
-            {
-                Huff_putBit((value & 1), msg->data, &msg->bit);
-                value = (value >> 1);
-            }
+            Huff_putBits(value, nbits, msg->data, &msg->bit);
+            value = (value >> nbits);
             bits = bits - nbits;
         }
         if (bits)
         {
             for (i = 0; i < bits; i += 8)
             {
-                Huff_offsetTransmit(&msgHuff.compressor, (value & 0xff), msg->data, &msg->bit, msg->maxsize << 3);
+                Huff_tableTransmit(&msgHuffTable, (value & 0xff), msg->data, &msg->bit, msg->maxsize << 3);
                 value = (value >> 8);
 
                 if (msg->bit > msg->maxsize << 3)
@@ -228,6 +228,34 @@ void MSG_WriteBits(msg_t *msg, int value, int bits)
     }
 }
 
+// appends bits already coded into another bitstream message; the codes
+// don't depend on where they start, so they can go in at any bit
+void MSG_WriteBitstream(msg_t *msg, const uint8_t *data, int bits)
+{
+    int i;
+
+    if ( msg->overflowed || !bits )
+    {
+        return;
+    }
+
+    if ( msg->bit + bits > msg->maxsize << 3 )
+    {
+        msg->overflowed = true;
+        return;
+    }
+
+    for (i = 0; i + 8 <= bits; i += 8)
+    {
+        Huff_putBits(data[i >> 3], 8, msg->data, &msg->bit);
+    }
+    if (i < bits)
+    {
+        Huff_putBits(data[i >> 3], bits - i, msg->data, &msg->bit);
+    }
+    msg->cursize = (msg->bit >> 3) + 1;
+}
+
 int MSG_ReadBits(msg_t *msg, int bits)
 {
     int value;
@@ -295,17 +323,14 @@ int MSG_ReadBits(msg_t *msg, int bits)
                 msg->readcount = msg->cursize + 1;
                 return 0;
             }
-            for (int i = 0; i < nbits; i++)
-            {
-                value |= (Huff_getBit(msg->data, &msg->bit) << i);
-            }
+            value = Huff_getBits(msg->data, &msg->bit, nbits);
             bits = bits - nbits;
         }
         if (bits)
         {
             for (int i = 0; i < bits; i += 8)
             {
-                Huff_offsetReceive(msgHuff.decompressor.tree, &get, msg->data, &msg->bit, msg->cursize << 3);
+                Huff_tableReceive(&msgHuffTable, &get, msg->data, &msg->bit, msg->cursize << 3);
                 value |= (get << (i + nbits));
 
                 if (msg->bit > msg->cursize << 3)
@@ -2208,6 +2233,305 @@ void MSG_initHuffman(void)
             Huff_addRef(&msgHuff.decompressor, (uint8_t)i);  // Do update
         }
     }
+
+    // the trees never change after this, so code from tables instead
+    Huff_BuildTable(&msgHuffTable, &msgHuff.compressor, &msgHuff.decompressor);
+}
+
+/*
+=================
+MSG_BenchWrite / MSG_BenchRead
+
+The bitstream half of MSG_WriteBits and MSG_ReadBits, through either the
+code tables or the original tree walk
+=================
+*/
+static bool MSG_BenchWrite(bool tree, uint8_t *data, int *bit, int maxbits, int value, int bits)
+{
+    int nbits = bits & 7;
+    int i;
+
+    value &= (0xffffffff >> (32 - bits));
+    if (nbits)
+    {
+        if (*bit + nbits > maxbits)
+        {
+            return false;
+        }
+
+        if (tree)
+        {
+            for (i = 0; i < nbits; i++)
+            {
+                Huff_putBit((value & 1), data, bit);
+                value = (value >> 1);
+            }
+        }
+        else
+        {
+            Huff_putBits(value, nbits, data, bit);
+            value = (value >> nbits);
+        }
+        bits -= nbits;
+    }
+
+    for (i = 0; i < bits; i += 8)
+    {
+        if (tree)
+        {
+            Huff_offsetTransmit(&msgHuff.compressor, (value & 0xff), data, bit, maxbits);
+        }
+        else
+        {
+            Huff_tableTransmit(&msgHuffTable, (value & 0xff), data, bit, maxbits);
+        }
+        value = (value >> 8);
+
+        if (*bit > maxbits)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool MSG_BenchRead(bool tree, uint8_t *data, int *bit, int maxbits, int bits, int *value)
+{
+    int nbits = bits & 7;
+    int get;
+    int i;
+
+    *value = 0;
+    if (nbits)
+    {
+        if (*bit + nbits > maxbits)
+        {
+            return false;
+        }
+
+        if (tree)
+        {
+            for (i = 0; i < nbits; i++)
+            {
+                *value |= (Huff_getBit(data, bit) << i);
+            }
+        }
+        else
+        {
+            *value = Huff_getBits(data, bit, nbits);
+        }
+        bits -= nbits;
+    }
+
+    for (i = 0; i < bits; i += 8)
+    {
+        if (tree)
+        {
+            Huff_offsetReceive(msgHuff.decompressor.tree, &get, data, bit, maxbits);
+        }
+        else
+        {
+            Huff_tableReceive(&msgHuffTable, &get, data, bit, maxbits);
+        }
+        *value |= ((unsigned)get << (i + nbits));
+
+        if (*bit > maxbits)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint32_t MSG_BenchRand(uint32_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// a byte distributed like real traffic, going by msg_hData
+static int MSG_BenchByte(uint32_t *seed, int total)
+{
+    int r = MSG_BenchRand(seed) % total;
+    int i;
+
+    for (i = 0; i < 255 && r >= msg_hData[i]; i++)
+    {
+        r -= msg_hData[i];
+    }
+
+    return i;
+}
+
+/*
+=================
+MSG_HuffmanBench_f
+
+Runs random messages and random garbage through both the code tables and
+the tree walk, reporting any difference in output, then times each
+=================
+*/
+void MSG_HuffmanBench_f(void)
+{
+    const int bufferSize = MAX_MSGLEN;
+    int iterations = 200;
+    uint32_t seed = 0x12345678;
+    uint8_t *input, *encoded, *treeBuf, *tableBuf;
+    int total = 0;
+    int failures = 0;
+    int bytes, start, msec;
+    double rate[2];
+    int i, j, k;
+
+    if (!msgInit)
+    {
+        MSG_initHuffman();
+    }
+
+    if (Cmd_Argc() > 1)
+    {
+        iterations = MAX(1, atoi(Cmd_Argv(1)));
+    }
+
+    for (i = 0; i < 256; i++)
+    {
+        total += msg_hData[i];
+    }
+
+    input = (uint8_t *)Z_Malloc(bufferSize);
+    encoded = (uint8_t *)Z_Malloc(bufferSize * 4);
+    treeBuf = (uint8_t *)Z_Malloc(bufferSize);
+    tableBuf = (uint8_t *)Z_Malloc(bufferSize);
+
+    for (i = 0; i < iterations && failures < 10; i++)
+    {
+        int maxbits = (1 + MSG_BenchRand(&seed) % bufferSize) << 3;
+        int treeBit = 0, tableBit = 0;
+        int widths[4096], values[4096];
+        int ops = 0;
+        bool treeOk = true, tableOk = true;
+        bool intact;
+
+        // leftover bytes must be handled the same too
+        for (j = 0; j < bufferSize; j++)
+        {
+            treeBuf[j] = tableBuf[j] = MSG_BenchRand(&seed);
+        }
+
+        while (ops < 4096 && treeOk && tableOk)
+        {
+            int bits = 1 + MSG_BenchRand(&seed) % 32;
+            int value = 0;
+
+            for (k = 0; k < bits; k += 8)
+            {
+                value |= MSG_BenchByte(&seed, total) << k;
+            }
+            widths[ops] = bits;
+            values[ops] = value & (0xffffffff >> (32 - bits));
+            ops++;
+
+            treeOk = MSG_BenchWrite(true, treeBuf, &treeBit, maxbits, value, bits);
+            tableOk = MSG_BenchWrite(false, tableBuf, &tableBit, maxbits, value, bits);
+        }
+
+        if (treeOk != tableOk || treeBit != tableBit || memcmp(treeBuf, tableBuf, bufferSize))
+        {
+            Com_Printf("huffbench: write mismatch on message %d\n", i);
+            failures++;
+            continue;
+        }
+
+        // read it back, sometimes cut short, and sometimes read garbage
+        if (!treeOk)
+        {
+            ops--;
+        }
+        intact = (MSG_BenchRand(&seed) & 1);
+        if (intact)
+        {
+            maxbits = MIN(maxbits, ((treeBit >> 3) + 1) << 3);
+        }
+        else
+        {
+            maxbits = (1 + MSG_BenchRand(&seed) % bufferSize) << 3;
+            if (MSG_BenchRand(&seed) & 1)
+            {
+                for (j = 0; j < bufferSize; j++)
+                {
+                    tableBuf[j] = MSG_BenchRand(&seed);
+                }
+            }
+        }
+
+        treeBit = tableBit = 0;
+        for (j = 0; j < ops; j++)
+        {
+            int treeValue, tableValue;
+
+            treeOk = MSG_BenchRead(true, tableBuf, &treeBit, maxbits, widths[j], &treeValue);
+            tableOk = MSG_BenchRead(false, tableBuf, &tableBit, maxbits, widths[j], &tableValue);
+            if (treeOk != tableOk || treeBit != tableBit || (treeOk && treeValue != tableValue))
+            {
+                Com_Printf("huffbench: read mismatch on message %d field %d\n", i, j);
+                failures++;
+                break;
+            }
+            if (!treeOk)
+            {
+                break;
+            }
+            if (intact && treeValue != values[j])
+            {
+                Com_Printf("huffbench: field %d of message %d didn't survive\n", j, i);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    // throughput on a stream of bytes that looks like real traffic
+    for (j = 0; j < bufferSize; j++)
+    {
+        input[j] = MSG_BenchByte(&seed, total);
+    }
+
+    for (k = 0; k < 2; k++)
+    {
+        bytes = 0;
+        start = Sys_Milliseconds();
+        do
+        {
+            int bit = 0;
+            int value;
+
+            for (j = 0; j < bufferSize; j++)
+            {
+                MSG_BenchWrite(k == 0, encoded, &bit, bufferSize * 32, input[j], 8);
+            }
+            bit = 0;
+            for (j = 0; j < bufferSize; j++)
+            {
+                MSG_BenchRead(k == 0, encoded, &bit, bufferSize * 32, 8, &value);
+            }
+            bytes += bufferSize;
+        } while ((msec = Sys_Milliseconds() - start) < 250);
+
+        rate[k] = bytes / (1024.0 * 1024.0) / (msec / 1000.0);
+        Com_Printf("%-6s %7.1f MB/s encode+decode\n", k == 0 ? "tree" : "table", rate[k]);
+    }
+
+    Com_Printf("%d messages checked, %d mismatches, table coder %.1fx\n", i, failures,
+        rate[1] / rate[0]);
+
+    Z_Free(tableBuf);
+    Z_Free(treeBuf);
+    Z_Free(encoded);
+    Z_Free(input);
 }
 
 /*
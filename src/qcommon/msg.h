@@ -34,6 +34,7 @@ typedef struct entityState_s entityState_t;
 typedef struct playerState_s playerState_t;
 
 void MSG_WriteBits(struct msg_t *msg, int value, int bits);
+void MSG_WriteBitstream(struct msg_t *msg, const uint8_t *data, int bits);
 
 void MSG_WriteChar(struct msg_t *sb, int c);
 void MSG_WriteByte(struct msg_t *sb, int c);
@@ -75,5 +76,6 @@ struct alternatePlayerState_t;
 void MSG_ReadDeltaAlternatePlayerstate(struct msg_t *msg, struct alternatePlayerState_t *from, struct alternatePlayerState_t *to);
 
 void MSG_ReportChangeVectors_f(void);
+void MSG_HuffmanBench_f(void);
 
 #endif
@@ -65,6 +65,8 @@ void NET_Restart_f(void);
 void NET_Config(bool enableNetworking);
 void NET_FlushPacketQueue(void);
 void NET_SendPacket(netsrc_t sock, int length, const void *data, struct netadr_t to);
+void NET_HoldPackets(int64_t release);
+int NET_SendHeldPackets(bool flush);
 void NET_OutOfBandPrint(netsrc_t net_socket, struct netadr_t adr, const char *format, ...)
     __attribute__((format(printf, 3, 4)));
 void NET_OutOfBandData(netsrc_t sock, struct netadr_t adr, uint8_t *format, int len);
@@ -80,6 +82,9 @@ bool NET_GetLoopPacket(netsrc_t sock, struct netadr_t *net_from, struct msg_t *n
 void NET_JoinMulticast6(void);
 void NET_LeaveMulticast6(void);
 void NET_Sleep(int msec);
+bool NET_SleepUsec(int64_t usec);
+void NET_BeginSendBatch(void);
+void NET_FlushSendBatch(void);
 
 #define MAX_MSGLEN 16384  // max length of a message, which may be fragmented into multiple packets
 
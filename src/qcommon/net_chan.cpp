@@ -530,6 +530,154 @@ void NET_FlushPacketQueue(void)
     }
 }
 
+static void NET_DeliverPacket(netsrc_t sock, int length, const void *data, netadr_t to)
+{
+    if (sock == NS_CLIENT && cl_packetdelay->integer > 0)
+    {
+        NET_QueuePacket(length, data, to, cl_packetdelay->integer);
+    }
+    else if (sock == NS_SERVER && sv_packetdelay->integer > 0)
+    {
+        NET_QueuePacket(length, data, to, sv_packetdelay->integer);
+    }
+    else
+    {
+        Sys_SendPacket(length, data, to);
+    }
+}
+
+/*
+=============================================================================
+
+Held packets
+
+Between NET_HoldPackets(release) and NET_HoldPackets(0), server packets are
+copied into a queue instead of going out, and NET_SendHeldPackets lets them
+go once their release time has come.  The server uses it to pace the
+snapshots it has already built and encoded over the frame.  A later packet
+to an address that still has some held waits behind them, so fragments and
+sequenced messages never overtake each other.
+
+=============================================================================
+*/
+
+#define MAX_HELD_PACKETS 256
+#define HELD_PACKET_BYTES 0x40000
+
+typedef struct {
+    netadr_t to;
+    int64_t release;  // usec
+    int offset;  // into heldPackets.data
+    int length;
+} heldPacket_t;
+
+static struct {
+    int64_t release;  // for new packets, 0 when not holding
+    int sent;  // packets before this one have gone out
+    int numPackets;
+    int used;
+    heldPacket_t packets[MAX_HELD_PACKETS];
+    byte data[HELD_PACKET_BYTES];
+} heldPackets;
+
+/*
+==================
+NET_HoldPackets
+
+Holds server packets until release (Sys_Microseconds), or stops holding
+new ones with 0
+==================
+*/
+void NET_HoldPackets(int64_t release)
+{
+    heldPackets.release = release;
+}
+
+/*
+==================
+NET_SendHeldPackets
+
+Sends the held packets that are due, or all of them with flush.  Returns
+the msec until the next one, or -1 if there's nothing left.
+==================
+*/
+int NET_SendHeldPackets(bool flush)
+{
+    heldPacket_t *packet;
+    int64_t now;
+
+    now = Sys_Microseconds();
+    while (heldPackets.sent < heldPackets.numPackets)
+    {
+        packet = &heldPackets.packets[heldPackets.sent];
+        if (!flush && packet->release > now)
+        {
+            return (packet->release - now + 999) / 1000;
+        }
+
+        heldPackets.sent++;
+        NET_DeliverPacket(NS_SERVER, packet->length, heldPackets.data + packet->offset, packet->to);
+    }
+
+    heldPackets.sent = heldPackets.numPackets = heldPackets.used = 0;
+    return -1;
+}
+
+/*
+==================
+NET_HoldPacket
+
+Returns false if the packet can go out now
+==================
+*/
+static bool NET_HoldPacket(int length, const void *data, netadr_t to)
+{
+    heldPacket_t *packet;
+    int64_t release;
+    int i;
+
+    release = heldPackets.release;
+    if (!release)
+    {
+        // keep behind anything already held for the same address
+        for (i = heldPackets.numPackets - 1; i >= heldPackets.sent; i--)
+        {
+            if (NET_CompareAdr(heldPackets.packets[i].to, to))
+            {
+                break;
+            }
+        }
+
+        if (i < heldPackets.sent)
+        {
+            return false;
+        }
+    }
+
+    if (heldPackets.numPackets == MAX_HELD_PACKETS || heldPackets.used + length > HELD_PACKET_BYTES)
+    {
+        // out of room, so everything goes now rather than out of order
+        NET_SendHeldPackets(true);
+        return false;
+    }
+
+    // release times never go backwards, so the queue goes out in order
+    if (heldPackets.numPackets && heldPackets.packets[heldPackets.numPackets - 1].release > release)
+    {
+        release = heldPackets.packets[heldPackets.numPackets - 1].release;
+    }
+
+    packet = &heldPackets.packets[heldPackets.numPackets++];
+    packet->to = to;
+    packet->release = release;
+    packet->offset = heldPackets.used;
+    packet->length = length;
+    ::memcpy(heldPackets.data + heldPackets.used, data, length);
+    heldPackets.used += length;
+
+    return true;
+}
+
 void NET_SendPacket(netsrc_t sock, int length, const void *data, netadr_t to)
 {
     // sequenced packets are shown in netchan, so just show oob
@@ -548,18 +696,13 @@ void NET_SendPacket(netsrc_t sock, int length, const void *data, netadr_t to)
         return;
     }
 
-    if (sock == NS_CLIENT && cl_packetdelay->integer > 0)
+    if (sock == NS_SERVER && (heldPackets.release || heldPackets.sent < heldPackets.numPackets) &&
+        NET_HoldPacket(length, data, to))
     {
-        NET_QueuePacket(length, data, to, cl_packetdelay->integer);
-    }
-    else if (sock == NS_SERVER && sv_packetdelay->integer > 0)
-    {
-        NET_QueuePacket(length, data, to, sv_packetdelay->integer);
-    }
-    else
-    {
-        Sys_SendPacket(length, data, to);
+        return;
     }
+
+    NET_DeliverPacket(sock, length, data, to);
 }
 
 /*
@@ -27,6 +27,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "cvar.h"
 #include "q_shared.h"
 #include "qcommon.h"
+#include "sys/sys_shared.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -86,6 +87,15 @@ static bool winsockInitialized = false;
 #include <sys/filio.h>
 #endif
 
+#ifdef __linux__
+// recvmmsg and sendmmsg move a whole batch of datagrams per syscall
+#define NET_HAVE_MMSG
+// epoll and a timerfd let NET_SleepUsec wait for less than a millisecond
+#define NET_HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
 typedef int SOCKET;
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
@@ -117,6 +127,14 @@ static cvar_t *net_mcast6iface;
 
 static cvar_t *net_dropsim;
 
+#ifdef NET_HAVE_MMSG
+static cvar_t *net_batch;
+#endif
+
+#ifdef NET_HAVE_EPOLL
+static cvar_t *net_epoll;
+#endif
+
 static struct sockaddr socksRelayAddr;
 
 static SOCKET ip_sockets[3] = {INVALID_SOCKET, INVALID_SOCKET, INVALID_SOCKET};
@@ -549,6 +567,55 @@ bool NET_CompareAdr(netadr_t a, netadr_t b)
 bool NET_IsLocalAddress(netadr_t adr) { return (bool)(adr.type == NA_LOOPBACK); }
 //=============================================================================
 
+/*
+==================
+NET_ParsePacket
+
+Fills in the sender of a datagram of length bytes that came in on
+ip_sockets[a], or ip6_sockets[a] if ip6, and strips any SOCKS header
+==================
+*/
+static bool NET_ParsePacket(int a, bool ip6, struct sockaddr_storage *from, socklen_t fromlen, int length,
+    netadr_t *net_from, msg_t *net_message)
+{
+    if (!ip6)
+    {
+        memset(((struct sockaddr_in *)from)->sin_zero, 0, 8);
+    }
+
+    if (!ip6 && usingSocks && memcmp(from, &socksRelayAddr, fromlen) == 0)
+    {
+        if (length < 10 || net_message->data[0] != 0 || net_message->data[1] != 0 ||
+            net_message->data[2] != 0 || net_message->data[3] != 1)
+        {
+            return false;
+        }
+        net_from->type = NA_IP;
+        net_from->ip[0] = net_message->data[4];
+        net_from->ip[1] = net_message->data[5];
+        net_from->ip[2] = net_message->data[6];
+        net_from->ip[3] = net_message->data[7];
+        net_from->port = *(short *)&net_message->data[8];
+        net_message->readcount = 10;
+    }
+    else
+    {
+        SockadrToNetadr((struct sockaddr *)from, net_from);
+        net_message->readcount = 0;
+    }
+
+    net_from->alternateProtocol = a;
+
+    if (length >= net_message->maxsize)
+    {
+        Com_Printf("Oversize packet from %s\n", NET_AdrToString(*net_from));
+        return false;
+    }
+
+    net_message->cursize = length;
+    return true;
+}
+
 /*
 ==================
 NET_GetPacket
@@ -581,39 +648,7 @@ bool NET_GetPacket(netadr_t *net_from, msg_t *net_message, fd_set *fdr)
             }
             else
             {
-                memset(((struct sockaddr_in *)&from)->sin_zero, 0, 8);
-
-                if (usingSocks && memcmp(&from, &socksRelayAddr, fromlen) == 0)
-                {
-                    if (ret < 10 || net_message->data[0] != 0 || net_message->data[1] != 0 ||
-                        net_message->data[2] != 0 || net_message->data[3] != 1)
-                    {
-                        return false;
-                    }
-                    net_from->type = NA_IP;
-                    net_from->ip[0] = net_message->data[4];
-                    net_from->ip[1] = net_message->data[5];
-                    net_from->ip[2] = net_message->data[6];
-                    net_from->ip[3] = net_message->data[7];
-                    net_from->port = *(short *)&net_message->data[8];
-                    net_message->readcount = 10;
-                }
-                else
-                {
-                    SockadrToNetadr((struct sockaddr *)&from, net_from);
-                    net_message->readcount = 0;
-                }
-
-                net_from->alternateProtocol = a;
-
-                if (ret >= net_message->maxsize)
-                {
-                    Com_Printf("Oversize packet from %s\n", NET_AdrToString(*net_from));
-                    return false;
-                }
-
-                net_message->cursize = ret;
-                return true;
+                return NET_ParsePacket(a, false, &from, fromlen, ret, net_from, net_message);
             }
         }
 
@@ -631,19 +666,7 @@ bool NET_GetPacket(netadr_t *net_from, msg_t *net_message, fd_set *fdr)
             }
             else
             {
-                SockadrToNetadr((struct sockaddr *)&from, net_from);
-                net_message->readcount = 0;
-
-                net_from->alternateProtocol = a;
-
-                if (ret >= net_message->maxsize)
-                {
-                    Com_Printf("Oversize packet from %s\n", NET_AdrToString(*net_from));
-                    return false;
-                }
-
-                net_message->cursize = ret;
-                return true;
+                return NET_ParsePacket(a, true, &from, fromlen, ret, net_from, net_message);
             }
         }
 
@@ -684,10 +707,630 @@ bool NET_GetPacket(netadr_t *net_from, msg_t *net_message, fd_set *fdr)
     return false;
 }
 
+/*
+==================
+NET_DispatchPacket
+
+Hands a received packet to the server or the client
+==================
+*/
+static void NET_DispatchPacket(netadr_t *from, msg_t *netmsg)
+{
+    if (net_dropsim->value > 0.0f && net_dropsim->value <= 100.0f)
+    {
+        // com_dropsim->value percent of incoming packets get dropped.
+        if (rand() < (int)(((double)RAND_MAX) / 100.0 * (double)net_dropsim->value))
+            return;  // drop this packet
+    }
+
+    if (com_sv_running->integer)
+        Com_RunAndTimeServerPacket(from, netmsg);
+    else
+        CL_PacketEvent(*from, netmsg);
+}
+
 //=============================================================================
 
 static char socksBuf[4096];
 
+/*
+==================
+NET_SendError
+
+Reports a failed send to, unless it is one of the expected ones
+==================
+*/
+static void NET_SendError(netadr_t to)
+{
+    int err = socketError;
+
+    // wouldblock is silent
+    if (err == EAGAIN)
+    {
+        return;
+    }
+
+    // some PPP links do not allow broadcasts and return an error
+    if ((err == EADDRNOTAVAIL) && ((to.type == NA_BROADCAST)))
+    {
+        return;
+    }
+
+    Com_Printf("Sys_SendPacket: %s\n", NET_ErrorString());
+}
+
+#ifdef NET_HAVE_MMSG
+/*
+=============================================================================
+
+Batched socket I/O
+
+Between NET_BeginSendBatch and NET_FlushSendBatch, Sys_SendPacket copies
+datagrams into a queue that goes out with one sendmmsg per socket, so a
+server frame's snapshots and fragments cost a handful of syscalls instead
+of one each.  NET_Event drains each readable socket with recvmmsg the same
+way.  Setting net_batch to 0 goes back to one sendto and recvfrom per
+packet.
+
+=============================================================================
+*/
+
+#define NET_BATCH_RECV 32
+#define NET_BATCH_SEND 256
+#define NET_BATCH_SEND_BYTES 0x40000
+
+typedef struct {
+    SOCKET socket;
+    netadr_t to;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int offset;  // into netSendBatch.data
+    int length;
+} netBatchPacket_t;
+
+static struct {
+    bool active;
+    int numPackets;
+    int used;
+    netBatchPacket_t packets[NET_BATCH_SEND];
+    struct mmsghdr hdrs[NET_BATCH_SEND];
+    struct iovec iovs[NET_BATCH_SEND];
+    int order[NET_BATCH_SEND];
+    uint8_t data[NET_BATCH_SEND_BYTES];
+} netSendBatch;
+
+static struct {
+    struct mmsghdr hdrs[NET_BATCH_RECV];
+    struct iovec iovs[NET_BATCH_RECV];
+    struct sockaddr_storage addrs[NET_BATCH_RECV];
+    uint8_t data[NET_BATCH_RECV][MAX_MSGLEN + 1];
+} netRecvBatch;
+
+/*
+==================
+NET_SendBatch
+
+Sends the queued packets, one sendmmsg per socket.  Packets for the same
+socket keep their order.
+==================
+*/
+static void NET_SendBatch(void)
+{
+    netBatchPacket_t *packet;
+    SOCKET socket;
+    int i, j, count, sent, ret;
+
+    for (i = 0; i < netSendBatch.numPackets; i++)
+    {
+        socket = netSendBatch.packets[i].socket;
+        if (socket == INVALID_SOCKET)
+        {
+            continue;  // already went out with an earlier socket
+        }
+
+        count = 0;
+        for (j = i; j < netSendBatch.numPackets; j++)
+        {
+            packet = &netSendBatch.packets[j];
+            if (packet->socket != socket)
+            {
+                continue;
+            }
+
+            netSendBatch.iovs[count].iov_base = netSendBatch.data + packet->offset;
+            netSendBatch.iovs[count].iov_len = packet->length;
+            memset(&netSendBatch.hdrs[count], 0, sizeof(netSendBatch.hdrs[count]));
+            netSendBatch.hdrs[count].msg_hdr.msg_name = &packet->addr;
+            netSendBatch.hdrs[count].msg_hdr.msg_namelen = packet->addrlen;
+            netSendBatch.hdrs[count].msg_hdr.msg_iov = &netSendBatch.iovs[count];
+            netSendBatch.hdrs[count].msg_hdr.msg_iovlen = 1;
+            netSendBatch.order[count++] = j;
+            packet->socket = INVALID_SOCKET;
+        }
+
+        // a failed packet is reported and skipped, like a failed sendto
+        for (sent = 0; sent < count; )
+        {
+            ret = sendmmsg(socket, &netSendBatch.hdrs[sent], count - sent, 0);
+            if (ret == SOCKET_ERROR)
+            {
+                NET_SendError(netSendBatch.packets[netSendBatch.order[sent]].to);
+                sent++;
+            }
+            else
+            {
+                sent += ret;
+            }
+        }
+    }
+
+    netSendBatch.numPackets = 0;
+    netSendBatch.used = 0;
+}
+
+/*
+==================
+NET_QueueBatchPacket
+
+Returns false if the packet has to be sent directly
+==================
+*/
+static bool NET_QueueBatchPacket(SOCKET socket, int length, const void *data, netadr_t to,
+    struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    netBatchPacket_t *packet;
+
+    if (length > NET_BATCH_SEND_BYTES)
+    {
+        NET_SendBatch();
+        return false;
+    }
+
+    if (netSendBatch.numPackets == NET_BATCH_SEND || netSendBatch.used + length > NET_BATCH_SEND_BYTES)
+    {
+        NET_SendBatch();
+    }
+
+    packet = &netSendBatch.packets[netSendBatch.numPackets++];
+    packet->socket = socket;
+    packet->to = to;
+    packet->addr = *addr;
+    packet->addrlen = addrlen;
+    packet->offset = netSendBatch.used;
+    packet->length = length;
+    memcpy(netSendBatch.data + netSendBatch.used, data, length);
+    netSendBatch.used += length;
+
+    return true;
+}
+
+/*
+==================
+NET_ReceiveBatch
+
+Reads everything waiting on a socket, NET_BATCH_RECV datagrams at a time
+==================
+*/
+static void NET_ReceiveBatch(SOCKET socket, int a, bool ip6)
+{
+    netadr_t from;
+    msg_t netmsg;
+    int i, ret;
+
+    memset(&from, 0, sizeof(from));
+
+    do
+    {
+        for (i = 0; i < NET_BATCH_RECV; i++)
+        {
+            netRecvBatch.iovs[i].iov_base = netRecvBatch.data[i];
+            netRecvBatch.iovs[i].iov_len = sizeof(netRecvBatch.data[i]);
+            memset(&netRecvBatch.hdrs[i], 0, sizeof(netRecvBatch.hdrs[i]));
+            netRecvBatch.hdrs[i].msg_hdr.msg_name = &netRecvBatch.addrs[i];
+            netRecvBatch.hdrs[i].msg_hdr.msg_namelen = sizeof(netRecvBatch.addrs[i]);
+            netRecvBatch.hdrs[i].msg_hdr.msg_iov = &netRecvBatch.iovs[i];
+            netRecvBatch.hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = recvmmsg(socket, netRecvBatch.hdrs, NET_BATCH_RECV, MSG_DONTWAIT, NULL);
+        if (ret == SOCKET_ERROR)
+        {
+            int err = socketError;
+
+            if (err != EAGAIN && err != ECONNRESET) Com_Printf("NET_GetPacket: %s\n", NET_ErrorString());
+            return;
+        }
+
+        for (i = 0; i < ret; i++)
+        {
+            MSG_Init(&netmsg, netRecvBatch.data[i], sizeof(netRecvBatch.data[i]));
+            if (NET_ParsePacket(a, ip6, &netRecvBatch.addrs[i], netRecvBatch.hdrs[i].msg_hdr.msg_namelen,
+                    netRecvBatch.hdrs[i].msg_len, &from, &netmsg))
+            {
+                NET_DispatchPacket(&from, &netmsg);
+            }
+        }
+    } while (ret == NET_BATCH_RECV);
+}
+
+/*
+==================
+NET_Bench_f
+
+Bounces packets between two loopback sockets, first with one sendto and
+recvfrom per packet and then with sendmmsg and recvmmsg, and reports the
+packets per second for each.
+
+usage: net_bench [packets] [size]
+==================
+*/
+static void NET_Bench_f(void)
+{
+    struct mmsghdr hdrs[NET_BATCH_RECV];
+    struct iovec iovs[NET_BATCH_RECV];
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    struct timeval timeout;
+    SOCKET tx, rx;
+    uint8_t *buffer;
+    int packets = 100000;
+    int size = 1200;
+    int bufsize = 0x400000;
+    int mode, sent, received, burst, got, ret, start, msec, i;
+
+    if (Cmd_Argc() > 1)
+    {
+        packets = MAX(1, atoi(Cmd_Argv(1)));
+    }
+    if (Cmd_Argc() > 2)
+    {
+        size = MAX(1, MIN(MAX_MSGLEN, atoi(Cmd_Argv(2))));
+    }
+
+    rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (rx == INVALID_SOCKET || tx == INVALID_SOCKET)
+    {
+        Com_Printf("net_bench: socket: %s\n", NET_ErrorString());
+        if (rx != INVALID_SOCKET) closesocket(rx);
+        if (tx != INVALID_SOCKET) closesocket(tx);
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addrlen = sizeof(addr);
+
+    // a lost packet shouldn't hang the server
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(rx, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (bind(rx, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        getsockname(rx, (struct sockaddr *)&addr, &addrlen) == SOCKET_ERROR)
+    {
+        Com_Printf("net_bench: bind: %s\n", NET_ErrorString());
+        closesocket(rx);
+        closesocket(tx);
+        return;
+    }
+
+    // packets sent from slot 0, received into all of them
+    buffer = (uint8_t *)Z_Malloc(NET_BATCH_RECV * size);
+
+    for (mode = 0; mode < 2; mode++)
+    {
+        received = 0;
+        start = Sys_Milliseconds();
+
+        for (sent = 0; sent < packets; sent += burst)
+        {
+            burst = MIN(NET_BATCH_RECV, packets - sent);
+
+            for (i = 0; i < burst; i++)
+            {
+                iovs[i].iov_base = buffer + i * size;
+                iovs[i].iov_len = size;
+                memset(&hdrs[i], 0, sizeof(hdrs[i]));
+                hdrs[i].msg_hdr.msg_name = &addr;
+                hdrs[i].msg_hdr.msg_namelen = sizeof(addr);
+                hdrs[i].msg_hdr.msg_iov = &iovs[i];
+                hdrs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            if (mode == 0)
+            {
+                for (i = 0; i < burst; i++)
+                {
+                    sendto(tx, (const char *)buffer, size, 0, (struct sockaddr *)&addr, sizeof(addr));
+                }
+            }
+            else
+            {
+                for (i = 0; i < burst; i += ret)
+                {
+                    ret = sendmmsg(tx, &hdrs[i], burst - i, 0);
+                    if (ret == SOCKET_ERROR)
+                    {
+                        break;
+                    }
+                }
+            }
+
+            for (got = 0; got < burst; got += ret)
+            {
+                if (mode == 0)
+                {
+                    ret = recvfrom(rx, (char *)buffer + got * size, size, 0, NULL, NULL);
+                    ret = (ret == SOCKET_ERROR) ? SOCKET_ERROR : 1;
+                }
+                else
+                {
+                    for (i = got; i < burst; i++)
+                    {
+                        hdrs[i].msg_hdr.msg_name = NULL;
+                        hdrs[i].msg_hdr.msg_namelen = 0;
+                    }
+                    ret = recvmmsg(rx, &hdrs[got], burst - got, MSG_WAITFORONE, NULL);
+                }
+
+                if (ret == SOCKET_ERROR)
+                {
+                    break;  // timed out, the rest were dropped
+                }
+                received += ret;
+            }
+        }
+
+        msec = MAX(1, Sys_Milliseconds() - start);
+        Com_Printf("%-9s %8i packets of %i bytes in %5i msec, %9.0f packets/sec, %i lost\n",
+            mode == 0 ? "sendto" : "sendmmsg", packets, size, msec, received * 1000.0 / msec, packets - received);
+    }
+
+    Z_Free(buffer);
+    closesocket(rx);
+    closesocket(tx);
+}
+#endif
+
+#ifdef NET_HAVE_EPOLL
+/*
+=============================================================================
+
+epoll waits
+
+NET_SleepUsec keeps the sockets, the console and a timerfd in one epoll
+set, so it can wait for a deadline to the microsecond and still wake for
+packets and console input.  The set is brought up to date with the
+sockets on every call, and NET_Config forgets the sockets it closes.
+
+=============================================================================
+*/
+
+void NET_Event(fd_set *fdr);
+
+#define NET_POLL_CONSOLE 6
+#define NET_POLL_TIMER 7
+#define NET_POLL_SLOTS 8
+
+static struct {
+    int epfd;  // -1 until first used
+    int fds[NET_POLL_SLOTS];  // what is in the set, ip_sockets, ip6_sockets, console, timer
+    bool consoleClosed;  // hung up, stop waiting on it
+} netPoll = {-1, {-1, -1, -1, -1, -1, -1, -1, -1}, false};
+
+/*
+==================
+NET_ForgetPollSockets
+
+Closing a socket takes it out of the epoll set, so the descriptor number
+must not count as registered if it gets reused
+==================
+*/
+static void NET_ForgetPollSockets(void)
+{
+    int i;
+
+    for (i = 0; i < NET_POLL_CONSOLE; i++)
+    {
+        netPoll.fds[i] = -1;
+    }
+}
+
+/*
+==================
+NET_UpdatePollSet
+==================
+*/
+static void NET_UpdatePollSet(void)
+{
+    struct epoll_event ev;
+    int want[NET_POLL_TIMER];
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        want[i] = ip_sockets[i];
+        want[3 + i] = ip6_sockets[i];
+    }
+    want[NET_POLL_CONSOLE] = netPoll.consoleClosed ? -1 : Sys_ConsoleInputFD();
+
+    for (i = 0; i < NET_POLL_TIMER; i++)
+    {
+        if (want[i] == netPoll.fds[i])
+        {
+            continue;
+        }
+
+        if (netPoll.fds[i] != -1)
+        {
+            epoll_ctl(netPoll.epfd, EPOLL_CTL_DEL, netPoll.fds[i], NULL);
+        }
+
+        // a failed add, say for stdin redirected from a file, just
+        // means that descriptor is only checked once a frame as before
+        if (want[i] != -1)
+        {
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.u32 = i;
+            epoll_ctl(netPoll.epfd, EPOLL_CTL_ADD, want[i], &ev);
+        }
+        netPoll.fds[i] = want[i];
+    }
+}
+
+/*
+==================
+NET_InitPoll
+==================
+*/
+static bool NET_InitPoll(void)
+{
+    struct epoll_event ev;
+
+    if (netPoll.epfd != -1)
+    {
+        return true;
+    }
+
+    netPoll.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (netPoll.epfd == -1)
+    {
+        Com_Printf("WARNING: epoll_create1 failed: %s, using select()\n", NET_ErrorString());
+        Cvar_Set("net_epoll", "0");
+        return false;
+    }
+
+    netPoll.fds[NET_POLL_TIMER] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (netPoll.fds[NET_POLL_TIMER] == -1)
+    {
+        Com_Printf("WARNING: timerfd_create failed: %s, using select()\n", NET_ErrorString());
+        close(netPoll.epfd);
+        netPoll.epfd = -1;
+        Cvar_Set("net_epoll", "0");
+        return false;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = NET_POLL_TIMER;
+    epoll_ctl(netPoll.epfd, EPOLL_CTL_ADD, netPoll.fds[NET_POLL_TIMER], &ev);
+
+    return true;
+}
+
+/*
+==================
+NET_PollSleep
+==================
+*/
+static bool NET_PollSleep(int64_t usec)
+{
+    struct epoll_event events[NET_POLL_SLOTS];
+    struct itimerspec timer;
+    uint64_t expirations;
+    fd_set fdr;
+    bool network = false;
+    bool console = false;
+    int i, n, slot;
+
+    NET_UpdatePollSet();
+
+    memset(&timer, 0, sizeof(timer));
+    if (usec > 0)
+    {
+        timer.it_value.tv_sec = usec / 1000000;
+        timer.it_value.tv_nsec = (usec % 1000000) * 1000;
+    }
+    timerfd_settime(netPoll.fds[NET_POLL_TIMER], 0, &timer, NULL);
+
+    n = epoll_wait(netPoll.epfd, events, NET_POLL_SLOTS, usec > 0 ? -1 : 0);
+    if (n == -1)
+    {
+        if (errno != EINTR)
+        {
+            Com_Printf("Warning: epoll_wait() syscall failed: %s\n", NET_ErrorString());
+        }
+        return false;
+    }
+
+    FD_ZERO(&fdr);
+    for (i = 0; i < n; i++)
+    {
+        slot = events[i].data.u32;
+
+        if (slot == NET_POLL_TIMER)
+        {
+            if (read(netPoll.fds[NET_POLL_TIMER], &expirations, sizeof(expirations)) < 0)
+            {
+                // raced with the disarm, nothing to clear
+            }
+        }
+        else if (slot == NET_POLL_CONSOLE)
+        {
+            // after a hangup it would poll readable forever, so take
+            // whatever is left and go back to checking once a frame
+            console = (events[i].events & EPOLLIN) != 0;
+            if (events[i].events & (EPOLLHUP | EPOLLERR))
+            {
+                netPoll.consoleClosed = true;
+            }
+        }
+        else if (netPoll.fds[slot] != -1)
+        {
+            FD_SET(netPoll.fds[slot], &fdr);
+            network = true;
+        }
+    }
+
+    if (network)
+    {
+        NET_Event(&fdr);
+    }
+
+    // read it here so a readable console can't keep waking us up
+    if (console && Com_QueueConsoleInput())
+    {
+        return true;
+    }
+
+    return false;
+}
+#endif
+
+/*
+==================
+NET_BeginSendBatch
+
+Queues packets from Sys_SendPacket until NET_FlushSendBatch
+==================
+*/
+void NET_BeginSendBatch(void)
+{
+#ifdef NET_HAVE_MMSG
+    netSendBatch.active = net_batch->integer != 0;
+#endif
+}
+
+/*
+==================
+NET_FlushSendBatch
+==================
+*/
+void NET_FlushSendBatch(void)
+{
+#ifdef NET_HAVE_MMSG
+    if (netSendBatch.numPackets)
+    {
+        NET_SendBatch();
+    }
+    netSendBatch.active = false;
+#endif
+}
+
 /*
 ==================
 Sys_SendPacket
@@ -717,6 +1360,13 @@ void Sys_SendPacket(int length, const void *data, netadr_t to)
 
     if (usingSocks && to.type == NA_IP)
     {
+#ifdef NET_HAVE_MMSG
+        // keep it behind anything already queued
+        if (netSendBatch.numPackets)
+        {
+            NET_SendBatch();
+        }
+#endif
         socksBuf[0] = 0;  // reserved
         socksBuf[1] = 0;
         socksBuf[2] = 0;  // fragment (not fragmented)
@@ -729,6 +1379,17 @@ void Sys_SendPacket(int length, const void *data, netadr_t to)
     }
     else
     {
+#ifdef NET_HAVE_MMSG
+        if (netSendBatch.active)
+        {
+            if (addr.ss_family == AF_INET &&
+                NET_QueueBatchPacket(ip_sockets[to.alternateProtocol], length, data, to, &addr, sizeof(struct sockaddr_in)))
+                return;
+            else if (addr.ss_family == AF_INET6 &&
+                NET_QueueBatchPacket(ip6_sockets[to.alternateProtocol], length, data, to, &addr, sizeof(struct sockaddr_in6)))
+                return;
+        }
+#endif
         if (addr.ss_family == AF_INET)
             ret = sendto(ip_sockets[to.alternateProtocol], (const char *)data, length, 0, (struct sockaddr *)&addr,
                 sizeof(struct sockaddr_in));
@@ -738,21 +1399,7 @@ void Sys_SendPacket(int length, const void *data, netadr_t to)
     }
     if (ret == SOCKET_ERROR)
     {
-        int err = socketError;
-
-        // wouldblock is silent
-        if (err == EAGAIN)
-        {
-            return;
-        }
-
-        // some PPP links do not allow broadcasts and return an error
-        if ((err == EADDRNOTAVAIL) && ((to.type == NA_BROADCAST)))
-        {
-            return;
-        }
-
-        Com_Printf("Sys_SendPacket: %s\n", NET_ErrorString());
+        NET_SendError(to);
     }
 }
 
@@ -1591,6 +2238,14 @@ static bool NET_GetCvars(void)
 
     net_dropsim = Cvar_Get("net_dropsim", "", CVAR_TEMP);
 
+#ifdef NET_HAVE_MMSG
+    net_batch = Cvar_Get("net_batch", "1", CVAR_ARCHIVE);
+#endif
+
+#ifdef NET_HAVE_EPOLL
+    net_epoll = Cvar_Get("net_epoll", "1", CVAR_ARCHIVE);
+#endif
+
     return modified ? true : false;
 }
 
@@ -1650,6 +2305,9 @@ void NET_Config(bool enableNetworking)
 
     if (stop)
     {
+        NET_FlushSendBatch();
+        NET_ForgetPollSockets();
+
         for (a = 0; a < 3; ++a)
         {
             if (ip_sockets[a] != INVALID_SOCKET)
@@ -1716,6 +2374,9 @@ void NET_Init(void)
     NET_Config(true);
 
     Cmd_AddCommand("net_restart", NET_Restart_f);
+#ifdef NET_HAVE_MMSG
+    Cmd_AddCommand("net_bench", NET_Bench_f);
+#endif
 }
 
 /*
@@ -1752,6 +2413,23 @@ void NET_Event(fd_set *fdr)
     netadr_t from;
     msg_t netmsg;
 
+#ifdef NET_HAVE_MMSG
+    if (net_batch->integer)
+    {
+        int a;
+
+        for (a = 0; a < 3; ++a)
+        {
+            if (ip_sockets[a] != INVALID_SOCKET && FD_ISSET(ip_sockets[a], fdr))
+                NET_ReceiveBatch(ip_sockets[a], a, false);
+
+            if (ip6_sockets[a] != INVALID_SOCKET && FD_ISSET(ip6_sockets[a], fdr))
+                NET_ReceiveBatch(ip6_sockets[a], a, true);
+        }
+        return;
+    }
+#endif
+
     memset(&from, 0, sizeof(from));
 
     while (1)
@@ -1759,19 +2437,7 @@ void NET_Event(fd_set *fdr)
         MSG_Init(&netmsg, bufData, sizeof(bufData));
 
         if (NET_GetPacket(&from, &netmsg, fdr))
-        {
-            if (net_dropsim->value > 0.0f && net_dropsim->value <= 100.0f)
-            {
-                // com_dropsim->value percent of incoming packets get dropped.
-                if (rand() < (int)(((double)RAND_MAX) / 100.0 * (double)net_dropsim->value))
-                    continue;  // drop this packet
-            }
-
-            if (com_sv_running->integer)
-                Com_RunAndTimeServerPacket(&from, &netmsg);
-            else
-                CL_PacketEvent(from, &netmsg);
-        }
+            NET_DispatchPacket(&from, &netmsg);
         else
             break;
     }
@@ -1794,6 +2460,9 @@ void NET_Sleep(int msec)
 
     if (msec < 0) msec = 0;
 
+    // nothing should be left queued while we wait
+    NET_FlushSendBatch();
+
     FD_ZERO(&fdr);
 
     for (a = 0; a < 3; ++a)
@@ -1832,6 +2501,34 @@ void NET_Sleep(int msec)
         NET_Event(&fdr);
 }
 
+/*
+====================
+NET_SleepUsec
+
+Sleeps usec or until something happens on the network or the console.
+Returns true if a console command came in, which is queued as an event.
+Without epoll this is NET_Sleep, a millisecond early, as Com_Frame used
+to call it.
+====================
+*/
+bool NET_SleepUsec(int64_t usec)
+{
+    if (usec < 0) usec = 0;
+
+#ifdef NET_HAVE_EPOLL
+    if (net_epoll->integer && NET_InitPoll())
+    {
+        // nothing should be left queued while we wait
+        NET_FlushSendBatch();
+
+        return NET_PollSleep(usec);
+    }
+#endif
+
+    NET_Sleep(usec < 1000 ? 0 : (int)((usec + 999) / 1000) - 1);
+    return false;
+}
+
 /*
 ====================
 NET_Restart_f
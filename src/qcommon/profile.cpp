@@ -0,0 +1,461 @@
+/*
+===========================================================================
+Copyright (C) 2000-2013 Darklegion Development
+
+This file is part of Tremulous.
+
+Tremulous is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Tremulous is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Tremulous; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// profile.cpp -- named scope timers
+
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "files.h"
+#include "q_shared.h"
+#include "qcommon.h"
+
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_TRACE_EVENTS (1 << 20)
+
+/*
+Every thread records into its own buffer, so Prof_End never waits on
+another thread.  The counters are relaxed atomics that only the owner
+writes; Prof_Print reads them as they are, and a trace is collected
+from the buffers under their locks, which nothing else contends for.
+Buffers are never freed, a new thread takes over one left by a thread
+that has exited.
+*/
+
+struct profSamples_t {
+    std::atomic<int64_t> samples[PROF_SAMPLES];  // nanoseconds, oldest overwritten first
+    std::atomic<int> numSamples;
+    std::atomic<int64_t> calls;
+    int next;  // only used by the owner
+};
+
+struct profEvent_t {
+    int scope;
+    int thread;
+    int64_t start;
+    int64_t duration;
+};
+
+struct profThread_t {
+    int id;  // tid in the trace
+    std::atomic<bool> inUse;
+    std::atomic<int> resets;  // the profResets its samples are from
+    std::atomic<profSamples_t *> scopes[MAX_PROF_SCOPES];  // created on first use
+
+    std::mutex traceLock;
+    std::vector<profEvent_t> trace;
+};
+
+struct profThreadRef_t {
+    profThread_t *thread = nullptr;
+    ~profThreadRef_t()
+    {
+        if (thread) thread->inUse.store(false, std::memory_order_release);
+    }
+};
+
+struct profOpen_t {
+    int scope;
+    int64_t start;
+};
+
+static char profNames[MAX_PROF_SCOPES][64];
+static std::atomic<int> profNumScopes;  // slots below this never change name
+static std::mutex profLock;  // guards registering scopes and threads, and the trace settings
+
+static std::vector<profThread_t *> profThreads;
+static std::atomic<int> profResets;
+
+static std::atomic<int> profTraceFrames;  // server frames left to capture
+static std::atomic<int> profTraceEvents;
+static int64_t profTraceStart;
+static char profTraceFile[MAX_QPATH];
+
+static thread_local profThreadRef_t profSelf;
+static thread_local profOpen_t profStack[PROF_MAX_DEPTH];
+static thread_local int profDepth;
+
+static int64_t Prof_Now(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+=================
+Prof_Register
+=================
+*/
+int Prof_Register(const char *name)
+{
+    std::lock_guard<std::mutex> lock(profLock);
+    int n = profNumScopes.load();
+    char *c;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!Q_stricmp(profNames[i], name))
+        {
+            return i;
+        }
+    }
+
+    if (n == MAX_PROF_SCOPES)
+    {
+        return -1;
+    }
+
+    Q_strncpyz(profNames[n], name, sizeof(profNames[n]));
+
+    // the name goes into the trace file verbatim
+    for (c = profNames[n]; *c; c++)
+    {
+        if (*c == '"' || *c == '\\' || *c < ' ')
+        {
+            *c = '_';
+        }
+    }
+
+    profNumScopes.store(n + 1);
+
+    return n;
+}
+
+/*
+=================
+Prof_Thread
+
+The calling thread's buffer
+=================
+*/
+static profThread_t *Prof_Thread(void)
+{
+    profThread_t *t;
+
+    if (profSelf.thread)
+    {
+        return profSelf.thread;
+    }
+
+    std::lock_guard<std::mutex> lock(profLock);
+
+    for (auto p : profThreads)
+    {
+        bool idle = false;
+        if (p->inUse.compare_exchange_strong(idle, true, std::memory_order_acquire))
+        {
+            return profSelf.thread = p;
+        }
+    }
+
+    t = new profThread_t();
+    t->id = profThreads.size();
+    t->inUse.store(true);
+    t->resets.store(profResets.load());
+    profThreads.push_back(t);
+
+    return profSelf.thread = t;
+}
+
+/*
+=================
+Prof_Begin
+=================
+*/
+void Prof_Begin(int scope)
+{
+    if (scope < 0 || scope >= profNumScopes.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    // too deep, End won't find it and the sample is lost
+    if (profDepth == PROF_MAX_DEPTH)
+    {
+        return;
+    }
+
+    profStack[profDepth].scope = scope;
+    profStack[profDepth].start = Prof_Now();
+    profDepth++;
+}
+
+/*
+=================
+Prof_End
+=================
+*/
+void Prof_End(int scope)
+{
+    int64_t now = Prof_Now();
+    int64_t start, duration;
+    profThread_t *t;
+    profSamples_t *s;
+    int i, resets;
+
+    for (i = profDepth - 1; i >= 0; i--)
+    {
+        if (profStack[i].scope == scope)
+        {
+            break;
+        }
+    }
+
+    if (i < 0)
+    {
+        return;
+    }
+
+    profDepth = i;
+    start = profStack[i].start;
+    duration = now - start;
+
+    t = Prof_Thread();
+
+    // Prof_Reset only asks, the owner clears its own samples
+    resets = profResets.load(std::memory_order_relaxed);
+    if (t->resets.load(std::memory_order_relaxed) != resets)
+    {
+        for (i = 0; i < MAX_PROF_SCOPES; i++)
+        {
+            if ((s = t->scopes[i].load(std::memory_order_relaxed)))
+            {
+                s->numSamples.store(0, std::memory_order_relaxed);
+                s->calls.store(0, std::memory_order_relaxed);
+                s->next = 0;
+            }
+        }
+        t->resets.store(resets, std::memory_order_release);
+    }
+
+    s = t->scopes[scope].load(std::memory_order_relaxed);
+    if (!s)
+    {
+        s = new profSamples_t();
+        t->scopes[scope].store(s, std::memory_order_release);
+    }
+
+    s->samples[s->next].store(duration, std::memory_order_relaxed);
+    s->next = (s->next + 1) % PROF_SAMPLES;
+    if (s->numSamples.load(std::memory_order_relaxed) < PROF_SAMPLES)
+    {
+        s->numSamples.store(s->numSamples.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    s->calls.store(s->calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (profTraceFrames.load(std::memory_order_relaxed) > 0)
+    {
+        if (profTraceEvents.fetch_add(1, std::memory_order_relaxed) >= PROF_MAX_TRACE_EVENTS)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(t->traceLock);
+        t->trace.push_back({scope, t->id, start, duration});
+    }
+}
+
+/*
+=================
+Prof_WriteTrace
+
+Writes the captured events in the Chrome trace event format
+=================
+*/
+static void Prof_WriteTrace(void)
+{
+    std::vector<profEvent_t> events;
+    fileHandle_t f;
+    int64_t base;
+    bool full;
+    size_t i;
+
+    {
+        std::lock_guard<std::mutex> lock(profLock);
+
+        for (auto t : profThreads)
+        {
+            std::lock_guard<std::mutex> traceLock(t->traceLock);
+            events.insert(events.end(), t->trace.begin(), t->trace.end());
+            t->trace.clear();
+        }
+        base = profTraceStart;
+        full = profTraceEvents.load() > PROF_MAX_TRACE_EVENTS;
+    }
+
+    f = FS_FOpenFileWrite(profTraceFile);
+    if (!f)
+    {
+        Com_Printf("Couldn't open %s for writing.\n", profTraceFile);
+        return;
+    }
+
+    FS_Printf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (i = 0; i < events.size(); i++)
+    {
+        const profEvent_t *ev = &events[i];
+
+        FS_Printf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}\n",
+            i ? "," : "", profNames[ev->scope], ev->thread,
+            (ev->start - base) / 1000.0, ev->duration / 1000.0);
+    }
+    FS_Printf(f, "]}\n");
+    FS_FCloseFile(f);
+
+    Com_Printf("Wrote %d trace events to %s.\n", (int)events.size(), profTraceFile);
+    if (full)
+    {
+        Com_Printf("WARNING: trace stopped recording after %d events\n", PROF_MAX_TRACE_EVENTS);
+    }
+}
+
+/*
+=================
+Prof_EndFrame
+=================
+*/
+void Prof_EndFrame(void)
+{
+    if (profTraceFrames.load() > 0 && profTraceFrames.fetch_sub(1) == 1)
+    {
+        Prof_WriteTrace();
+    }
+}
+
+/*
+=================
+Prof_BeginTrace
+=================
+*/
+void Prof_BeginTrace(const char *filename, int frames)
+{
+    std::lock_guard<std::mutex> lock(profLock);
+
+    if (frames < 1)
+    {
+        frames = 1;
+    }
+
+    Q_strncpyz(profTraceFile, filename, sizeof(profTraceFile));
+    COM_DefaultExtension(profTraceFile, sizeof(profTraceFile), ".json");
+
+    // anything recorded after the last trace was written
+    for (auto t : profThreads)
+    {
+        std::lock_guard<std::mutex> traceLock(t->traceLock);
+        t->trace.clear();
+    }
+    profTraceEvents.store(0);
+    profTraceStart = Prof_Now();
+    profTraceFrames.store(frames);
+
+    Com_Printf("Tracing %d server frames to %s.\n", frames, profTraceFile);
+}
+
+/*
+=================
+Prof_Reset
+=================
+*/
+void Prof_Reset(void)
+{
+    profResets.fetch_add(1);
+}
+
+/*
+=================
+Prof_Print
+
+Min, average, 99th percentile and max over the last PROF_SAMPLES
+calls of each scope on each thread, in microseconds
+=================
+*/
+void Prof_Print(void)
+{
+    std::vector<int64_t> samples;
+    std::vector<profThread_t *> threads;
+    int n = profNumScopes.load();
+    int resets = profResets.load();
+    int64_t calls, total;
+    profSamples_t *s;
+    int i, j, count;
+
+    {
+        std::lock_guard<std::mutex> lock(profLock);
+        threads = profThreads;
+    }
+
+    Com_Printf("%-28s %10s %9s %9s %9s %9s\n", "scope", "calls", "min", "avg", "p99", "max");
+
+    for (i = 0; i < n; i++)
+    {
+        samples.clear();
+        calls = 0;
+
+        for (auto t : threads)
+        {
+            // samples from before a reset the owner hasn't seen yet
+            if (t->resets.load(std::memory_order_acquire) != resets)
+            {
+                continue;
+            }
+
+            if (!(s = t->scopes[i].load(std::memory_order_acquire)))
+            {
+                continue;
+            }
+
+            count = s->numSamples.load(std::memory_order_acquire);
+            for (j = 0; j < count; j++)
+            {
+                samples.push_back(s->samples[j].load(std::memory_order_relaxed));
+            }
+            calls += s->calls.load(std::memory_order_relaxed);
+        }
+
+        if (samples.empty())
+        {
+            continue;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        for (total = 0, j = 0; j < (int)samples.size(); j++)
+        {
+            total += samples[j];
+        }
+
+        Com_Printf("%-28s %10lld %9.1f %9.1f %9.1f %9.1f\n", profNames[i], (long long)calls,
+            samples[0] / 1000.0, total / 1000.0 / samples.size(),
+            samples[(samples.size() - 1) * 99 / 100] / 1000.0, samples.back() / 1000.0);
+    }
+
+    Com_Printf("usec over the last %d calls of each scope on each thread\n", PROF_SAMPLES);
+    if (profTraceFrames.load() > 0)
+    {
+        Com_Printf("tracing to %s, %d frames left\n", profTraceFile, profTraceFrames.load());
+    }
+}
@@ -0,0 +1,81 @@
+/*
+===========================================================================
+Copyright (C) 2000-2013 Darklegion Development
+
+This file is part of Tremulous.
+
+Tremulous is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Tremulous is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Tremulous; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H 1
+
+/*
+==============================================================
+
+PROFILE
+
+Named scope timers with nanosecond resolution.  Every scope
+keeps its last PROF_SAMPLES durations on each thread for
+min/avg/p99, and
+while a trace is being captured every begin/end pair is also
+logged for a Chrome trace (chrome://tracing) JSON file.
+
+Begin/End may be called from any thread; nesting is tracked
+per thread, so a job only ever closes scopes it opened.
+
+==============================================================
+*/
+
+#define MAX_PROF_SCOPES 128
+#define PROF_SAMPLES 1024
+
+int Prof_Register(const char *name);
+// returns the handle for name, creating the scope on first use.
+// -1 once MAX_PROF_SCOPES is reached; Begin/End ignore bad handles
+
+void Prof_Begin(int scope);
+void Prof_End(int scope);
+// ends the innermost open scope with this handle on the calling
+// thread, dropping anything opened inside it that never ended
+
+void Prof_EndFrame(void);
+// called after every SV_Frame, finishes a trace capture when its
+// frame count runs out
+
+void Prof_Print(void);
+void Prof_Reset(void);
+void Prof_BeginTrace(const char *filename, int frames);
+
+class profScope_t
+{
+public:
+    explicit profScope_t(int scope) : scope(scope) { Prof_Begin(scope); }
+    ~profScope_t() { Prof_End(scope); }
+
+private:
+    profScope_t(const profScope_t &) = delete;
+    profScope_t &operator=(const profScope_t &) = delete;
+
+    int scope;
+};
+
+// times the rest of the enclosing block as name
+#define PROF_SCOPE(var, name) \
+    static const int var##Handle = Prof_Register(name); \
+    profScope_t var(var##Handle)
+
+#endif
@@ -166,6 +166,7 @@ typedef struct {
 void		Com_QueueEvent( int time, sysEventType_t type, int value, int value2, int ptrLength, void *ptr );
 int			Com_EventLoop( void );
 sysEvent_t	Com_GetSystemEvent( void );
+bool		Com_QueueConsoleInput( void );
 
 char		*CopyString( const char *in );
 void		Info_Print( const char *s );
@@ -192,6 +193,25 @@ void		Com_RunAndTimeServerPacket(struct netadr_t *evFrom, struct msg_t *buf);
 
 bool	Com_IsVoipTarget(uint8_t *voipTargets, int voipTargetsSize, int clientNum);
 
+// bit counting for the engine's entity bitsets and the zone's free list
+// maps; Q_ctz( 0 ) and Q_clz( 0 ) are undefined
+#ifdef __GNUC__
+static inline int Q_popcount( unsigned int x ) { return __builtin_popcount( x ); }
+static inline int Q_ctz( unsigned int x ) { return __builtin_ctz( x ); }
+static inline int Q_clz( unsigned int x ) { return __builtin_clz( x ); }
+#else
+static inline int Q_popcount( unsigned int x ) {
+	x = x - ( ( x >> 1 ) & 0x55555555 );
+	x = ( x & 0x33333333 ) + ( ( x >> 2 ) & 0x33333333 );
+	return ( ( ( x + ( x >> 4 ) ) & 0x0F0F0F0F ) * 0x01010101 ) >> 24;
+}
+static inline int Q_ctz( unsigned int x ) { return Q_popcount( ( x & ( ~x + 1 ) ) - 1 ); }
+static inline int Q_clz( unsigned int x ) {
+	x |= x >> 1; x |= x >> 2; x |= x >> 4; x |= x >> 8; x |= x >> 16;
+	return 32 - Q_popcount( x );
+}
+#endif
+
 void		Com_StartupVariable( const char *match );
 // checks for and removes command line "+set var arg" constructs
 // if match is NULL, all set commands will be executed, otherwise
@@ -383,6 +403,7 @@ void SV_PacketEvent( struct netadr_t from, struct msg_t *msg );
 int SV_FrameMsec(void);
 bool SV_GameCommand( void );
 int SV_SendQueuedPackets(void);
+void SV_FlushSnapshots(void);
 
 //
 // UI interface
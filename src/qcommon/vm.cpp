@@ -40,11 +40,14 @@ and one exported function: Perform
 #include "cvar.h"
 #include "files.h"
 #include "sys/sys_shared.h"
+#include "sys/sys_loadlib.h"
 
 
 vm_t	*currentVM = NULL;
 vm_t	*lastVM    = NULL;
 int		vm_debugLevel;
+cvar_t	*vm_jitOptimize;
+cvar_t	*vm_profile;
 
 // used by Com_Error to get rid of running vm's before longjmp
 static int forced_unload;
@@ -55,6 +58,10 @@ vm_t	vmTable[MAX_VM];
 
 void VM_VmInfo_f( void );
 void VM_VmProfile_f( void );
+void VM_VmSample_f( void );
+#ifndef NO_VM_COMPILED
+void VM_JitTest_f( void );
+#endif
 
 
 
@@ -79,9 +86,15 @@ void VM_Init( void ) {
 	Cvar_Get( "vm_cgame", "2", CVAR_ARCHIVE );	// !@# SHIP WITH SET TO 2
 	Cvar_Get( "vm_game", "2", CVAR_ARCHIVE );	// !@# SHIP WITH SET TO 2
 	Cvar_Get( "vm_ui", "2", CVAR_ARCHIVE );		// !@# SHIP WITH SET TO 2
+	vm_jitOptimize = Cvar_Get( "vm_jitOptimize", "1", CVAR_ARCHIVE );
+	vm_profile = Cvar_Get( "vm_profile", "0", 0 );
 
 	Cmd_AddCommand ("vmprofile", VM_VmProfile_f );
 	Cmd_AddCommand ("vminfo", VM_VmInfo_f );
+	Cmd_AddCommand ("vmsample", VM_VmSample_f );
+#ifndef NO_VM_COMPILED
+	Cmd_AddCommand ("vm_jittest", VM_JitTest_f );
+#endif
 
 	::memset( vmTable, 0, sizeof( vmTable ) );
 }
@@ -653,6 +666,11 @@ vm_t *VM_Create( const char *module, intptr_t (*systemCalls)(intptr_t *),
 	vm->instructionCount = header->instructionCount;
 	vm->instructionPointers = (intptr_t*)Hunk_Alloc(vm->instructionCount * sizeof(*vm->instructionPointers), h_high);
 
+	// the compiler emits code that keeps this up to date, so it has to exist first
+	if ( vm_profile->integer ) {
+		vm->profileStack = (vmProfileStack_t*)Hunk_Alloc( sizeof( *vm->profileStack ), h_high );
+	}
+
 	// copy or compile the instructions
 	vm->codeLength = header->codeLength;
 
@@ -711,6 +729,8 @@ void VM_Free( vm_t *vm ) {
 		}
 	}
 
+	VM_ProfileForget(vm);
+
 	if(vm->destroy)
 		vm->destroy(vm);
 
@@ -754,6 +774,22 @@ void VM_ClearCallLevel(vm_t *vm) {
 	vm->callLevel = 0;
 }
 
+/*
+=================
+VM_DllFunction
+
+Looks up an optional export of a native module beyond vmMain and
+dllEntry.  Returns NULL for a qvm or if the module does not have it
+=================
+*/
+void *VM_DllFunction( vm_t *vm, const char *name ) {
+	if ( !vm || !vm->dllHandle ) {
+		return NULL;
+	}
+
+	return Sys_LoadFunction( vm->dllHandle, name );
+}
+
 void *VM_ArgPtr( intptr_t intValue ) {
 	if ( !intValue ) {
 		return NULL;
@@ -770,6 +806,29 @@ void *VM_ArgPtr( intptr_t intValue ) {
 	}
 }
 
+void *VM_ArgArray( intptr_t intValue, size_t size, int count ) {
+	size_t	length;
+
+	if ( !intValue || currentVM == NULL ) {
+		return NULL;
+	}
+
+	if ( count < 0 ) {
+		Com_Error( ERR_DROP, "VM_ArgArray: negative count %i", count );
+	}
+
+	if ( !currentVM->entryPoint ) {
+		length = size * count;
+		if ( (size_t)intValue > (size_t)currentVM->dataMask
+			|| length > (size_t)currentVM->dataMask + 1 - intValue ) {
+			Com_Error( ERR_DROP, "VM_ArgArray: %i bytes at 0x%x out of range",
+				(int)length, (unsigned int)intValue );
+		}
+	}
+
+	return VM_ArgPtr( intValue );
+}
+
 void *VM_ExplicitArgPtr( vm_t *vm, intptr_t intValue ) {
 	if ( !intValue ) {
 		return NULL;
@@ -829,6 +888,11 @@ intptr_t QDECL VM_Call( vm_t *vm, int callnum, ... )
 	  Com_Printf( "VM_Call( %d )\n", callnum );
 	}
 
+	// a Com_Error out of the vm leaves stale frames behind
+	if ( vm->profileStack && !vm->callLevel ) {
+		vm->profileStack->depth = 0;
+	}
+
 	++vm->callLevel;
 	// if we have a dll loaded, call it directly
 	if ( vm->entryPoint ) {
@@ -944,6 +1008,53 @@ void VM_VmProfile_f( void ) {
 	Z_Free( sorted );
 }
 
+/*
+==============
+VM_VmSample_f
+
+vmsample start [vm] [hz] | stop | flat [count] | graph [count] | folded [file]
+==============
+*/
+void VM_VmSample_f( void ) {
+	const char	*cmd, *name;
+	vm_t		*vm;
+	int			i;
+
+	cmd = Cmd_Argv( 1 );
+
+	if ( !Q_stricmp( cmd, "start" ) ) {
+		name = Cmd_Argc( ) > 2 ? Cmd_Argv( 2 ) : "game";
+		for ( i = 0 ; i < MAX_VM ; i++ ) {
+			if ( vmTable[i].name[0] && !Q_stricmp( vmTable[i].name, name ) ) {
+				break;
+			}
+		}
+		if ( i == MAX_VM ) {
+			Com_Printf( "No vm named %s.\n", name );
+			return;
+		}
+
+		vm = &vmTable[i];
+		if ( !VM_ProfileStart( vm, Cmd_Argc( ) > 3 ? atoi( Cmd_Argv( 3 ) ) : 1000 ) ) {
+			Com_Printf( "%s was loaded without vm_profile 1, set it and reload the vm.\n", vm->name );
+			return;
+		}
+		Com_Printf( "Sampling %s.\n", vm->name );
+	} else if ( !Q_stricmp( cmd, "stop" ) ) {
+		VM_ProfileStop( );
+		VM_ProfileStatus( );
+	} else if ( !Q_stricmp( cmd, "flat" ) ) {
+		VM_ProfileFlat( Cmd_Argc( ) > 2 ? atoi( Cmd_Argv( 2 ) ) : 30 );
+	} else if ( !Q_stricmp( cmd, "graph" ) ) {
+		VM_ProfileGraph( Cmd_Argc( ) > 2 ? atoi( Cmd_Argv( 2 ) ) : 10 );
+	} else if ( !Q_stricmp( cmd, "folded" ) ) {
+		VM_ProfileWriteFolded( Cmd_Argc( ) > 2 ? Cmd_Argv( 2 ) : "vmsample.folded" );
+	} else {
+		Com_Printf( "usage: vmsample start [vm] [hz] | stop | flat [count] | graph [count] | folded [file]\n" );
+		VM_ProfileStatus( );
+	}
+}
+
 /*
 ==============
 VM_VmInfo_f
@@ -976,6 +1087,468 @@ void VM_VmInfo_f( void ) {
 	}
 }
 
+#ifndef NO_VM_COMPILED
+/*
+==============================================================================
+
+JIT DIFFERENTIAL TEST
+
+Builds a few small bytecode programs in memory that follow the code patterns
+q3lcc emits, runs them through the interpreter and the compiler without
+and with its vm_jitOptimize peephole pass, and compares the results. The timings double as a benchmark of the three execution paths.
+
+==============================================================================
+*/
+
+#define	VM_TEST_DATA_SIZE	0x20000
+#define	VM_TEST_ARRAY		0x1000
+#define	VM_TEST_BYTES		0x2000
+#define	VM_TEST_SUM			0x3000
+
+typedef struct {
+	byte	code[2048];
+	int		length;
+	int		instructions;
+} vmTestProgram_t;
+
+typedef struct {
+	const char	*name;
+	void		(*build)( vmTestProgram_t *prog );
+	int			args[2];
+} vmTestCase_t;
+
+static void VM_TestOp( vmTestProgram_t *prog, int op ) {
+	prog->code[prog->length++] = op;
+	prog->instructions++;
+}
+
+static int VM_TestOp4( vmTestProgram_t *prog, int op, int v ) {
+	int		ofs;
+
+	VM_TestOp( prog, op );
+	ofs = prog->length;
+	prog->code[prog->length++] = v & 0xff;
+	prog->code[prog->length++] = ( v >> 8 ) & 0xff;
+	prog->code[prog->length++] = ( v >> 16 ) & 0xff;
+	prog->code[prog->length++] = ( v >> 24 ) & 0xff;
+	return ofs;
+}
+
+static void VM_TestOp1( vmTestProgram_t *prog, int op, int v ) {
+	VM_TestOp( prog, op );
+	prog->code[prog->length++] = v;
+}
+
+static void VM_TestPatch( vmTestProgram_t *prog, int ofs, int v ) {
+	prog->code[ofs] = v & 0xff;
+	prog->code[ofs + 1] = ( v >> 8 ) & 0xff;
+	prog->code[ofs + 2] = ( v >> 16 ) & 0xff;
+	prog->code[ofs + 3] = ( v >> 24 ) & 0xff;
+}
+
+// local = local op local
+static void VM_TestLocalOp( vmTestProgram_t *prog, int dest, int a, int b, int op ) {
+	VM_TestOp4( prog, OP_LOCAL, dest );
+	VM_TestOp4( prog, OP_LOCAL, a );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LOCAL, b );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, op );
+	VM_TestOp( prog, OP_STORE4 );
+}
+
+// local = local + 1
+static void VM_TestLocalInc( vmTestProgram_t *prog, int local ) {
+	VM_TestOp4( prog, OP_LOCAL, local );
+	VM_TestOp4( prog, OP_LOCAL, local );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 1 );
+	VM_TestOp( prog, OP_ADD );
+	VM_TestOp( prog, OP_STORE4 );
+}
+
+// local = c
+static void VM_TestLocalConst( vmTestProgram_t *prog, int local, int c ) {
+	VM_TestOp4( prog, OP_LOCAL, local );
+	VM_TestOp4( prog, OP_CONST, c );
+	VM_TestOp( prog, OP_STORE4 );
+}
+
+/*
+==============
+VM_TestBuildLocals
+
+int vmMain( int n, int seed ) {
+	int i, s, t;
+	i = 0; s = seed;
+	do {
+		s += i; s ^= s << 5; s &= ~i | 0x7ffff; s |= i & 3; t = s - i;
+		if( t < 0 ) s++;
+	} while( ++i < n );
+	return s;
+}
+==============
+*/
+static void VM_TestBuildLocals( vmTestProgram_t *prog ) {
+	int		loop, skip;
+
+	VM_TestOp4( prog, OP_ENTER, 64 );
+	VM_TestLocalConst( prog, 32, 0 );
+	VM_TestOp4( prog, OP_LOCAL, 36 );		// s = seed
+	VM_TestOp4( prog, OP_LOCAL, 76 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_STORE4 );
+	VM_TestOp4( prog, OP_LOCAL, 40 );		// limit = n
+	VM_TestOp4( prog, OP_LOCAL, 72 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_STORE4 );
+
+	loop = prog->instructions;
+	VM_TestLocalOp( prog, 36, 36, 32, OP_ADD );
+	VM_TestOp4( prog, OP_LOCAL, 36 );		// s ^= s << 5
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 5 );
+	VM_TestOp( prog, OP_LSH );
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_BXOR );
+	VM_TestOp( prog, OP_STORE4 );
+	VM_TestOp4( prog, OP_LOCAL, 48 );		// m = ~i | 0x7ffff
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_BCOM );
+	VM_TestOp4( prog, OP_CONST, 0x7ffff );
+	VM_TestOp( prog, OP_BOR );
+	VM_TestOp( prog, OP_STORE4 );
+	VM_TestLocalOp( prog, 36, 36, 48, OP_BAND );
+	VM_TestOp4( prog, OP_LOCAL, 48 );		// m = i & 3
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 3 );
+	VM_TestOp( prog, OP_BAND );
+	VM_TestOp( prog, OP_STORE4 );
+	VM_TestLocalOp( prog, 36, 36, 48, OP_BOR );
+	VM_TestLocalOp( prog, 44, 36, 32, OP_SUB );
+	VM_TestOp4( prog, OP_LOCAL, 44 );		// if( t < 0 )
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 0 );
+	skip = VM_TestOp4( prog, OP_GEI, 0 );
+	VM_TestLocalInc( prog, 36 );
+	VM_TestPatch( prog, skip, prog->instructions );
+	VM_TestLocalInc( prog, 32 );
+	VM_TestOp4( prog, OP_LOCAL, 32 );		// while( i < limit )
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LOCAL, 40 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LTI, loop );
+
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LEAVE, 64 );
+}
+
+/*
+==============
+VM_TestBuildGlobals
+
+int array[256]; byte bytes[256]; int sum;
+
+int vmMain( int n, int seed ) {
+	int i, s;
+	for( i = 0; i < 256; i++ ) array[i] = i * 7 ^ seed;
+	for( s = 0, i = 0; i < 256; i++ ) { s += array[i]; bytes[i] = s; }
+	sum = s;
+	return s;
+}
+==============
+*/
+static void VM_TestBuildGlobals( vmTestProgram_t *prog ) {
+	int		loop;
+
+	VM_TestOp4( prog, OP_ENTER, 48 );
+	VM_TestLocalConst( prog, 32, 0 );
+
+	loop = prog->instructions;
+	VM_TestOp4( prog, OP_CONST, VM_TEST_ARRAY );	// array[i] = i * 7 ^ seed
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 2 );
+	VM_TestOp( prog, OP_LSH );
+	VM_TestOp( prog, OP_ADD );
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 7 );
+	VM_TestOp( prog, OP_MULI );
+	VM_TestOp4( prog, OP_LOCAL, 60 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_BXOR );
+	VM_TestOp( prog, OP_STORE4 );
+	VM_TestLocalInc( prog, 32 );
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 256 );
+	VM_TestOp4( prog, OP_LTI, loop );
+
+	VM_TestLocalConst( prog, 36, 0 );
+	VM_TestLocalConst( prog, 32, 0 );
+
+	loop = prog->instructions;
+	VM_TestOp4( prog, OP_LOCAL, 36 );		// s += array[i]
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, VM_TEST_ARRAY );
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 2 );
+	VM_TestOp( prog, OP_LSH );
+	VM_TestOp( prog, OP_ADD );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_ADD );
+	VM_TestOp( prog, OP_STORE4 );
+	VM_TestOp4( prog, OP_CONST, VM_TEST_BYTES );	// bytes[i] = s
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_ADD );
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_STORE1 );
+	VM_TestLocalInc( prog, 32 );
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_CONST, 256 );
+	VM_TestOp4( prog, OP_LTI, loop );
+
+	VM_TestOp4( prog, OP_CONST, VM_TEST_SUM );	// sum = s
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_STORE4 );
+
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LEAVE, 48 );
+}
+
+/*
+==============
+VM_TestBuildCalls
+
+static int f( int x ) { return x * x + 1; }
+
+int vmMain( int n ) {
+	int i = 0, s = 0;
+	do { s += f( i ); } while( ++i < n );
+	return s;
+}
+==============
+*/
+static void VM_TestBuildCalls( vmTestProgram_t *prog ) {
+	int		loop, func;
+
+	VM_TestOp4( prog, OP_ENTER, 48 );
+	VM_TestLocalConst( prog, 32, 0 );
+	VM_TestLocalConst( prog, 36, 0 );
+
+	loop = prog->instructions;
+	VM_TestOp4( prog, OP_LOCAL, 36 );		// s += f( i )
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp1( prog, OP_ARG, 8 );
+	func = VM_TestOp4( prog, OP_CONST, 0 );
+	VM_TestOp( prog, OP_CALL );
+	VM_TestOp( prog, OP_ADD );
+	VM_TestOp( prog, OP_STORE4 );
+	VM_TestLocalInc( prog, 32 );
+	VM_TestOp4( prog, OP_LOCAL, 32 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LOCAL, 56 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LTI, loop );
+
+	VM_TestOp4( prog, OP_LOCAL, 36 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LEAVE, 48 );
+
+	VM_TestPatch( prog, func, prog->instructions );
+	VM_TestOp4( prog, OP_ENTER, 16 );
+	VM_TestOp4( prog, OP_LOCAL, 24 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp4( prog, OP_LOCAL, 24 );
+	VM_TestOp( prog, OP_LOAD4 );
+	VM_TestOp( prog, OP_MULI );
+	VM_TestOp4( prog, OP_CONST, 1 );
+	VM_TestOp( prog, OP_ADD );
+	VM_TestOp4( prog, OP_LEAVE, 16 );
+}
+
+static const vmTestCase_t vmTestCases[] = {
+	{ "locals", VM_TestBuildLocals, { 1000, 0x1234567 } },
+	{ "globals", VM_TestBuildGlobals, { 0, 0x5a5a5a5 } },
+	{ "calls", VM_TestBuildCalls, { 1000, 0 } }
+};
+
+static intptr_t VM_TestSystemCall( intptr_t *args ) {
+	Com_Error( ERR_DROP, "vm_jittest: unexpected system call %i", (int)args[0] );
+	return 0;
+}
+
+/*
+==============
+VM_TestRun
+
+Prepares a vm for the given mode (0 interpreted, 1 compiled, 2 compiled and
+optimized), checks its results against the reference image and returns the
+average time per call in microseconds, or -1 on failure
+==============
+*/
+static float VM_TestRun( const vmTestCase_t *test, vmHeader_t *header, int mode,
+		byte *image, byte *reference, int *result, int *codeSize, int count ) {
+	vm_t		vm;
+	byte		jumpTableTargets[4];
+	int			args[MAX_VMMAIN_ARGS];
+	int			i, value;
+	int64_t		start, elapsed;
+	bool		ok;
+
+	::memset( &vm, 0, sizeof( vm ) );
+	Q_strncpyz( vm.name, test->name, sizeof( vm.name ) );
+	vm.systemCall = VM_TestSystemCall;
+	vm.dataBase = image;
+	vm.dataMask = VM_TEST_DATA_SIZE - 1;
+	vm.codeLength = header->codeLength;
+	vm.instructionCount = header->instructionCount;
+	vm.instructionPointers = (intptr_t *)Z_Malloc( vm.instructionCount * sizeof( *vm.instructionPointers ) );
+	// an empty jump table still lets the compiler trust its jump target map
+	vm.jumpTableTargets = jumpTableTargets;
+	vm.numJumpTableTargets = 0;
+
+	if ( mode == 0 ) {
+		VM_PrepareInterpreterCode( &vm, header, (byte *)Z_Malloc( vm.codeLength * 4 ) );
+	} else {
+		// set on the vm rather than through the cvar, so an error
+		// can't leave the cvar changed
+		vm.jitOptimize = mode == 2 ? 1 : -1;
+		vm.compiled = true;
+		VM_Compile( &vm, header );
+		if ( !vm.compiled ) {
+			Z_Free( vm.instructionPointers );
+			return -1;
+		}
+	}
+	*codeSize = vm.codeLength;
+
+	vm.programStack = vm.dataMask + 1;
+	vm.stackBottom = vm.programStack - PROGRAM_STACK_SIZE;
+
+	::memset( args, 0, sizeof( args ) );
+	args[0] = test->args[0];
+	args[1] = test->args[1];
+
+	// one checked call from a clean image
+	::memset( image, 0, VM_TEST_DATA_SIZE );
+	value = mode ? VM_CallCompiled( &vm, args ) : VM_CallInterpreted( &vm, args );
+
+	ok = true;
+	if ( mode == 0 ) {
+		*result = value;
+		::memcpy( reference, image, vm.stackBottom );
+	} else if ( value != *result ) {
+		Com_Printf( S_COLOR_RED "%s: %s returned %i, interpreter returned %i\n",
+			test->name, mode == 2 ? "optimized jit" : "jit", value, *result );
+		ok = false;
+	} else if ( ::memcmp( reference, image, vm.stackBottom ) ) {
+		Com_Printf( S_COLOR_RED "%s: %s data image differs from the interpreter\n",
+			test->name, mode == 2 ? "optimized jit" : "jit" );
+		ok = false;
+	}
+
+	start = Sys_Microseconds( );
+	for ( i = 0; i < count; i++ ) {
+		if ( mode ) {
+			VM_CallCompiled( &vm, args );
+		} else {
+			VM_CallInterpreted( &vm, args );
+		}
+	}
+	elapsed = Sys_Microseconds( ) - start;
+
+	if ( vm.destroy ) {
+		vm.destroy( &vm );
+	} else {
+		Z_Free( vm.codeBase );
+	}
+	Z_Free( vm.instructionPointers );
+
+	return ok ? (float)elapsed / count : -1;
+}
+
+/*
+==============
+VM_JitTest_f
+
+vm_jittest [iterations]
+==============
+*/
+void VM_JitTest_f( void ) {
+	vmTestProgram_t	prog;
+	vmHeader_t	*header;
+	vm_t		*savedVM;
+	byte		*image, *reference;
+	float		usec[3];
+	int			codeSize[3];
+	int			result, count, failures;
+	int			i, mode;
+
+	count = Cmd_Argc( ) > 1 ? atoi( Cmd_Argv( 1 ) ) : 2000;
+	if ( count < 1 ) {
+		count = 1;
+	}
+
+	savedVM = currentVM;
+	header = (vmHeader_t *)Z_Malloc( sizeof( *header ) + sizeof( prog.code ) );
+	image = (byte *)Z_Malloc( VM_TEST_DATA_SIZE );
+	reference = (byte *)Z_Malloc( VM_TEST_DATA_SIZE );
+	failures = 0;
+
+	Com_Printf( "usec per call over %i calls, code size in bytes\n", count );
+	for ( i = 0; i < (int)ARRAY_LEN( vmTestCases ); i++ ) {
+		::memset( &prog, 0, sizeof( prog ) );
+		vmTestCases[i].build( &prog );
+
+		::memset( header, 0, sizeof( *header ) );
+		header->vmMagic = VM_MAGIC_VER2;
+		header->instructionCount = prog.instructions;
+		header->codeOffset = sizeof( *header );
+		header->codeLength = prog.length;
+		::memcpy( (byte *)header + header->codeOffset, prog.code, prog.length );
+
+		for ( mode = 0; mode < 3; mode++ ) {
+			usec[mode] = VM_TestRun( &vmTestCases[i], header, mode, image, reference,
+				&result, &codeSize[mode], count );
+			if ( usec[mode] < 0 ) {
+				failures++;
+			}
+		}
+
+		Com_Printf( "%-8s interp %8.3f  jit %8.3f (%i)  jit-opt %8.3f (%i)\n", vmTestCases[i].name,
+			usec[0], usec[1], codeSize[1], usec[2], codeSize[2] );
+	}
+
+	currentVM = savedVM;
+	Z_Free( reference );
+	Z_Free( image );
+	Z_Free( header );
+
+	if ( failures ) {
+		Com_Printf( S_COLOR_RED "vm_jittest: %i failure(s)\n", failures );
+	} else {
+		Com_Printf( "vm_jittest: all programs match the interpreter\n" );
+	}
+}
+#endif
+
 /*
 ===============
 VM_LogSyscalls
@@ -47,6 +47,8 @@ void	VM_Forced_Unload_Start(void);
 void	VM_Forced_Unload_Done(void);
 void	VM_ClearCallLevel(vm_t *vm);
 vm_t	*VM_Restart(vm_t *vm, bool unpure);
+void	*VM_DllFunction( vm_t *vm, const char *name );
+// an extra export of a native module, NULL for a qvm
 
 intptr_t		QDECL VM_Call( vm_t *vm, int callNum, ... );
 
@@ -54,6 +56,9 @@ void	VM_Debug( int level );
 
 void	*VM_ArgPtr( intptr_t intValue );
 void	*VM_ExplicitArgPtr( vm_t *vm, intptr_t intValue );
+void	*VM_ArgArray( intptr_t intValue, size_t size, int count );
+// like VM_ArgPtr, but drops the game if count elements of size bytes
+// would run past the end of a qvm's data segment
 
 #define	VMA(x) VM_ArgPtr(args[x])
 static ID_INLINE float _vmf(intptr_t x)
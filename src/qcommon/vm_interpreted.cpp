@@ -170,6 +170,17 @@ VM_PrepareInterpreter
 ====================
 */
 void VM_PrepareInterpreter( vm_t *vm, vmHeader_t *header ) {
+	VM_PrepareInterpreterCode( vm, header, (byte *)Hunk_Alloc( vm->codeLength*4, h_high ) );			// we're now int aligned
+}
+
+/*
+====================
+VM_PrepareInterpreterCode
+
+Like VM_PrepareInterpreter, into codeLength * 4 bytes the caller owns
+====================
+*/
+void VM_PrepareInterpreterCode( vm_t *vm, vmHeader_t *header, byte *codeBuffer ) {
 	int		op;
 	int		byte_pc;
 	int		int_pc;
@@ -177,7 +188,7 @@ void VM_PrepareInterpreter( vm_t *vm, vmHeader_t *header ) {
 	int		instruction;
 	int		*codeBase;
 
-	vm->codeBase = (unsigned char*)Hunk_Alloc( vm->codeLength*4, h_high );			// we're now int aligned
+	vm->codeBase = codeBuffer;
 //	memcpy( vm->codeBase, (byte *)header + header->codeOffset, vm->codeLength );
 
 	// we don't need to translate the instructions, but we still need
@@ -329,6 +340,7 @@ int	VM_CallInterpreted( vm_t *vm, int *args ) {
 	int		v1;
 	int		dataMask;
 	int		arg;
+	int		calledFunction;		// instruction number for the profiler
 #ifdef DEBUG_VM
 	vmSymbol_t	*profileSymbol;
 #endif
@@ -351,6 +363,7 @@ int	VM_CallInterpreted( vm_t *vm, int *args ) {
 	dataMask = vm->dataMask;
 	
 	programCounter = 0;
+	calledFunction = 0;
 
 	programStack -= ( 8 + 4 * MAX_VMMAIN_ARGS );
 
@@ -500,6 +513,9 @@ nextInstruction2:
 				*(int *)&image[ programStack + 4 ] = -1 - programCounter;
 
 //VM_LogSyscalls( (int *)&image[ programStack + 4 ] );
+				if ( vm->profileStack ) {
+					VM_ProfilePush( vm, programCounter );
+				}
 				{
 					// the vm has ints on the stack, we expect
 					// pointers so we might have to convert it
@@ -517,6 +533,10 @@ nextInstruction2:
 					}
 				}
 
+				if ( vm->profileStack ) {
+					VM_ProfilePop( vm );
+				}
+
 #ifdef DEBUG_VM
 				// this is just our stack frame pointer, only needed
 				// for debugging
@@ -537,6 +557,7 @@ nextInstruction2:
 				Com_Error( ERR_DROP, "VM program counter out of range in OP_CALL" );
 				return 0;
 			} else {
+				calledFunction = programCounter;
 				programCounter = vm->instructionPointers[ programCounter ];
 			}
 			goto nextInstruction;
@@ -558,6 +579,9 @@ nextInstruction2:
 
 			programCounter += 1;
 			programStack -= v1;
+			if ( vm->profileStack ) {
+				VM_ProfilePush( vm, calledFunction );
+			}
 #ifdef DEBUG_VM
 			// save old stack frame for debugging traces
 			*(int *)&image[programStack+4] = programStack + v1;
@@ -577,6 +601,10 @@ nextInstruction2:
 			// remove our stack frame
 			v1 = r2;
 
+			if ( vm->profileStack ) {
+				VM_ProfilePop( vm );
+			}
+
 			programStack += v1;
 
 			// grab the saved program counter
@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include "q_shared.h"
 #include "qcommon.h"
+#include "cvar.h"
 
 // Max number of arguments to pass from engine to vm's vmMain function.
 // command number + 3 arguments
@@ -139,6 +140,17 @@ typedef struct vmSymbol_s {
 	char	symName[1];		// variable sized
 } vmSymbol_t;
 
+// shadow call stack kept by the prologue and epilogue of every vm function
+// when vm_profile is set at load time, read by the sampling profiler.
+// frames hold the instruction number of each function's OP_ENTER, or the
+// negative call number of a system call in progress
+#define	VM_PROFILE_DEPTH	64		// must be a power of two
+
+typedef struct {
+	volatile int	depth;			// may exceed VM_PROFILE_DEPTH, frames wrap
+	volatile int	frames[VM_PROFILE_DEPTH];
+} vmProfileStack_t;
+
 #define	VM_OFFSET_PROGRAM_STACK		0
 #define	VM_OFFSET_SYSTEM_CALL		4
 
@@ -162,6 +174,7 @@ struct vm_s {
 	bool currentlyInterpreting;
 
 	bool	compiled;
+	int			jitOptimize;		// 0 follows vm_jitOptimize, 1 forces the peephole pass, -1 skips it
 	byte		*codeBase;
 	int			entryOfs;
 	int			codeLength;
@@ -183,16 +196,21 @@ struct vm_s {
 
 	byte		*jumpTableTargets;
 	int			numJumpTableTargets;
+
+	vmProfileStack_t	*profileStack;	// NULL unless vm_profile was set when loaded
 };
 
 
 extern	vm_t	*currentVM;
 extern	int		vm_debugLevel;
+extern	cvar_t	*vm_jitOptimize;
+extern	cvar_t	*vm_profile;
 
 void VM_Compile( vm_t *vm, vmHeader_t *header );
 int	VM_CallCompiled( vm_t *vm, int *args );
 
 void VM_PrepareInterpreter( vm_t *vm, vmHeader_t *header );
+void VM_PrepareInterpreterCode( vm_t *vm, vmHeader_t *header, byte *codeBuffer );
 int	VM_CallInterpreted( vm_t *vm, int *args );
 
 vmSymbol_t *VM_ValueToFunctionSymbol( vm_t *vm, int value );
@@ -201,3 +219,23 @@ const char *VM_ValueToSymbol( vm_t *vm, int value );
 void VM_LogSyscalls( int *args );
 
 void VM_BlockCopy(unsigned int dest, unsigned int src, size_t n);
+
+static inline void VM_ProfilePush( vm_t *vm, int frame ) {
+	vmProfileStack_t	*stack = vm->profileStack;
+
+	// the frame has to be in place before the sampler can see the new depth
+	stack->frames[stack->depth & ( VM_PROFILE_DEPTH - 1 )] = frame;
+	stack->depth = stack->depth + 1;
+}
+
+static inline void VM_ProfilePop( vm_t *vm ) {
+	vm->profileStack->depth = vm->profileStack->depth - 1;
+}
+
+bool VM_ProfileStart( vm_t *vm, int hz );
+void VM_ProfileStop( void );
+void VM_ProfileForget( vm_t *vm );
+void VM_ProfileStatus( void );
+void VM_ProfileFlat( int count );
+void VM_ProfileGraph( int count );
+void VM_ProfileWriteFolded( const char *filename );
@@ -0,0 +1,525 @@
+/*
+===========================================================================
+Copyright (C) 2000-2013 Darklegion Development
+
+This file is part of Tremulous.
+
+Tremulous is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Tremulous is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Tremulous; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// vm_profile.cpp -- sampling profiler for qvm code
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "vm.h"
+#include "vm_local.h"
+#include "files.h"
+
+/*
+==============================================================
+
+VM SAMPLING PROFILER
+
+A vm loaded with vm_profile 1 keeps a shadow call stack: the
+compiler emits a push in every OP_ENTER and a pop in every
+OP_LEAVE, the interpreter does the same, and system calls add
+a frame of their own while they run.  A thread wakes up at the
+sampling rate and copies that stack into a table of distinct
+call stacks.  The vm thread never waits on the profiler, so a
+sample taken during a call or return may be slightly off; that
+is noise, not bias.
+
+==============================================================
+*/
+
+#define VM_PROF_STACKS 4096  // distinct call stacks kept, a power of two
+
+struct vmProfStack_t {
+    int count;  // samples, 0 for a free slot
+    int depth;
+    int frames[VM_PROFILE_DEPTH];  // outermost first
+};
+
+struct vmProfFunc_t {
+    int frame;
+    int self;   // samples with this function on top of the stack
+    int total;  // samples with it anywhere on the stack
+};
+
+static std::vector<vmProfStack_t> vmProfStacks;
+static std::mutex vmProfLock;  // guards the table and the counters below
+static int vmProfSamples;      // samples taken while the vm was running
+static int vmProfIdle;         // samples taken while it was not
+static int vmProfDropped;      // samples lost to a full table
+
+static vm_t *vmProfVM;
+static std::thread *vmProfThread;
+static std::atomic<bool> vmProfRunning;
+static int vmProfHz;
+
+/*
+=================
+VM_ProfHash
+=================
+*/
+static unsigned VM_ProfHash(const int *frames, int depth)
+{
+    unsigned hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (unsigned)frames[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+=================
+VM_ProfSample
+=================
+*/
+static void VM_ProfSample(void)
+{
+    vmProfileStack_t *stack = vmProfVM->profileStack;
+    int frames[VM_PROFILE_DEPTH];
+    int depth, first, i;
+    unsigned slot;
+
+    depth = stack->depth;
+    if (!vmProfVM->callLevel || depth <= 0)
+    {
+        std::lock_guard<std::mutex> lock(vmProfLock);
+        vmProfIdle++;
+        return;
+    }
+
+    // past VM_PROFILE_DEPTH the outermost frames have been overwritten
+    first = depth > VM_PROFILE_DEPTH ? depth - VM_PROFILE_DEPTH : 0;
+    depth -= first;
+    for (i = 0; i < depth; i++)
+    {
+        frames[i] = stack->frames[(first + i) & (VM_PROFILE_DEPTH - 1)];
+    }
+
+    std::lock_guard<std::mutex> lock(vmProfLock);
+
+    slot = VM_ProfHash(frames, depth);
+    for (i = 0; i < VM_PROF_STACKS; i++, slot++)
+    {
+        vmProfStack_t *s = &vmProfStacks[slot & (VM_PROF_STACKS - 1)];
+
+        if (!s->count)
+        {
+            s->count = 1;
+            s->depth = depth;
+            std::copy(frames, frames + depth, s->frames);
+            vmProfSamples++;
+            return;
+        }
+
+        if (s->depth == depth && std::equal(frames, frames + depth, s->frames))
+        {
+            s->count++;
+            vmProfSamples++;
+            return;
+        }
+    }
+
+    vmProfDropped++;
+}
+
+/*
+=================
+VM_ProfThread
+=================
+*/
+static void VM_ProfThread(void)
+{
+    std::chrono::microseconds interval(1000000 / vmProfHz);
+
+    while (vmProfRunning.load())
+    {
+        std::this_thread::sleep_for(interval);
+        VM_ProfSample();
+    }
+}
+
+/*
+=================
+VM_ProfileStart
+
+Clears the previous results and starts sampling vm, which must
+have been loaded with vm_profile set
+=================
+*/
+bool VM_ProfileStart(vm_t *vm, int hz)
+{
+    if (!vm->profileStack)
+    {
+        return false;
+    }
+
+    VM_ProfileStop();
+
+    vmProfStacks.assign(VM_PROF_STACKS, vmProfStack_t());
+    vmProfSamples = vmProfIdle = vmProfDropped = 0;
+    vmProfVM = vm;
+    vmProfHz = Com_Clamp(10, 10000, hz);
+
+    vmProfRunning.store(true);
+    vmProfThread = new std::thread(VM_ProfThread);
+
+    return true;
+}
+
+/*
+=================
+VM_ProfileStop
+
+Stops sampling, the results stay available for the reports
+=================
+*/
+void VM_ProfileStop(void)
+{
+    if (!vmProfThread)
+    {
+        return;
+    }
+
+    vmProfRunning.store(false);
+    vmProfThread->join();
+    delete vmProfThread;
+    vmProfThread = NULL;
+}
+
+/*
+=================
+VM_ProfileForget
+
+Called when vm is freed, its results can't be symbolized anymore
+=================
+*/
+void VM_ProfileForget(vm_t *vm)
+{
+    if (vm != vmProfVM)
+    {
+        return;
+    }
+
+    VM_ProfileStop();
+    vmProfStacks.clear();
+    vmProfVM = NULL;
+}
+
+/*
+=================
+VM_ProfName
+=================
+*/
+static const char *VM_ProfName(int frame)
+{
+    vm_t *vm = vmProfVM;
+
+    if (frame < 0)
+    {
+        return va("[syscall_%d]", ~frame);
+    }
+
+    // symbols were converted to code offsets through the same table
+    if (vm->symbols && frame < vm->instructionCount)
+    {
+        return VM_ValueToFunctionSymbol(vm, (int)vm->instructionPointers[frame])->symName;
+    }
+
+    return va("func_%d", frame);
+}
+
+/*
+=================
+VM_ProfSnapshot
+
+Copies the used part of the table
+=================
+*/
+static std::vector<vmProfStack_t> VM_ProfSnapshot(int *samples)
+{
+    std::lock_guard<std::mutex> lock(vmProfLock);
+    std::vector<vmProfStack_t> stacks;
+
+    for (const vmProfStack_t &s : vmProfStacks)
+    {
+        if (s.count)
+        {
+            stacks.push_back(s);
+        }
+    }
+
+    *samples = vmProfSamples;
+    return stacks;
+}
+
+/*
+=================
+VM_ProfFunctions
+
+Self and total samples of every function that was seen,
+sorted by total
+=================
+*/
+static std::vector<vmProfFunc_t> VM_ProfFunctions(const std::vector<vmProfStack_t> &stacks)
+{
+    std::unordered_map<int, vmProfFunc_t> funcs;
+    std::vector<vmProfFunc_t> sorted;
+    int i, j;
+
+    for (const vmProfStack_t &s : stacks)
+    {
+        for (i = 0; i < s.depth; i++)
+        {
+            vmProfFunc_t &f = funcs[s.frames[i]];
+
+            f.frame = s.frames[i];
+
+            // recursion counts once per sample
+            for (j = 0; j < i; j++)
+            {
+                if (s.frames[j] == s.frames[i])
+                {
+                    break;
+                }
+            }
+            if (j == i)
+            {
+                f.total += s.count;
+            }
+        }
+
+        funcs[s.frames[s.depth - 1]].self += s.count;
+    }
+
+    for (const auto &f : funcs)
+    {
+        sorted.push_back(f.second);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const vmProfFunc_t &a, const vmProfFunc_t &b) {
+        return a.total > b.total || (a.total == b.total && a.self > b.self);
+    });
+
+    return sorted;
+}
+
+/*
+=================
+VM_ProfileStatus
+=================
+*/
+void VM_ProfileStatus(void)
+{
+    std::lock_guard<std::mutex> lock(vmProfLock);
+
+    if (!vmProfVM)
+    {
+        Com_Printf("No vm has been sampled.\n");
+        return;
+    }
+
+    Com_Printf("%s %s at %d Hz: %d samples, %d idle, %d dropped\n", vmProfThread ? "sampling" : "sampled",
+        vmProfVM->name, vmProfHz, vmProfSamples, vmProfIdle, vmProfDropped);
+
+    if (!vmProfVM->symbols)
+    {
+        Com_Printf("no symbols, load the vm with developer 1 and its .map file for function names\n");
+    }
+}
+
+/*
+=================
+VM_ProfileFlat
+
+The count functions with the most samples of their own
+=================
+*/
+void VM_ProfileFlat(int count)
+{
+    std::vector<vmProfStack_t> stacks;
+    std::vector<vmProfFunc_t> funcs;
+    int samples, i;
+
+    if (!vmProfVM)
+    {
+        Com_Printf("No vm has been sampled.\n");
+        return;
+    }
+
+    stacks = VM_ProfSnapshot(&samples);
+    if (!samples)
+    {
+        Com_Printf("No samples.\n");
+        return;
+    }
+
+    funcs = VM_ProfFunctions(stacks);
+    std::stable_sort(funcs.begin(), funcs.end(), [](const vmProfFunc_t &a, const vmProfFunc_t &b) {
+        return a.self > b.self;
+    });
+
+    Com_Printf("%7s %7s %9s  %s\n", "self%", "total%", "samples", "function");
+    for (i = 0; i < (int)funcs.size() && i < count; i++)
+    {
+        Com_Printf("%7.2f %7.2f %9d  %s\n", 100.0 * funcs[i].self / samples,
+            100.0 * funcs[i].total / samples, funcs[i].self, VM_ProfName(funcs[i].frame));
+    }
+    Com_Printf("%d samples of %s\n", samples, vmProfVM->name);
+}
+
+/*
+=================
+VM_ProfileGraph
+
+Callers and callees of the count functions with the most
+samples including their children
+=================
+*/
+void VM_ProfileGraph(int count)
+{
+    std::vector<vmProfStack_t> stacks;
+    std::vector<vmProfFunc_t> funcs;
+    std::map<std::pair<int, int>, int> edges;  // (caller, callee) -> samples
+    std::vector<std::pair<int, int>> lines;
+    int samples, i, j;
+
+    if (!vmProfVM)
+    {
+        Com_Printf("No vm has been sampled.\n");
+        return;
+    }
+
+    stacks = VM_ProfSnapshot(&samples);
+    if (!samples)
+    {
+        Com_Printf("No samples.\n");
+        return;
+    }
+
+    for (const vmProfStack_t &s : stacks)
+    {
+        for (i = 1; i < s.depth; i++)
+        {
+            edges[std::make_pair(s.frames[i - 1], s.frames[i])] += s.count;
+        }
+    }
+
+    funcs = VM_ProfFunctions(stacks);
+
+    Com_Printf("%7s %7s  %s\n", "total%", "self%", "function");
+    for (i = 0; i < (int)funcs.size() && i < count; i++)
+    {
+        const vmProfFunc_t &f = funcs[i];
+
+        Com_Printf("%7.2f %7.2f  %s\n", 100.0 * f.total / samples, 100.0 * f.self / samples,
+            VM_ProfName(f.frame));
+
+        // callers
+        lines.clear();
+        for (const auto &e : edges)
+        {
+            if (e.first.second == f.frame)
+            {
+                lines.push_back(std::make_pair(e.second, e.first.first));
+            }
+        }
+        std::sort(lines.rbegin(), lines.rend());
+        for (j = 0; j < (int)lines.size(); j++)
+        {
+            Com_Printf("%7.2f           <- %s\n", 100.0 * lines[j].first / samples, VM_ProfName(lines[j].second));
+        }
+
+        // callees
+        lines.clear();
+        for (const auto &e : edges)
+        {
+            if (e.first.first == f.frame)
+            {
+                lines.push_back(std::make_pair(e.second, e.first.second));
+            }
+        }
+        std::sort(lines.rbegin(), lines.rend());
+        for (j = 0; j < (int)lines.size(); j++)
+        {
+            Com_Printf("%7.2f           -> %s\n", 100.0 * lines[j].first / samples, VM_ProfName(lines[j].second));
+        }
+    }
+    Com_Printf("%d samples of %s\n", samples, vmProfVM->name);
+}
+
+/*
+=================
+VM_ProfileWriteFolded
+
+One line per distinct call stack, outermost function first,
+separated by semicolons and followed by the sample count.
+This is the input format of flamegraph.pl and speedscope
+=================
+*/
+void VM_ProfileWriteFolded(const char *filename)
+{
+    std::vector<vmProfStack_t> stacks;
+    char line[MAX_STRING_CHARS * 4];
+    fileHandle_t f;
+    int samples, i;
+
+    if (!vmProfVM)
+    {
+        Com_Printf("No vm has been sampled.\n");
+        return;
+    }
+
+    stacks = VM_ProfSnapshot(&samples);
+
+    f = FS_FOpenFileWrite(filename);
+    if (!f)
+    {
+        Com_Printf("Couldn't open %s for writing.\n", filename);
+        return;
+    }
+
+    for (const vmProfStack_t &s : stacks)
+    {
+        line[0] = '\0';
+        for (i = 0; i < s.depth; i++)
+        {
+            if (i)
+            {
+                Q_strcat(line, sizeof(line), ";");
+            }
+            Q_strcat(line, sizeof(line), VM_ProfName(s.frames[i]));
+        }
+        FS_Printf(f, "%s %d\n", line, s.count);
+    }
+    FS_FCloseFile(f);
+
+    Com_Printf("Wrote %d call stacks (%d samples) to %s.\n", (int)stacks.size(), samples, filename);
+}
@@ -429,6 +429,9 @@ static void DoSyscall(void)
 		data = (int *) (savedVM->dataBase + vm_programStack + 4);
 		ret = &vm_opStackBase[vm_opStackOfs + 1];
 
+		if(savedVM->profileStack)
+			VM_ProfilePush(savedVM, vm_syscallNum);
+
 #if idx64
 		args[0] = ~vm_syscallNum;
 		for(index = 1; index < ARRAY_LEN(args); index++)
@@ -439,6 +442,9 @@ static void DoSyscall(void)
 		data[0] = ~vm_syscallNum;
 		*ret = savedVM->systemCall((intptr_t *) data);
 #endif
+
+		if(savedVM->profileStack)
+			VM_ProfilePop(savedVM);
 	}
 	else
 	{
@@ -545,6 +551,38 @@ int EmitCallDoSyscall(vm_t *vm)
 	return compiledOfs;
 }
 
+/*
+=================
+EmitProfileEnter
+Pushes func onto the vm's shadow call stack for the sampling profiler
+=================
+*/
+
+static void EmitProfileEnter(vm_t *vm, int func)
+{
+	EmitRexString(0x48, "BA");			// mov edx, vm->profileStack
+	EmitPtr(vm->profileStack);
+	EmitString("8B 0A");				// mov ecx, dword ptr [edx]
+	MASK_REG("E1", VM_PROFILE_DEPTH - 1);		// and ecx, 0x12345678
+	EmitString("C7 44 8A 04");			// mov dword ptr 4[edx + ecx * 4], 0x12345678
+	Emit4(func);
+	EmitString("FF 02");				// inc dword ptr [edx]
+}
+
+/*
+=================
+EmitProfileLeave
+Pops the shadow call stack
+=================
+*/
+
+static void EmitProfileLeave(vm_t *vm)
+{
+	EmitRexString(0x48, "BA");			// mov edx, vm->profileStack
+	EmitPtr(vm->profileStack);
+	EmitString("FF 0A");				// dec dword ptr [edx]
+}
+
 /*
 =================
 EmitCallErrJump
@@ -1064,6 +1102,215 @@ static bool ConstOptimize(vm_t *vm, int callProcOfsSyscall)
 	return false;
 }
 
+/*
+=================
+NoJumpLabels
+Returns true if none of the next count instructions can be reached by a jump,
+so they are known to execute straight after the current one
+=================
+*/
+
+static bool NoJumpLabels(vm_t *vm, int count)
+{
+	int i;
+
+	if (!vm->jumpTableTargets)
+		return false;
+
+	for(i = 0; i < count; i++)
+	{
+		if(instruction + i >= vm->instructionCount || jused[instruction + i])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+=================
+EmitLocalAddress
+Loads the masked data offset of a local into edx
+=================
+*/
+
+static void EmitLocalAddress(vm_t *vm, int v)
+{
+	EmitString("8D 96");				// lea edx, [0x12345678 + esi]
+	Emit4(v);
+	MASK_REG("E2", vm->dataMask & ~3);		// and edx, 0x12345678
+}
+
+/*
+=================
+EmitLocalOperand
+Emits an instruction whose memory operand is the local addressed by edx,
+reg is the ModRM reg field (a register or an opcode extension)
+=================
+*/
+
+static void EmitLocalOperand(vm_t *vm, int opcode, int reg)
+{
+#if idx64
+	Emit1(0x41);					// op reg, dword ptr [r9 + edx]
+	Emit1(opcode);
+	Emit1(0x04 | (reg << 3));
+	Emit1(0x11);
+#else
+	Emit1(opcode);					// op reg, dword ptr [edx + 0x12345678]
+	Emit1(0x82 | (reg << 3));
+	Emit4((intptr_t) vm->dataBase);
+#endif
+}
+
+/*
+=================
+LocalOptimize
+Folds the common instruction sequences that start with OP_LOCAL into direct
+memory operands, so that neither the address of the local nor its value goes
+through the opStack. The folded instructions must belong to the same basic
+block. Returns the last opcode consumed, or 0 if nothing was folded
+=================
+*/
+
+static int LocalOptimize(vm_t *vm)
+{
+	int v, c;
+	int op1, op2;
+
+	if(vm->jitOptimize < 0 || (!vm->jitOptimize && !vm_jitOptimize->integer))
+		return 0;
+
+	v = NextConstant4();
+	op1 = code[pc+4];
+
+	if(op1 == OP_LOAD4)
+	{
+		op2 = code[pc+5];
+
+		switch(op2)
+		{
+		case OP_ADD:
+		case OP_SUB:
+		case OP_BAND:
+		case OP_BOR:
+		case OP_BXOR:
+			// <x> LOCAL LOAD4 op  ->  op eax, [local]
+			if(!NoJumpLabels(vm, 2))
+				return 0;
+
+			EmitMovEAXStack(vm, 0);
+			EmitLocalAddress(vm, v);
+			if(op2 == OP_ADD)
+				EmitLocalOperand(vm, 0x03, 0);	// add eax, [local]
+			else if(op2 == OP_SUB)
+				EmitLocalOperand(vm, 0x2B, 0);	// sub eax, [local]
+			else if(op2 == OP_BAND)
+				EmitLocalOperand(vm, 0x23, 0);	// and eax, [local]
+			else if(op2 == OP_BOR)
+				EmitLocalOperand(vm, 0x0B, 0);	// or eax, [local]
+			else
+				EmitLocalOperand(vm, 0x33, 0);	// xor eax, [local]
+			EmitCommand(LAST_COMMAND_MOV_STACK_EAX);	// mov dword ptr [edi + ebx * 4], eax
+
+			pc += 6;				// LOCAL + LOAD4 + op
+			instruction += 2;
+			return op2;
+
+		case OP_EQ:
+		case OP_NE:
+		case OP_LTI:
+		case OP_LEI:
+		case OP_GTI:
+		case OP_GEI:
+		case OP_LTU:
+		case OP_LEU:
+		case OP_GTU:
+		case OP_GEU:
+			// <x> LOCAL LOAD4 cmp  ->  cmp eax, [local]
+			if(!NoJumpLabels(vm, 2))
+				return 0;
+
+			EmitMovEAXStack(vm, 0);
+			EmitCommand(LAST_COMMAND_SUB_BL_1);	// sub bl, 1
+			EmitLocalAddress(vm, v);
+			EmitLocalOperand(vm, 0x3B, 0);		// cmp eax, [local]
+
+			pc += 6;				// LOCAL + LOAD4 + cmp
+			EmitBranchConditions(vm, op2);
+			instruction += 2;
+			return op2;
+
+		case OP_CONST:
+			// LOCAL LOAD4 CONST cmp  ->  cmp [local], c
+			op2 = code[pc+10];
+			if(op2 < OP_EQ || op2 > OP_GEU || !NoJumpLabels(vm, 3))
+				return 0;
+
+			c = (code[pc+6] | (code[pc+7]<<8) | (code[pc+8]<<16) | (code[pc+9]<<24));
+
+			EmitLocalAddress(vm, v);
+			if(iss8(c))
+			{
+				EmitLocalOperand(vm, 0x83, 7);	// cmp dword ptr [local], 0x7F
+				Emit1(c);
+			}
+			else
+			{
+				EmitLocalOperand(vm, 0x81, 7);	// cmp dword ptr [local], 0x12345678
+				Emit4(c);
+			}
+
+			pc += 11;				// LOCAL + LOAD4 + CONST + cmp
+			EmitBranchConditions(vm, op2);
+			instruction += 3;
+			return op2;
+
+		default:
+			break;
+		}
+
+		return 0;
+	}
+
+	if(op1 == OP_LOCAL && code[pc+9] == OP_LOAD4 && code[pc+10] == OP_STORE4)
+	{
+		// LOCAL LOCAL LOAD4 STORE4  ->  copy local to local
+		if(!NoJumpLabels(vm, 3))
+			return 0;
+
+		c = (code[pc+5] | (code[pc+6]<<8) | (code[pc+7]<<16) | (code[pc+8]<<24));
+
+		EmitLocalAddress(vm, c);
+		EmitLocalOperand(vm, 0x8B, 0);			// mov eax, [source]
+		EmitLocalAddress(vm, v);
+		EmitLocalOperand(vm, 0x89, 0);			// mov [dest], eax
+
+		pc += 11;					// LOCAL + LOCAL + LOAD4 + STORE4
+		instruction += 3;
+		return OP_STORE4;
+	}
+
+	if(op1 == OP_CONST && code[pc+9] == OP_STORE4)
+	{
+		// LOCAL CONST STORE4  ->  mov [local], c
+		if(!NoJumpLabels(vm, 2))
+			return 0;
+
+		c = (code[pc+5] | (code[pc+6]<<8) | (code[pc+7]<<16) | (code[pc+8]<<24));
+
+		EmitString("B8");				// mov eax, 0x12345678
+		Emit4(c);
+		EmitLocalAddress(vm, v);
+		EmitLocalOperand(vm, 0x89, 0);			// mov [local], eax
+
+		pc += 10;					// LOCAL + CONST + STORE4
+		instruction += 2;
+		return OP_STORE4;
+	}
+
+	return 0;
+}
+
 #if idx64
   #define EAX "%%rax"
   #define EBX "%%rbx"
@@ -1185,6 +1432,8 @@ void VM_Compile(vm_t *vm, vmHeader_t *header)
 		case OP_ENTER:
 			EmitString("81 EE");				// sub esi, 0x12345678
 			Emit4(Constant4());
+			if(vm->profileStack)
+				EmitProfileEnter(vm, instruction - 1);
 			break;
 		case OP_CONST:
 			if(ConstOptimize(vm, callProcOfsSyscall))
@@ -1200,6 +1449,13 @@ void VM_Compile(vm_t *vm, vmHeader_t *header)
 
 			break;
 		case OP_LOCAL:
+			v = LocalOptimize(vm);
+			if(v)
+			{
+				op = v;
+				break;
+			}
+
 			EmitPushStack(vm);
 			EmitString("8D 86");				// lea eax, [0x12345678 + esi]
 			oc0 = oc1;
@@ -1232,6 +1488,8 @@ void VM_Compile(vm_t *vm, vmHeader_t *header)
 			break;
 		case OP_LEAVE:
 			v = Constant4();
+			if(vm->profileStack)
+				EmitProfileLeave(vm);
 			EmitString("81 C6");				// add	esi, 0x12345678
 			Emit4(v);
 			EmitString("C3");				// ret
@@ -31,6 +31,8 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "qcommon/msg.h"
 #include "qcommon/net.h"
 #include "qcommon/huffman.h"
+#include "qcommon/jobs.h"
+#include "qcommon/profile.h"
 #include "qcommon/vm.h"
 #include "qcommon/cmd.h"
 #include "qcommon/cvar.h"
@@ -59,15 +61,15 @@ struct voipServerPacket_t {
 #endif // USE_VOIP
 
 struct svEntity_t {
-    struct worldSector_t *worldSector;
-    svEntity_t *nextEntityInWorldSector;
+    svEntity_t **gridList;  // world grid chain this entity is on, NULL if not linked
+    svEntity_t *gridPrev, *gridNext;
 
     entityState_t baseline;  // for delta compression of initial sighting
     int numClusters;  // if -1, use headnode instead
     int clusternums[MAX_ENT_CLUSTERS];
     int lastCluster;  // if all the clusters don't fit in clusternums
     int areanum, areanum2;
-    int snapshotCounter;  // used to prevent double adding from portal views
+    int originCluster, originArea;  // leaf of r.currentOrigin as of the last link
 };
 
 enum serverState_t {
@@ -91,7 +93,6 @@ struct server_t {
     // https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=475
     // the serverId associated with the current checksumFeed (always <= serverId)
     int checksumFeedServerId;
-    int snapshotCounter;  // incremented for each snapshot built
     int timeResidual;  // <= 1000 / sv_frame->value
     int nextFrameTime;  // when time > nextFrameTime, process world
     configString_t configstrings[MAX_CONFIGSTRINGS];
@@ -107,6 +108,8 @@ struct server_t {
     playerState_t *gameClients;
     int gameClientSize;  // will be > sizeof(playerState_t) due to game private data
 
+    struct snapshotIndex_t *snapshotIndex;  // per-frame cluster buckets, see sv_snapshot.c
+
     int restartTime;
     int time;
 
@@ -124,6 +127,8 @@ struct clientSnapshot_t {
     int messageSent;  // time the message was transmitted
     int messageAcked;  // time the message was acked
     int messageSize;  // used to rate drop packets
+    int entityFrame;  // svs.snapshotFrame the entities were copied in, 0 if not cached
+    int snapFlags;  // SNAPFLAG_* the snapshot went out with
 };
 
 enum clientState_t {
@@ -185,6 +190,14 @@ struct client_t {
     int ping;
     int rate;  // bytes / second
     int snapshotMsec;  // requests a snapshot every snapshotMsec unless rate choked
+    int snapshotSize;  // running average of the snapshot messages, for sv_adaptiveSnapshots
+    int snapshotEntityLimit;  // 0 for MAX_SNAPSHOT_ENTITIES, lowered by sv_adaptiveSnapshots
+    int snapshotsSent;
+    int snapshotsDelayed;  // skipped for the client's own rate or a full netchan queue
+    int snapshotsDeferred;  // skipped because sv_uplinkRate ran out
+    int rateBytes;  // sent since rateTime
+    int rateTime;
+    int achievedRate;  // bytes / second over the last second
     int pureAuthentic;
     bool gotCP;  // TTimo - additional flag to distinguish between a bad pure checksum, and no cp command at all
     netchan_t netchan;
@@ -247,6 +260,7 @@ struct serverStatic_t {
     int numSnapshotEntities;  // sv_maxclients->integer*PACKET_BACKUP*MAX_SNAPSHOT_ENTITIES
     int nextSnapshotEntities;  // next snapshotEntities to use
     entityState_t *snapshotEntities;  // [numSnapshotEntities]
+    int snapshotFrame;  // bumped by every SV_SendClientMessages, keys the delta cache
     int nextHeartbeatTime;
     challenge_t challenges[MAX_CHALLENGES];  // to prevent invalid IPs from connecting
     netadr_t redirectAddress;  // for rcon return messages
@@ -285,6 +299,13 @@ extern cvar_t *sv_maxPing;
 extern cvar_t *sv_pure;
 extern cvar_t *sv_lanForceRate;
 extern cvar_t *sv_banFile;
+extern cvar_t *sv_snapshotIndex;
+extern cvar_t *sv_snapshotThreads;
+extern cvar_t *sv_deltaCache;
+extern cvar_t *sv_autoDemo;
+extern cvar_t *sv_uplinkRate;
+extern cvar_t *sv_snapshotPacing;
+extern cvar_t *sv_adaptiveSnapshots;
 
 #ifdef USE_VOIP
 extern cvar_t *sv_voip;
@@ -326,6 +347,7 @@ void SV_AddOperatorCommands(void);
 void SV_RemoveOperatorCommands(void);
 
 void SV_MasterShutdown(void);
+int SV_ClientRate(client_t *client);
 int SV_RateMsec(client_t *client);
 
 //
@@ -376,7 +398,24 @@ void SV_UpdateServerCommandsToClient(client_t *client, msg_t *msg);
 void SV_WriteFrameToClient(client_t *client, msg_t *msg);
 void SV_SendMessageToClient(msg_t *msg, client_t *client);
 void SV_SendClientMessages(void);
+int SV_SendPacedSnapshots(bool flush);
 void SV_SendClientSnapshot(client_t *client);
+void SV_InitSnapshotIndex(void);
+void SV_SnapshotBench_f(void);
+void SV_Rates_f(void);
+
+//
+// sv_demo.c
+//
+void SV_DemoSnapshot(client_t *client, clientSnapshot_t *frame);
+void SV_DemoServerCommand(int clientNum, const char *cmd);
+void SV_DemoConfigstring(int index, const char *val);
+void SV_DemoEndFrame(void);
+void SV_DemoAutoRecord(void);
+void SV_DemoStop(void);
+void SV_DemoRecord_f(void);
+void SV_DemoStop_f(void);
+void SV_DemoExport_f(void);
 
 //
 // sv_game.c
@@ -390,6 +429,7 @@ void SV_InitGameProgs(void);
 void SV_ShutdownGameProgs(void);
 void SV_RestartGameProgs(void);
 bool SV_inPVS(const vec3_t p1, const vec3_t p2);
+bool SV_EntitiesInPVS(int num1, int num2, bool ignorePortals);
 
 //============================================================
 //
@@ -413,6 +453,8 @@ void SV_LinkEntity(sharedEntity_t *ent);
 clipHandle_t SV_ClipHandleForEntity(const sharedEntity_t *ent);
 
 void SV_SectorList_f(void);
+void SV_AreaBench_f(void);
+void SV_TraceStress_f(void);
 
 int SV_AreaEntities(const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount);
 // fills in a table of entity numbers with entities that have bounding boxes
@@ -437,6 +479,10 @@ void SV_Trace(trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, co
 
 // passEntityNum is explicitly excluded from clipping checks (normally ENTITYNUM_NONE)
 
+void SV_TraceBatch(trace_t *results, const traceRequest_t *requests, int count);
+// results[i] is what SV_Trace returns for requests[i]; entities are looked
+// up once for the whole batch and large batches run on the job pool
+
 void SV_ClipToEntity(trace_t *trace, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end,
     int entityNum, int contentmask, traceType_t type);
 // clip to a specific entity
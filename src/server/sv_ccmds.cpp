@@ -183,6 +183,8 @@ static void SV_MapRestart_f( void ) {
 	sv.state = SS_GAME;
 	sv.restarting = false;
 
+	SV_DemoServerCommand( -1, "map_restart\n" );
+
 	// connect and begin all the clients
 	for (i=0 ; i<sv_maxclients->integer ; i++) {
 		client = &svs.clients[i];
@@ -282,6 +284,55 @@ static void SV_KillServer_f( void ) {
 	SV_Shutdown( "killserver" );
 }
 
+/*
+=================
+SV_Profile_f
+
+Dump the profiler scopes, or capture a Chrome trace of the next few frames
+=================
+*/
+static void SV_Profile_f( void ) {
+	const char	*cmd;
+
+	cmd = Cmd_Argv( 1 );
+
+	if ( !*cmd ) {
+		Prof_Print();
+	} else if ( !Q_stricmp( cmd, "reset" ) ) {
+		Prof_Reset();
+	} else if ( !Q_stricmp( cmd, "trace" ) && Cmd_Argc() >= 3 ) {
+		Prof_BeginTrace( Cmd_Argv( 2 ), Cmd_Argc() > 3 ? atoi( Cmd_Argv( 3 ) ) : 100 );
+	} else {
+		Com_Printf( "usage: sv_profile [reset | trace <file> [frames]]\n" );
+	}
+}
+
+/*
+=================
+SV_TraceCache_f
+
+Print how well the world trace cache is doing, optionally starting over
+=================
+*/
+static void SV_TraceCache_f( void ) {
+	cmTraceCacheStats_t	stats;
+	bool		reset;
+	int			total;
+
+	reset = !Q_stricmp( Cmd_Argv( 1 ), "reset" );
+	CM_TraceCacheStats( &stats, reset );
+
+	total = stats.hits + stats.misses;
+	Com_Printf( "cm_traceCache %s, %i entries (%i KB) per thread, %i KB over %i threads\n",
+		Cvar_VariableIntegerValue( "cm_traceCache" ) ? "on" : "off", stats.entries, stats.bytes / 1024,
+		stats.totalBytes / 1024, stats.tables );
+	Com_Printf( "%i hits, %i misses (%.1f%% hit), %i evictions\n",
+		stats.hits, stats.misses, total ? 100.0f * stats.hits / total : 0.0f, stats.evictions );
+	if ( reset ) {
+		Com_Printf( "counters reset\n" );
+	}
+}
+
 //===========================================================
 
 /*
@@ -313,6 +364,15 @@ void SV_AddOperatorCommands( void ) {
 	Cmd_AddCommand ("systeminfo", SV_Systeminfo_f);
 	Cmd_AddCommand ("map_restart", SV_MapRestart_f);
 	Cmd_AddCommand ("sectorlist", SV_SectorList_f);
+	Cmd_AddCommand ("areabench", SV_AreaBench_f);
+	Cmd_AddCommand ("tracestress", SV_TraceStress_f);
+	Cmd_AddCommand ("snapshotbench", SV_SnapshotBench_f);
+	Cmd_AddCommand ("sv_profile", SV_Profile_f);
+	Cmd_AddCommand ("sv_rates", SV_Rates_f);
+	Cmd_AddCommand ("tracecache", SV_TraceCache_f);
+	Cmd_AddCommand ("svrecord", SV_DemoRecord_f);
+	Cmd_AddCommand ("svstoprecord", SV_DemoStop_f);
+	Cmd_AddCommand ("svdemoexport", SV_DemoExport_f);
 	Cmd_AddCommand ("map", SV_Map_f);
 	Cmd_SetCommandCompletionFunc( "map", SV_CompleteMapName );
 	Cmd_AddCommand ("devmap", SV_Map_f);
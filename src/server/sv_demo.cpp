@@ -0,0 +1,1382 @@
+/*
+===========================================================================
+Copyright (C) 1999-2005 Id Software, Inc.
+Copyright (C) 2000-2013 Darklegion Development
+
+This file is part of Tremulous.
+
+Tremulous is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Tremulous is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Tremulous; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+// sv_demo.cpp -- server side demo recording
+
+#include "server.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+=============================================================================
+
+Server demos
+
+svrecord saves every snapshot the server sends, the entity states they
+reference, configstrings and reliable server commands to
+svdemos/<name>.svdemo.  SV_Frame only copies the raw data into a single
+producer, single consumer ring.  A writer thread does the delta encoding
+and all of the file I/O, so a slow disk never holds up a frame.  When the
+ring is full, records are dropped and the next frame is written as a
+keyframe.
+
+File layout, little endian:
+
+  header   "SVDM" version protocol checksumFeed startTime mapname[MAX_QPATH]
+  blocks   [length][message] for every frame that sent a snapshot,
+           ended by a length of -1
+  index    [count] then [serverTime][offset] for every keyframe
+  trailer  [index offset] "SVDX"
+
+Each block is a Huffman coded message: serverTime, flags, then dm_* ops
+up to dm_eof.  Keyframes delta from nothing, so reading can start at any
+of them.  The index is only written when recording stops cleanly;
+without it, readers start from the first block.
+
+svdemoexport turns one client's point of view back into a normal client
+demo.
+
+=============================================================================
+*/
+
+#define DEMO_VERSION 1
+#define DEMO_RING_SIZE (16 * 1024 * 1024)
+#define DEMO_BLOCK_SIZE (1024 * 1024)
+#define DEMO_KEYFRAME_MSEC 10000
+
+#define DEMO_KEYFRAME 1  // block flag
+#define DEMO_BROADCAST MAX_CLIENTS  // command target for every client
+
+enum demoRecordType_t {
+    DR_WRAP,  // rest of the ring is unused, continue at the start
+    DR_CONFIGSTRING,
+    DR_COMMAND,
+    DR_SNAPSHOT,
+    DR_FRAME
+};
+
+enum demoOp_t {
+    dm_eof,
+    dm_configstring,  // [short] index [bigstring]
+    dm_command,  // [byte] client or DEMO_BROADCAST [string]
+    dm_entities,  // entity deltas, ended by MAX_GENTITIES-1
+    dm_snapshot  // [byte] client [byte] snapFlags [areabits] [playerstate] visibility toggles
+};
+
+struct demoHeader_t {
+    char magic[4];
+    int version;
+    int protocol;
+    int checksumFeed;
+    int startTime;
+    char mapname[MAX_QPATH];
+};
+
+// records in the ring are 8 byte aligned and size includes the header
+struct demoRecord_t {
+    int type;
+    int size;
+};
+
+struct demoString_t {
+    int index;  // configstring, or client for commands
+    char s[1];
+};
+
+struct demoSnapshot_t {
+    int clientNum;
+    int snapFlags;
+    int areabytes;
+    byte areabits[MAX_MAP_AREA_BYTES];
+    playerState_t ps;
+    int numEntities;
+    int entities[MAX_SNAPSHOT_ENTITIES];  // only numEntities are in the ring
+};
+
+struct demoFrame_t {
+    int serverTime;
+    int dropped;  // records lost so far
+    int numEntities;
+    entityState_t entities[MAX_GENTITIES];  // only numEntities are in the ring
+};
+
+// what both ends of a demo file know after each block
+struct demoMirror_t {
+    std::string configstrings[MAX_CONFIGSTRINGS];
+    entityState_t entities[MAX_GENTITIES];
+    unsigned int present[MAX_GENTITIES / 32];
+    playerState_t ps[MAX_CLIENTS];
+    bool hasPs[MAX_CLIENTS];
+    unsigned int visible[MAX_CLIENTS][MAX_GENTITIES / 32];
+};
+
+struct demoEvent_t {
+    int op;
+    int index;
+    std::string s;
+};
+
+static struct {
+    bool recording;
+    char name[MAX_QPATH];
+    std::thread *thread;
+    std::atomic<bool> quit;
+
+    // ring, head is only written by SV_Frame and tail by the writer
+    byte *ring;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    uint64_t reserved;  // head after the record being filled in
+    int dropped;
+
+    // entities referenced by this frame's snapshots
+    unsigned int frameEntities[MAX_GENTITIES / 32];
+    int numSnapshots;
+} demo;
+
+// only touched by the writer thread while recording
+static struct {
+    FILE *f;
+    int offset;
+    demoMirror_t state;
+    std::vector<demoEvent_t> events;  // since the last block
+    demoSnapshot_t snapshots[MAX_CLIENTS];
+    bool haveSnapshot[MAX_CLIENTS];
+    int lastKeyframe;
+    bool forceKeyframe;
+    int lastDropped;
+    std::vector<int> index;  // serverTime and offset pairs
+    int blocks;
+    int overflows;
+    byte block[DEMO_BLOCK_SIZE];
+} demoWriter;
+
+static entityState_t demoNullEntity;
+
+/*
+=============================================================================
+
+Encoding shared by the writer and svdemoexport
+
+=============================================================================
+*/
+
+static inline bool SV_DemoBit(const unsigned int *bits, int n)
+{
+    return (bits[n >> 5] >> (n & 31)) & 1;
+}
+
+static inline void SV_DemoSetBit(unsigned int *bits, int n)
+{
+    bits[n >> 5] |= 1u << (n & 31);
+}
+
+static void SV_DemoClearState(demoMirror_t *state)
+{
+    int i;
+
+    for (i = 0; i < MAX_CONFIGSTRINGS; i++)
+    {
+        state->configstrings[i].clear();
+    }
+    ::memset(state->entities, 0, sizeof(state->entities));
+    ::memset(state->present, 0, sizeof(state->present));
+    ::memset(state->ps, 0, sizeof(state->ps));
+    ::memset(state->hasPs, 0, sizeof(state->hasPs));
+    ::memset(state->visible, 0, sizeof(state->visible));
+}
+
+/*
+==================
+SV_DemoWriteEntities
+
+Deltas state's entity set to the sorted list in frame
+==================
+*/
+static void SV_DemoWriteEntities(msg_t *msg, demoMirror_t *state, demoFrame_t *frame)
+{
+    unsigned int present[MAX_GENTITIES / 32];
+    entityState_t *to;
+    int i, n;
+
+    ::memset(present, 0, sizeof(present));
+    for (i = 0; i < frame->numEntities; i++)
+    {
+        SV_DemoSetBit(present, frame->entities[i].number);
+    }
+
+    MSG_WriteByte(msg, dm_entities);
+
+    for (i = 0, n = 0; n < MAX_GENTITIES; n++)
+    {
+        if (SV_DemoBit(present, n))
+        {
+            to = &frame->entities[i++];
+            // an entity coming back deltas from the last state sent for it
+            MSG_WriteDeltaEntity(0, msg, &state->entities[n], to, !SV_DemoBit(state->present, n));
+            state->entities[n] = *to;
+        }
+        else if (SV_DemoBit(state->present, n))
+        {
+            MSG_WriteDeltaEntity(0, msg, &state->entities[n], NULL, true);
+        }
+    }
+    MSG_WriteBits(msg, MAX_GENTITIES - 1, GENTITYNUM_BITS);
+
+    ::memcpy(state->present, present, sizeof(present));
+}
+
+/*
+==================
+SV_DemoReadEntities
+==================
+*/
+static bool SV_DemoReadEntities(msg_t *msg, demoMirror_t *state)
+{
+    entityState_t to;
+    int n;
+
+    while ((n = MSG_ReadBits(msg, GENTITYNUM_BITS)) != MAX_GENTITIES - 1)
+    {
+        if (msg->readcount > msg->cursize)
+        {
+            return false;
+        }
+
+        MSG_ReadDeltaEntity(0, msg, &state->entities[n], &to, n);
+        if (to.number == MAX_GENTITIES - 1)
+        {
+            state->present[n >> 5] &= ~(1u << (n & 31));
+        }
+        else
+        {
+            state->entities[n] = to;
+            SV_DemoSetBit(state->present, n);
+        }
+    }
+
+    return true;
+}
+
+/*
+==================
+SV_DemoWriteSnapshot
+==================
+*/
+static void SV_DemoWriteSnapshot(msg_t *msg, demoMirror_t *state, demoSnapshot_t *snap)
+{
+    unsigned int visible[MAX_GENTITIES / 32];
+    unsigned int changed;
+    int c = snap->clientNum;
+    int i;
+
+    ::memset(visible, 0, sizeof(visible));
+    for (i = 0; i < snap->numEntities; i++)
+    {
+        SV_DemoSetBit(visible, snap->entities[i]);
+    }
+
+    MSG_WriteByte(msg, dm_snapshot);
+    MSG_WriteByte(msg, c);
+    MSG_WriteByte(msg, snap->snapFlags);
+    MSG_WriteByte(msg, snap->areabytes);
+    MSG_WriteData(msg, snap->areabits, snap->areabytes);
+    MSG_WriteDeltaPlayerstate(0, msg, state->hasPs[c] ? &state->ps[c] : NULL, &snap->ps);
+
+    // entities that came into or went out of view
+    for (i = 0; i < MAX_GENTITIES / 32; i++)
+    {
+        for (changed = visible[i] ^ state->visible[c][i]; changed; changed &= changed - 1)
+        {
+            MSG_WriteBits(msg, i * 32 + Q_ctz(changed), GENTITYNUM_BITS);
+        }
+    }
+    MSG_WriteBits(msg, MAX_GENTITIES - 1, GENTITYNUM_BITS);
+
+    state->ps[c] = snap->ps;
+    state->hasPs[c] = true;
+    ::memcpy(state->visible[c], visible, sizeof(visible));
+}
+
+/*
+==================
+SV_DemoReadSnapshot
+
+Returns the client number, or -1 if the message is bad
+==================
+*/
+static int SV_DemoReadSnapshot(msg_t *msg, demoMirror_t *state, int *snapFlags, int *areabytes, byte *areabits)
+{
+    playerState_t ps;
+    int c, n;
+
+    c = MSG_ReadByte(msg);
+    if (c < 0 || c >= MAX_CLIENTS)
+    {
+        return -1;
+    }
+
+    *snapFlags = MSG_ReadByte(msg);
+    *areabytes = MSG_ReadByte(msg);
+    if (*areabytes < 0 || *areabytes > MAX_MAP_AREA_BYTES)
+    {
+        return -1;
+    }
+    MSG_ReadData(msg, areabits, *areabytes);
+
+    MSG_ReadDeltaPlayerstate(msg, state->hasPs[c] ? &state->ps[c] : NULL, &ps);
+    state->ps[c] = ps;
+    state->hasPs[c] = true;
+
+    while ((n = MSG_ReadBits(msg, GENTITYNUM_BITS)) != MAX_GENTITIES - 1)
+    {
+        if (msg->readcount > msg->cursize)
+        {
+            return -1;
+        }
+        state->visible[c][n >> 5] ^= 1u << (n & 31);
+    }
+
+    return c;
+}
+
+/*
+=============================================================================
+
+Writer thread
+
+=============================================================================
+*/
+
+/*
+==================
+SV_DemoWriteBlock
+
+Encodes everything collected since the last block along with frame
+==================
+*/
+static void SV_DemoWriteBlock(demoFrame_t *frame)
+{
+    demoMirror_t *state = &demoWriter.state;
+    bool keyframe;
+    msg_t msg;
+    int len;
+    int i;
+
+    keyframe = demoWriter.forceKeyframe || frame->dropped != demoWriter.lastDropped ||
+               frame->serverTime - demoWriter.lastKeyframe >= DEMO_KEYFRAME_MSEC ||
+               frame->serverTime < demoWriter.lastKeyframe;
+
+    MSG_Init(&msg, demoWriter.block, sizeof(demoWriter.block));
+    msg.allowoverflow = true;
+
+    MSG_WriteLong(&msg, frame->serverTime);
+    MSG_WriteByte(&msg, keyframe ? DEMO_KEYFRAME : 0);
+
+    if (keyframe)
+    {
+        // the configstrings are state too, the events after them replay
+        // whatever changed since the last block
+        for (i = 0; i < MAX_CONFIGSTRINGS; i++)
+        {
+            if (!state->configstrings[i].empty())
+            {
+                MSG_WriteByte(&msg, dm_configstring);
+                MSG_WriteShort(&msg, i);
+                MSG_WriteBigString(&msg, state->configstrings[i].c_str());
+            }
+        }
+
+        ::memset(state->present, 0, sizeof(state->present));
+        ::memset(state->entities, 0, sizeof(state->entities));
+        ::memset(state->hasPs, 0, sizeof(state->hasPs));
+        ::memset(state->visible, 0, sizeof(state->visible));
+    }
+
+    for (const demoEvent_t &ev : demoWriter.events)
+    {
+        MSG_WriteByte(&msg, ev.op);
+        if (ev.op == dm_configstring)
+        {
+            MSG_WriteShort(&msg, ev.index);
+            MSG_WriteBigString(&msg, ev.s.c_str());
+            state->configstrings[ev.index] = ev.s;
+        }
+        else
+        {
+            MSG_WriteByte(&msg, ev.index);
+            MSG_WriteString(&msg, ev.s.c_str());
+        }
+    }
+    demoWriter.events.clear();
+
+    SV_DemoWriteEntities(&msg, state, frame);
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (demoWriter.haveSnapshot[i])
+        {
+            SV_DemoWriteSnapshot(&msg, state, &demoWriter.snapshots[i]);
+            demoWriter.haveSnapshot[i] = false;
+        }
+    }
+
+    MSG_WriteByte(&msg, dm_eof);
+
+    demoWriter.lastDropped = frame->dropped;
+
+    if (msg.overflowed)
+    {
+        // the state above went ahead without the reader, start over
+        demoWriter.overflows++;
+        demoWriter.forceKeyframe = true;
+        return;
+    }
+
+    if (keyframe)
+    {
+        demoWriter.index.push_back(frame->serverTime);
+        demoWriter.index.push_back(demoWriter.offset);
+        demoWriter.lastKeyframe = frame->serverTime;
+        demoWriter.forceKeyframe = false;
+    }
+
+    len = LittleLong(msg.cursize);
+    fwrite(&len, 4, 1, demoWriter.f);
+    fwrite(msg.data, msg.cursize, 1, demoWriter.f);
+    demoWriter.offset += 4 + msg.cursize;
+    demoWriter.blocks++;
+}
+
+/*
+==================
+SV_DemoWriteRecord
+==================
+*/
+static void SV_DemoWriteRecord(demoRecord_t *rec)
+{
+    demoString_t *str;
+    demoSnapshot_t *snap;
+    demoEvent_t ev;
+
+    switch (rec->type)
+    {
+        case DR_CONFIGSTRING:
+        case DR_COMMAND:
+            str = (demoString_t *)(rec + 1);
+            ev.op = rec->type == DR_CONFIGSTRING ? dm_configstring : dm_command;
+            ev.index = str->index;
+            ev.s = str->s;
+            demoWriter.events.push_back(ev);
+            break;
+
+        case DR_SNAPSHOT:
+            snap = (demoSnapshot_t *)(rec + 1);
+            ::memcpy(&demoWriter.snapshots[snap->clientNum], snap,
+                offsetof(demoSnapshot_t, entities) + snap->numEntities * sizeof(snap->entities[0]));
+            demoWriter.haveSnapshot[snap->clientNum] = true;
+            break;
+
+        case DR_FRAME:
+            SV_DemoWriteBlock((demoFrame_t *)(rec + 1));
+            break;
+    }
+}
+
+/*
+==================
+SV_DemoWriter
+
+Drains the ring until SV_DemoStop, then finishes the file
+==================
+*/
+static void SV_DemoWriter(void)
+{
+    demoRecord_t *rec;
+    uint64_t tail, head;
+    size_t i;
+    int v;
+
+    for (;;)
+    {
+        tail = demo.tail.load(std::memory_order_relaxed);
+        head = demo.head.load(std::memory_order_acquire);
+
+        if (tail == head)
+        {
+            if (demo.quit.load())
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+
+        rec = (demoRecord_t *)(demo.ring + tail % DEMO_RING_SIZE);
+        SV_DemoWriteRecord(rec);
+        demo.tail.store(tail + rec->size, std::memory_order_release);
+    }
+
+    v = LittleLong(-1);
+    fwrite(&v, 4, 1, demoWriter.f);
+
+    v = LittleLong((int)demoWriter.index.size() / 2);
+    fwrite(&v, 4, 1, demoWriter.f);
+    for (i = 0; i < demoWriter.index.size(); i++)
+    {
+        v = LittleLong(demoWriter.index[i]);
+        fwrite(&v, 4, 1, demoWriter.f);
+    }
+
+    v = LittleLong(demoWriter.offset + 4);
+    fwrite(&v, 4, 1, demoWriter.f);
+    fwrite("SVDX", 4, 1, demoWriter.f);
+
+    fclose(demoWriter.f);
+    demoWriter.f = NULL;
+}
+
+/*
+=============================================================================
+
+Producer side, all on the main thread
+
+=============================================================================
+*/
+
+/*
+==================
+SV_DemoAlloc
+
+Reserves a contiguous record in the ring, or returns NULL when the writer
+has fallen too far behind.  Nothing is visible to the writer until
+SV_DemoCommit.
+==================
+*/
+static void *SV_DemoAlloc(int type, int size)
+{
+    uint64_t head = demo.head.load(std::memory_order_relaxed);
+    uint64_t tail = demo.tail.load(std::memory_order_acquire);
+    int pos = head % DEMO_RING_SIZE;
+    int skip = 0;
+    demoRecord_t *rec;
+
+    size = PAD(size + (int)sizeof(demoRecord_t), 8);
+    if (pos + size > DEMO_RING_SIZE)
+    {
+        skip = DEMO_RING_SIZE - pos;
+    }
+
+    if (head + skip + size - tail > DEMO_RING_SIZE)
+    {
+        demo.dropped++;
+        return NULL;
+    }
+
+    if (skip)
+    {
+        rec = (demoRecord_t *)(demo.ring + pos);
+        rec->type = DR_WRAP;
+        rec->size = skip;
+        pos = 0;
+    }
+
+    rec = (demoRecord_t *)(demo.ring + pos);
+    rec->type = type;
+    rec->size = size;
+    demo.reserved = head + skip + size;
+
+    return rec + 1;
+}
+
+static void SV_DemoCommit(void)
+{
+    demo.head.store(demo.reserved, std::memory_order_release);
+}
+
+/*
+==================
+SV_DemoString
+==================
+*/
+static void SV_DemoString(int type, int index, const char *s)
+{
+    int len = strlen(s);
+    demoString_t *str;
+
+    str = (demoString_t *)SV_DemoAlloc(type, offsetof(demoString_t, s) + len + 1);
+    if (!str)
+    {
+        return;
+    }
+
+    str->index = index;
+    ::memcpy(str->s, s, len + 1);
+    SV_DemoCommit();
+}
+
+/*
+==================
+SV_DemoConfigstring
+
+Called by SV_SetConfigstring after the string changed
+==================
+*/
+void SV_DemoConfigstring(int index, const char *val)
+{
+    if (!demo.recording)
+    {
+        return;
+    }
+
+    SV_DemoString(DR_CONFIGSTRING, index, val);
+}
+
+/*
+==================
+SV_DemoServerCommand
+
+clientNum -1 is a broadcast.  Configstring updates are left out, the
+exporter rebuilds them from the configstrings themselves.
+==================
+*/
+void SV_DemoServerCommand(int clientNum, const char *cmd)
+{
+    if (!demo.recording)
+    {
+        return;
+    }
+
+    if (!Q_strncmp(cmd, "cs ", 3) || !Q_strncmp(cmd, "bcs", 3))
+    {
+        return;
+    }
+
+    SV_DemoString(DR_COMMAND, clientNum < 0 ? DEMO_BROADCAST : clientNum, cmd);
+}
+
+/*
+==================
+SV_DemoSnapshot
+
+Called with the frame a client is being sent, once it has been encoded
+==================
+*/
+void SV_DemoSnapshot(client_t *client, clientSnapshot_t *frame)
+{
+    demoSnapshot_t *snap;
+    int i, n;
+
+    if (!demo.recording)
+    {
+        return;
+    }
+
+    snap = (demoSnapshot_t *)SV_DemoAlloc(
+        DR_SNAPSHOT, offsetof(demoSnapshot_t, entities) + frame->num_entities * sizeof(snap->entities[0]));
+    if (!snap)
+    {
+        return;
+    }
+
+    snap->clientNum = client - svs.clients;
+    snap->snapFlags = frame->snapFlags;
+    snap->areabytes = frame->areabytes;
+    ::memcpy(snap->areabits, frame->areabits, sizeof(snap->areabits));
+    snap->ps = frame->ps;
+    snap->numEntities = frame->num_entities;
+
+    for (i = 0; i < frame->num_entities; i++)
+    {
+        n = svs.snapshotEntities[(frame->first_entity + i) % svs.numSnapshotEntities].number;
+        snap->entities[i] = n;
+        SV_DemoSetBit(demo.frameEntities, n);
+    }
+
+    SV_DemoCommit();
+    demo.numSnapshots++;
+}
+
+/*
+==================
+SV_DemoEndFrame
+
+Called once the frame's snapshots are out, adds the entity states they
+referenced
+==================
+*/
+void SV_DemoEndFrame(void)
+{
+    demoFrame_t *frame;
+    unsigned int bits;
+    int numEntities;
+    int i, n;
+
+    if (!demo.recording || !demo.numSnapshots)
+    {
+        return;
+    }
+
+    for (i = 0, numEntities = 0; i < MAX_GENTITIES / 32; i++)
+    {
+        numEntities += Q_popcount(demo.frameEntities[i]);
+    }
+
+    frame = (demoFrame_t *)SV_DemoAlloc(
+        DR_FRAME, offsetof(demoFrame_t, entities) + numEntities * sizeof(frame->entities[0]));
+    if (frame)
+    {
+        frame->serverTime = sv.time;
+        frame->numEntities = 0;
+
+        for (i = 0; i < MAX_GENTITIES / 32; i++)
+        {
+            for (bits = demo.frameEntities[i]; bits; bits &= bits - 1)
+            {
+                n = i * 32 + Q_ctz(bits);
+                frame->entities[frame->numEntities] = SV_GentityNum(n)->s;
+                frame->entities[frame->numEntities].number = n;
+                frame->numEntities++;
+            }
+        }
+
+        // after the alloc, so a frame that didn't fit counts itself
+        frame->dropped = demo.dropped;
+        SV_DemoCommit();
+    }
+
+    ::memset(demo.frameEntities, 0, sizeof(demo.frameEntities));
+    demo.numSnapshots = 0;
+}
+
+/*
+==================
+SV_DemoRecord
+==================
+*/
+static void SV_DemoRecord(const char *name)
+{
+    demoHeader_t header;
+    char path[MAX_QPATH];
+    char *ospath;
+    int i;
+
+    if (demo.recording)
+    {
+        Com_Printf("Already recording to %s.\n", demo.name);
+        return;
+    }
+
+    if (sv.state != SS_GAME)
+    {
+        Com_Printf("Server is not running.\n");
+        return;
+    }
+
+    Com_sprintf(path, sizeof(path), "svdemos/%s.svdemo", name);
+    ospath = FS_BuildOSPath(Cvar_VariableString("fs_homepath"), FS_GetCurrentGameDir(), path);
+    if (FS_CreatePath(ospath) || !(demoWriter.f = Sys_FOpen(ospath, "wb")))
+    {
+        Com_Printf("Couldn't open %s for writing.\n", path);
+        return;
+    }
+
+    if (!demo.ring)
+    {
+        demo.ring = new byte[DEMO_RING_SIZE];
+    }
+    demo.head.store(0);
+    demo.tail.store(0);
+    demo.dropped = 0;
+    demo.numSnapshots = 0;
+    ::memset(demo.frameEntities, 0, sizeof(demo.frameEntities));
+    demo.quit.store(false);
+
+    ::memset(&header, 0, sizeof(header));
+    ::memcpy(header.magic, "SVDM", 4);
+    header.version = LittleLong(DEMO_VERSION);
+    header.protocol = LittleLong(PROTOCOL_VERSION);
+    header.checksumFeed = LittleLong(sv.checksumFeed);
+    header.startTime = LittleLong(sv.time);
+    Q_strncpyz(header.mapname, sv_mapname->string, sizeof(header.mapname));
+    fwrite(&header, sizeof(header), 1, demoWriter.f);
+
+    SV_DemoClearState(&demoWriter.state);
+    demoWriter.events.clear();
+    demoWriter.index.clear();
+    ::memset(demoWriter.haveSnapshot, 0, sizeof(demoWriter.haveSnapshot));
+    demoWriter.offset = sizeof(header);
+    demoWriter.forceKeyframe = true;
+    demoWriter.lastKeyframe = 0;
+    demoWriter.lastDropped = 0;
+    demoWriter.blocks = 0;
+    demoWriter.overflows = 0;
+
+    Q_strncpyz(demo.name, path, sizeof(demo.name));
+    demo.recording = true;
+
+    for (i = 0; i < MAX_CONFIGSTRINGS; i++)
+    {
+        if (sv.configstrings[i].s && sv.configstrings[i].s[0])
+        {
+            SV_DemoConfigstring(i, sv.configstrings[i].s);
+        }
+    }
+
+    demo.thread = new std::thread(SV_DemoWriter);
+
+    Com_Printf("Recording server demo to %s.\n", path);
+}
+
+/*
+==================
+SV_DemoStop
+==================
+*/
+void SV_DemoStop(void)
+{
+    if (!demo.recording)
+    {
+        return;
+    }
+
+    demo.recording = false;
+    demo.quit.store(true);
+    demo.thread->join();
+    delete demo.thread;
+    demo.thread = NULL;
+
+    Com_Printf("Stopped server demo %s: %d frames, %d KB.\n", demo.name, demoWriter.blocks,
+        demoWriter.offset / 1024);
+    if (demo.dropped || demoWriter.overflows)
+    {
+        Com_Printf("WARNING: %d records dropped, %d frames too large\n", demo.dropped, demoWriter.overflows);
+    }
+}
+
+/*
+==================
+SV_DemoAutoRecord
+
+Called at the end of SV_SpawnServer
+==================
+*/
+void SV_DemoAutoRecord(void)
+{
+    qtime_t t;
+
+    if (!sv_autoDemo->integer)
+    {
+        return;
+    }
+
+    Com_RealTime(&t);
+    SV_DemoRecord(va("%04d-%02d-%02d_%02d%02d%02d_%s", 1900 + t.tm_year, 1 + t.tm_mon, t.tm_mday, t.tm_hour,
+        t.tm_min, t.tm_sec, sv_mapname->string));
+}
+
+/*
+==================
+SV_DemoRecord_f
+==================
+*/
+void SV_DemoRecord_f(void)
+{
+    if (Cmd_Argc() != 2)
+    {
+        Com_Printf("usage: svrecord <demoname>\n");
+        return;
+    }
+
+    SV_DemoRecord(Cmd_Argv(1));
+}
+
+/*
+==================
+SV_DemoStop_f
+==================
+*/
+void SV_DemoStop_f(void)
+{
+    if (!demo.recording)
+    {
+        Com_Printf("Not recording a server demo.\n");
+        return;
+    }
+
+    SV_DemoStop();
+}
+
+/*
+=============================================================================
+
+Exporting a client demo
+
+=============================================================================
+*/
+
+struct demoExport_t {
+    demoMirror_t state;
+    int clientNum;
+    fileHandle_t out;
+    bool started;
+    int sequence;  // serverMessageSequence of the last message
+    int commandSequence;
+    std::vector<std::string> commands;  // waiting for the next snapshot
+    bool delta;  // the last snapshot made it into the demo
+    playerState_t ps;
+    entityState_t entities[MAX_GENTITIES];
+    unsigned int visible[MAX_GENTITIES / 32];
+    int snapshots;
+};
+
+/*
+==================
+SV_DemoExportMessage
+==================
+*/
+static void SV_DemoExportMessage(demoExport_t *ex, msg_t *msg)
+{
+    int len;
+
+    len = LittleLong(ex->sequence);
+    FS_Write(&len, 4, ex->out);
+    len = LittleLong(msg->cursize);
+    FS_Write(&len, 4, ex->out);
+    FS_Write(msg->data, msg->cursize, ex->out);
+}
+
+/*
+==================
+SV_DemoExportConfigstring
+
+Queues the same commands SV_SendConfigstring would have sent
+==================
+*/
+static void SV_DemoExportConfigstring(demoExport_t *ex, int index)
+{
+    const std::string &s = ex->state.configstrings[index];
+    int maxChunkSize = MAX_STRING_CHARS - 24;
+    int sent, remaining;
+    const char *cmd;
+
+    if ((int)s.size() < maxChunkSize)
+    {
+        ex->commands.push_back(va("cs %i \"%s\"\n", index, s.c_str()));
+        return;
+    }
+
+    for (sent = 0, remaining = s.size(); remaining > 0; sent += maxChunkSize - 1, remaining -= maxChunkSize - 1)
+    {
+        if (sent == 0)
+        {
+            cmd = "bcs0";
+        }
+        else if (remaining < maxChunkSize)
+        {
+            cmd = "bcs2";
+        }
+        else
+        {
+            cmd = "bcs1";
+        }
+        ex->commands.push_back(va("%s %i \"%s\"\n", cmd, index, s.substr(sent, maxChunkSize - 1).c_str()));
+    }
+}
+
+/*
+==================
+SV_DemoExportGamestate
+==================
+*/
+static bool SV_DemoExportGamestate(demoExport_t *ex, int checksumFeed)
+{
+    byte buf[MAX_MSGLEN];
+    msg_t msg;
+    int i;
+
+    MSG_Init(&msg, buf, sizeof(buf));
+    msg.allowoverflow = true;
+
+    MSG_WriteLong(&msg, 0);
+
+    MSG_WriteByte(&msg, svc_gamestate);
+    MSG_WriteLong(&msg, ex->commandSequence);
+
+    for (i = 0; i < MAX_CONFIGSTRINGS; i++)
+    {
+        if (!ex->state.configstrings[i].empty())
+        {
+            MSG_WriteByte(&msg, svc_configstring);
+            MSG_WriteShort(&msg, i);
+            MSG_WriteBigString(&msg, ex->state.configstrings[i].c_str());
+        }
+    }
+
+    // no baselines, new entities are sent in full
+    MSG_WriteByte(&msg, svc_EOF);
+
+    MSG_WriteLong(&msg, ex->clientNum);
+    MSG_WriteLong(&msg, checksumFeed);
+
+    MSG_WriteByte(&msg, svc_EOF);
+
+    if (msg.overflowed)
+    {
+        Com_Printf("Gamestate overflowed.\n");
+        return false;
+    }
+
+    SV_DemoExportMessage(ex, &msg);
+    return true;
+}
+
+/*
+==================
+SV_DemoExportSnapshot
+
+Writes the client's snapshot the way SV_WriteSnapshotFrame did, delta
+compressed against the previous one in the demo
+==================
+*/
+static void SV_DemoExportSnapshot(
+    demoExport_t *ex, int serverTime, int snapFlags, int areabytes, byte *areabits)
+{
+    demoMirror_t *state = &ex->state;
+    unsigned int *visible = state->visible[ex->clientNum];
+    byte buf[MAX_MSGLEN];
+    bool sent, show;
+    msg_t msg;
+    int n;
+
+    ex->sequence++;
+
+    MSG_Init(&msg, buf, sizeof(buf));
+    msg.allowoverflow = true;
+
+    MSG_WriteLong(&msg, 0);
+
+    for (const std::string &cmd : ex->commands)
+    {
+        MSG_WriteByte(&msg, svc_serverCommand);
+        MSG_WriteLong(&msg, ++ex->commandSequence);
+        MSG_WriteString(&msg, cmd.c_str());
+    }
+    ex->commands.clear();
+
+    MSG_WriteByte(&msg, svc_snapshot);
+    MSG_WriteLong(&msg, serverTime);
+    MSG_WriteByte(&msg, ex->delta ? 1 : 0);
+    MSG_WriteByte(&msg, snapFlags);
+    MSG_WriteByte(&msg, areabytes);
+    MSG_WriteData(&msg, areabits, areabytes);
+    MSG_WriteDeltaPlayerstate(0, &msg, ex->delta ? &ex->ps : NULL, &state->ps[ex->clientNum]);
+
+    for (n = 0; n < MAX_GENTITIES; n++)
+    {
+        sent = ex->delta && SV_DemoBit(ex->visible, n);
+        show = SV_DemoBit(visible, n) && SV_DemoBit(state->present, n);
+
+        if (show)
+        {
+            MSG_WriteDeltaEntity(0, &msg, sent ? &ex->entities[n] : &demoNullEntity, &state->entities[n], !sent);
+        }
+        else if (sent)
+        {
+            MSG_WriteDeltaEntity(0, &msg, &ex->entities[n], NULL, true);
+        }
+    }
+    MSG_WriteBits(&msg, MAX_GENTITIES - 1, GENTITYNUM_BITS);
+
+    MSG_WriteByte(&msg, svc_EOF);
+
+    if (msg.overflowed)
+    {
+        Com_Printf("WARNING: snapshot at %d overflowed, skipped\n", serverTime);
+        ex->delta = false;
+        return;
+    }
+
+    SV_DemoExportMessage(ex, &msg);
+
+    ex->ps = state->ps[ex->clientNum];
+    ::memset(ex->visible, 0, sizeof(ex->visible));
+    for (n = 0; n < MAX_GENTITIES; n++)
+    {
+        if (SV_DemoBit(visible, n) && SV_DemoBit(state->present, n))
+        {
+            ex->entities[n] = state->entities[n];
+            SV_DemoSetBit(ex->visible, n);
+        }
+    }
+    ex->delta = true;
+    ex->snapshots++;
+}
+
+/*
+==================
+SV_DemoExportBlock
+
+Returns false if the block is bad or the export can't go on
+==================
+*/
+static bool SV_DemoExportBlock(demoExport_t *ex, msg_t *msg, int startTime, int checksumFeed)
+{
+    demoMirror_t *state = &ex->state;
+    byte areabits[MAX_MAP_AREA_BYTES];
+    int serverTime, snapFlags, areabytes;
+    int op, index, c;
+    const char *s;
+
+    serverTime = MSG_ReadLong(msg);
+    if (MSG_ReadByte(msg) & DEMO_KEYFRAME)
+    {
+        // configstrings are kept, the keyframe only resends the ones that
+        // are set and unchanged ones shouldn't reach the client again
+        ::memset(state->present, 0, sizeof(state->present));
+        ::memset(state->entities, 0, sizeof(state->entities));
+        ::memset(state->hasPs, 0, sizeof(state->hasPs));
+        ::memset(state->visible, 0, sizeof(state->visible));
+    }
+
+    for (;;)
+    {
+        if (msg->readcount > msg->cursize)
+        {
+            return false;
+        }
+
+        op = MSG_ReadByte(msg);
+        switch (op)
+        {
+            case dm_eof:
+                return true;
+
+            case dm_configstring:
+                index = MSG_ReadShort(msg);
+                if (index < 0 || index >= MAX_CONFIGSTRINGS)
+                {
+                    return false;
+                }
+                s = MSG_ReadBigString(msg);
+                if (state->configstrings[index] != s)
+                {
+                    state->configstrings[index] = s;
+                    if (ex->started)
+                    {
+                        SV_DemoExportConfigstring(ex, index);
+                    }
+                }
+                break;
+
+            case dm_command:
+                index = MSG_ReadByte(msg);
+                s = MSG_ReadString(msg);
+                if (ex->started && (index == ex->clientNum || index == DEMO_BROADCAST))
+                {
+                    ex->commands.push_back(s);
+                }
+                break;
+
+            case dm_entities:
+                if (!SV_DemoReadEntities(msg, state))
+                {
+                    return false;
+                }
+                break;
+
+            case dm_snapshot:
+                c = SV_DemoReadSnapshot(msg, state, &snapFlags, &areabytes, areabits);
+                if (c < 0)
+                {
+                    return false;
+                }
+                if (c != ex->clientNum || serverTime < startTime)
+                {
+                    break;
+                }
+
+                if (!ex->started)
+                {
+                    if (!SV_DemoExportGamestate(ex, checksumFeed))
+                    {
+                        return false;
+                    }
+                    ex->started = true;
+                }
+                SV_DemoExportSnapshot(ex, serverTime, snapFlags, areabytes, areabits);
+                break;
+
+            default:
+                return false;
+        }
+    }
+}
+
+/*
+==================
+SV_DemoSeek
+
+Returns the offset of the last keyframe at or before startTime
+==================
+*/
+static int SV_DemoSeek(fileHandle_t f, int length, int startTime)
+{
+    char magic[4];
+    int offset, count, best;
+    int entry[2];
+    int i;
+
+    best = sizeof(demoHeader_t);
+    if (length < (int)sizeof(demoHeader_t) + 8)
+    {
+        return best;
+    }
+
+    FS_Seek(f, length - 8, FS_SEEK_SET);
+    FS_Read(&offset, 4, f);
+    FS_Read(magic, 4, f);
+    offset = LittleLong(offset);
+    if (::memcmp(magic, "SVDX", 4) || offset < best || offset > length - 12)
+    {
+        Com_Printf("No keyframe index, reading from the start.\n");
+        return best;
+    }
+
+    FS_Seek(f, offset, FS_SEEK_SET);
+    FS_Read(&count, 4, f);
+    count = LittleLong(count);
+    for (i = 0; i < count; i++)
+    {
+        FS_Read(entry, sizeof(entry), f);
+        if (LittleLong(entry[0]) > startTime)
+        {
+            break;
+        }
+        best = LittleLong(entry[1]);
+    }
+
+    return best;
+}
+
+/*
+==================
+SV_DemoExport_f
+
+svdemoexport <svdemo> <clientNum> [seconds]
+==================
+*/
+void SV_DemoExport_f(void)
+{
+    static byte buf[DEMO_BLOCK_SIZE];
+    demoHeader_t header;
+    demoExport_t *ex;
+    char path[MAX_QPATH], out[MAX_QPATH];
+    fileHandle_t f;
+    msg_t msg;
+    int length, len, clientNum, startTime;
+
+    if (Cmd_Argc() < 3)
+    {
+        Com_Printf("usage: svdemoexport <svdemo> <clientNum> [start seconds]\n");
+        return;
+    }
+
+    clientNum = atoi(Cmd_Argv(2));
+    if (clientNum < 0 || clientNum >= MAX_CLIENTS)
+    {
+        Com_Printf("Bad client number %d.\n", clientNum);
+        return;
+    }
+
+    Com_sprintf(path, sizeof(path), "svdemos/%s.svdemo", Cmd_Argv(1));
+    length = FS_FOpenFileRead(path, &f, true);
+    if (!f)
+    {
+        Com_Printf("Couldn't open %s.\n", path);
+        return;
+    }
+
+    if (FS_Read(&header, sizeof(header), f) != sizeof(header) || ::memcmp(header.magic, "SVDM", 4) ||
+        LittleLong(header.version) != DEMO_VERSION || LittleLong(header.protocol) != PROTOCOL_VERSION)
+    {
+        Com_Printf("%s is not a protocol %d server demo.\n", path, PROTOCOL_VERSION);
+        FS_FCloseFile(f);
+        return;
+    }
+
+    startTime = LittleLong(header.startTime) + atoi(Cmd_Argv(3)) * 1000;
+    FS_Seek(f, SV_DemoSeek(f, length, startTime), FS_SEEK_SET);
+
+    Com_sprintf(out, sizeof(out), "demos/%s-%d.%s%d", Cmd_Argv(1), clientNum, DEMOEXT, PROTOCOL_VERSION);
+
+    ex = new demoExport_t();
+    ex->clientNum = clientNum;
+    ex->sequence = 1;
+    ex->out = FS_FOpenFileWrite(out);
+    if (!ex->out)
+    {
+        Com_Printf("Couldn't open %s for writing.\n", out);
+        FS_FCloseFile(f);
+        delete ex;
+        return;
+    }
+
+    while (FS_Read(&len, 4, f) == 4 && (len = LittleLong(len)) >= 0)
+    {
+        if (len > DEMO_BLOCK_SIZE || FS_Read(buf, len, f) != len)
+        {
+            Com_Printf("WARNING: %s is truncated\n", path);
+            break;
+        }
+
+        MSG_Init(&msg, buf, sizeof(buf));
+        msg.cursize = len;
+        MSG_BeginReading(&msg);
+        if (!SV_DemoExportBlock(ex, &msg, startTime, LittleLong(header.checksumFeed)))
+        {
+            Com_Printf("WARNING: bad block in %s, stopping there\n", path);
+            break;
+        }
+    }
+
+    len = -1;
+    FS_Write(&len, 4, ex->out);
+    FS_Write(&len, 4, ex->out);
+    FS_FCloseFile(ex->out);
+    FS_FCloseFile(f);
+
+    if (ex->started)
+    {
+        Com_Printf("Wrote %d snapshots of client %d on %s to %s.\n", ex->snapshots, clientNum, header.mapname, out);
+    }
+    else
+    {
+        Com_Printf("Client %d has no snapshots in %s, %s is empty.\n", clientNum, path, out);
+    }
+    delete ex;
+}
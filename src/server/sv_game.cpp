@@ -193,6 +193,65 @@ bool SV_inPVSIgnorePortals( const vec3_t p1, const vec3_t p2)
 }
 
 
+/*
+=================
+SV_EntityPVSLeaf
+
+The cluster and area of an entity's origin.  Linked entities kept them
+from SV_LinkEntity, anything else has to be looked up.
+=================
+*/
+static void SV_EntityPVSLeaf( int num, int *cluster, int *area )
+{
+	sharedEntity_t	*gEnt;
+	svEntity_t		*svEnt;
+	int				leafnum;
+
+	if ( num < 0 || num >= sv.num_entities ) {
+		Com_Error( ERR_DROP, "SV_EntitiesInPVS: bad entity number %i", num );
+	}
+
+	gEnt = SV_GentityNum( num );
+	if ( gEnt->r.linked ) {
+		svEnt = SV_SvEntityForGentity( gEnt );
+		*cluster = svEnt->originCluster;
+		*area = svEnt->originArea;
+		return;
+	}
+
+	leafnum = CM_PointLeafnum( gEnt->r.currentOrigin );
+	*cluster = CM_LeafCluster( leafnum );
+	*area = CM_LeafArea( leafnum );
+}
+
+/*
+=================
+SV_EntitiesInPVS
+
+SV_inPVS (or SV_inPVSIgnorePortals) for the origins of two entities,
+which for linked entities is a single bit test in the vis data
+=================
+*/
+bool SV_EntitiesInPVS( int num1, int num2, bool ignorePortals )
+{
+	int		cluster1, cluster2;
+	int		area1, area2;
+	byte	*mask;
+
+	SV_EntityPVSLeaf( num1, &cluster1, &area1 );
+	SV_EntityPVSLeaf( num2, &cluster2, &area2 );
+
+	mask = CM_ClusterPVS( cluster1 );
+	if ( mask && !(mask[cluster2>>3] & (1<<(cluster2&7))) )
+		return false;
+
+	if ( !ignorePortals && !CM_AreasConnected( area1, area2 ) )
+		return false;		// a door blocks sight
+
+	return true;
+}
+
+
 /*
 ========================
 SV_AdjustAreaPortalState
@@ -367,6 +426,10 @@ intptr_t SV_GameSystemCalls( intptr_t *args ) {
         case G_TRACECAPSULE:
             SV_Trace( (trace_t*)VMA(1), (const vec_t*)VMA(2), (vec_t*)VMA(3), (vec_t*)VMA(4), (const vec_t*)VMA(5), args[6], args[7], TT_CAPSULE );
             return 0;
+        case G_TRACE_BATCH:
+            SV_TraceBatch( (trace_t*)VM_ArgArray( args[1], sizeof( trace_t ), args[3] ),
+                (const traceRequest_t*)VM_ArgArray( args[2], sizeof( traceRequest_t ), args[3] ), args[3] );
+            return 0;
         case G_POINT_CONTENTS:
             return SV_PointContents( (const vec_t*)VMA(1), args[2] );
         case G_SET_BRUSH_MODEL:
@@ -376,6 +439,8 @@ intptr_t SV_GameSystemCalls( intptr_t *args ) {
             return SV_inPVS( (const vec_t*)VMA(1), (const vec_t*)VMA(2) );
         case G_IN_PVS_IGNORE_PORTALS:
             return SV_inPVSIgnorePortals( (const vec_t*)VMA(1), (const vec_t*)VMA(2) );
+        case G_ENTITIES_IN_PVS:
+            return SV_EntitiesInPVS( args[1], args[2], args[3] );
 
         case G_SET_CONFIGSTRING:
             SV_SetConfigstring( args[1], (const char*)VMA(2) );
@@ -446,6 +511,15 @@ intptr_t SV_GameSystemCalls( intptr_t *args ) {
             Cmd_RemoveCommand( (const char*)VMA(1) );
             return 0;
 
+        case G_PROFILE_REGISTER:
+            return Prof_Register( (const char*)VMA(1) );
+        case G_PROFILE_BEGIN:
+            Prof_Begin( args[1] );
+            return 0;
+        case G_PROFILE_END:
+            Prof_End( args[1] );
+            return 0;
+
         case TRAP_MEMSET:
             ::memset( VMA(1), args[2], args[3] );
             return 0;
@@ -516,6 +590,52 @@ void SV_ShutdownGameProgs( void ) {
 	sv.gvm = NULL;
 }
 
+/*
+==================
+SV_GameDirectTrace
+
+The SV_Trace signature differs from the trap, so the direct table
+needs these two thin wrappers
+==================
+*/
+static void SV_GameDirectTrace( trace_t *results, const vec3_t start, const vec3_t mins,
+		const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask ) {
+	SV_Trace( results, start, (vec_t*)mins, (vec_t*)maxs, end, passEntityNum, contentmask, TT_AABB );
+}
+
+static void SV_GameDirectTraceCapsule( trace_t *results, const vec3_t start, const vec3_t mins,
+		const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask ) {
+	SV_Trace( results, start, (vec_t*)mins, (vec_t*)maxs, end, passEntityNum, contentmask, TT_CAPSULE );
+}
+
+static const gameDirectCalls_t gameDirectCalls = {
+	GAME_DIRECT_VERSION,
+	sizeof( gameDirectCalls_t ),
+
+	SV_GameDirectTrace,
+	SV_GameDirectTraceCapsule,
+	SV_PointContents,
+	SV_LinkEntity,
+	SV_UnlinkEntity,
+	SV_AreaEntities
+};
+
+/*
+==================
+SV_GameDirectCalls
+
+Hands the direct call table to a native game module that wants it
+==================
+*/
+static void SV_GameDirectCalls( void ) {
+	void	(*directCalls)( const gameDirectCalls_t *calls );
+
+	directCalls = (void (*)( const gameDirectCalls_t * ))VM_DllFunction( sv.gvm, "dllDirectCalls" );
+	if ( directCalls ) {
+		directCalls( &gameDirectCalls );
+	}
+}
+
 /*
 ==================
 SV_InitGameVM
@@ -526,6 +646,9 @@ Called for both a full init and a restart
 static void SV_InitGameVM( bool restart ) {
 	int		i;
 
+	// a restarted dll is a fresh load, so this is needed every time
+	SV_GameDirectCalls();
+
 	// start the entity parsing at the beginning
 	sv.entityParsePoint = CM_EntityString();
 
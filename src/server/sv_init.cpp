@@ -202,6 +202,11 @@ void SV_SetConfigstring(int idx, const char *val)
         sv.configstrings[idx].s = CopyString(val);
     }
 
+    if (idx > CS_SYSTEMINFO || modified[0])
+    {
+        SV_DemoConfigstring(idx, val);
+    }
+
     // send it to all the clients if we aren't
     // spawning a new server
     if (sv.state == SS_GAME || sv.restarting)
@@ -553,6 +558,9 @@ void SV_SpawnServer(char *server)
     char systemInfo[16384];
     const char *p;
 
+    // a server demo only ever covers one map
+    SV_DemoStop();
+
     // shut down the existing game if it is running
     SV_ShutdownGameProgs();
 
@@ -645,6 +653,9 @@ void SV_SpawnServer(char *server)
     // clear physics interaction links
     SV_ClearWorld();
 
+    // size the snapshot visibility index for the new map's clusters
+    SV_InitSnapshotIndex();
+
     // media configstring setting should be done during
     // the loading stage, so connected clients don't have
     // to load during actual gameplay
@@ -752,6 +763,8 @@ void SV_SpawnServer(char *server)
     // send a heartbeat now so the master will get up to date info
     SV_Heartbeat_f();
 
+    SV_DemoAutoRecord();
+
     Hunk_SetMark();
 
 #ifndef DEDICATED
@@ -833,6 +846,15 @@ void SV_Init(void)
     sv_mapChecksum = Cvar_Get("sv_mapChecksum", "", CVAR_ROM);
     sv_lanForceRate = Cvar_Get("sv_lanForceRate", "1", CVAR_ARCHIVE);
     sv_rsaAuth = Cvar_Get("sv_rsaAuth", "1", CVAR_INIT | CVAR_PROTECTED);
+    sv_snapshotIndex = Cvar_Get("sv_snapshotIndex", "1", CVAR_ARCHIVE);
+    sv_snapshotThreads = Cvar_Get("sv_snapshotThreads", "0", CVAR_ARCHIVE);
+    Cvar_CheckRange(sv_snapshotThreads, 0, 32, true);
+    sv_deltaCache = Cvar_Get("sv_deltaCache", "1", CVAR_ARCHIVE);
+    sv_autoDemo = Cvar_Get("sv_autoDemo", "0", CVAR_ARCHIVE);
+    sv_uplinkRate = Cvar_Get("sv_uplinkRate", "0", CVAR_ARCHIVE);
+    sv_snapshotPacing = Cvar_Get("sv_snapshotPacing", "0", CVAR_ARCHIVE);
+    Cvar_CheckRange(sv_snapshotPacing, 0, MAX_CLIENTS, true);
+    sv_adaptiveSnapshots = Cvar_Get("sv_adaptiveSnapshots", "0", CVAR_ARCHIVE);
 }
 
 /*
@@ -890,15 +912,24 @@ void SV_Shutdown(const char *finalmsg)
 
     NET_LeaveMulticast6();
 
+    // held snapshots would keep the final messages waiting behind them
+    SV_FlushSnapshots();
+
     if (svs.clients && !com_errorEntered)
     {
         SV_FinalMessage(finalmsg);
     }
 
+    SV_DemoStop();
+
     SV_RemoveOperatorCommands();
     SV_MasterShutdown();
     SV_ShutdownGameProgs();
 
+    // stop the snapshot job threads, they are started again on demand
+    Job_SetThreads(0);
+    sv_snapshotThreads->modified = true;
+
     // free current level
     SV_ClearServer();
 
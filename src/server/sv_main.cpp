@@ -59,6 +59,13 @@ cvar_t	*sv_maxPing;
 cvar_t	*sv_pure;
 cvar_t	*sv_lanForceRate; // dedicated 1 (LAN) server forces local client rates to 99999 (bug #491)
 cvar_t	*sv_banFile;
+cvar_t	*sv_snapshotIndex;		// cull snapshot entities through the per-frame cluster index
+cvar_t	*sv_snapshotThreads;		// job threads used to build client snapshots
+cvar_t	*sv_deltaCache;			// share encoded entity deltas between clients
+cvar_t	*sv_autoDemo;			// record a server demo of every map
+cvar_t	*sv_uplinkRate;			// KB/s for all snapshots together, 0 is unlimited
+cvar_t	*sv_snapshotPacing;		// batches to spread a frame's snapshots over
+cvar_t	*sv_adaptiveSnapshots;	// fit snapshot interval and size to the client's rate
 
 cvar_t  *sv_rsaAuth;
 
@@ -200,6 +207,8 @@ void QDECL SV_SendServerCommand(client_t *cl, const char *fmt, ...) {
 	  return;
 	}
 
+	SV_DemoServerCommand( cl ? cl - svs.clients : -1, (char *)message );
+
 	if ( cl != NULL ) {
 		SV_AddServerCommand( cl, (char *)message );
 		return;
@@ -1112,6 +1121,8 @@ void SV_Frame( int msec ) {
 		cvar_modifiedFlags &= ~CVAR_SYSTEMINFO;
 	}
 
+	PROF_SCOPE( prof, "sv_frame" );
+
 	if ( com_speeds->integer ) {
 		startTime = Sys_Milliseconds ();
 	} else {
@@ -1128,6 +1139,7 @@ void SV_Frame( int msec ) {
 		sv.time += frameMsec;
 
 		// let everything in the world think and move
+		PROF_SCOPE( profGame, "game_frame" );
 		VM_Call (sv.gvm, GAME_RUN_FRAME, sv.time);
 	}
 
@@ -1138,8 +1150,13 @@ void SV_Frame( int msec ) {
 	// check timeouts
 	SV_CheckTimeouts();
 
-	// send messages back to the clients
+	// send messages back to the clients, a syscall per socket where possible
+	NET_BeginSendBatch();
 	SV_SendClientMessages();
+	{
+		PROF_SCOPE( profFlush, "net_flush" );
+		NET_FlushSendBatch();
+	}
 
 	// send a heartbeat to the master if needed
 	SV_MasterHeartbeat(HEARTBEAT_FOR_MASTER);
@@ -1147,23 +1164,14 @@ void SV_Frame( int msec ) {
 
 /*
 ====================
-SV_RateMsec
+SV_ClientRate
 
-Return the number of msec until another message can be sent to
-a client based on its rate settings
+Return the client's rate after sv_minRate and sv_maxRate
 ====================
 */
-
-#define UDPIP_HEADER_SIZE 28
-#define UDPIP6_HEADER_SIZE 48
-
-int SV_RateMsec(client_t *client)
+int SV_ClientRate(client_t *client)
 {
-	int rate, rateMsec;
-	int messageSize;
-	
-	messageSize = client->netchan.lastSentSize;
-	rate = client->rate;
+	int rate = client->rate;
 
 	if(sv_maxRate->integer)
 	{
@@ -1181,6 +1189,29 @@ int SV_RateMsec(client_t *client)
 			rate = sv_minRate->integer;
 	}
 
+	return rate;
+}
+
+/*
+====================
+SV_RateMsec
+
+Return the number of msec until another message can be sent to
+a client based on its rate settings
+====================
+*/
+
+#define UDPIP_HEADER_SIZE 28
+#define UDPIP6_HEADER_SIZE 48
+
+int SV_RateMsec(client_t *client)
+{
+	int rate, rateMsec;
+	int messageSize;
+	
+	messageSize = client->netchan.lastSentSize;
+	rate = SV_ClientRate(client);
+
 	if(client->netchan.remoteAddress.type == NA_IP6)
 		messageSize += UDPIP6_HEADER_SIZE;
 	else
@@ -1216,10 +1247,17 @@ int SV_SendQueuedPackets()
 	int timeVal = INT_MAX;
 
 	// Send out fragmented packets now that we're idle
+	NET_BeginSendBatch();
 	delayT = SV_SendQueuedMessages();
 	if(delayT >= 0)
 		timeVal = delayT;
 
+	// and the snapshots that are paced over the frame
+	delayT = SV_SendPacedSnapshots(false);
+	NET_FlushSendBatch();
+	if(delayT >= 0 && delayT < timeVal)
+		timeVal = delayT;
+
 	if(sv_dlRate->integer)
 	{
 		// Rate limiting. This is very imprecise for high
@@ -1277,3 +1315,18 @@ int SV_SendQueuedPackets()
 
 	return timeVal;
 }
+
+/*
+====================
+SV_FlushSnapshots
+
+Send whatever snapshots of the last frame are still waiting on
+sv_snapshotPacing, so none of them slips into the next frame
+====================
+*/
+void SV_FlushSnapshots(void)
+{
+	NET_BeginSendBatch();
+	SV_SendPacedSnapshots(true);
+	NET_FlushSendBatch();
+}
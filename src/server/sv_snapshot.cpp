@@ -23,6 +23,9 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "server.h"
 
+#include <algorithm>
+#include <atomic>
+
 /*
 =============================================================================
 
@@ -45,6 +48,195 @@ A normal server packet will look like:
 =============================================================================
 */
 
+/*
+=============================================================================
+
+Entity delta cache
+
+Every snapshot sent by one SV_SendClientMessages copies the same entity
+states, and clients at the same rate mostly acknowledge the same earlier
+frame, so many of them delta the same entity from the same state.  The
+first client to need a delta encodes it into a scratch message and keeps
+the bits; the rest splice them in.  The key is the entity number, the
+svs.snapshotFrame the old state was copied in (or the baseline) and the
+protocol, since alternateProtocol 2 skips a field.  Nothing in that key
+pins down the new state, so each slot keeps a copy of it and a hit only
+counts when the state being written is the same.
+
+Slots are claimed with a compare-and-swap, so clients encoded on the job
+threads share the cache as well.  A slot somebody else is still filling
+is treated as a miss.
+
+=============================================================================
+*/
+
+#define DELTA_CACHE_SLOTS 4096  // power of two
+#define DELTA_CACHE_PROBES 8
+#define DELTA_CACHE_BYTES 0x40000
+#define DELTA_CACHE_MAX_DELTA 1024  // bytes, larger deltas are written directly
+#define DELTA_FROM_BASELINE -1
+
+enum { DELTA_EMPTY, DELTA_BUSY, DELTA_READY };
+
+struct deltaCacheSlot_t {
+    std::atomic<int> state;
+    int number;
+    int fromFrame;
+    int alternateProtocol;
+    int offset;  // into deltaCache.data
+    int bits;
+    entityState_t to;  // the state the delta leads to
+};
+
+struct deltaCache_t {
+    bool valid;  // only set while a frame's snapshots are going out
+    deltaCacheSlot_t slots[DELTA_CACHE_SLOTS];
+    std::atomic<int> used;  // bytes of data handed out
+    std::atomic<int> hits;
+    std::atomic<int> misses;
+    byte data[DELTA_CACHE_BYTES];
+};
+
+static deltaCache_t deltaCache;
+
+/*
+=============
+SV_BeginDeltaCache
+
+Empties the cache for a new set of snapshots
+=============
+*/
+static void SV_BeginDeltaCache(void)
+{
+    int i;
+
+    svs.snapshotFrame++;
+
+    deltaCache.valid = sv_deltaCache->integer != 0;
+    if (!deltaCache.valid)
+    {
+        return;
+    }
+
+    for (i = 0; i < DELTA_CACHE_SLOTS; i++)
+    {
+        deltaCache.slots[i].state.store(DELTA_EMPTY, std::memory_order_relaxed);
+    }
+    deltaCache.used.store(0, std::memory_order_relaxed);
+}
+
+/*
+=============
+SV_EndDeltaCache
+
+The entity states will have moved on by the next call, so stop using the
+cache and report how it did
+=============
+*/
+static void SV_EndDeltaCache(void)
+{
+    int hits, misses;
+
+    if (!deltaCache.valid)
+    {
+        return;
+    }
+    deltaCache.valid = false;
+
+    hits = deltaCache.hits.exchange(0, std::memory_order_relaxed);
+    misses = deltaCache.misses.exchange(0, std::memory_order_relaxed);
+
+    if (com_speeds->integer && hits + misses)
+    {
+        Com_Printf("delta hit:%4i miss:%4i rate:%3i%% bytes:%6i\n", hits, misses,
+            hits * 100 / (hits + misses), deltaCache.used.load(std::memory_order_relaxed));
+    }
+}
+
+/*
+=============
+SV_WriteCachedDeltaEntity
+
+MSG_WriteDeltaEntity through the delta cache.  fromFrame is the frame the
+from state was copied in, DELTA_FROM_BASELINE, or 0 if it can't be cached.
+=============
+*/
+static void SV_WriteCachedDeltaEntity(
+    int alternateProtocol, msg_t *msg, entityState_t *from, int fromFrame, entityState_t *to, bool force)
+{
+    deltaCacheSlot_t *slot, *claimed;
+    unsigned int hash;
+    int i, state, offset;
+    msg_t scratch;
+    byte scratchBuf[DELTA_CACHE_MAX_DELTA];
+
+    if (!deltaCache.valid || !fromFrame)
+    {
+        MSG_WriteDeltaEntity(alternateProtocol, msg, from, to, force);
+        return;
+    }
+
+    hash = (unsigned int)to->number * 2654435761u ^ (unsigned int)fromFrame * 40503u ^ alternateProtocol;
+    claimed = NULL;
+    for (i = 0; i < DELTA_CACHE_PROBES; i++)
+    {
+        slot = &deltaCache.slots[(hash + i) & (DELTA_CACHE_SLOTS - 1)];
+        state = slot->state.load(std::memory_order_acquire);
+
+        if (state == DELTA_READY)
+        {
+            if (slot->number == to->number && slot->fromFrame == fromFrame &&
+                slot->alternateProtocol == alternateProtocol && !::memcmp(&slot->to, to, sizeof(*to)))
+            {
+                MSG_WriteBitstream(msg, deltaCache.data + slot->offset, slot->bits);
+                deltaCache.hits.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            continue;
+        }
+
+        if (state == DELTA_EMPTY &&
+            slot->state.compare_exchange_strong(state, DELTA_BUSY, std::memory_order_acquire))
+        {
+            claimed = slot;
+            break;
+        }
+    }
+
+    deltaCache.misses.fetch_add(1, std::memory_order_relaxed);
+
+    MSG_Init(&scratch, scratchBuf, sizeof(scratchBuf));
+    MSG_WriteDeltaEntity(alternateProtocol, &scratch, from, to, force);
+    if (scratch.overflowed)
+    {
+        // leave the slot busy, nobody else will do better
+        MSG_WriteDeltaEntity(alternateProtocol, msg, from, to, force);
+        return;
+    }
+
+    MSG_WriteBitstream(msg, scratch.data, scratch.bit);
+
+    if (!claimed)
+    {
+        return;
+    }
+
+    offset = deltaCache.used.fetch_add((scratch.bit + 7) >> 3, std::memory_order_relaxed);
+    if (offset + ((scratch.bit + 7) >> 3) > DELTA_CACHE_BYTES)
+    {
+        return;
+    }
+
+    ::memcpy(deltaCache.data + offset, scratch.data, (scratch.bit + 7) >> 3);
+    claimed->number = to->number;
+    claimed->fromFrame = fromFrame;
+    claimed->alternateProtocol = alternateProtocol;
+    claimed->offset = offset;
+    claimed->bits = scratch.bit;
+    claimed->to = *to;
+    claimed->state.store(DELTA_READY, std::memory_order_release);
+}
+
 /*
 =============
 SV_EmitPacketEntities
@@ -59,6 +251,8 @@ static void SV_EmitPacketEntities(int alternateProtocol, clientSnapshot_t *from,
     int oldnum, newnum;
     int from_num_entities;
 
+    PROF_SCOPE(prof, "delta_encode");
+
     // generate the delta update
     if (!from)
     {
@@ -100,7 +294,7 @@ static void SV_EmitPacketEntities(int alternateProtocol, clientSnapshot_t *from,
             // delta update from old position
             // because the force parm is false, this will not result
             // in any bytes being emited if the entity has not changed at all
-            MSG_WriteDeltaEntity(alternateProtocol, msg, oldent, newent, false);
+            SV_WriteCachedDeltaEntity(alternateProtocol, msg, oldent, from->entityFrame, newent, false);
             oldindex++;
             newindex++;
             continue;
@@ -109,7 +303,8 @@ static void SV_EmitPacketEntities(int alternateProtocol, clientSnapshot_t *from,
         if (newnum < oldnum)
         {
             // this is a new entity, send it from the baseline
-            MSG_WriteDeltaEntity(alternateProtocol, msg, &sv.svEntities[newnum].baseline, newent, true);
+            SV_WriteCachedDeltaEntity(
+                alternateProtocol, msg, &sv.svEntities[newnum].baseline, DELTA_FROM_BASELINE, newent, true);
             newindex++;
             continue;
         }
@@ -128,48 +323,67 @@ static void SV_EmitPacketEntities(int alternateProtocol, clientSnapshot_t *from,
 
 /*
 ==================
-SV_WriteSnapshotToClient
+SV_SnapshotDeltaFrame
+
+Picks the snapshot to delta compress against, or NULL to send a full
+one.  *lastframe is set to the value that goes on the wire.
 ==================
 */
-static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg)
+static clientSnapshot_t *SV_SnapshotDeltaFrame(client_t *client, int *lastframe)
 {
-    clientSnapshot_t *frame, *oldframe;
-    int lastframe;
-    int i;
-    int snapFlags;
-
-    // this is the snapshot we are creating
-    frame = &client->frames[client->netchan.outgoingSequence & PACKET_MASK];
+    clientSnapshot_t *oldframe;
 
     // try to use a previous frame as the source for delta compressing the snapshot
     if (client->deltaMessage <= 0 || client->state != CS_ACTIVE)
     {
         // client is asking for a retransmit
         oldframe = NULL;
-        lastframe = 0;
+        *lastframe = 0;
     }
     else if (client->netchan.outgoingSequence - client->deltaMessage >= (PACKET_BACKUP - 3))
     {
         // client hasn't gotten a good message through in a long time
         Com_DPrintf("%s: Delta request from out of date packet.\n", client->name);
         oldframe = NULL;
-        lastframe = 0;
+        *lastframe = 0;
     }
     else
     {
         // we have a valid snapshot to delta from
         oldframe = &client->frames[client->deltaMessage & PACKET_MASK];
-        lastframe = client->netchan.outgoingSequence - client->deltaMessage;
+        *lastframe = client->netchan.outgoingSequence - client->deltaMessage;
 
         // the snapshot's entities may still have rolled off the buffer, though
         if (oldframe->first_entity <= svs.nextSnapshotEntities - svs.numSnapshotEntities)
         {
             Com_DPrintf("%s: Delta request from out of date entities.\n", client->name);
             oldframe = NULL;
-            lastframe = 0;
+            *lastframe = 0;
         }
     }
 
+    return oldframe;
+}
+
+/*
+==================
+SV_WriteSnapshotFrame
+
+Encodes the current frame against oldframe.  Only touches the client's
+own frames and svs.snapshotEntities, so it is safe to run on a job thread.
+==================
+*/
+static void SV_WriteSnapshotFrame(client_t *client, clientSnapshot_t *oldframe, int lastframe, msg_t *msg)
+{
+    clientSnapshot_t *frame;
+    int i;
+    int snapFlags;
+
+    PROF_SCOPE(prof, "snapshot_encode");
+
+    // this is the snapshot we are creating
+    frame = &client->frames[client->netchan.outgoingSequence & PACKET_MASK];
+
     MSG_WriteByte(msg, svc_snapshot);
 
     // NOTE, MRE: now sent at the start of every message from server to client
@@ -207,6 +421,7 @@ static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg)
     }
 
     MSG_WriteByte(msg, snapFlags);
+    frame->snapFlags = snapFlags;
 
     // send over the areabits
     MSG_WriteByte(msg, frame->areabytes);
@@ -235,6 +450,20 @@ static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg)
     }
 }
 
+/*
+==================
+SV_WriteSnapshotToClient
+==================
+*/
+static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg)
+{
+    clientSnapshot_t *oldframe;
+    int lastframe;
+
+    oldframe = SV_SnapshotDeltaFrame(client, &lastframe);
+    SV_WriteSnapshotFrame(client, oldframe, lastframe, msg);
+}
+
 /*
 ==================
 SV_UpdateServerCommandsToClient
@@ -264,34 +493,31 @@ Build a client snapshot structure
 =============================================================================
 */
 
+// Entity numbers are kept as a bitset, so walking it with Q_ctz gives them
+// in ascending order no matter which viewpoint added them.
 typedef struct {
     int numSnapshotEntities;
-    int snapshotEntities[MAX_SNAPSHOT_ENTITIES];
+    unsigned int entities[MAX_GENTITIES / 32];  // the ones that will be sent
+    unsigned int added[MAX_GENTITIES / 32];  // kept per snapshot so portals can't double add
 } snapshotEntityNumbers_t;
 
 /*
 =======================
-SV_QsortEntityNumbers
+SV_ClearEntityNumbers
+
+Empties the list.  The viewing client's own entity is never sent, because
+it can be regenerated from the playerstate.
 =======================
 */
-static int QDECL SV_QsortEntityNumbers(const void *a, const void *b)
+static void SV_ClearEntityNumbers(snapshotEntityNumbers_t *eNums, int clientNum)
 {
-    int *ea, *eb;
-
-    ea = (int *)a;
-    eb = (int *)b;
-
-    if (*ea == *eb)
-    {
-        Com_Error(ERR_DROP, "SV_QsortEntityStates: duplicated entity");
-    }
-
-    if (*ea < *eb)
+    eNums->numSnapshotEntities = 0;
+    ::memset(eNums->entities, 0, sizeof(eNums->entities));
+    ::memset(eNums->added, 0, sizeof(eNums->added));
+    if (clientNum >= 0 && clientNum < MAX_GENTITIES)
     {
-        return -1;
+        eNums->added[clientNum >> 5] |= 1u << (clientNum & 31);
     }
-
-    return 1;
 }
 
 /*
@@ -299,63 +525,95 @@ static int QDECL SV_QsortEntityNumbers(const void *a, const void *b)
 SV_AddEntToSnapshot
 ===============
 */
-static void SV_AddEntToSnapshot(svEntity_t *svEnt, sharedEntity_t *gEnt, snapshotEntityNumbers_t *eNums)
+static void SV_AddEntToSnapshot(sharedEntity_t *gEnt, snapshotEntityNumbers_t *eNums)
 {
-    // if we have already added this entity to this snapshot, don't add again
-    if (svEnt->snapshotCounter == sv.snapshotCounter)
-    {
-        return;
-    }
-    svEnt->snapshotCounter = sv.snapshotCounter;
+    int e = gEnt->s.number;
 
-    // if we are full, silently discard entities
-    if (eNums->numSnapshotEntities == MAX_SNAPSHOT_ENTITIES)
+    // if we have already added this entity to this snapshot, don't add again
+    if (eNums->added[e >> 5] & (1u << (e & 31)))
     {
         return;
     }
+    eNums->added[e >> 5] |= 1u << (e & 31);
 
-    eNums->snapshotEntities[eNums->numSnapshotEntities] = gEnt->s.number;
+    eNums->entities[e >> 5] |= 1u << (e & 31);
     eNums->numSnapshotEntities++;
 }
 
+/*
+=============================================================================
+
+Per-frame visibility index
+
+Instead of every client walking every entity, the entities that are culled
+by the PVS are bucketed once per frame by the clusters they were linked
+into, so a client only has to look at the buckets of the clusters set in
+its own PVS row.  Broadcast entities and entities whose clusters overflowed
+clusternums[] are kept on separate lists and go through the full test.
+
+=============================================================================
+*/
+
+struct snapshotIndex_t {
+    bool valid;  // only set while a frame's snapshots are going out
+    int numClusters;
+    int *clusterFirst;  // [numClusters + 2], bucket c is [clusterFirst[c], clusterFirst[c + 1])
+    int clusterEntities[MAX_GENTITIES * MAX_ENT_CLUSTERS];
+    int numBroadcast;
+    int broadcastEntities[MAX_GENTITIES];
+    int numOverflow;
+    int overflowEntities[MAX_GENTITIES];
+};
+
 /*
 ===============
-SV_AddEntitiesVisibleFromPoint
+SV_InitSnapshotIndex
+
+Called from SV_SpawnServer once the collision map is loaded
 ===============
 */
-static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums)
+void SV_InitSnapshotIndex(void)
+{
+    snapshotIndex_t *index;
+
+    index = (snapshotIndex_t *)Hunk_Alloc(sizeof(*index), h_high);
+    index->numClusters = CM_NumClusters();
+    index->clusterFirst = (int *)Hunk_Alloc((index->numClusters + 2) * sizeof(int), h_high);
+    sv.snapshotIndex = index;
+}
+
+/*
+===============
+SV_BuildSnapshotIndex
+
+Buckets every sendable entity by cluster.  This is a counting sort, so the
+buckets keep ascending entity order.
+===============
+*/
+static void SV_BuildSnapshotIndex(void)
 {
-    int e, i;
+    snapshotIndex_t *index = sv.snapshotIndex;
     sharedEntity_t *ent;
     svEntity_t *svEnt;
-    int l;
-    int clientarea, clientcluster;
-    int leafnum;
-    byte *clientpvs;
-    byte *bitvector;
+    int *first;
+    int e, i, c;
 
-    // during an error shutdown message we may need to transmit
-    // the shutdown message after the server has shutdown, so
-    // specfically check for it
-    if (!sv.state)
+    if (!index)
     {
         return;
     }
 
-    leafnum = CM_PointLeafnum(origin);
-    clientarea = CM_LeafArea(leafnum);
-    clientcluster = CM_LeafCluster(leafnum);
-
-    // calculate the visible areas
-    frame->areabytes = CM_WriteAreaBits(frame->areabits, clientarea);
-
-    clientpvs = CM_ClusterPVS(clientcluster);
+    first = index->clusterFirst;
+    ::memset(first, 0, (index->numClusters + 2) * sizeof(int));
+    index->numBroadcast = 0;
+    index->numOverflow = 0;
 
+    // count the entities in each cluster, offset by two so the
+    // running sum below leaves bucket c starting at first[c + 1]
     for (e = 0; e < sv.num_entities; e++)
     {
         ent = SV_GentityNum(e);
 
-        // never send entities that aren't linked in
         if (!ent->r.linked)
         {
             continue;
@@ -367,172 +625,433 @@ static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *fram
             ent->s.number = e;
         }
 
-        // entities can be flagged to explicitly not be sent to the client
         if (ent->r.svFlags & SVF_NOCLIENT)
         {
             continue;
         }
 
-        // entities can be flagged to be sent to only one client
-        if (ent->r.svFlags & SVF_SINGLECLIENT)
-        {
-            if (ent->r.singleClient != frame->ps.clientNum)
-            {
-                continue;
-            }
-        }
-        // entities can be flagged to be sent to everyone but one client
-        if (ent->r.svFlags & SVF_NOTSINGLECLIENT)
-        {
-            if (ent->r.singleClient == frame->ps.clientNum)
-            {
-                continue;
-            }
-        }
-        // entities can be flagged to be sent to a given mask of clients
-        if (ent->r.svFlags & SVF_CLIENTMASK)
-        {
-            if (frame->ps.clientNum >= 32)
-            {
-                if (~ent->r.hack.generic1 & (1 << (frame->ps.clientNum - 32))) continue;
-            }
-            else
-            {
-                if (~ent->r.singleClient & (1 << frame->ps.clientNum)) continue;
-            }
-        }
-
-        svEnt = SV_SvEntityForGentity(ent);
+        svEnt = &sv.svEntities[e];
 
-        // don't double add an entity through portals
-        if (svEnt->snapshotCounter == sv.snapshotCounter)
+        if (ent->r.svFlags & SVF_BROADCAST)
         {
+            index->broadcastEntities[index->numBroadcast++] = e;
             continue;
         }
 
-        // broadcast entities are always sent
-        if (ent->r.svFlags & SVF_BROADCAST)
+        if (svEnt->lastCluster)
         {
-            SV_AddEntToSnapshot(svEnt, ent, eNums);
+            index->overflowEntities[index->numOverflow++] = e;
             continue;
         }
 
-        // ignore if not touching a PV leaf
-        // check area
-        if (!CM_AreasConnected(clientarea, svEnt->areanum))
+        for (i = 0; i < svEnt->numClusters; i++)
         {
-            // doors can legally straddle two areas, so
-            // we may need to check another one
-            if (!CM_AreasConnected(clientarea, svEnt->areanum2))
+            c = svEnt->clusternums[i];
+            if (c >= 0 && c < index->numClusters)
             {
-                continue;  // blocked by a door
+                first[c + 2]++;
             }
         }
+    }
+
+    for (c = 2; c < index->numClusters + 2; c++)
+    {
+        first[c] += first[c - 1];
+    }
 
-        bitvector = clientpvs;
+    // fill the buckets, which shifts every start down into place
+    for (e = 0; e < sv.num_entities; e++)
+    {
+        ent = SV_GentityNum(e);
+        svEnt = &sv.svEntities[e];
 
-        // check individual leafs
-        if (!svEnt->numClusters)
+        if (!ent->r.linked || (ent->r.svFlags & (SVF_NOCLIENT | SVF_BROADCAST)) || svEnt->lastCluster)
         {
             continue;
         }
-        l = 0;
+
         for (i = 0; i < svEnt->numClusters; i++)
         {
-            l = svEnt->clusternums[i];
-            if (bitvector[l >> 3] & (1 << (l & 7)))
+            c = svEnt->clusternums[i];
+            if (c >= 0 && c < index->numClusters)
             {
-                break;
+                index->clusterEntities[first[c + 1]++] = e;
             }
         }
+    }
+
+    index->valid = true;
+}
+
+/*
+===============
+SV_EntityInPVS
+
+Tests the clusters an entity was linked into against a PVS row
+===============
+*/
+static bool SV_EntityInPVS(svEntity_t *svEnt, byte *bitvector)
+{
+    int i, l;
+
+    // check individual leafs
+    if (!svEnt->numClusters)
+    {
+        return false;
+    }
+    l = 0;
+    for (i = 0; i < svEnt->numClusters; i++)
+    {
+        l = svEnt->clusternums[i];
+        if (bitvector[l >> 3] & (1 << (l & 7)))
+        {
+            break;
+        }
+    }
 
-        // if we haven't found it to be visible,
-        // check overflow clusters that coudln't be stored
-        if (i == svEnt->numClusters)
+    // if we haven't found it to be visible,
+    // check overflow clusters that coudln't be stored
+    if (i == svEnt->numClusters)
+    {
+        if (svEnt->lastCluster)
         {
-            if (svEnt->lastCluster)
+            for (; l <= svEnt->lastCluster; l++)
             {
-                for (; l <= svEnt->lastCluster; l++)
+                if (bitvector[l >> 3] & (1 << (l & 7)))
                 {
-                    if (bitvector[l >> 3] & (1 << (l & 7)))
-                    {
-                        break;
-                    }
-                }
-                if (l == svEnt->lastCluster)
-                {
-                    continue;  // not visible
+                    break;
                 }
             }
-            else
+            if (l == svEnt->lastCluster)
             {
-                continue;
+                return false;  // not visible
             }
         }
-
-        // add it
-        SV_AddEntToSnapshot(svEnt, ent, eNums);
-
-        // if it's a portal entity, add everything visible from its camera position
-        if (ent->r.svFlags & SVF_PORTAL)
+        else
         {
-            if (ent->s.generic1)
-            {
-                vec3_t dir;
-                VectorSubtract(ent->r.currentOrigin, origin, dir);
-                if (VectorLengthSquared(dir) > (float)ent->s.generic1 * ent->s.generic1)
-                {
-                    continue;
-                }
-            }
-            SV_AddEntitiesVisibleFromPoint(ent->s.origin2, frame, eNums);
+            return false;
         }
     }
-}
 
-/*
-=============
-SV_BuildClientSnapshot
+    return true;
+}
 
-Decides which entities are going to be visible to the client, and
-copies off the playerstate and areabits.
+static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums);
 
-This properly handles multiple recursive portals, but the render
-currently doesn't.
+/*
+===============
+SV_AddEntityIfVisible
 
-For viewing through other player's eyes, clent can be something other than client->gentity
-=============
+Applies the send rules to a single entity.  inPVS is true when the caller
+already knows that the entity touches a cluster in clientpvs.
+===============
 */
-static void SV_BuildClientSnapshot(client_t *client)
+static void SV_AddEntityIfVisible(int e, vec3_t origin, int clientarea, byte *clientpvs, bool inPVS,
+    clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums)
 {
-    vec3_t org;
-    clientSnapshot_t *frame;
-    snapshotEntityNumbers_t entityNumbers;
-    int i;
     sharedEntity_t *ent;
-    entityState_t *state;
     svEntity_t *svEnt;
-    sharedEntity_t *clent;
-    int clientNum;
-    playerState_t *ps;
 
-    // bump the counter used to prevent double adding
-    sv.snapshotCounter++;
+    ent = SV_GentityNum(e);
 
-    // this is the frame we are creating
-    frame = &client->frames[client->netchan.outgoingSequence & PACKET_MASK];
-
-    // clear everything in this snapshot
-    entityNumbers.numSnapshotEntities = 0;
-    ::memset(frame->areabits, 0, sizeof(frame->areabits));
+    // never send entities that aren't linked in
+    if (!ent->r.linked)
+    {
+        return;
+    }
+
+    if (ent->s.number != e)
+    {
+        Com_DPrintf("FIXING ENT->S.NUMBER!!!\n");
+        ent->s.number = e;
+    }
+
+    // entities can be flagged to explicitly not be sent to the client
+    if (ent->r.svFlags & SVF_NOCLIENT)
+    {
+        return;
+    }
+
+    // entities can be flagged to be sent to only one client
+    if (ent->r.svFlags & SVF_SINGLECLIENT)
+    {
+        if (ent->r.singleClient != frame->ps.clientNum)
+        {
+            return;
+        }
+    }
+    // entities can be flagged to be sent to everyone but one client
+    if (ent->r.svFlags & SVF_NOTSINGLECLIENT)
+    {
+        if (ent->r.singleClient == frame->ps.clientNum)
+        {
+            return;
+        }
+    }
+    // entities can be flagged to be sent to a given mask of clients
+    if (ent->r.svFlags & SVF_CLIENTMASK)
+    {
+        if (frame->ps.clientNum >= 32)
+        {
+            if (~ent->r.hack.generic1 & (1 << (frame->ps.clientNum - 32))) return;
+        }
+        else
+        {
+            if (~ent->r.singleClient & (1 << frame->ps.clientNum)) return;
+        }
+    }
+
+    svEnt = SV_SvEntityForGentity(ent);
+
+    // don't double add an entity through portals
+    if (eNums->added[e >> 5] & (1u << (e & 31)))
+    {
+        return;
+    }
+
+    // broadcast entities are always sent
+    if (ent->r.svFlags & SVF_BROADCAST)
+    {
+        SV_AddEntToSnapshot(ent, eNums);
+        return;
+    }
+
+    // ignore if not touching a PV leaf
+    // check area
+    if (!CM_AreasConnected(clientarea, svEnt->areanum))
+    {
+        // doors can legally straddle two areas, so
+        // we may need to check another one
+        if (!CM_AreasConnected(clientarea, svEnt->areanum2))
+        {
+            return;  // blocked by a door
+        }
+    }
+
+    if (!inPVS && !SV_EntityInPVS(svEnt, clientpvs))
+    {
+        return;
+    }
+
+    // add it
+    SV_AddEntToSnapshot(ent, eNums);
+
+    // if it's a portal entity, add everything visible from its camera position
+    if (ent->r.svFlags & SVF_PORTAL)
+    {
+        if (ent->s.generic1)
+        {
+            vec3_t dir;
+            VectorSubtract(ent->r.currentOrigin, origin, dir);
+            if (VectorLengthSquared(dir) > (float)ent->s.generic1 * ent->s.generic1)
+            {
+                return;
+            }
+        }
+        SV_AddEntitiesVisibleFromPoint(ent->s.origin2, frame, eNums);
+    }
+}
+
+/*
+===============
+SV_AddIndexedEntities
+
+Gathers candidates from the buckets of every cluster in clientpvs, then
+runs the normal send rules on them in ascending entity order, so the
+result is identical to walking every entity.
+===============
+*/
+static void SV_AddIndexedEntities(vec3_t origin, int clientarea, byte *clientpvs, clientSnapshot_t *frame,
+    snapshotEntityNumbers_t *eNums)
+{
+    snapshotIndex_t *index = sv.snapshotIndex;
+    unsigned int candidates[MAX_GENTITIES / 32];
+    unsigned int culled[MAX_GENTITIES / 32];
+    unsigned int bits;
+    int clusterBytes;
+    int b, c, e, i, w;
+
+    ::memset(candidates, 0, sizeof(candidates));
+    ::memset(culled, 0, sizeof(culled));
+
+    for (i = 0; i < index->numBroadcast; i++)
+    {
+        e = index->broadcastEntities[i];
+        candidates[e >> 5] |= 1u << (e & 31);
+    }
+
+    for (i = 0; i < index->numOverflow; i++)
+    {
+        e = index->overflowEntities[i];
+        candidates[e >> 5] |= 1u << (e & 31);
+    }
+
+    clusterBytes = (index->numClusters + 7) >> 3;
+    for (b = 0; b < clusterBytes; b++)
+    {
+        if (!clientpvs[b])
+        {
+            continue;
+        }
+
+        for (c = b << 3; c < (b << 3) + 8 && c < index->numClusters; c++)
+        {
+            if (!(clientpvs[b] & (1 << (c & 7))))
+            {
+                continue;
+            }
+
+            for (i = index->clusterFirst[c]; i < index->clusterFirst[c + 1]; i++)
+            {
+                e = index->clusterEntities[i];
+                candidates[e >> 5] |= 1u << (e & 31);
+                culled[e >> 5] |= 1u << (e & 31);
+            }
+        }
+    }
+
+    for (w = 0; w < MAX_GENTITIES / 32; w++)
+    {
+        for (bits = candidates[w]; bits; bits &= bits - 1)
+        {
+            e = (w << 5) + Q_ctz(bits);
+            SV_AddEntityIfVisible(e, origin, clientarea, clientpvs, (culled[w] >> (e & 31)) & 1, frame, eNums);
+        }
+    }
+}
+
+/*
+===============
+SV_AddEntitiesVisibleFromPoint
+===============
+*/
+static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums)
+{
+    int e;
+    int clientarea, clientcluster;
+    int leafnum;
+    byte *clientpvs;
+
+    // during an error shutdown message we may need to transmit
+    // the shutdown message after the server has shutdown, so
+    // specfically check for it
+    if (!sv.state)
+    {
+        return;
+    }
+
+    leafnum = CM_PointLeafnum(origin);
+    clientarea = CM_LeafArea(leafnum);
+    clientcluster = CM_LeafCluster(leafnum);
+
+    // calculate the visible areas
+    frame->areabytes = CM_WriteAreaBits(frame->areabits, clientarea);
+
+    clientpvs = CM_ClusterPVS(clientcluster);
+
+    if (sv.snapshotIndex && sv.snapshotIndex->valid)
+    {
+        SV_AddIndexedEntities(origin, clientarea, clientpvs, frame, eNums);
+        return;
+    }
+
+    for (e = 0; e < sv.num_entities; e++)
+    {
+        SV_AddEntityIfVisible(e, origin, clientarea, clientpvs, false, frame, eNums);
+    }
+}
+
+struct snapshotPriority_t {
+    float distance;
+    int number;
+};
+
+/*
+===============
+SV_LimitSnapshotEntities
+
+Keeps the limit most relevant entities: broadcast entities first, then
+the rest nearest to the viewer.  Far entities are the ones the client
+misses least when the snapshot is full or its rate can't carry more.
+===============
+*/
+static void SV_LimitSnapshotEntities(const vec3_t origin, snapshotEntityNumbers_t *eNums, int limit)
+{
+    snapshotPriority_t priorities[MAX_GENTITIES];
+    sharedEntity_t *ent;
+    unsigned int bits;
+    vec3_t center;
+    int i, n, w;
+
+    for (w = 0, n = 0; w < MAX_GENTITIES / 32; w++)
+    {
+        for (bits = eNums->entities[w]; bits; bits &= bits - 1)
+        {
+            priorities[n].number = (w << 5) + Q_ctz(bits);
+            ent = SV_GentityNum(priorities[n].number);
+            if (ent->r.svFlags & SVF_BROADCAST)
+            {
+                priorities[n].distance = -1.0f;
+            }
+            else
+            {
+                VectorAdd(ent->r.absmin, ent->r.absmax, center);
+                VectorScale(center, 0.5f, center);
+                priorities[n].distance = DistanceSquared(origin, center);
+            }
+            n++;
+        }
+    }
+
+    std::nth_element(priorities, priorities + limit, priorities + n,
+        [](const snapshotPriority_t &a, const snapshotPriority_t &b) { return a.distance < b.distance; });
+
+    for (i = limit; i < n; i++)
+    {
+        eNums->entities[priorities[i].number >> 5] &= ~(1u << (priorities[i].number & 31));
+    }
+    eNums->numSnapshotEntities = limit;
+}
+
+/*
+=============
+SV_CullClientSnapshot
+
+Decides which entities are going to be visible to the client, and
+copies off the playerstate and areabits.  Returns false if the client
+has no entity to view from, in which case the frame is left empty.
+
+This properly handles multiple recursive portals, but the render
+currently doesn't.
+
+Reads the game entities and the collision map but writes nothing outside
+of frame and eNums, so it is safe to run on a job thread.
+
+For viewing through other player's eyes, clent can be something other than client->gentity
+=============
+*/
+static bool SV_CullClientSnapshot(client_t *client, clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums)
+{
+    vec3_t org;
+    int i;
+    sharedEntity_t *clent;
+    playerState_t *ps;
+    int limit;
+
+    PROF_SCOPE(prof, "snapshot_build");
+
+    // clear everything in this snapshot
+    SV_ClearEntityNumbers(eNums, -1);
+    ::memset(frame->areabits, 0, sizeof(frame->areabits));
 
     // https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=62
     frame->num_entities = 0;
+    frame->entityFrame = 0;
 
     clent = client->gentity;
     if (!clent || client->state == CS_ZOMBIE)
     {
-        return;
+        return false;
     }
 
     // grab the current playerState_t
@@ -541,14 +1060,7 @@ static void SV_BuildClientSnapshot(client_t *client)
 
     // never send client's own entity, because it can
     // be regenerated from the playerstate
-    clientNum = frame->ps.clientNum;
-    if (clientNum < 0 || clientNum >= MAX_GENTITIES)
-    {
-        Com_Error(ERR_DROP, "SV_SvEntityForGentity: bad gEnt");
-    }
-    svEnt = &sv.svEntities[clientNum];
-
-    svEnt->snapshotCounter = sv.snapshotCounter;
+    SV_ClearEntityNumbers(eNums, frame->ps.clientNum);
 
     // find the client's viewpoint
     VectorCopy(ps->origin, org);
@@ -556,14 +1068,13 @@ static void SV_BuildClientSnapshot(client_t *client)
 
     // add all the entities directly visible to the eye, which
     // may include portal entities that merge other viewpoints
-    SV_AddEntitiesVisibleFromPoint(org, frame, &entityNumbers);
+    SV_AddEntitiesVisibleFromPoint(org, frame, eNums);
 
-    // if there were portals visible, there may be out of order entities
-    // in the list which will need to be resorted for the delta compression
-    // to work correctly.  This also catches the error condition
-    // of an entity being included twice.
-    qsort(entityNumbers.snapshotEntities, entityNumbers.numSnapshotEntities, sizeof(entityNumbers.snapshotEntities[0]),
-        SV_QsortEntityNumbers);
+    limit = client->snapshotEntityLimit ? client->snapshotEntityLimit : MAX_SNAPSHOT_ENTITIES;
+    if (eNums->numSnapshotEntities > limit)
+    {
+        SV_LimitSnapshotEntities(org, eNums, limit);
+    }
 
     // now that all viewpoint's areabits have been OR'd together, invert
     // all of them to make it a mask vector, which is what the renderer wants
@@ -572,24 +1083,107 @@ static void SV_BuildClientSnapshot(client_t *client)
         ((int *)frame->areabits)[i] = ((int *)frame->areabits)[i] ^ -1;
     }
 
-    // copy the entity states out
-    frame->num_entities = 0;
+    return true;
+}
+
+/*
+=============
+SV_CheckSnapshotClientNum
+
+The game hands us the playerstate, so make sure its client number is
+usable before the snapshot is culled, possibly on another thread.
+=============
+*/
+static void SV_CheckSnapshotClientNum(client_t *client)
+{
+    int clientNum;
+
+    if (!client->gentity || client->state == CS_ZOMBIE)
+    {
+        return;
+    }
+
+    clientNum = SV_GameClientNum(client - svs.clients)->clientNum;
+    if (clientNum < 0 || clientNum >= MAX_GENTITIES)
+    {
+        Com_Error(ERR_DROP, "SV_CheckSnapshotClientNum: bad gEnt");
+    }
+}
+
+/*
+=============
+SV_ReserveSnapshotEntities
+
+Claims the next run of svs.snapshotEntities for the frame
+=============
+*/
+static void SV_ReserveSnapshotEntities(clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums)
+{
     frame->first_entity = svs.nextSnapshotEntities;
-    for (i = 0; i < entityNumbers.numSnapshotEntities; i++)
+    svs.nextSnapshotEntities += eNums->numSnapshotEntities;
+
+    // this should never hit, map should always be restarted first in SV_Frame
+    if (svs.nextSnapshotEntities >= 0x7FFFFFFE)
+    {
+        Com_Error(ERR_FATAL, "svs.nextSnapshotEntities wrapped");
+    }
+}
+
+/*
+=============
+SV_CopySnapshotEntities
+
+Copies the entity states out into the frame's reserved run
+=============
+*/
+static void SV_CopySnapshotEntities(clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums)
+{
+    int w;
+    unsigned int bits;
+    sharedEntity_t *ent;
+    entityState_t *state;
+
+    // ascending entity order, which the delta compression relies on
+    frame->num_entities = 0;
+    frame->entityFrame = deltaCache.valid ? svs.snapshotFrame : 0;
+    for (w = 0; w < MAX_GENTITIES / 32; w++)
     {
-        ent = SV_GentityNum(entityNumbers.snapshotEntities[i]);
-        state = &svs.snapshotEntities[svs.nextSnapshotEntities % svs.numSnapshotEntities];
-        *state = ent->s;
-        svs.nextSnapshotEntities++;
-        // this should never hit, map should always be restarted first in SV_Frame
-        if (svs.nextSnapshotEntities >= 0x7FFFFFFE)
+        for (bits = eNums->entities[w]; bits; bits &= bits - 1)
         {
-            Com_Error(ERR_FATAL, "svs.nextSnapshotEntities wrapped");
+            ent = SV_GentityNum((w << 5) + Q_ctz(bits));
+            state = &svs.snapshotEntities[(frame->first_entity + frame->num_entities) % svs.numSnapshotEntities];
+            *state = ent->s;
+            frame->num_entities++;
         }
-        frame->num_entities++;
     }
 }
 
+/*
+=============
+SV_BuildClientSnapshot
+
+Returns false if the client has nothing to see yet
+=============
+*/
+static bool SV_BuildClientSnapshot(client_t *client)
+{
+    clientSnapshot_t *frame;
+    snapshotEntityNumbers_t entityNumbers;
+
+    // this is the frame we are creating
+    frame = &client->frames[client->netchan.outgoingSequence & PACKET_MASK];
+
+    SV_CheckSnapshotClientNum(client);
+    if (!SV_CullClientSnapshot(client, frame, &entityNumbers))
+    {
+        return false;
+    }
+
+    SV_ReserveSnapshotEntities(frame, &entityNumbers);
+    SV_CopySnapshotEntities(frame, &entityNumbers);
+    return true;
+}
+
 #ifdef USE_VOIP
 /*
 ==================
@@ -639,38 +1233,191 @@ static void SV_WriteVoipToClient(client_t *cl, msg_t *msg)
 #endif
 
 /*
-=======================
-SV_SendMessageToClient
+=============================================================================
 
-Called by SV_SendClientSnapshot and SV_SendClientGameState
-=======================
+Bandwidth
+
+sv_uplinkRate caps the bytes all clients are sent together, as a token
+bucket refilled in real time.  Clients that miss out on a frame are the
+most overdue ones on the next, so the cap is shared out fairly.
+
+sv_adaptiveSnapshots spaces each rate limited client's snapshots out to
+what its rate can carry, instead of sending at snapshotMsec and skipping
+whichever ones hit the limit.  When that alone would more than halve the
+snapshot rate, the farthest entities are left out as well.
+
+=============================================================================
 */
-void SV_SendMessageToClient(msg_t *msg, client_t *client)
-{
-    // record information about the message
-    client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageSize = msg->cursize;
-    client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageSent = svs.time;
-    client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageAcked = -1;
 
-    // send the datagram
-    SV_Netchan_Transmit(client, msg);
-}
+static struct {
+    int64_t refillTime;  // usec
+    int64_t tokens;  // bytes, negative when the last frame overshot
+    int bytes;  // sent to all clients since time
+    int time;
+    int achievedRate;
+} uplink;
 
 /*
 =======================
-SV_SendClientSnapshot
-
-Also called by SV_FinalMessage
-
+SV_RefillUplink
 =======================
 */
-void SV_SendClientSnapshot(client_t *client)
+static void SV_RefillUplink(void)
+{
+    int64_t now = Sys_Microseconds();
+    int64_t rate, burst;
+
+    if (!sv_uplinkRate->integer)
+    {
+        uplink.tokens = 0;
+        uplink.refillTime = now;
+        return;
+    }
+
+    // up to two frames worth can be saved up
+    rate = (int64_t)sv_uplinkRate->integer * 1024;
+    burst = rate * 2 / MAX(sv_fps->integer, 1);
+
+    uplink.tokens += (now - uplink.refillTime) * rate / 1000000;
+    uplink.refillTime = now;
+    if (uplink.tokens > burst)
+    {
+        uplink.tokens = burst;
+    }
+}
+
+/*
+=======================
+SV_RateLimited
+
+Loopback and, with sv_lanForceRate, LAN clients get everything
+=======================
+*/
+static bool SV_RateLimited(client_t *client)
+{
+    return !(client->netchan.remoteAddress.type == NA_LOOPBACK ||
+             (sv_lanForceRate->integer && Sys_IsLANAddress(client->netchan.remoteAddress)));
+}
+
+/*
+=======================
+SV_SnapshotInterval
+
+Msec between snapshots for the client, before timescale
+=======================
+*/
+static int SV_SnapshotInterval(client_t *client)
+{
+    int rateMsec;
+
+    if (!sv_adaptiveSnapshots->integer || !client->snapshotSize || !SV_RateLimited(client))
+    {
+        return client->snapshotMsec;
+    }
+
+    rateMsec = client->snapshotSize * 1000 / MAX(SV_ClientRate(client), 1);
+    return MAX(client->snapshotMsec, rateMsec);
+}
+
+/*
+=======================
+SV_SnapshotSent
+
+Bookkeeping for a snapshot that has just gone out
+=======================
+*/
+static void SV_SnapshotSent(client_t *client, int numEntities, int size)
+{
+    int rateMsec, limit;
+
+    client->lastSnapshotTime = svs.time;
+    client->rateDelayed = false;
+    client->snapshotsSent++;
+    client->snapshotSize = client->snapshotSize ? (client->snapshotSize * 7 + size) / 8 : size;
+
+    if (!sv_adaptiveSnapshots->integer || !SV_RateLimited(client))
+    {
+        client->snapshotEntityLimit = 0;
+        return;
+    }
+
+    // shed entities slowly when the stretched interval gets too long, and
+    // take them back even more slowly once it's short enough again
+    rateMsec = client->snapshotSize * 1000 / MAX(SV_ClientRate(client), 1);
+    limit = client->snapshotEntityLimit ? client->snapshotEntityLimit : MAX_SNAPSHOT_ENTITIES;
+    if (rateMsec > client->snapshotMsec * 2)
+    {
+        limit = MIN(limit, numEntities);
+        limit = MAX(MAX_SNAPSHOT_ENTITIES / 8, limit - limit / 8);
+    }
+    else if (rateMsec < client->snapshotMsec * 3 / 2)
+    {
+        limit = MIN(MAX_SNAPSHOT_ENTITIES, limit + 2);
+    }
+    client->snapshotEntityLimit = limit < MAX_SNAPSHOT_ENTITIES ? limit : 0;
+}
+
+/*
+=======================
+SV_SendMessageToClient
+
+Called by SV_SendClientSnapshot and SV_SendClientGameState
+=======================
+*/
+void SV_SendMessageToClient(msg_t *msg, client_t *client)
+{
+    PROF_SCOPE(prof, "send");
+
+    // achieved rates, over about a second
+    client->rateBytes += msg->cursize;
+    if (svs.time - client->rateTime >= 1000)
+    {
+        client->achievedRate = client->rateBytes * 1000 / (svs.time - client->rateTime);
+        client->rateBytes = 0;
+        client->rateTime = svs.time;
+    }
+
+    uplink.bytes += msg->cursize;
+    if (svs.time - uplink.time >= 1000)
+    {
+        uplink.achievedRate = uplink.bytes * 1000 / (svs.time - uplink.time);
+        uplink.bytes = 0;
+        uplink.time = svs.time;
+    }
+
+    if (sv_uplinkRate->integer)
+    {
+        uplink.tokens -= msg->cursize;
+    }
+
+    // record information about the message
+    client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageSize = msg->cursize;
+    client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageSent = svs.time;
+    client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageAcked = -1;
+
+    // send the datagram
+    SV_Netchan_Transmit(client, msg);
+}
+
+/*
+=======================
+SV_TransmitSnapshot
+
+Builds and sends one client's snapshot.  The demo writer is left to
+SV_SendClientMessages, which flushes the whole frame once it's out.
+=======================
+*/
+static void SV_TransmitSnapshot(client_t *client)
 {
     byte msg_buf[MAX_MSGLEN];
+    clientSnapshot_t *frame;
     msg_t msg;
+    bool culled;
+
+    frame = &client->frames[client->netchan.outgoingSequence & PACKET_MASK];
 
     // build the snapshot
-    SV_BuildClientSnapshot(client);
+    culled = SV_BuildClientSnapshot(client);
 
     MSG_Init(&msg, msg_buf, sizeof(msg_buf));
     msg.allowoverflow = true;
@@ -686,6 +1433,12 @@ void SV_SendClientSnapshot(client_t *client)
     // and the playerState_t
     SV_WriteSnapshotToClient(client, &msg);
 
+    // after the write, so the demo gets the flags that were sent
+    if (culled)
+    {
+        SV_DemoSnapshot(client, frame);
+    }
+
 #ifdef USE_VOIP
     SV_WriteVoipToClient(client, &msg);
 #endif
@@ -698,6 +1451,297 @@ void SV_SendClientSnapshot(client_t *client)
     }
 
     SV_SendMessageToClient(&msg, client);
+    SV_SnapshotSent(client, frame->num_entities, msg.cursize);
+}
+
+/*
+=======================
+SV_SendClientSnapshot
+
+Called by SV_FinalMessage and the unpure check, outside of the scheduled
+frame, so the snapshot is handed to the demo writer straight away and
+paired with the entity states it was built from
+=======================
+*/
+void SV_SendClientSnapshot(client_t *client)
+{
+    SV_TransmitSnapshot(client);
+    SV_DemoEndFrame();
+}
+
+/*
+=============================================================================
+
+Threaded snapshot building
+
+With sv_snapshotThreads set, the snapshots for one frame are built in
+passes.  Everything that touches shared server state (reliable commands,
+the svs.snapshotEntities cursor, VoIP queues and the sockets) runs on the
+main thread in client order, so each client gets the same entities and
+commands as on the serial path.  The delta base can differ: sources are
+checked against the cursor after the whole batch has been claimed, so a
+client whose old frame is about to be overwritten gets a full snapshot
+where the serial path would still have sent a delta.  Culling, copying
+the entity states and delta encoding run on the job threads in between.
+
+=============================================================================
+*/
+
+struct snapshotJob_t {
+    client_t *client;
+    bool culled;
+    snapshotEntityNumbers_t entityNumbers;
+    clientSnapshot_t *oldframe;
+    int lastframe;
+    msg_t msg;
+    byte msgBuf[MAX_MSGLEN];
+};
+
+static snapshotJob_t snapshotJobs[MAX_CLIENTS];
+
+/*
+=======================
+SV_CullSnapshotJob
+=======================
+*/
+static void SV_CullSnapshotJob(void *data, int index)
+{
+    snapshotJob_t *job = &((snapshotJob_t *)data)[index];
+    client_t *client = job->client;
+
+    job->culled = SV_CullClientSnapshot(
+        client, &client->frames[client->netchan.outgoingSequence & PACKET_MASK], &job->entityNumbers);
+}
+
+/*
+=======================
+SV_EncodeSnapshotJob
+=======================
+*/
+static void SV_EncodeSnapshotJob(void *data, int index)
+{
+    snapshotJob_t *job = &((snapshotJob_t *)data)[index];
+    client_t *client = job->client;
+
+    if (job->culled)
+    {
+        SV_CopySnapshotEntities(
+            &client->frames[client->netchan.outgoingSequence & PACKET_MASK], &job->entityNumbers);
+    }
+
+    SV_WriteSnapshotFrame(client, job->oldframe, job->lastframe, &job->msg);
+}
+
+/*
+=======================
+SV_SendClientSnapshots
+
+Builds and sends a snapshot to each of the clients, spreading the work
+over the job threads
+=======================
+*/
+static void SV_SendClientSnapshots(snapshotJob_t *jobs, int numJobs)
+{
+    snapshotJob_t *job;
+    client_t *client;
+    int numEntities;
+    int i;
+
+    for (i = 0, job = jobs; i < numJobs; i++, job++)
+    {
+        client = job->client;
+
+        SV_CheckSnapshotClientNum(client);
+
+        MSG_Init(&job->msg, job->msgBuf, sizeof(job->msgBuf));
+        job->msg.allowoverflow = true;
+
+        // NOTE, MRE: all server->client messages now acknowledge
+        // let the client know which reliable clientCommands we have received
+        MSG_WriteLong(&job->msg, client->lastClientCommand);
+
+        // (re)send any reliable server commands
+        SV_UpdateServerCommandsToClient(client, &job->msg);
+    }
+
+    Job_Run(SV_CullSnapshotJob, jobs, numJobs);
+
+    // hand out the runs of svs.snapshotEntities in client order, which
+    // is the same layout the serial path ends up with
+    for (i = 0, job = jobs; i < numJobs; i++, job++)
+    {
+        client = job->client;
+        if (job->culled)
+        {
+            SV_ReserveSnapshotEntities(
+                &client->frames[client->netchan.outgoingSequence & PACKET_MASK], &job->entityNumbers);
+        }
+    }
+
+    // every run for this frame is claimed before any of them is written,
+    // so check the delta sources against the final cursor; a frame the
+    // serial path would still have used may be overwritten by a client
+    // encoded at the same time
+    for (i = 0, job = jobs; i < numJobs; i++, job++)
+    {
+        job->oldframe = SV_SnapshotDeltaFrame(job->client, &job->lastframe);
+    }
+
+    Job_Run(SV_EncodeSnapshotJob, jobs, numJobs);
+
+    for (i = 0, job = jobs; i < numJobs; i++, job++)
+    {
+        client = job->client;
+
+#ifdef USE_VOIP
+        SV_WriteVoipToClient(client, &job->msg);
+#endif
+
+        // check for overflow
+        if (job->msg.overflowed)
+        {
+            Com_Printf("WARNING: msg overflowed for %s\n", client->name);
+            MSG_Clear(&job->msg);
+        }
+
+        if (job->culled)
+        {
+            SV_DemoSnapshot(client, &client->frames[client->netchan.outgoingSequence & PACKET_MASK]);
+        }
+
+        numEntities = client->frames[client->netchan.outgoingSequence & PACKET_MASK].num_entities;
+        SV_SendMessageToClient(&job->msg, client);
+        SV_SnapshotSent(client, numEntities, job->msg.cursize);
+    }
+}
+
+/*
+=============================================================================
+
+Scheduling
+
+SV_SendClientMessages picks the clients that are due a snapshot, most
+overdue first.  With sv_snapshotPacing they are split into that many
+batches spread over the frame, so the server's uplink doesn't see every
+snapshot of the frame in one burst.  Every snapshot is still built,
+encoded and recorded right here, from the world as SV_Frame left it; only
+the datagrams of the later batches are held back by the net layer, and
+SV_SendPacedSnapshots lets them go when their time comes.  Packets read in
+between can't change what they carry.
+
+=============================================================================
+*/
+
+struct snapshotDue_t {
+    client_t *client;
+    int late;  // msec past its interval
+};
+
+static bool snapshotsHeld;
+
+/*
+=======================
+SV_QsortSnapshotDue
+=======================
+*/
+static int QDECL SV_QsortSnapshotDue(const void *a, const void *b)
+{
+    const snapshotDue_t *da = (const snapshotDue_t *)a;
+    const snapshotDue_t *db = (const snapshotDue_t *)b;
+
+    if (da->late != db->late)
+    {
+        return db->late - da->late;
+    }
+
+    return da->client - db->client;
+}
+
+/*
+=======================
+SV_SendSnapshotBatch
+
+budget is the uplink bytes this batch may use, or unlimited without
+sv_uplinkRate
+=======================
+*/
+static void SV_SendSnapshotBatch(snapshotDue_t *due, int numDue, int64_t budget)
+{
+    client_t *c;
+    int i, numJobs, numSized;
+    int64_t sized, estimate;
+    bool threaded;
+
+    threaded = Job_NumThreads() > 0;
+    numJobs = 0;
+
+    // clients that haven't had a snapshot measured yet, such as everyone
+    // right after a map change, are charged the batch's average so they
+    // can't all get through for free
+    for (i = 0, sized = 0, numSized = 0; i < numDue; i++)
+    {
+        if (due[i].client->snapshotSize)
+        {
+            sized += due[i].client->snapshotSize;
+            numSized++;
+        }
+    }
+    estimate = numSized ? sized / numSized : MAX_MSGLEN / 4;
+
+    for (i = 0; i < numDue; i++)
+    {
+        c = due[i].client;
+
+        // sizes aren't known until the snapshots are built, so go by
+        // each client's average and settle up with the real ones
+        if (sv_uplinkRate->integer && budget <= 0)
+        {
+            c->rateDelayed = true;
+            c->snapshotsDeferred++;
+            continue;
+        }
+        budget -= c->snapshotSize ? c->snapshotSize : estimate;
+
+        if (threaded)
+        {
+            snapshotJobs[numJobs++].client = c;
+            continue;
+        }
+
+        // generate and send a new message
+        SV_TransmitSnapshot(c);
+    }
+
+    if (numJobs)
+    {
+        SV_SendClientSnapshots(snapshotJobs, numJobs);
+    }
+}
+
+/*
+=======================
+SV_SendPacedSnapshots
+
+Sends the paced snapshots that are due, or all of them with flush.
+Returns the msec until the next one, or -1 if there's nothing left.
+=======================
+*/
+int SV_SendPacedSnapshots(bool flush)
+{
+    int msec;
+
+    if (!snapshotsHeld)
+    {
+        return -1;
+    }
+
+    msec = NET_SendHeldPackets(flush);
+    if (msec < 0)
+    {
+        snapshotsHeld = false;
+    }
+
+    return msec;
 }
 
 /*
@@ -707,42 +1751,247 @@ SV_SendClientMessages
 */
 void SV_SendClientMessages(void)
 {
+    snapshotDue_t due[MAX_CLIENTS];
+    int numDue;
     int i;
     client_t *c;
+    bool threaded;
+    int numBatches, first, end;
+    int64_t start, spacing, rate;
+
+    // only if something ran a frame without going through Com_Frame
+    SV_SendPacedSnapshots(true);
 
-    // send a message to each connected client
+    if (sv_snapshotThreads->modified)
+    {
+        Job_SetThreads(sv_snapshotThreads->integer);
+        sv_snapshotThreads->modified = false;
+    }
+    threaded = Job_NumThreads() > 0;
+    numDue = 0;
+
+    PROF_SCOPE(prof, "snapshots");
+
+    // find the clients that are due a snapshot
     for (i = 0; i < sv_maxclients->integer; i++)
     {
         c = &svs.clients[i];
 
         if (!c->state) continue;  // not connected
 
-        if (svs.time - c->lastSnapshotTime < c->snapshotMsec * com_timescale->value) continue; // It's not time yet
+        due[numDue].late = svs.time - c->lastSnapshotTime - SV_SnapshotInterval(c) * com_timescale->value;
+        if (due[numDue].late < 0) continue; // It's not time yet
 
         if (*c->downloadName) continue;  // Client is downloading, don't send snapshots
 
         if (c->netchan.unsentFragments || c->netchan_start_queue)
         {
             c->rateDelayed = true;
+            c->snapshotsDelayed++;
             continue;  // Drop this snapshot if the packet queue is still full or delta compression will break
         }
 
-        if (!(c->netchan.remoteAddress.type == NA_LOOPBACK ||
-                (sv_lanForceRate->integer && Sys_IsLANAddress(c->netchan.remoteAddress))))
+        // rate control for clients not on LAN
+        if (SV_RateLimited(c) && SV_RateMsec(c) > 0)
         {
-            // rate control for clients not on LAN
+            // Not enough time since last packet passed through the line
+            c->rateDelayed = true;
+            c->snapshotsDelayed++;
+            continue;
+        }
 
-            if (SV_RateMsec(c) > 0)
-            {
-                // Not enough time since last packet passed through the line
-                c->rateDelayed = true;
-                continue;
-            }
+        due[numDue++].client = c;
+    }
+
+    if (!numDue)
+    {
+        return;
+    }
+
+    // whoever has waited longest goes first, which also decides who
+    // misses out when sv_uplinkRate runs short
+    qsort(due, numDue, sizeof(due[0]), SV_QsortSnapshotDue);
+
+    SV_BeginDeltaCache();
+
+    // bucket the entities once for every snapshot built this frame; the
+    // threaded path always needs it, because building the index is also
+    // what fixes up bad entity numbers before the job threads look at them
+    if (sv_snapshotIndex->integer || threaded)
+    {
+        SV_BuildSnapshotIndex();
+    }
+
+    numBatches = MAX(1, MIN(sv_snapshotPacing->integer, numDue));
+    start = Sys_Microseconds();
+    spacing = (int64_t)(1000000 / MAX(sv_fps->value, 1.0f)) / numBatches;
+    rate = (int64_t)sv_uplinkRate->integer * 1024;
+
+    SV_RefillUplink();
+
+    for (i = 0, first = 0; i < numBatches; i++, first = end)
+    {
+        end = numDue * (i + 1) / numBatches;
+
+        // the first batch goes right away, the rest when their turn comes,
+        // with the uplink allowance they will have saved up by then
+        NET_HoldPackets(i ? start + i * spacing : 0);
+        SV_SendSnapshotBatch(due + first, end - first, uplink.tokens + rate * i * spacing / 1000000);
+    }
+    NET_HoldPackets(0);
+    snapshotsHeld = numBatches > 1;
+
+    // hand the frame to the demo writer
+    SV_DemoEndFrame();
+
+    // entities may move before the next frame, so never reuse the buckets
+    if (sv.snapshotIndex)
+    {
+        sv.snapshotIndex->valid = false;
+    }
+    SV_EndDeltaCache();
+}
+
+/*
+=======================
+SV_Rates_f
+
+Prints what each client is getting out of the bandwidth scheduler
+=======================
+*/
+void SV_Rates_f(void)
+{
+    client_t *c;
+    int i;
+
+    if (!com_sv_running->integer)
+    {
+        Com_Printf("Server is not running.\n");
+        return;
+    }
+
+    Com_Printf("num  rate achieved interval entities avgsize     sent delayed deferred name\n");
+    Com_Printf("--- ----- -------- -------- -------- ------- -------- ------- -------- ---------------\n");
+
+    for (i = 0, c = svs.clients; i < sv_maxclients->integer; i++, c++)
+    {
+        if (!c->state)
+        {
+            continue;
         }
 
-        // generate and send a new message
-        SV_SendClientSnapshot(c);
-        c->lastSnapshotTime = svs.time;
-        c->rateDelayed = false;
+        Com_Printf("%3i %5i %8i %8i %8i %7i %8i %7i %8i %s\n", i, SV_ClientRate(c), c->achievedRate,
+            SV_SnapshotInterval(c), c->snapshotEntityLimit ? c->snapshotEntityLimit : MAX_SNAPSHOT_ENTITIES,
+            c->snapshotSize, c->snapshotsSent, c->snapshotsDelayed, c->snapshotsDeferred, c->name);
+    }
+
+    Com_Printf("uplink: %i bytes/sec", uplink.achievedRate);
+    if (sv_uplinkRate->integer)
+    {
+        Com_Printf(" of %i", sv_uplinkRate->integer * 1024);
+    }
+    Com_Printf("\n");
+}
+
+/*
+=======================
+SV_SnapshotBench_f
+
+Culls the current entity set from every active client's viewpoint through
+both the full entity walk and the cluster index, checks that they agree,
+and reports how long each took.  It works on whatever is in the game when
+it runs, so timings only compare between runs from the same game state.
+=======================
+*/
+void SV_SnapshotBench_f(void)
+{
+    static clientSnapshot_t frame;
+    static snapshotEntityNumbers_t full, indexed;
+    int iterations;
+    int fullTime, indexTime, buildTime, start;
+    int clients, mismatches;
+    int i, n;
+    client_t *c;
+    playerState_t *ps;
+    vec3_t org;
+
+    if (Cmd_Argc() > 1 && !Q_isanumber(Cmd_Argv(1)))
+    {
+        Com_Printf("usage: snapshotbench [iterations]\n");
+        Com_Printf("culls the live entities from every active client; results depend on the current\n"
+                   "game state, so only compare runs taken from the same state\n");
+        return;
+    }
+
+    if (!com_sv_running->integer || !sv.snapshotIndex)
+    {
+        Com_Printf("Server is not running.\n");
+        return;
+    }
+
+    iterations = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 1000;
+    if (iterations < 1)
+    {
+        iterations = 1;
+    }
+
+    fullTime = indexTime = 0;
+    clients = mismatches = 0;
+
+    for (i = 0, c = svs.clients; i < sv_maxclients->integer; i++, c++)
+    {
+        if (c->state != CS_ACTIVE || !c->gentity)
+        {
+            continue;
+        }
+        clients++;
+
+        ps = SV_GameClientNum(i);
+        VectorCopy(ps->origin, org);
+        org[2] += ps->viewheight;
+        frame.ps = *ps;
+
+        sv.snapshotIndex->valid = false;
+        start = Sys_Milliseconds();
+        for (n = 0; n < iterations; n++)
+        {
+            SV_ClearEntityNumbers(&full, ps->clientNum);
+            SV_AddEntitiesVisibleFromPoint(org, &frame, &full);
+        }
+        fullTime += Sys_Milliseconds() - start;
+
+        SV_BuildSnapshotIndex();
+        start = Sys_Milliseconds();
+        for (n = 0; n < iterations; n++)
+        {
+            SV_ClearEntityNumbers(&indexed, ps->clientNum);
+            SV_AddEntitiesVisibleFromPoint(org, &frame, &indexed);
+        }
+        indexTime += Sys_Milliseconds() - start;
+        sv.snapshotIndex->valid = false;
+
+        if (full.numSnapshotEntities != indexed.numSnapshotEntities ||
+            ::memcmp(full.entities, indexed.entities, sizeof(full.entities)))
+        {
+            Com_Printf("client %i: full walk sent %i entities, index sent %i\n", i, full.numSnapshotEntities,
+                indexed.numSnapshotEntities);
+            mismatches++;
+        }
+    }
+
+    // the index is built once per frame, not once per client
+    start = Sys_Milliseconds();
+    for (n = 0; n < iterations; n++)
+    {
+        SV_BuildSnapshotIndex();
     }
+    buildTime = Sys_Milliseconds() - start;
+    sv.snapshotIndex->valid = false;
+
+    Com_Printf("%i entities, %i clusters, %i clients, %i iterations (live game state, not a fixed set)\n",
+        sv.num_entities, sv.snapshotIndex->numClusters, clients, iterations);
+    Com_Printf("full walk:   %i msec\n", fullTime);
+    Com_Printf("index build: %i msec\n", buildTime);
+    Com_Printf("index cull:  %i msec\n", indexTime);
+    Com_Printf("%i mismatches\n", mismatches);
 }
@@ -24,6 +24,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "server.h"
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
 /*
 ================
 SV_ClipHandleForEntity
@@ -56,25 +60,63 @@ clipHandle_t SV_ClipHandleForEntity(const sharedEntity_t *ent)
 ENTITY CHECKING
 
 To avoid linearly searching through lists of entities during environment testing,
-the world is carved up with an evenly spaced, axially aligned bsp tree.  Entities
-are kept in chains either at the final leafs, or at the first node that splits
-them, which prevents having to deal with multiple fragments of a single entity.
+the x/y extent of the world is covered by a loose grid.  Each entity is chained
+in the cell holding the center of its bounds, so a cell's entities can reach up
+to half a cell outside of it.  Entities wider than a cell go on a separate list
+that every query checks.
+
+A new map starts with coarse cells.  Whenever a link leaves one cell crowded the
+cell size is halved and everything is rechained, so a base full of buildables
+ends up in small cells while the rest of the map keeps large ones.  Once a
+second a link checks whether the crowd has gone: if no cell would hold more
+than GRID_SPARSE entities at twice the size, the cell size is doubled again,
+never past the size the map started with.
 
 ===============================================================================
 */
 
-struct worldSector_t {
-    int axis;  // -1 = leaf node
-    float dist;
-    worldSector_t *children[2];
-    svEntity_t *entities;
+#define GRID_START_CELLS 16  // cells along the longer side of a fresh map
+#define GRID_MAX_CELLS 128  // cells along either side
+#define GRID_MIN_SIZE 128  // cells are never split below this many units
+#define GRID_CROWDED 16  // entities in one cell before the grid is split
+#define GRID_SPARSE (GRID_CROWDED / 2)  // entities in any merged cell before the grid is coarsened
+#define GRID_CHECK_MSEC 1000  // how often the grid looks for a chance to coarsen
+
+struct worldGrid_t {
+    vec3_t mins, maxs;  // world bounds
+    float cellSize;
+    int size[2];
+    svEntity_t *cells[GRID_MAX_CELLS * GRID_MAX_CELLS];
+    int counts[GRID_MAX_CELLS * GRID_MAX_CELLS];
+    svEntity_t *large;  // entities wider than a cell
+    int numLarge;
+    int numLinked;
+    int splits;
+    int merges;
+    int checkTime;  // svs.time of the last coarsening check
 };
 
-#define AREA_DEPTH 4
-#define AREA_NODES 64
+// SV_AreaEntities also runs on the job threads through SV_Trace
+struct areaStats_t {
+    std::atomic<int> queries;
+    std::atomic<int64_t> candidates;  // entities whose bounds were tested
+    std::atomic<int64_t> found;
+};
 
-worldSector_t sv_worldSectors[AREA_NODES];
-int sv_numworldSectors;
+static worldGrid_t sv_worldGrid;
+static areaStats_t sv_areaStats;
+
+/*
+===============
+SV_ClearAreaStats
+===============
+*/
+static void SV_ClearAreaStats(void)
+{
+    sv_areaStats.queries.store(0, std::memory_order_relaxed);
+    sv_areaStats.candidates.store(0, std::memory_order_relaxed);
+    sv_areaStats.found.store(0, std::memory_order_relaxed);
+}
 
 /*
 ===============
@@ -83,68 +125,253 @@ SV_SectorList_f
 */
 void SV_SectorList_f(void)
 {
-    int i, c;
-    worldSector_t *sec;
-    svEntity_t *ent;
+    worldGrid_t *g = &sv_worldGrid;
+    int i, occupied, crowded, most, queries;
 
-    for (i = 0; i < AREA_NODES; i++)
+    occupied = crowded = most = 0;
+    for (i = 0; i < g->size[0] * g->size[1]; i++)
     {
-        sec = &sv_worldSectors[i];
-
-        c = 0;
-        for (ent = sec->entities; ent; ent = ent->nextEntityInWorldSector)
+        if (g->counts[i])
+        {
+            occupied++;
+        }
+        if (g->counts[i] > GRID_CROWDED)
         {
-            c++;
+            crowded++;
         }
-        Com_Printf("sector %i: %i entities\n", i, c);
+        most = MAX(most, g->counts[i]);
+    }
+
+    Com_Printf("cell size %g, %ix%i cells, split %i times, coarsened %i times\n", g->cellSize, g->size[0],
+        g->size[1], g->splits, g->merges);
+    Com_Printf("%i entities linked, %i too large for a cell\n", g->numLinked, g->numLarge);
+    Com_Printf("%i cells occupied, %i crowded, at most %i entities in a cell\n", occupied, crowded, most);
+
+    queries = sv_areaStats.queries.load(std::memory_order_relaxed);
+    if (queries)
+    {
+        Com_Printf("%i area queries, %.1f candidates and %.1f entities per query\n", queries,
+            (double)sv_areaStats.candidates.load(std::memory_order_relaxed) / queries,
+            (double)sv_areaStats.found.load(std::memory_order_relaxed) / queries);
+    }
+
+    if (Cmd_Argc() > 1 && !Q_stricmp(Cmd_Argv(1), "reset"))
+    {
+        SV_ClearAreaStats();
     }
 }
 
 /*
 ===============
-SV_CreateworldSector
+SV_GridCoord
 
-Builds a uniformly subdivided tree for the given world size
+The cell column (axis 0) or row (axis 1) holding v, clamped to the grid
 ===============
 */
-static worldSector_t *SV_CreateworldSector(int depth, vec3_t mins, vec3_t maxs)
+static int SV_GridCoord(float v, int axis)
 {
-    worldSector_t *anode;
-    vec3_t size;
-    vec3_t mins1, maxs1, mins2, maxs2;
+    worldGrid_t *g = &sv_worldGrid;
+    int c;
+
+    c = (int)floor((v - g->mins[axis]) / g->cellSize);
 
-    anode = &sv_worldSectors[sv_numworldSectors];
-    sv_numworldSectors++;
+    return c < 0 ? 0 : c >= g->size[axis] ? g->size[axis] - 1 : c;
+}
+
+/*
+===============
+SV_SizeWorldGrid
+===============
+*/
+static void SV_SizeWorldGrid(float cellSize)
+{
+    worldGrid_t *g = &sv_worldGrid;
+    int i;
 
-    if (depth == AREA_DEPTH)
+    g->cellSize = cellSize;
+    for (i = 0; i < 2; i++)
     {
-        anode->axis = -1;
-        anode->children[0] = anode->children[1] = NULL;
-        return anode;
+        g->size[i] = (int)ceil((g->maxs[i] - g->mins[i]) / cellSize);
+        g->size[i] = (int)Com_Clamp(1, GRID_MAX_CELLS, g->size[i]);
     }
+}
 
-    VectorSubtract(maxs, mins, size);
-    if (size[0] > size[1])
+/*
+===============
+SV_GridInsert
+===============
+*/
+static void SV_GridInsert(svEntity_t *ent, const sharedEntity_t *gEnt)
+{
+    worldGrid_t *g = &sv_worldGrid;
+    svEntity_t **list;
+    int cell;
+
+    if (gEnt->r.absmax[0] - gEnt->r.absmin[0] > g->cellSize || gEnt->r.absmax[1] - gEnt->r.absmin[1] > g->cellSize)
     {
-        anode->axis = 0;
+        list = &g->large;
+        g->numLarge++;
     }
     else
     {
-        anode->axis = 1;
+        cell = SV_GridCoord(0.5f * (gEnt->r.absmin[1] + gEnt->r.absmax[1]), 1) * g->size[0] +
+               SV_GridCoord(0.5f * (gEnt->r.absmin[0] + gEnt->r.absmax[0]), 0);
+        list = &g->cells[cell];
+        g->counts[cell]++;
     }
 
-    anode->dist = 0.5 * (maxs[anode->axis] + mins[anode->axis]);
-    VectorCopy(mins, mins1);
-    VectorCopy(mins, mins2);
-    VectorCopy(maxs, maxs1);
-    VectorCopy(maxs, maxs2);
+    ent->gridList = list;
+    ent->gridPrev = NULL;
+    ent->gridNext = *list;
+    if (*list)
+    {
+        (*list)->gridPrev = ent;
+    }
+    *list = ent;
+    g->numLinked++;
+}
 
-    maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
+/*
+===============
+SV_GridRemove
+===============
+*/
+static void SV_GridRemove(svEntity_t *ent)
+{
+    worldGrid_t *g = &sv_worldGrid;
+
+    if (ent->gridList == &g->large)
+    {
+        g->numLarge--;
+    }
+    else
+    {
+        g->counts[ent->gridList - g->cells]--;
+    }
+
+    if (ent->gridPrev)
+    {
+        ent->gridPrev->gridNext = ent->gridNext;
+    }
+    else
+    {
+        *ent->gridList = ent->gridNext;
+    }
+    if (ent->gridNext)
+    {
+        ent->gridNext->gridPrev = ent->gridPrev;
+    }
+
+    ent->gridList = NULL;
+    ent->gridPrev = ent->gridNext = NULL;
+    g->numLinked--;
+}
+
+/*
+===============
+SV_ResizeWorldGrid
+
+Changes the cell size and rechains every linked entity
+===============
+*/
+static void SV_ResizeWorldGrid(float cellSize)
+{
+    worldGrid_t *g = &sv_worldGrid;
+    svEntity_t *ent;
+    int i;
+
+    ::memset(g->cells, 0, sizeof(g->cells));
+    ::memset(g->counts, 0, sizeof(g->counts));
+    g->large = NULL;
+    g->numLarge = g->numLinked = 0;
+
+    SV_SizeWorldGrid(cellSize);
+
+    for (i = 0, ent = sv.svEntities; i < MAX_GENTITIES; i++, ent++)
+    {
+        if (ent->gridList)
+        {
+            SV_GridInsert(ent, SV_GEntityForSvEntity(ent));
+        }
+    }
+}
+
+/*
+===============
+SV_GridCrowded
+
+Whether ent's cell has become crowded and can still be split
+===============
+*/
+static bool SV_GridCrowded(const svEntity_t *ent)
+{
+    worldGrid_t *g = &sv_worldGrid;
+
+    if (ent->gridList == &g->large || g->counts[ent->gridList - g->cells] <= GRID_CROWDED)
+    {
+        return false;
+    }
+
+    return g->cellSize * 0.5f >= GRID_MIN_SIZE && g->size[0] * 2 <= GRID_MAX_CELLS &&
+           g->size[1] * 2 <= GRID_MAX_CELLS;
+}
+
+/*
+===============
+SV_GridSparse
+
+Whether the grid has been split and would have no cell holding more than
+GRID_SPARSE entities with twice the cell size, counting the large entities
+that would then fit in a cell
+===============
+*/
+static bool SV_GridSparse(void)
+{
+    static int merged[((GRID_MAX_CELLS + 1) / 2) * ((GRID_MAX_CELLS + 1) / 2)];
+    worldGrid_t *g = &sv_worldGrid;
+    const sharedEntity_t *gEnt;
+    svEntity_t *ent;
+    int x, y, width, cell;
+
+    if (g->merges >= g->splits)
+    {
+        return false;
+    }
+
+    width = (g->size[0] + 1) / 2;
+    ::memset(merged, 0, sizeof(merged));
+
+    for (y = 0; y < g->size[1]; y++)
+    {
+        for (x = 0; x < g->size[0]; x++)
+        {
+            cell = (y / 2) * width + x / 2;
+            merged[cell] += g->counts[y * g->size[0] + x];
+            if (merged[cell] > GRID_SPARSE)
+            {
+                return false;
+            }
+        }
+    }
+
+    for (ent = g->large; ent; ent = ent->gridNext)
+    {
+        gEnt = SV_GEntityForSvEntity(ent);
+        if (gEnt->r.absmax[0] - gEnt->r.absmin[0] > g->cellSize * 2.0f ||
+            gEnt->r.absmax[1] - gEnt->r.absmin[1] > g->cellSize * 2.0f)
+        {
+            continue;
+        }
 
-    anode->children[0] = SV_CreateworldSector(depth + 1, mins2, maxs2);
-    anode->children[1] = SV_CreateworldSector(depth + 1, mins1, maxs1);
+        cell = (SV_GridCoord(0.5f * (gEnt->r.absmin[1] + gEnt->r.absmax[1]), 1) / 2) * width +
+               SV_GridCoord(0.5f * (gEnt->r.absmin[0] + gEnt->r.absmax[0]), 0) / 2;
+        if (++merged[cell] > GRID_SPARSE)
+        {
+            return false;
+        }
+    }
 
-    return anode;
+    return true;
 }
 
 /*
@@ -155,16 +382,20 @@ SV_ClearWorld
 */
 void SV_ClearWorld(void)
 {
+    worldGrid_t *g = &sv_worldGrid;
     clipHandle_t h;
-    vec3_t mins, maxs;
+    float longest;
 
-    ::memset(sv_worldSectors, 0, sizeof(sv_worldSectors));
-    sv_numworldSectors = 0;
+    ::memset(g, 0, sizeof(*g));
+    SV_ClearAreaStats();
 
     // get world map bounds
     h = CM_InlineModel(0);
-    CM_ModelBounds(h, mins, maxs);
-    SV_CreateworldSector(0, mins, maxs);
+    CM_ModelBounds(h, g->mins, g->maxs);
+
+    longest = MAX(g->maxs[0] - g->mins[0], g->maxs[1] - g->mins[1]);
+    SV_SizeWorldGrid(MAX(longest / GRID_START_CELLS, GRID_MIN_SIZE));
+    g->checkTime = svs.time;
 }
 
 /*
@@ -176,36 +407,17 @@ SV_UnlinkEntity
 void SV_UnlinkEntity(sharedEntity_t *gEnt)
 {
     svEntity_t *ent;
-    svEntity_t *scan;
-    worldSector_t *ws;
 
     ent = SV_SvEntityForGentity(gEnt);
 
     gEnt->r.linked = qfalse;
 
-    ws = ent->worldSector;
-    if (!ws)
+    if (!ent->gridList)
     {
         return;  // not linked in anywhere
     }
-    ent->worldSector = NULL;
-
-    if (ws->entities == ent)
-    {
-        ws->entities = ent->nextEntityInWorldSector;
-        return;
-    }
-
-    for (scan = ws->entities; scan; scan = scan->nextEntityInWorldSector)
-    {
-        if (scan->nextEntityInWorldSector == ent)
-        {
-            scan->nextEntityInWorldSector = ent->nextEntityInWorldSector;
-            return;
-        }
-    }
 
-    Com_Printf("WARNING: SV_UnlinkEntity: not found in worldSector\n");
+    SV_GridRemove(ent);
 }
 
 /*
@@ -217,19 +429,19 @@ SV_LinkEntity
 #define MAX_TOTAL_ENT_LEAFS 128
 void SV_LinkEntity(sharedEntity_t *gEnt)
 {
-    worldSector_t *node;
     int leafs[MAX_TOTAL_ENT_LEAFS];
-    int cluster;
+    int leaf, cluster;
     int num_leafs;
     int i, j, k;
     int area;
     int lastLeaf;
     float *origin, *angles;
     svEntity_t *ent;
+    worldGrid_t *g = &sv_worldGrid;
 
     ent = SV_SvEntityForGentity(gEnt);
 
-    if (ent->worldSector)
+    if (ent->gridList)
     {
         SV_UnlinkEntity(gEnt);  // unlink from old position
     }
@@ -302,6 +514,12 @@ void SV_LinkEntity(sharedEntity_t *gEnt)
     ent->areanum = -1;
     ent->areanum2 = -1;
 
+    // the origin's own leaf, so entity to entity PVS checks don't need to
+    // find it again
+    leaf = CM_PointLeafnum(origin);
+    ent->originCluster = CM_LeafCluster(leaf);
+    ent->originArea = CM_LeafArea(leaf);
+
     // get all leafs, including solids
     num_leafs = CM_BoxLeafnums(gEnt->r.absmin, gEnt->r.absmax, leafs, MAX_TOTAL_ENT_LEAFS, &lastLeaf);
 
@@ -359,25 +577,24 @@ void SV_LinkEntity(sharedEntity_t *gEnt)
 
     gEnt->r.linkcount++;
 
-    // find the first world sector node that the ent's box crosses
-    node = sv_worldSectors;
-    for ( ;; )
-    {
-        if (node->axis == -1)
-            break;
+    // link it in
+    SV_GridInsert(ent, gEnt);
 
-        if (gEnt->r.absmin[node->axis] > node->dist)
-            node = node->children[0];
-        else if (gEnt->r.absmax[node->axis] < node->dist)
-            node = node->children[1];
-        else
-            break;  // crosses the node
+    if (SV_GridCrowded(ent))
+    {
+        g->splits++;
+        SV_ResizeWorldGrid(g->cellSize * 0.5f);
+    }
+    else if (svs.time - g->checkTime >= GRID_CHECK_MSEC)
+    {
+        // a crowd that has moved on shouldn't leave the whole map in small cells
+        g->checkTime = svs.time;
+        if (SV_GridSparse())
+        {
+            g->merges++;
+            SV_ResizeWorldGrid(g->cellSize * 2.0f);
+        }
     }
-
-    // link it in
-    ent->worldSector = node;
-    ent->nextEntityInWorldSector = node->entities;
-    node->entities = ent;
 
     gEnt->r.linked = qtrue;
 }
@@ -392,82 +609,317 @@ bounds.  This does NOT mean that they actually touch in the case of bmodels.
 ============================================================================
 */
 
-struct areaParms_t {
-    const float *mins;
-    const float *maxs;
-    int *list;
-    int count;
-    int maxcount;
-};
+/*
+================
+SV_AreaEntitiesInList
+================
+*/
+static void SV_AreaEntitiesInList(
+    const svEntity_t *check, const vec3_t mins, const vec3_t maxs, unsigned *found, int *candidates)
+{
+    const sharedEntity_t *gcheck;
+    int num;
+
+    for (; check; check = check->gridNext)
+    {
+        gcheck = SV_GEntityForSvEntity((svEntity_t *)check);
+        (*candidates)++;
+
+        if (gcheck->r.absmin[0] > maxs[0] || gcheck->r.absmin[1] > maxs[1] || gcheck->r.absmin[2] > maxs[2] ||
+            gcheck->r.absmax[0] < mins[0] || gcheck->r.absmax[1] < mins[1] || gcheck->r.absmax[2] < mins[2])
+        {
+            continue;
+        }
+
+        num = check - sv.svEntities;
+        found[num >> 5] |= 1u << (num & 31);
+    }
+}
 
 /*
-====================
-SV_AreaEntities_r
+================
+SV_AreaEntities
 
-====================
+Entities are listed in increasing number, so the list for a box is
+always the same as the list for any larger box with the entities outside
+the smaller one taken out
+================
 */
-static void SV_AreaEntities_r(worldSector_t *node, areaParms_t *ap)
+int SV_AreaEntities(const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount)
 {
-    svEntity_t *check, *next;
-    sharedEntity_t *gcheck;
+    worldGrid_t *g = &sv_worldGrid;
+    unsigned found[MAX_GENTITIES / 32];
+    unsigned bits;
+    float reach;
+    int x0, x1, y0, y1, x, y;
+    int candidates, count;
+    int i;
 
-    for (check = node->entities; check; check = next)
-    {
-        next = check->nextEntityInWorldSector;
+    ::memset(found, 0, sizeof(found));
+    candidates = 0;
 
-        gcheck = SV_GEntityForSvEntity(check);
+    // a cell's entities reach half a cell past it, with a little slack
+    // for the rounding of their centers
+    reach = g->cellSize * 0.5f + 1.0f;
+    x0 = SV_GridCoord(mins[0] - reach, 0);
+    x1 = SV_GridCoord(maxs[0] + reach, 0);
+    y0 = SV_GridCoord(mins[1] - reach, 1);
+    y1 = SV_GridCoord(maxs[1] + reach, 1);
 
-        if (gcheck->r.absmin[0] > ap->maxs[0] || gcheck->r.absmin[1] > ap->maxs[1] ||
-            gcheck->r.absmin[2] > ap->maxs[2] || gcheck->r.absmax[0] < ap->mins[0] ||
-            gcheck->r.absmax[1] < ap->mins[1] || gcheck->r.absmax[2] < ap->mins[2])
+    for (y = y0; y <= y1; y++)
+    {
+        for (x = x0; x <= x1; x++)
         {
-            continue;
+            SV_AreaEntitiesInList(g->cells[y * g->size[0] + x], mins, maxs, found, &candidates);
         }
+    }
+    SV_AreaEntitiesInList(g->large, mins, maxs, found, &candidates);
 
-        if (ap->count == ap->maxcount)
+    count = 0;
+    for (i = 0; i < MAX_GENTITIES / 32; i++)
+    {
+        for (bits = found[i]; bits; bits &= bits - 1)
         {
-            Com_Printf("SV_AreaEntities: MAXCOUNT\n");
-            return;
+            if (count == maxcount)
+            {
+                Com_Printf("SV_AreaEntities: MAXCOUNT\n");
+                goto done;
+            }
+            entityList[count++] = (i << 5) + Q_ctz(bits);
+        }
+    }
+
+done:
+    sv_areaStats.queries.fetch_add(1, std::memory_order_relaxed);
+    sv_areaStats.candidates.fetch_add(candidates, std::memory_order_relaxed);
+    sv_areaStats.found.fetch_add(count, std::memory_order_relaxed);
+
+    return count;
+}
+
+/*
+================
+SV_AreaBench_f
+
+Rebuilds the old fixed depth sector tree from the linked entities and
+runs the same area queries through it and through the grid: a box
+around each linked entity at a few reaches.  Reports how many entities
+each had to test per query, how many it found and how long it took.
+================
+*/
+#define BENCH_AREA_DEPTH 4
+#define BENCH_AREA_NODES 64
+
+struct benchSector_t {
+    int axis;  // -1 = leaf node
+    float dist;
+    int children[2];
+    int entities;
+};
+
+static benchSector_t benchSectors[BENCH_AREA_NODES];
+static int benchNumSectors;
+static int benchNextEntity[MAX_GENTITIES];
+
+static int SV_BenchCreateSector(int depth, vec3_t mins, vec3_t maxs)
+{
+    benchSector_t *anode;
+    vec3_t size;
+    vec3_t mins1, maxs1, mins2, maxs2;
+    int num;
+
+    num = benchNumSectors++;
+    anode = &benchSectors[num];
+    anode->entities = -1;
+
+    if (depth == BENCH_AREA_DEPTH)
+    {
+        anode->axis = -1;
+        return num;
+    }
+
+    VectorSubtract(maxs, mins, size);
+    anode->axis = size[0] > size[1] ? 0 : 1;
+    anode->dist = 0.5 * (maxs[anode->axis] + mins[anode->axis]);
+    VectorCopy(mins, mins1);
+    VectorCopy(mins, mins2);
+    VectorCopy(maxs, maxs1);
+    VectorCopy(maxs, maxs2);
+
+    maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
+
+    anode->children[0] = SV_BenchCreateSector(depth + 1, mins2, maxs2);
+    anode->children[1] = SV_BenchCreateSector(depth + 1, mins1, maxs1);
+
+    return num;
+}
+
+static void SV_BenchAreaEntities_r(
+    int num, const vec3_t mins, const vec3_t maxs, unsigned *found, int *candidates)
+{
+    benchSector_t *node = &benchSectors[num];
+    sharedEntity_t *gcheck;
+    int e;
+
+    for (e = node->entities; e != -1; e = benchNextEntity[e])
+    {
+        gcheck = SV_GentityNum(e);
+        (*candidates)++;
+
+        if (gcheck->r.absmin[0] > maxs[0] || gcheck->r.absmin[1] > maxs[1] || gcheck->r.absmin[2] > maxs[2] ||
+            gcheck->r.absmax[0] < mins[0] || gcheck->r.absmax[1] < mins[1] || gcheck->r.absmax[2] < mins[2])
+        {
+            continue;
         }
 
-        ap->list[ap->count] = check - sv.svEntities;
-        ap->count++;
+        found[e >> 5] |= 1u << (e & 31);
     }
 
     if (node->axis == -1)
     {
-        return;  // terminal node
+        return;
     }
 
-    // recurse down both sides
-    if (ap->maxs[node->axis] > node->dist)
+    if (maxs[node->axis] > node->dist)
     {
-        SV_AreaEntities_r(node->children[0], ap);
+        SV_BenchAreaEntities_r(node->children[0], mins, maxs, found, candidates);
     }
-    if (ap->mins[node->axis] < node->dist)
+    if (mins[node->axis] < node->dist)
     {
-        SV_AreaEntities_r(node->children[1], ap);
+        SV_BenchAreaEntities_r(node->children[1], mins, maxs, found, candidates);
     }
 }
 
-/*
-================
-SV_AreaEntities
-================
-*/
-int SV_AreaEntities(const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount)
+void SV_AreaBench_f(void)
 {
-    areaParms_t ap;
+    static const float reaches[] = {0, 64, 256};
+    static int list[MAX_GENTITIES];
+    unsigned oldFound[MAX_GENTITIES / 32], newFound[MAX_GENTITIES / 32];
+    int64_t oldCandidates, newCandidates, oldTotal, newTotal;
+    int oldTime, newTime, start;
+    int iterations, queries, mismatches;
+    int candidates, count;
+    int i, j, n, e, k, node;
+    benchSector_t *sec;
+    sharedEntity_t *gEnt;
+    int savedQueries;
+    int64_t savedCandidates, savedFound;
+    vec3_t mins, maxs;
+
+    if (!com_sv_running->integer)
+    {
+        Com_Printf("Server is not running.\n");
+        return;
+    }
+
+    iterations = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 100;
+    if (iterations < 1)
+    {
+        iterations = 1;
+    }
+
+    // the old tree, linked the way SV_LinkEntity used to
+    benchNumSectors = 0;
+    SV_BenchCreateSector(0, sv_worldGrid.mins, sv_worldGrid.maxs);
+    for (e = 0; e < sv.num_entities; e++)
+    {
+        if (!sv.svEntities[e].gridList)
+        {
+            continue;
+        }
+        gEnt = SV_GentityNum(e);
+        for (node = 0;;)
+        {
+            sec = &benchSectors[node];
+            if (sec->axis == -1)
+                break;
+            if (gEnt->r.absmin[sec->axis] > sec->dist)
+                node = sec->children[0];
+            else if (gEnt->r.absmax[sec->axis] < sec->dist)
+                node = sec->children[1];
+            else
+                break;
+        }
+        benchNextEntity[e] = benchSectors[node].entities;
+        benchSectors[node].entities = e;
+    }
+
+    // the benchmark's own queries are left out of the stats
+    savedQueries = sv_areaStats.queries.load(std::memory_order_relaxed);
+    savedCandidates = sv_areaStats.candidates.load(std::memory_order_relaxed);
+    savedFound = sv_areaStats.found.load(std::memory_order_relaxed);
+    oldCandidates = newCandidates = oldTotal = newTotal = 0;
+    oldTime = newTime = 0;
+    queries = mismatches = 0;
+
+    for (e = 0; e < sv.num_entities; e++)
+    {
+        if (!sv.svEntities[e].gridList)
+        {
+            continue;
+        }
+        gEnt = SV_GentityNum(e);
+
+        for (k = 0; k < (int)ARRAY_LEN(reaches); k++)
+        {
+            for (j = 0; j < 3; j++)
+            {
+                mins[j] = gEnt->r.absmin[j] - reaches[k];
+                maxs[j] = gEnt->r.absmax[j] + reaches[k];
+            }
+            queries++;
 
-    ap.mins = mins;
-    ap.maxs = maxs;
-    ap.list = entityList;
-    ap.count = 0;
-    ap.maxcount = maxcount;
+            start = Sys_Milliseconds();
+            for (n = 0; n < iterations; n++)
+            {
+                ::memset(oldFound, 0, sizeof(oldFound));
+                candidates = 0;
+                SV_BenchAreaEntities_r(0, mins, maxs, oldFound, &candidates);
+            }
+            oldTime += Sys_Milliseconds() - start;
+            oldCandidates += candidates;
+
+            start = Sys_Milliseconds();
+            for (n = 0; n < iterations; n++)
+            {
+                count = SV_AreaEntities(mins, maxs, list, MAX_GENTITIES);
+            }
+            newTime += Sys_Milliseconds() - start;
+            newCandidates += (sv_areaStats.candidates.load(std::memory_order_relaxed) - savedCandidates) / iterations;
+            sv_areaStats.queries.store(savedQueries, std::memory_order_relaxed);
+            sv_areaStats.candidates.store(savedCandidates, std::memory_order_relaxed);
+            sv_areaStats.found.store(savedFound, std::memory_order_relaxed);
+
+            ::memset(newFound, 0, sizeof(newFound));
+            for (i = 0; i < count; i++)
+            {
+                newFound[list[i] >> 5] |= 1u << (list[i] & 31);
+            }
+            for (i = 0; i < MAX_GENTITIES / 32; i++)
+            {
+                oldTotal += Q_popcount(oldFound[i]);
+            }
+            newTotal += count;
 
-    SV_AreaEntities_r(sv_worldSectors, &ap);
+            if (::memcmp(oldFound, newFound, sizeof(oldFound)))
+            {
+                mismatches++;
+            }
+        }
+    }
 
-    return ap.count;
+    if (!queries)
+    {
+        Com_Printf("No linked entities.\n");
+        return;
+    }
+
+    Com_Printf("%i entities linked, %i queries, %i iterations\n", sv_worldGrid.numLinked, queries, iterations);
+    Com_Printf("sector tree: %5.1f candidates, %5.1f found per query, %i msec\n",
+        (double)oldCandidates / queries, (double)oldTotal / queries, oldTime);
+    Com_Printf("grid:        %5.1f candidates, %5.1f found per query, %i msec\n",
+        (double)newCandidates / queries, (double)newTotal / queries, newTime);
+    Com_Printf("%i mismatches\n", mismatches);
 }
 
 //===========================================================================
@@ -536,18 +988,15 @@ SV_ClipMoveToEntities
 
 ====================
 */
-static void SV_ClipMoveToEntities(moveclip_t *clip)
+static void SV_ClipMoveToEntities(moveclip_t *clip, const int *touchlist, int num)
 {
-    int i, num;
-    int touchlist[MAX_GENTITIES];
+    int i;
     sharedEntity_t *touch;
     int passOwnerNum;
     trace_t trace;
     clipHandle_t clipHandle;
     float *origin, *angles;
 
-    num = SV_AreaEntities(clip->boxmins, clip->boxmaxs, touchlist, MAX_GENTITIES);
-
     if (clip->passEntityNum != ENTITYNUM_NONE)
     {
         passOwnerNum = (SV_GentityNum(clip->passEntityNum))->r.ownerNum;
@@ -632,6 +1081,60 @@ static void SV_ClipMoveToEntities(moveclip_t *clip)
     }
 }
 
+/*
+==================
+SV_StartMoveClip
+
+Fills in the moveclip for a trace and clips it to the world.  Returns
+false if the world blocks it immediately, so there is nothing left to
+test against entities.
+==================
+*/
+static bool SV_StartMoveClip(moveclip_t *clip, const vec3_t start, const vec3_t mins, const vec3_t maxs,
+    const vec3_t end, int passEntityNum, int contentmask, traceType_t type)
+{
+    int i;
+
+    ::memset(clip, 0, sizeof(moveclip_t));
+
+    // clip to world
+    CM_BoxTrace(&clip->trace, start, end, (float *)mins, (float *)maxs, 0, contentmask, type);
+    clip->trace.entityNum = clip->trace.fraction != 1.0 ? ENTITYNUM_WORLD : ENTITYNUM_NONE;
+    if (clip->trace.fraction == 0)
+    {
+        return false;  // blocked immediately by the world
+    }
+
+    clip->contentmask = contentmask;
+    clip->start = start;
+    //	VectorCopy( clip->trace.endpos, clip->end );
+    VectorCopy(end, clip->end);
+    clip->mins = mins;
+    clip->maxs = maxs;
+    clip->passEntityNum = passEntityNum;
+    clip->collisionType = type;
+
+    // create the bounding box of the entire move
+    // we can limit it to the part of the move not
+    // already clipped off by the world, which can be
+    // a significant savings for line of sight and shot traces
+    for (i = 0; i < 3; i++)
+    {
+        if (end[i] > start[i])
+        {
+            clip->boxmins[i] = clip->start[i] + clip->mins[i] - 1;
+            clip->boxmaxs[i] = clip->end[i] + clip->maxs[i] + 1;
+        }
+        else
+        {
+            clip->boxmins[i] = clip->end[i] + clip->mins[i] - 1;
+            clip->boxmaxs[i] = clip->start[i] + clip->maxs[i] + 1;
+        }
+    }
+
+    return true;
+}
+
 /*
 ==================
 SV_Trace
@@ -644,7 +1147,8 @@ void SV_Trace(trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, co
     int contentmask, traceType_t type)
 {
     moveclip_t clip;
-    int i;
+    int touchlist[MAX_GENTITIES];
+    int num;
 
     if (!mins)
     {
@@ -655,48 +1159,133 @@ void SV_Trace(trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, co
         maxs = vec3_origin;
     }
 
-    ::memset(&clip, 0, sizeof(moveclip_t));
-
-    // clip to world
-    CM_BoxTrace(&clip.trace, start, end, mins, maxs, 0, contentmask, type);
-    clip.trace.entityNum = clip.trace.fraction != 1.0 ? ENTITYNUM_WORLD : ENTITYNUM_NONE;
-    if (clip.trace.fraction == 0)
+    if (SV_StartMoveClip(&clip, start, mins, maxs, end, passEntityNum, contentmask, type))
     {
-        *results = clip.trace;
-        return;  // blocked immediately by the world
+        // clip to other solid entities
+        num = SV_AreaEntities(clip.boxmins, clip.boxmaxs, touchlist, MAX_GENTITIES);
+        SV_ClipMoveToEntities(&clip, touchlist, num);
     }
 
-    clip.contentmask = contentmask;
-    clip.start = start;
-    //	VectorCopy( clip.trace.endpos, clip.end );
-    VectorCopy(end, clip.end);
-    clip.mins = mins;
-    clip.maxs = maxs;
-    clip.passEntityNum = passEntityNum;
-    clip.collisionType = type;
+    *results = clip.trace;
+}
 
-    // create the bounding box of the entire move
-    // we can limit it to the part of the move not
-    // already clipped off by the world, which can be
-    // a significant savings for line of sight and shot traces
-    for (i = 0; i < 3; i++)
+/*
+===============================================================================
+
+BATCHED TRACES
+
+===============================================================================
+*/
+
+// below this many traces a batch isn't worth handing to the job pool
+#define TRACE_BATCH_JOB_MIN 16
+
+typedef struct {
+    trace_t *results;
+    const traceRequest_t *requests;
+    const int *touchlist;  // every entity touching any trace of the batch
+    int numTouch;
+} traceBatch_t;
+
+/*
+==================
+SV_TraceBatchJob
+
+Runs one trace of a batch.  Only entities from the batch's shared list
+whose bounds touch this trace are clipped against, in the order
+SV_AreaEntities would have listed them for this trace alone.
+==================
+*/
+static void SV_TraceBatchJob(void *data, int index)
+{
+    traceBatch_t *batch = (traceBatch_t *)data;
+    const traceRequest_t *req = &batch->requests[index];
+    int touchlist[MAX_GENTITIES];
+    sharedEntity_t *check;
+    moveclip_t clip;
+    int i, num;
+
+    if (SV_StartMoveClip(
+            &clip, req->start, req->mins, req->maxs, req->end, req->passEntityNum, req->contentmask, req->type))
     {
-        if (end[i] > start[i])
+        for (i = num = 0; i < batch->numTouch; i++)
         {
-            clip.boxmins[i] = clip.start[i] + clip.mins[i] - 1;
-            clip.boxmaxs[i] = clip.end[i] + clip.maxs[i] + 1;
+            check = SV_GentityNum(batch->touchlist[i]);
+
+            if (check->r.absmin[0] > clip.boxmaxs[0] || check->r.absmin[1] > clip.boxmaxs[1] ||
+                check->r.absmin[2] > clip.boxmaxs[2] || check->r.absmax[0] < clip.boxmins[0] ||
+                check->r.absmax[1] < clip.boxmins[1] || check->r.absmax[2] < clip.boxmins[2])
+            {
+                continue;
+            }
+
+            touchlist[num++] = batch->touchlist[i];
         }
-        else
+
+        SV_ClipMoveToEntities(&clip, touchlist, num);
+    }
+
+    batch->results[index] = clip.trace;
+}
+
+/*
+==================
+SV_TraceBatch
+
+Runs count traces against the same state of the world.  The entity
+lookup is done once for the whole batch, and large batches are spread
+over the job pool.
+==================
+*/
+void SV_TraceBatch(trace_t *results, const traceRequest_t *requests, int count)
+{
+    PROF_SCOPE(prof, "trace_batch");
+    int touchlist[MAX_GENTITIES];
+    const traceRequest_t *req;
+    traceBatch_t batch;
+    vec3_t mins, maxs;
+    int i, j;
+
+    if (count <= 0)
+    {
+        return;
+    }
+
+    // the union of every trace's move box, as SV_StartMoveClip builds it
+    ClearBounds(mins, maxs);
+    for (i = 0, req = requests; i < count; i++, req++)
+    {
+        for (j = 0; j < 3; j++)
         {
-            clip.boxmins[i] = clip.end[i] + clip.mins[i] - 1;
-            clip.boxmaxs[i] = clip.start[i] + clip.maxs[i] + 1;
+            if (req->end[j] > req->start[j])
+            {
+                mins[j] = MIN(mins[j], req->start[j] + req->mins[j] - 1);
+                maxs[j] = MAX(maxs[j], req->end[j] + req->maxs[j] + 1);
+            }
+            else
+            {
+                mins[j] = MIN(mins[j], req->end[j] + req->mins[j] - 1);
+                maxs[j] = MAX(maxs[j], req->start[j] + req->maxs[j] + 1);
+            }
         }
     }
 
-    // clip to other solid entities
-    SV_ClipMoveToEntities(&clip);
+    batch.results = results;
+    batch.requests = requests;
+    batch.touchlist = touchlist;
+    batch.numTouch = SV_AreaEntities(mins, maxs, touchlist, MAX_GENTITIES);
 
-    *results = clip.trace;
+    if (count >= TRACE_BATCH_JOB_MIN && Job_NumThreads() > 0)
+    {
+        Job_Run(SV_TraceBatchJob, &batch, count);
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            SV_TraceBatchJob(&batch, i);
+        }
+    }
 }
 
 /*
@@ -741,3 +1330,173 @@ int SV_PointContents(const vec3_t p, int passEntityNum)
 
     return contents;
 }
+
+/*
+===============================================================================
+
+TRACE STRESS TEST
+
+===============================================================================
+*/
+
+// what a player movement trace clips against
+#define STRESS_MASK (CONTENTS_SOLID | CONTENTS_PLAYERCLIP | CONTENTS_BODY)
+
+typedef struct {
+    vec3_t start, end;
+    vec3_t mins, maxs;
+    traceType_t type;
+} stressTrace_t;
+
+static bool SV_TracesMatch(const trace_t *a, const trace_t *b)
+{
+    return a->fraction == b->fraction && VectorCompare(a->endpos, b->endpos) &&
+           VectorCompare(a->plane.normal, b->plane.normal) && a->plane.dist == b->plane.dist &&
+           a->surfaceFlags == b->surfaceFlags && a->contents == b->contents && a->entityNum == b->entityNum &&
+           a->allsolid == b->allsolid && a->startsolid == b->startsolid;
+}
+
+/*
+==================
+SV_TraceStress_f
+
+Runs a set of random traces through the loaded map on one thread, then
+again with the SSE brush side tests turned off and on several threads at
+once, and reports any trace whose result differs from the serial run.
+The trace cache is off throughout, or every pass after the first would
+only be comparing the cache with itself.
+==================
+*/
+void SV_TraceStress_f(void)
+{
+    static const vec3_t playerMins = {-15, -15, -24};
+    static const vec3_t playerMaxs = {15, 15, 32};
+    std::vector<stressTrace_t> traces;
+    std::vector<trace_t> expected;
+    std::vector<std::thread> threads;
+    std::atomic<int> mismatches(0);
+    trace_t tr;
+    vec3_t worldMins, worldMaxs, dir;
+    int count, numThreads;
+    int serialTime, scalarTime, parallelTime, start;
+    int scalarMismatches, simd, traceCache;
+    int seed;
+    int i, j;
+
+    if (!com_sv_running->integer)
+    {
+        Com_Printf("Server is not running.\n");
+        return;
+    }
+
+    count = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 10000;
+    if (count < 1)
+    {
+        count = 1;
+    }
+    numThreads = Cmd_Argc() > 2 ? atoi(Cmd_Argv(2)) : std::thread::hardware_concurrency();
+    if (numThreads < 2)
+    {
+        numThreads = 2;
+    }
+
+    CM_ModelBounds(0, worldMins, worldMaxs);
+
+    seed = Sys_Milliseconds();
+    traces.resize(count);
+    for (i = 0; i < count; i++)
+    {
+        stressTrace_t *t = &traces[i];
+
+        for (j = 0; j < 3; j++)
+        {
+            t->start[j] = worldMins[j] + Q_random(&seed) * (worldMaxs[j] - worldMins[j]);
+            dir[j] = Q_crandom(&seed);
+        }
+        VectorNormalize(dir);
+        VectorMA(t->start, Q_random(&seed) * 2048, dir, t->end);
+
+        // a third each of points, player boxes and player capsules
+        switch (i % 3)
+        {
+            case 0:
+                VectorClear(t->mins);
+                VectorClear(t->maxs);
+                t->type = TT_AABB;
+                break;
+            case 1:
+                VectorCopy(playerMins, t->mins);
+                VectorCopy(playerMaxs, t->maxs);
+                t->type = TT_AABB;
+                break;
+            default:
+                VectorCopy(playerMins, t->mins);
+                VectorCopy(playerMaxs, t->maxs);
+                t->type = TT_CAPSULE;
+                break;
+        }
+    }
+
+    traceCache = Cvar_VariableIntegerValue("cm_traceCache");
+    Cvar_Set("cm_traceCache", "0");
+
+    expected.resize(count);
+    start = Sys_Milliseconds();
+    for (i = 0; i < count; i++)
+    {
+        stressTrace_t *t = &traces[i];
+        SV_Trace(&expected[i], t->start, t->mins, t->maxs, t->end, ENTITYNUM_NONE, STRESS_MASK, t->type);
+    }
+    serialTime = Sys_Milliseconds() - start;
+
+    simd = Cvar_VariableIntegerValue("cm_simd");
+    Cvar_Set("cm_simd", "0");
+    scalarMismatches = 0;
+    start = Sys_Milliseconds();
+    for (i = 0; i < count; i++)
+    {
+        stressTrace_t *t = &traces[i];
+        SV_Trace(&tr, t->start, t->mins, t->maxs, t->end, ENTITYNUM_NONE, STRESS_MASK, t->type);
+        if (!SV_TracesMatch(&tr, &expected[i]))
+        {
+            scalarMismatches++;
+        }
+    }
+    scalarTime = Sys_Milliseconds() - start;
+    Cvar_Set("cm_simd", va("%i", simd));
+
+    // every thread runs the whole set from a different offset, so the same
+    // brushes are being visited by several threads at once
+    start = Sys_Milliseconds();
+    for (i = 0; i < numThreads; i++)
+    {
+        threads.emplace_back([&, i]() {
+            trace_t tr;
+            int64_t offset = (int64_t)i * count / numThreads;
+            int n, k;
+
+            for (n = 0; n < count; n++)
+            {
+                k = (int)((n + offset) % count);
+                stressTrace_t *t = &traces[k];
+                SV_Trace(&tr, t->start, t->mins, t->maxs, t->end, ENTITYNUM_NONE, STRESS_MASK, t->type);
+                if (!SV_TracesMatch(&tr, &expected[k]))
+                {
+                    mismatches++;
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    parallelTime = Sys_Milliseconds() - start;
+    Cvar_Set("cm_traceCache", va("%i", traceCache));
+
+    Com_Printf("%i traces, %i threads\n", count, numThreads);
+    Com_Printf("serial:   %i msec (cm_simd %i)\n", serialTime, simd);
+    Com_Printf("scalar:   %i msec, %i scalar/SSE mismatches\n", scalarTime, scalarMismatches);
+    Com_Printf("parallel: %i msec for %i traces\n", parallelTime, count * numThreads);
+    Com_Printf("%i mismatches\n", mismatches.load());
+}
@@ -56,6 +56,16 @@ char *CON_Input( void )
 	return NULL;
 }
 
+/*
+==================
+CON_InputFD
+==================
+*/
+int CON_InputFD( void )
+{
+	return -1;
+}
+
 /*
 ==================
 CON_Print
@@ -343,6 +343,19 @@ void CON_Init( void )
 	CON_Show();
 }
 
+/*
+==================
+CON_InputFD
+==================
+*/
+int CON_InputFD( void )
+{
+	if (ttycon_on || stdin_active)
+		return STDIN_FILENO;
+
+	return -1;
+}
+
 /*
 ==================
 CON_Input
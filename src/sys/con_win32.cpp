@@ -324,6 +324,18 @@ void CON_Init( void )
 	SetConsoleTextAttribute( qconsole_hout, CON_ColorCharToAttrib( COLOR_WHITE ) );
 }
 
+/*
+==================
+CON_InputFD
+
+Console input isn't a socket here, so it can't share the wait
+==================
+*/
+int CON_InputFD( void )
+{
+	return -1;
+}
+
 /*
 ==================
 CON_Input
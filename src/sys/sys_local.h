@@ -37,6 +37,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 void CON_Shutdown( void );
 void CON_Init( void );
 char *CON_Input( void );
+int CON_InputFD( void );
 void CON_Print( const char *message );
 
 unsigned int CON_LogSize( void );
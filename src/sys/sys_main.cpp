@@ -154,6 +154,16 @@ char *Sys_ConsoleInput(void)
     return CON_Input( );
 }
 
+/*
+=================
+Sys_ConsoleInputFD
+=================
+*/
+int Sys_ConsoleInputFD(void)
+{
+    return CON_InputFD( );
+}
+
 /*
 ==================
 Sys_GetClipboardData
@@ -56,6 +56,8 @@ void Sys_Print(const char *msg);
 // Sys_Milliseconds should only be used for profiling purposes,
 // any game related timing information should come from event timestamps
 int Sys_Milliseconds(void);
+// the same clock in microseconds, for waits shorter than a millisecond
+int64_t Sys_Microseconds(void);
 
 bool Sys_RandomBytes(byte *string, int len);
 
@@ -71,6 +73,11 @@ void Sys_SetErrorText(const char *text);
 FILE *Sys_FOpen(const char *ospath, const char *mode);
 bool Sys_Mkdir(const char *path);
 FILE *Sys_Mkfifo(const char *ospath);
+
+// maps a whole file copy-on-write: writes through the mapping are private to
+// this process and never reach the file.  NULL if it can't be mapped
+void *Sys_MapFile(const char *ospath, size_t *length);
+void Sys_UnmapFile(void *base, size_t length);
 char *Sys_Cwd(void);
 void Sys_SetDefaultInstallPath(const char *path);
 char *Sys_DefaultInstallPath(void);
@@ -84,6 +91,7 @@ char *Sys_DefaultHomePath(void);
 const char *Sys_Dirname(char *path);
 const char *Sys_Basename(char *path);
 char *Sys_ConsoleInput(void);
+int Sys_ConsoleInputFD(void);  // descriptor that polls readable with console input, or -1
 
 char **Sys_ListFiles(const char *directory, const char *extension,
                      const char *filter,
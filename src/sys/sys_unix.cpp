@@ -114,6 +114,28 @@ int Sys_Milliseconds (void)
 	return curtime;
 }
 
+/*
+================
+Sys_Microseconds
+
+Shares sys_timeBase with Sys_Milliseconds, so dividing by 1000 gives
+the same millisecond
+================
+*/
+int64_t Sys_Microseconds (void)
+{
+	struct timeval tp;
+
+	gettimeofday(&tp, NULL);
+
+	if (!sys_timeBase)
+	{
+		sys_timeBase = tp.tv_sec;
+	}
+
+	return (int64_t)(tp.tv_sec - sys_timeBase)*1000000 + tp.tv_usec;
+}
+
 /*
 ==================
 Sys_RandomBytes
@@ -229,6 +251,48 @@ bool Sys_Mkdir( const char *path )
 	return true;
 }
 
+/*
+==================
+Sys_MapFile
+==================
+*/
+void *Sys_MapFile( const char *ospath, size_t *length )
+{
+	struct stat	buf;
+	void		*base;
+	int			fd;
+
+	fd = open( ospath, O_RDONLY );
+	if( fd < 0 )
+		return NULL;
+
+	if( fstat( fd, &buf ) || !S_ISREG( buf.st_mode ) || buf.st_size <= 0 )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	base = mmap( NULL, buf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+
+	if( base == MAP_FAILED )
+		return NULL;
+
+	*length = buf.st_size;
+	return base;
+}
+
+/*
+==================
+Sys_UnmapFile
+==================
+*/
+void Sys_UnmapFile( void *base, size_t length )
+{
+	if( base )
+		munmap( base, length );
+}
+
 /*
 ==================
 Sys_Mkfifo
@@ -99,6 +99,18 @@ int Sys_Milliseconds (void)
 	return sys_curtime;
 }
 
+/*
+================
+Sys_Microseconds
+
+timeGetTime only counts milliseconds
+================
+*/
+int64_t Sys_Microseconds (void)
+{
+	return (int64_t)Sys_Milliseconds() * 1000;
+}
+
 /*
 ================
 Sys_RandomBytes
@@ -244,6 +256,55 @@ bool Sys_Mkdir( const char *path )
 	return true;
 }
 
+/*
+==============
+Sys_MapFile
+==============
+*/
+void *Sys_MapFile( const char *ospath, size_t *length )
+{
+	HANDLE			file, mapping;
+	LARGE_INTEGER	size;
+	void			*base;
+
+	file = CreateFile( ospath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+		return NULL;
+
+	if( !GetFileSizeEx( file, &size ) || size.QuadPart <= 0 )
+	{
+		CloseHandle( file );
+		return NULL;
+	}
+
+	mapping = CreateFileMapping( file, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+	CloseHandle( file );
+	if( !mapping )
+		return NULL;
+
+	// the view keeps the mapping alive
+	base = MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+	CloseHandle( mapping );
+
+	if( !base )
+		return NULL;
+
+	*length = (size_t)size.QuadPart;
+	return base;
+}
+
+/*
+==============
+Sys_UnmapFile
+==============
+*/
+void Sys_UnmapFile( void *base, size_t length )
+{
+	if( base )
+		UnmapViewOfFile( base );
+}
+
 /*
 ==================
 Sys_Mkfifo